@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include "aio_pipe.h"
+#include "alog.h"
+#include "lat_hist.h"
+#include "stat_shm.h"
+#include "trace_rec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int fd_seekable(int fd)
+{
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return 0;
+  return S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+}
+
+static int fd_is_chrdev(int fd)
+{
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return 0;
+  return S_ISCHR(st.st_mode);
+}
+
+static int fd_is_direct(int fd)
+{
+  int flags = fd < 0 ? -1 : fcntl(fd, F_GETFL);
+  return flags >= 0 && (flags & O_DIRECT);
+}
+
+/* O_DIRECT needs aligned length and offset, continue buffered otherwise */
+static void drop_direct(struct aio_pipe *p, size_t len)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  int flags;
+
+  if (!(len % page_size) && !(p->dst_offset % page_size))
+    return;
+  flags = fcntl(p->dst_fd, F_GETFL);
+  if (flags >= 0)
+    fcntl(p->dst_fd, F_SETFL, flags & ~O_DIRECT);
+  p->dst_direct = 0;
+}
+
+/* a timestamp for the histograms or the trace, 0 if neither wants one */
+static uint64_t stamp(const struct aio_pipe *p)
+{
+  return p->lat_xfer || p->lat_persist || trace_on() ? lat_hist_now() : 0;
+}
+
+static void queue_iocb(struct aio_pipe *p, struct iocb *iocb)
+{
+  aio_waiter_prep(p->waiter, iocb);
+  p->batch[p->nbatch++] = iocb;
+}
+
+/*
+ * Read complete callback.
+ * Only record the result, the slot is retired in sequence order later.
+ */
+static void rd_done(io_context_t ctx, struct iocb *iocb, long res, long res2)
+{
+  struct aio_slot *slot = (struct aio_slot *)iocb;
+  struct aio_pipe *p = slot->pipe;
+
+  p->inflight--;
+  p->pending -= slot->requested;
+
+  slot->len = 0;
+  if (res2 != 0 || res < 0) {
+    long err = res < 0 ? res : -EIO;
+    /*
+     * xdma reports a timeout without data as an error, retried later: the
+     * errors Transport::timed_out() retries, any other one is fatal
+     */
+    if (p->src_chrdev && (err == -EIO || err == -ETIMEDOUT || err == -EAGAIN ||
+                          err == -EINTR)) {
+      p->timeouts++;
+      stat_inc(p->st_empty, 1);
+    } else {
+      alog(ALOG_ERROR, "aio read: %s\n", strerror(-err));
+      p->error = err;
+    }
+  } else if (res == 0) {
+    /* no data: end of input for a file/fifo stand-in, idle for xdma */
+    if (p->src_chrdev) {
+      p->timeouts++;
+      stat_inc(p->st_empty, 1);
+    }
+    else
+      p->eof = 1;
+  } else {
+    slot->len = res;
+    p->bytes_read += res;
+    stat_inc(p->st_read, res);
+    slot->t_done = p->reap_ns;
+    if (p->lat_xfer)
+      lat_hist_record(p->lat_xfer, p->reap_ns - slot->t_submit);
+    trace_span(TRACE_XFER, slot->t_submit, p->reap_ns, res);
+  }
+  slot->state = AIO_SLOT_READ_DONE;
+}
+
+/*
+ * Write complete callback.
+ * Requeue the remainder of a short write, otherwise free the slot.
+ */
+static void wr_done(io_context_t ctx, struct iocb *iocb, long res, long res2)
+{
+  struct aio_slot *slot = (struct aio_slot *)iocb;
+  struct aio_pipe *p = slot->pipe;
+  unsigned long nbytes = iocb->u.c.nbytes;
+
+  p->inflight--;
+
+  if (res2 != 0 || res < 0) {
+    alog(ALOG_ERROR, "aio write: %s\n", strerror(res < 0 ? -res : EIO));
+    p->error = res < 0 ? res : -EIO;
+    slot->state = AIO_SLOT_FREE;
+    return;
+  }
+
+  p->bytes_written += res;
+  stat_inc(p->st_written, res);
+  if ((unsigned long)res < nbytes) {
+    char *buf = (char *)iocb->u.c.buf + res;
+    long long offset = p->dst_seekable ? iocb->u.c.offset + res : 0;
+
+    io_prep_pwrite(iocb, iocb->aio_fildes, buf, nbytes - res, offset);
+    io_set_callback(iocb, wr_done);
+    queue_iocb(p, iocb);
+    p->inflight++;
+    return;
+  }
+
+  if (p->lat_persist)
+    lat_hist_record(p->lat_persist, p->reap_ns - slot->t_done);
+  trace_span(TRACE_PERSIST, slot->t_done, p->reap_ns, slot->len);
+  slot->state = AIO_SLOT_FREE;
+}
+
+int aio_pipe_init(struct aio_pipe *p, struct buf_pool *pool, int src_fd,
+                  int dst_fd, int depth, int64_t length)
+{
+  int i, rc;
+
+  memset(p, 0, sizeof(*p));
+  if (depth <= 0)
+    return -EINVAL;
+
+  p->src_fd = src_fd;
+  p->dst_fd = dst_fd;
+  p->src_seekable = fd_seekable(src_fd);
+  p->dst_seekable = fd_seekable(dst_fd);
+  p->src_chrdev = fd_is_chrdev(src_fd);
+  p->dst_direct = fd_is_direct(dst_fd);
+  p->depth = depth;
+  p->blksize = pool->blksize;
+  p->length = length;
+  p->pool = pool;
+
+  p->slots = calloc(depth, sizeof(struct aio_slot));
+  p->batch = calloc(depth, sizeof(struct iocb *));
+  p->events = calloc(depth, sizeof(struct io_event));
+  if (!p->slots || !p->batch || !p->events) {
+    aio_pipe_free(p);
+    return -ENOMEM;
+  }
+
+  /* the pool's guard page takes what the device returns beyond blksize */
+  for (i = 0; i < depth; i++) {
+    p->slots[i].pipe = p;
+    p->slots[i].item = buf_pool_get(pool);
+    if (!p->slots[i].item) {
+      aio_pipe_free(p);
+      return -ENOBUFS;
+    }
+    p->slots[i].buf = p->slots[i].item->data;
+  }
+
+  rc = io_queue_init(depth, &p->ctx);
+  if (rc < 0) {
+    p->ctx = 0;
+    aio_pipe_free(p);
+    return rc;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &p->ts_start);
+  return 0;
+}
+
+void aio_pipe_free(struct aio_pipe *p)
+{
+  int i;
+
+  if (p->ctx)
+    io_queue_release(p->ctx);
+  for (i = 0; p->slots && i < p->depth; i++) {
+    if (p->slots[i].item)
+      buf_pool_put(p->pool, p->slots[i].item);
+  }
+  free(p->events);
+  free(p->batch);
+  free(p->slots);
+  p->ctx = 0;
+  p->events = NULL;
+  p->batch = NULL;
+  p->slots = NULL;
+}
+
+static int more_to_read(const struct aio_pipe *p)
+{
+  if (p->eof || p->error)
+    return 0;
+  if (p->length < 0)
+    return 1;
+  return p->bytes_read + p->pending < (uint64_t)p->length;
+}
+
+/* turn the reads completed in sequence order into writes */
+static void commit_reads(struct aio_pipe *p)
+{
+  while (p->commit_seq < p->next_seq) {
+    struct aio_slot *slot = &p->slots[p->commit_seq % p->depth];
+    if (slot->state != AIO_SLOT_READ_DONE)
+      break;
+
+    if (slot->len <= 0 || p->dst_fd < 0) {
+      slot->state = AIO_SLOT_FREE;
+    } else {
+      if (p->dst_direct)
+        drop_direct(p, slot->len);
+      io_prep_pwrite(&slot->iocb, p->dst_fd, slot->buf, slot->len,
+                     p->dst_seekable ? p->dst_offset : 0);
+      io_set_callback(&slot->iocb, wr_done);
+      p->dst_offset += slot->len;
+      slot->state = AIO_SLOT_WRITING;
+      queue_iocb(p, &slot->iocb);
+      p->inflight++;
+    }
+    p->commit_seq++;
+  }
+}
+
+/* fill the free slots with reads, in sequence order */
+static void queue_reads(struct aio_pipe *p)
+{
+  while (more_to_read(p)) {
+    struct aio_slot *slot = &p->slots[p->next_seq % p->depth];
+    size_t iosize = p->blksize;
+
+    if (slot->state != AIO_SLOT_FREE)
+      break;
+
+    if (p->length >= 0 &&
+        (uint64_t)p->length - p->bytes_read - p->pending < iosize)
+      iosize = p->length - p->bytes_read - p->pending;
+
+    io_prep_pread(&slot->iocb, p->src_fd, slot->buf, iosize,
+                  p->src_seekable ? p->src_offset : 0);
+    io_set_callback(&slot->iocb, rd_done);
+    slot->seq = p->next_seq++;
+    slot->requested = iosize;
+    slot->len = 0;
+    slot->state = AIO_SLOT_READING;
+    slot->t_submit = stamp(p);
+    p->src_offset += iosize;
+    p->pending += iosize;
+    queue_iocb(p, &slot->iocb);
+    p->inflight++;
+  }
+}
+
+static int submit_batch(struct aio_pipe *p)
+{
+  int done = 0;
+
+  if (p->nbatch)
+    trace_mark(TRACE_SUBMIT, p->nbatch);
+  while (done < p->nbatch) {
+    int rc = io_submit(p->ctx, p->nbatch - done, p->batch + done);
+    if (rc < 0)
+      return rc;
+    done += rc;
+  }
+  p->nbatch = 0;
+  return 0;
+}
+
+/* reap as many completions as are ready with one syscall */
+static int reap(struct aio_pipe *p, struct timespec *timeout)
+{
+  uint64_t t_wait;
+  int rc, i;
+
+  t_wait = trace_start();
+  if (p->waiter)
+    rc = aio_waiter_getevents(p->waiter, 1, p->depth, p->events, timeout);
+  else
+    rc = io_getevents(p->ctx, 1, p->depth, p->events, timeout);
+  p->reap_ns = stamp(p);
+  trace_span(TRACE_REAP, t_wait, p->reap_ns, rc > 0 ? rc : 0);
+  if (rc <= 0)
+    return rc;
+  p->reaps++;
+  p->events_reaped += rc;
+
+  for (i = 0; i < rc; i++) {
+    struct io_event *ev = &p->events[i];
+    io_callback_t cb = (io_callback_t)ev->data;
+    cb(p->ctx, ev->obj, ev->res, ev->res2);
+  }
+  return rc;
+}
+
+int aio_pipe_run(struct aio_pipe *p, struct timespec *timeout)
+{
+  int rc, i;
+
+  queue_reads(p);
+  rc = submit_batch(p);
+  if (rc < 0)
+    return rc;
+  if (!p->inflight)
+    return 0;
+
+  rc = reap(p, timeout);
+  if (rc <= 0)
+    return rc;
+
+  commit_reads(p);
+  queue_reads(p);
+  i = submit_batch(p);
+  if (i < 0)
+    return i;
+  stat_set(p->st_inflight, p->inflight);
+  if (p->error)
+    return p->error;
+
+  return rc;
+}
+
+int aio_pipe_done(const struct aio_pipe *p)
+{
+  if (p->inflight || p->commit_seq < p->next_seq)
+    return 0;
+  return !more_to_read(p);
+}
+
+uint64_t aio_pipe_persisted(const struct aio_pipe *p)
+{
+  uint64_t end = p->dst_offset;
+  int i;
+
+  for (i = 0; i < p->depth; i++) {
+    const struct aio_slot *slot = &p->slots[i];
+    if (slot->state == AIO_SLOT_WRITING &&
+        (uint64_t)slot->iocb.u.c.offset < end)
+      end = slot->iocb.u.c.offset;
+  }
+  return end;
+}
+
+static int writes_inflight(const struct aio_pipe *p)
+{
+  int i, n = 0;
+
+  for (i = 0; i < p->depth; i++)
+    n += p->slots[i].state == AIO_SLOT_WRITING;
+  return n;
+}
+
+int aio_pipe_drop_output(struct aio_pipe *p)
+{
+  int rc;
+
+  p->dst_fd = -1;
+  /* reads completing meanwhile are retired (dropped) by the next run */
+  while (writes_inflight(p)) {
+    rc = submit_batch(p);       // the rest of a short write
+    if (rc < 0)
+      return rc;
+    rc = reap(p, NULL);
+    if (rc < 0 && rc != -EINTR)
+      return rc;
+  }
+  return p->error;
+}
+
+void aio_pipe_publish(struct aio_pipe *p, struct stat_shm *shm, const char *name)
+{
+  p->st_read = stat_shm_add(shm, name, "read", STAT_BYTES);
+  p->st_written = stat_shm_add(shm, name, "written", STAT_BYTES);
+  p->st_empty = stat_shm_add(shm, name, "empty", STAT_COUNTER);
+  p->st_inflight = stat_shm_add(shm, name, "inflight", STAT_GAUGE);
+}
+
+void aio_pipe_report(const struct aio_pipe *p, const char *name)
+{
+  struct timespec ts_end;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  secs = (ts_end.tv_sec - p->ts_start.tv_sec) +
+         (ts_end.tv_nsec - p->ts_start.tv_nsec) / 1e9;
+
+  fprintf(stdout, "%s: depth %d, blk-size %lu, %lu bytes read, %lu bytes written in %.3f s\n",
+          name, p->depth, p->blksize, p->bytes_read, p->bytes_written, secs);
+  fprintf(stdout, "%s: throughput %.2f MB/s, %.2f completions per reap, %lu empty reads\n",
+          name, secs > 0 ? p->bytes_read / secs / 1e6 : 0.0,
+          p->reaps ? (double)p->events_reaped / p->reaps : 0.0, p->timeouts);
+}
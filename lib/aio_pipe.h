@@ -0,0 +1,131 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libaio.h>
+#include "aio_waiter.h"
+#include "buf_pool.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Queue-depth-N libaio copy engine: src --read--> slot --write--> dst
+ *
+ * - up to `depth` slots, each with its own iocb and a page-aligned buffer
+ *   taken from the caller's buf_pool (blksize is the pool's)
+ * - reads are submitted in sequence order, completions may arrive in any
+ *   order; writes are issued strictly in read sequence order, so a stream
+ *   dst (h2c) sees the data in order and a file dst gets exact offsets even
+ *   with short (EOP) reads
+ * - a seekable fd (regular file) uses positional io, a stream fd (xdma
+ *   node, fifo) always uses offset 0
+ * - optional live counters in a stat_shm segment (aio_pipe_publish)
+ * - optional latency histograms, stamped once per reap: lat_xfer gets
+ *   read submit -> complete, lat_persist read complete -> write complete;
+ *   the same stamps go to the pipeline trace while it records (trace_rec.h)
+ */
+
+enum aio_slot_state {
+  AIO_SLOT_FREE = 0,
+  AIO_SLOT_READING,
+  AIO_SLOT_READ_DONE,
+  AIO_SLOT_WRITING,
+};
+
+struct aio_pipe;
+struct lat_hist;
+struct stat_shm;
+
+struct aio_slot {
+  struct iocb iocb;
+  struct aio_pipe *pipe;
+  struct buf_item *item;
+  char *buf;
+  uint64_t seq;
+  size_t requested;
+  long len;                     // bytes read, <0 on error/timeout
+  enum aio_slot_state state;
+  uint64_t t_submit;            // lat_hist_now(), 0: neither histograms nor trace
+  uint64_t t_done;
+};
+
+struct aio_pipe {
+  io_context_t ctx;
+  int src_fd;
+  int dst_fd;                   // <0: data read is dropped
+  int src_seekable;
+  int dst_seekable;
+  int src_chrdev;               // xdma node: an empty read is a timeout
+  int dst_direct;               // O_DIRECT dst, dropped at the first unaligned write
+  int depth;
+  size_t blksize;
+  int64_t length;               // total bytes to read, <0: until eof
+
+  struct aio_slot *slots;
+  struct buf_pool *pool;
+  struct iocb **batch;
+  struct io_event *events;
+  int nbatch;
+  struct aio_waiter *waiter;    // completion wait strategy, NULL: io_getevents
+  struct lat_hist *lat_xfer;    // NULL: not recorded
+  struct lat_hist *lat_persist;
+  uint64_t reap_ns;
+
+  uint64_t next_seq;            // next read to submit
+  uint64_t commit_seq;          // next read to hand to the writer
+  off_t src_offset;
+  off_t dst_offset;
+  uint64_t pending;             // bytes requested by reads in flight
+  int inflight;
+  int eof;
+  int error;
+
+  /* statistics */
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t timeouts;            // reads completed with no data
+  uint64_t reaps;               // io_getevents calls returning events
+  uint64_t events_reaped;
+  struct timespec ts_start;
+
+  /* live counters, NULL: not published */
+  uint64_t *st_read;
+  uint64_t *st_written;
+  uint64_t *st_empty;
+  uint64_t *st_inflight;
+};
+
+/* -ENOBUFS: fewer than `depth` buffers free in the pool */
+int aio_pipe_init(struct aio_pipe *p, struct buf_pool *pool, int src_fd,
+                  int dst_fd, int depth, int64_t length);
+void aio_pipe_free(struct aio_pipe *p);
+
+/*
+ * submit what can be submitted, wait up to `timeout` for completions and
+ * retire them; returns nr of completions handled or a negative errno
+ */
+int aio_pipe_run(struct aio_pipe *p, struct timespec *timeout);
+
+/* all requested data read and persisted */
+int aio_pipe_done(const struct aio_pipe *p);
+
+/* dst offset below which every write has completed */
+uint64_t aio_pipe_persisted(const struct aio_pipe *p);
+
+/*
+ * stop writing to dst, following reads are dropped; returns once the
+ * writes in flight completed (dst may be truncated and closed then),
+ * 0 or a negative errno
+ */
+int aio_pipe_drop_output(struct aio_pipe *p);
+
+void aio_pipe_publish(struct aio_pipe *p, struct stat_shm *shm, const char *name);
+void aio_pipe_report(const struct aio_pipe *p, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
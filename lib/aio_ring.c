@@ -0,0 +1,44 @@
+#include "aio_ring.h"
+
+/* fs/aio.c */
+#define AIO_RING_MAGIC 0xa10a10a1
+#define AIO_RING_INCOMPAT_FEATURES 0
+
+struct aio_ring {
+  unsigned id;
+  unsigned nr;                  // number of io_events
+  unsigned head;                // advanced by the reaper
+  unsigned tail;                // advanced by the kernel
+  unsigned magic;
+  unsigned compat_features;
+  unsigned incompat_features;
+  unsigned header_length;
+  struct io_event io_events[];
+};
+
+int aio_ring_usable(io_context_t ctx)
+{
+  const struct aio_ring *ring = (const struct aio_ring *)ctx;
+
+  return ring && ring->magic == AIO_RING_MAGIC &&
+         ring->incompat_features == AIO_RING_INCOMPAT_FEATURES &&
+         ring->header_length == sizeof(struct aio_ring);
+}
+
+int aio_ring_reap(io_context_t ctx, long nr, struct io_event *events)
+{
+  struct aio_ring *ring = (struct aio_ring *)ctx;
+  unsigned head = ring->head, tail, n = 0;
+
+  /* the kernel fills an event before it publishes the tail */
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  while (head != tail && n < nr) {
+    events[n++] = ring->io_events[head];
+    if (++head == ring->nr)
+      head = 0;
+  }
+  /* hand the slots back only after they have been copied */
+  if (n)
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  return n;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libaio.h>
+
+/*
+ * Userspace reaping of the libaio completion ring
+ *
+ * - an io_context_t is the address of the kernel's completion ring, mapped
+ *   into the process by io_setup(); completions are copied out of it and
+ *   the head advanced without entering the kernel
+ * - only one thread may reap a context, and not concurrently with
+ *   io_getevents() on it
+ * - the ring layout is checked once (magic, no incompatible features),
+ *   aio_ring_usable() is false on a kernel with another layout and the
+ *   callers then stay on io_getevents()
+ */
+
+int aio_ring_usable(io_context_t ctx);
+
+/* copy up to `nr` completions out of the ring, never blocks */
+int aio_ring_reap(io_context_t ctx, long nr, struct io_event *events);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include "aio_waiter.h"
+#include "aio_ring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static const char *mode_names[] = {"block", "eventfd", "poll", "spin"};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+int aio_waiter_parse_mode(const char *str, enum aio_wait_mode *mode)
+{
+  unsigned i;
+  for (i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+    if (!strcmp(str, mode_names[i])) {
+      *mode = (enum aio_wait_mode)i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *aio_waiter_mode_name(enum aio_wait_mode mode)
+{
+  return mode_names[mode];
+}
+
+int aio_waiter_init(struct aio_waiter *w, io_context_t ctx,
+                    enum aio_wait_mode mode, unsigned spin_us)
+{
+  memset(w, 0, sizeof(*w));
+  w->ctx = ctx;
+  w->mode = mode;
+  w->spin_us = spin_us;
+  w->efd = w->epfd = -1;
+
+  if (mode == AIO_WAIT_EVENTFD || mode == AIO_WAIT_SPIN) {
+    struct epoll_event ev;
+
+    w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->efd < 0)
+      return -errno;
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0) {
+      int err = -errno;
+      aio_waiter_free(w);
+      return err;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &ev) < 0) {
+      int err = -errno;
+      aio_waiter_free(w);
+      return err;
+    }
+  }
+
+  getrusage(RUSAGE_THREAD, &w->ru_start);
+  clock_gettime(CLOCK_MONOTONIC, &w->ts_start);
+  return 0;
+}
+
+void aio_waiter_free(struct aio_waiter *w)
+{
+  if (w->epfd >= 0)
+    close(w->epfd);
+  if (w->efd >= 0)
+    close(w->efd);
+  w->epfd = w->efd = -1;
+}
+
+int aio_waiter_user_reap(struct aio_waiter *w)
+{
+  if (!aio_ring_usable(w->ctx))
+    return -EOPNOTSUPP;
+  w->user_reap = 1;
+  return 0;
+}
+
+void aio_waiter_prep(struct aio_waiter *w, struct iocb *iocb)
+{
+  if (w && w->efd >= 0)
+    io_set_eventfd(iocb, w->efd);
+}
+
+/* sleep until the eventfd fires or the deadline passes */
+static int sleep_on_eventfd(struct aio_waiter *w, uint64_t now,
+                            uint64_t deadline)
+{
+  struct epoll_event ev;
+  uint64_t count;
+  int ms = -1, n;
+
+  if (deadline != UINT64_MAX)
+    ms = (deadline - now + 999999) / 1000000;
+
+  w->sleeps++;
+  n = epoll_wait(w->epfd, &ev, 1, ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -errno;
+  /* reset the count, completions it stands for may be reaped already */
+  if (n > 0 && read(w->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    return -errno;
+  return 0;
+}
+
+/* non-blocking reap */
+static int reap(struct aio_waiter *w, long nr, struct io_event *events)
+{
+  static struct timespec zero = {0, 0};
+  int n;
+
+  if (w->user_reap) {
+    n = aio_ring_reap(w->ctx, nr, events);
+    w->ring_events += n;
+    return n;
+  }
+  w->syscalls++;
+  return io_getevents(w->ctx, 0, nr, events, &zero);
+}
+
+int aio_waiter_getevents(struct aio_waiter *w, long min_nr, long nr,
+                         struct io_event *events, struct timespec *timeout)
+{
+  uint64_t t0 = now_ns(), now, deadline, spin_end, dt;
+  int rc, slept = 0;
+
+  w->waits++;
+  if (w->mode == AIO_WAIT_BLOCK) {
+    if (w->user_reap) {
+      rc = reap(w, nr, events);
+      if (rc || min_nr <= 0)
+        goto out;
+    }
+    w->sleeps++;
+    w->syscalls++;
+    rc = io_getevents(w->ctx, min_nr, nr, events, timeout);
+    goto out;
+  }
+
+  deadline = timeout ? t0 + timeout->tv_sec * 1000000000ull + timeout->tv_nsec
+                     : UINT64_MAX;
+  if (w->mode == AIO_WAIT_POLL)
+    spin_end = deadline;
+  else if (w->mode == AIO_WAIT_SPIN)
+    spin_end = t0 + w->spin_us * 1000ull;
+  else
+    spin_end = t0;
+
+  for (;;) {
+    rc = reap(w, nr, events);
+    if (rc != 0 || min_nr <= 0)
+      break;
+    now = now_ns();
+    if (now >= deadline)
+      break;
+    if (now < spin_end) {
+      cpu_relax();
+      continue;
+    }
+    rc = sleep_on_eventfd(w, now, deadline);
+    if (rc < 0)
+      break;
+    slept = 1;
+  }
+  if (rc > 0 && w->mode == AIO_WAIT_SPIN && !slept)
+    w->spin_hits++;
+
+out:
+  dt = now_ns() - t0;
+  if (rc == 0)
+    w->empty++;
+  w->wait_ns += dt;
+  if (dt > w->wait_max_ns)
+    w->wait_max_ns = dt;
+  return rc;
+}
+
+static double tv_secs(const struct timeval *tv)
+{
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void aio_waiter_report(const struct aio_waiter *w, const char *name)
+{
+  struct rusage ru;
+  struct timespec ts_end;
+  double secs, cpu;
+
+  getrusage(RUSAGE_THREAD, &ru);
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  secs = (ts_end.tv_sec - w->ts_start.tv_sec) +
+         (ts_end.tv_nsec - w->ts_start.tv_nsec) / 1e9;
+  cpu = tv_secs(&ru.ru_utime) - tv_secs(&w->ru_start.ru_utime) +
+        tv_secs(&ru.ru_stime) - tv_secs(&w->ru_start.ru_stime);
+
+  fprintf(stdout, "%s: wait %s, cpu %.3f s of %.3f s (%.0f%%), %ld context switches\n",
+          name, aio_waiter_mode_name(w->mode), cpu, secs,
+          secs > 0 ? cpu / secs * 100 : 0.0,
+          (ru.ru_nvcsw - w->ru_start.ru_nvcsw) +
+          (ru.ru_nivcsw - w->ru_start.ru_nivcsw));
+  fprintf(stdout, "%s: %lu waits, %lu empty, %lu slept, %lu spin hits, "
+          "avg %.3f us, max %.3f us\n", name, w->waits, w->empty, w->sleeps,
+          w->spin_hits, w->waits ? w->wait_ns / 1e3 / w->waits : 0.0,
+          w->wait_max_ns / 1e3);
+  fprintf(stdout, "%s: %lu io_getevents calls, %lu completions reaped in "
+          "user space\n", name, w->syscalls, w->ring_events);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libaio.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+ * Completion wait strategies for libaio, a drop-in for io_getevents()
+ *
+ * block   : io_getevents() sleeping in the kernel up to the timeout (legacy)
+ * eventfd : completions signal an eventfd (io_set_eventfd), the thread
+ *           sleeps in epoll_wait() on it and reaps without blocking
+ * poll    : non-blocking reaps in a loop, no sleep and no wake-up latency
+ *           at the price of a full core
+ * spin    : poll for up to `spin_us`, then block as eventfd does
+ *
+ * With aio_waiter_user_reap() completions are read straight out of the
+ * kernel's completion ring (aio_ring.h), io_getevents() is only called to
+ * sleep on an empty ring in block mode.
+ *
+ * The report gives the thread's cpu time and context switches over the
+ * run, how often a wait had to sleep and how long waits took.
+ */
+
+enum aio_wait_mode {
+  AIO_WAIT_BLOCK = 0,
+  AIO_WAIT_EVENTFD,
+  AIO_WAIT_POLL,
+  AIO_WAIT_SPIN,
+};
+
+#define AIO_WAIT_DEFAULT "block"
+#define AIO_WAIT_SPIN_US_DEFAULT 50
+
+struct aio_waiter {
+  io_context_t ctx;
+  enum aio_wait_mode mode;
+  unsigned spin_us;
+  int efd;                      // eventfd signalled by completions
+  int epfd;
+  int user_reap;                // reap the completion ring in user space
+
+  /* statistics */
+  uint64_t waits;
+  uint64_t empty;               // timed out without a completion
+  uint64_t sleeps;              // waits that went to sleep
+  uint64_t spin_hits;           // waits satisfied while spinning
+  uint64_t wait_ns;
+  uint64_t wait_max_ns;
+  uint64_t syscalls;            // io_getevents() calls
+  uint64_t ring_events;         // completions reaped in user space
+  struct rusage ru_start;
+  struct timespec ts_start;
+};
+
+int aio_waiter_parse_mode(const char *str, enum aio_wait_mode *mode);
+const char *aio_waiter_mode_name(enum aio_wait_mode mode);
+
+int aio_waiter_init(struct aio_waiter *w, io_context_t ctx,
+                    enum aio_wait_mode mode, unsigned spin_us);
+void aio_waiter_free(struct aio_waiter *w);
+
+/* -EOPNOTSUPP when the kernel's ring layout is unknown */
+int aio_waiter_user_reap(struct aio_waiter *w);
+
+/* call on every iocb after io_prep_*() and before io_submit() */
+void aio_waiter_prep(struct aio_waiter *w, struct iocb *iocb);
+
+/*
+ * as io_getevents(ctx, min_nr, nr, events, timeout), min_nr 0 or 1;
+ * a NULL timeout waits for ever
+ */
+int aio_waiter_getevents(struct aio_waiter *w, long min_nr, long nr,
+                         struct io_event *events, struct timespec *timeout);
+
+void aio_waiter_report(const struct aio_waiter *w, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
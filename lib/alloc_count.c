@@ -0,0 +1,91 @@
+#include "alloc_count.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+
+static uint64_t allocs;
+
+#ifdef UTILITY_ALLOC_COUNT
+
+/* glibc's own entry points, the definitions below shadow the public ones */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static void count(void)
+{
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+  count();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  count();
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  count();
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  count();
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  count();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  void *p;
+
+  if (!alignment || (alignment & (alignment - 1)) ||
+      alignment % sizeof(void *))
+    return EINVAL;
+  count();
+  p = __libc_memalign(alignment, size);
+  if (!p)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+int alloc_count_enabled(void)
+{
+  return 1;
+}
+
+#else
+
+int alloc_count_enabled(void)
+{
+  return 0;
+}
+
+#endif
+
+uint64_t alloc_count(void)
+{
+  return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+void alloc_count_report(const char *name, uint64_t count)
+{
+  if (!alloc_count_enabled())
+    return;
+  fprintf(stdout, "%s: %lu heap allocations in the transfer loop\n", name,
+          count);
+}
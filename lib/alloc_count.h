@@ -0,0 +1,27 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Heap allocation counter (debug): with -DUTILITY_ALLOC_COUNT=ON malloc,
+ * calloc, realloc and the aligned allocators are interposed and counted,
+ * so a tool can show that its transfer loop does not allocate. Without it
+ * the counter stays 0 and the report prints nothing.
+ */
+
+int alloc_count_enabled(void);
+uint64_t alloc_count(void);
+
+/*
+ * `count`: alloc_count() difference taken around the loop, before any
+ * output that might allocate (the first stdio write allocates its buffer)
+ */
+void alloc_count_report(const char *name, uint64_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,375 @@
+#include "alog.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ALOG_MAX_ARGS 8
+#define ALOG_STR_SPACE 96
+#define ALOG_RING_SIZE 1024     // records, power of 2
+#define ALOG_IDLE_NS 1000000
+
+union alog_arg {
+  long long i;                  // integers; %s: offset into str, -1 if cut
+  double d;
+  const void *p;
+};
+
+struct alog_record {
+  uint64_t ts_ns;
+  const char *fmt;
+  uint8_t level;
+  uint8_t nargs;
+  union alog_arg args[ALOG_MAX_ARGS];
+  char str[ALOG_STR_SPACE];
+};
+
+/* single producer (its thread), single consumer (the background thread) */
+struct alog_ring {
+  struct alog_record recs[ALOG_RING_SIZE];
+  unsigned head;                // consumer
+  unsigned tail;                // producer
+  uint64_t dropped;             // ring full
+  uint64_t suppressed;          // over the rate
+  uint64_t win_start;           // rate window
+  unsigned win_count;
+  struct alog_ring *next;
+};
+
+int alog_level = ALOG_INFO;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+static int started;
+static int stopping;
+static unsigned generation;
+static unsigned rate;
+static struct alog_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t thread;
+
+static __thread struct alog_ring *self;
+static __thread unsigned self_generation;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int alog_parse_level(const char *str, enum alog_level *level)
+{
+  unsigned i;
+
+  for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+    if (!strcmp(str, level_names[i])) {
+      *level = (enum alog_level)i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+void alog_set_level(enum alog_level level)
+{
+  __atomic_store_n(&alog_level, level, __ATOMIC_RELAXED);
+}
+
+/*
+ * one conversion spec, p just after the '%': returns the end of the spec,
+ * its conversion character and length modifier ('l' for l/ll/j/z/t, 'L'
+ * for long double, 0 otherwise)
+ */
+static const char *parse_spec(const char *p, char *conv, char *len)
+{
+  *len = 0;
+  while (*p && strchr("-+ #0'", *p))
+    p++;
+  while (*p >= '0' && *p <= '9')
+    p++;
+  if (*p == '.') {
+    p++;
+    while (*p >= '0' && *p <= '9')
+      p++;
+  }
+  while (*p && strchr("hlLqjzt", *p)) {
+    if (*p == 'L')
+      *len = 'L';
+    else if (*p != 'h')
+      *len = 'l';
+    p++;
+  }
+  *conv = *p;
+  return *p ? p + 1 : p;
+}
+
+static void capture(struct alog_record *r, const char *fmt, va_list ap)
+{
+  const char *p = fmt;
+  size_t used = 0;
+  char conv, len;
+
+  r->fmt = fmt;
+  r->nargs = 0;
+  while ((p = strchr(p, '%'))) {
+    union alog_arg *a = &r->args[r->nargs];
+
+    p = parse_spec(p + 1, &conv, &len);
+    if (conv == '%' || !conv)
+      continue;
+    if (r->nargs == ALOG_MAX_ARGS)
+      break;
+    r->nargs++;
+
+    if (strchr("diouxXc", conv)) {
+      a->i = len == 'l' ? va_arg(ap, long long) : va_arg(ap, int);
+    } else if (strchr("fFeEgGaA", conv)) {
+      a->d = len == 'L' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+    } else if (conv == 's') {
+      const char *s = va_arg(ap, const char *);
+      size_t n = strlen(s ? s : "(null)");
+      if (used < ALOG_STR_SPACE) {
+        if (n > ALOG_STR_SPACE - used - 1)
+          n = ALOG_STR_SPACE - used - 1;
+        memcpy(r->str + used, s ? s : "(null)", n);
+        r->str[used + n] = 0;
+        a->i = used;
+        used += n + 1;
+      } else {
+        a->i = -1;
+      }
+    } else {
+      a->p = va_arg(ap, void *);
+    }
+  }
+}
+
+static void format(const struct alog_record *r, char *out, size_t size)
+{
+  const char *p = r->fmt, *spec_start;
+  char spec[32], conv, len;
+  size_t n = 0;
+  unsigned arg = 0;
+
+  while (*p && n < size - 1) {
+    if (*p != '%') {
+      out[n++] = *p++;
+      continue;
+    }
+    spec_start = p;
+    p = parse_spec(p + 1, &conv, &len);
+    if (conv == '%') {
+      out[n++] = '%';
+      continue;
+    }
+    if (!conv || arg >= r->nargs || (size_t)(p - spec_start) >= sizeof(spec))
+      break;
+    memcpy(spec, spec_start, p - spec_start);
+    spec[p - spec_start] = 0;
+
+    const union alog_arg *a = &r->args[arg++];
+    int w;
+    if (strchr("diouxXc", conv))
+      w = len == 'l' ? snprintf(out + n, size - n, spec, a->i)
+                     : snprintf(out + n, size - n, spec, (int)a->i);
+    else if (strchr("fFeEgGaA", conv))
+      w = len == 'L' ? snprintf(out + n, size - n, spec, (long double)a->d)
+                     : snprintf(out + n, size - n, spec, a->d);
+    else if (conv == 's')
+      w = snprintf(out + n, size - n, spec, a->i < 0 ? "..." : r->str + a->i);
+    else
+      w = snprintf(out + n, size - n, spec, a->p);
+    if (w > 0)
+      n += (size_t)w < size - n ? (size_t)w : size - n - 1;
+  }
+  out[n] = 0;
+}
+
+static void emit(const struct alog_record *r)
+{
+  char line[512];
+
+  format(r, line, sizeof(line));
+  fputs(line, r->level <= ALOG_WARN ? stderr : stdout);
+}
+
+static struct alog_ring *ring_get(void)
+{
+  unsigned gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+
+  if (self && self_generation == gen)
+    return self;
+
+  self = calloc(1, sizeof(*self));
+  if (!self)
+    return NULL;
+  self_generation = gen;
+  pthread_mutex_lock(&rings_lock);
+  self->next = rings;
+  __atomic_store_n(&rings, self, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_lock);
+  return self;
+}
+
+int alog_thread_init(void)
+{
+  if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+    return 0;
+  return ring_get() ? 0 : -ENOMEM;
+}
+
+void alog_push(enum alog_level level, const char *fmt, ...)
+{
+  struct alog_ring *ring;
+  struct alog_record *r, local;
+  unsigned tail;
+  va_list ap;
+
+  if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+    local.level = level;
+    va_start(ap, fmt);
+    capture(&local, fmt, ap);
+    va_end(ap);
+    emit(&local);
+    return;
+  }
+
+  ring = ring_get();
+  if (!ring)
+    return;
+
+  if (rate) {
+    uint64_t now = now_ns();
+    if (now - ring->win_start >= 1000000000ull) {
+      ring->win_start = now;
+      ring->win_count = 0;
+    }
+    if (++ring->win_count > rate) {
+      __atomic_fetch_add(&ring->suppressed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= ALOG_RING_SIZE) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  r = &ring->recs[tail & (ALOG_RING_SIZE - 1)];
+  r->ts_ns = now_ns();
+  r->level = level;
+  va_start(ap, fmt);
+  capture(r, fmt, ap);
+  va_end(ap);
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* emit the oldest pending record of all rings, 0 if none */
+static int drain_one(void)
+{
+  struct alog_ring *ring, *oldest = NULL;
+  uint64_t ts = UINT64_MAX;
+
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    unsigned head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+      continue;
+    if (ring->recs[head & (ALOG_RING_SIZE - 1)].ts_ns < ts) {
+      ts = ring->recs[head & (ALOG_RING_SIZE - 1)].ts_ns;
+      oldest = ring;
+    }
+  }
+  if (!oldest)
+    return 0;
+  emit(&oldest->recs[oldest->head & (ALOG_RING_SIZE - 1)]);
+  __atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* losses since the last call, reported at most once a second */
+static void report_losses(uint64_t *seen_dropped, uint64_t *seen_suppressed)
+{
+  struct alog_ring *ring;
+  uint64_t dropped = 0, suppressed = 0;
+
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    suppressed += __atomic_load_n(&ring->suppressed, __ATOMIC_RELAXED);
+  }
+  if (dropped != *seen_dropped || suppressed != *seen_suppressed)
+    fprintf(stderr, "alog: %lu records dropped (ring full), %lu suppressed "
+            "(over %u/s)\n", dropped - *seen_dropped,
+            suppressed - *seen_suppressed, rate);
+  *seen_dropped = dropped;
+  *seen_suppressed = suppressed;
+}
+
+static void *run(void *arg)
+{
+  struct timespec idle = {0, ALOG_IDLE_NS};
+  uint64_t dropped = 0, suppressed = 0, last = now_ns();
+
+  (void)arg;
+  for (;;) {
+    int n = 0;
+    while (drain_one())
+      n++;
+    if (now_ns() - last >= 1000000000ull) {
+      report_losses(&dropped, &suppressed);
+      last = now_ns();
+    }
+    if (!n) {
+      if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+        break;
+      fflush(stdout);
+      fflush(stderr);
+      nanosleep(&idle, NULL);
+    }
+  }
+  report_losses(&dropped, &suppressed);
+  fflush(stdout);
+  fflush(stderr);
+  return NULL;
+}
+
+int alog_start(enum alog_level level, unsigned max_rate)
+{
+  int err;
+
+  alog_set_level(level);
+  if (started)
+    return 0;
+  rate = max_rate;
+  stopping = 0;
+  __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+  err = pthread_create(&thread, NULL, run, NULL);
+  if (err)
+    return -err;
+  __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void alog_stop(void)
+{
+  struct alog_ring *ring, *next;
+  int err = errno;              // callers may still perror() afterwards
+
+  if (!started)
+    return;
+  /* records pushed from here on are written synchronously */
+  __atomic_store_n(&started, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+
+  pthread_mutex_lock(&rings_lock);
+  for (ring = rings; ring; ring = next) {
+    next = ring->next;
+    free(ring);
+  }
+  rings = NULL;
+  pthread_mutex_unlock(&rings_lock);
+  errno = err;
+}
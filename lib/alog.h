@@ -0,0 +1,67 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous logger for the transfer loops
+ *
+ * - alog() copies the format pointer, the arguments and a timestamp into a
+ *   fixed-size record on the calling thread's own lock-free ring; it never
+ *   formats, locks or blocks (a full ring drops the record and counts it)
+ * - a background thread drains all rings, formats the records and writes
+ *   them: error and warn to stderr, info and debug to stdout
+ * - levels above the current one cost a single compare; every thread may
+ *   push at most `rate` records per second, the rest are counted as
+ *   suppressed and summed up by the background thread
+ * - formats must be string literals; %s arguments are copied (truncated)
+ *   into the record, doubles and integers are kept by value; '*' widths
+ *   are not supported
+ *
+ * Before alog_start() (and after alog_stop()) records are formatted and
+ * written synchronously, so tools that never start the logger behave as
+ * before, only filtered by level.
+ */
+
+enum alog_level {
+  ALOG_ERROR = 0,
+  ALOG_WARN,
+  ALOG_INFO,
+  ALOG_DEBUG,
+};
+
+#define ALOG_LEVEL_DEFAULT "info"
+#define ALOG_RATE_DEFAULT 1000  // records per second and thread
+
+extern int alog_level;
+
+#define alog(level, ...)                                                       \
+  do {                                                                         \
+    if ((int)(level) <= alog_level)                                            \
+      alog_push(level, __VA_ARGS__);                                           \
+  } while (0)
+
+void alog_push(enum alog_level level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+int alog_parse_level(const char *str, enum alog_level *level);
+void alog_set_level(enum alog_level level);
+
+/* rate 0: unlimited */
+int alog_start(enum alog_level level, unsigned rate);
+/*
+ * drain everything, report losses, back to synchronous mode; call once
+ * the logging threads are done (their rings are freed)
+ */
+void alog_stop(void);
+
+/* optional: set up the calling thread's ring outside its hot loop */
+int alog_thread_init(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+#include "buf_pool.h"
+#include "dma_mem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int buf_pool_init(struct buf_pool *p, unsigned count, size_t blksize)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned i;
+
+  memset(p, 0, sizeof(*p));
+  if (!count || !blksize)
+    return -EINVAL;
+
+  /* one extra page per buffer: the device may return more than requested */
+  p->count = count;
+  p->blksize = blksize;
+  p->stride = (blksize + page_size - 1) / page_size * page_size + page_size;
+
+  p->allocated = dma_mem_alloc(p->stride * count);
+  if (!p->allocated)
+    return -ENOMEM;
+  p->items = calloc(count, sizeof(struct buf_item));
+  if (!p->items) {
+    dma_mem_free(p->allocated);
+    p->allocated = NULL;
+    return -ENOMEM;
+  }
+
+  /* free list in address order, so a single user walks the buffers in turn */
+  for (i = count; i-- > 0;) {
+    p->items[i].data = p->allocated + (size_t)i * p->stride;
+    p->items[i].next = p->free_list;
+    p->free_list = &p->items[i];
+  }
+  p->nfree = p->low = count;
+
+  pthread_mutex_init(&p->lock, NULL);
+  return 0;
+}
+
+void buf_pool_free(struct buf_pool *p)
+{
+  if (!p->items)
+    return;
+  pthread_mutex_destroy(&p->lock);
+  free(p->items);
+  dma_mem_free(p->allocated);
+  p->items = NULL;
+  p->allocated = NULL;
+}
+
+/* callers hold p->lock */
+static struct buf_item *pop(struct buf_pool *p)
+{
+  struct buf_item *it = p->free_list;
+
+  if (!it) {
+    p->empty++;
+    return NULL;
+  }
+  p->free_list = it->next;
+  it->next = NULL;
+  if (--p->nfree < p->low)
+    p->low = p->nfree;
+  p->gets++;
+  return it;
+}
+
+static void push(struct buf_pool *p, struct buf_item *it)
+{
+  it->next = p->free_list;
+  p->free_list = it;
+  p->nfree++;
+  p->puts++;
+}
+
+struct buf_item *buf_pool_get(struct buf_pool *p)
+{
+  struct buf_item *it;
+
+  pthread_mutex_lock(&p->lock);
+  it = pop(p);
+  pthread_mutex_unlock(&p->lock);
+  if (it)
+    it->len = 0;
+  return it;
+}
+
+void buf_pool_put(struct buf_pool *p, struct buf_item *it)
+{
+  pthread_mutex_lock(&p->lock);
+  push(p, it);
+  pthread_mutex_unlock(&p->lock);
+}
+
+void buf_pool_report(const struct buf_pool *p, const char *name)
+{
+  fprintf(stdout, "%s: pool %u x %lu bytes, %lu gets, %lu puts, "
+          "low water %u free, %lu empty\n", name, p->count, p->blksize,
+          p->gets, p->puts, p->low, p->empty);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libaio.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pool of page-aligned transfer buffers, each paired with its request
+ * descriptor (an iocb), all allocated once at init
+ *
+ * - buf_pool_get/put: O(1) free list under the pool lock
+ * - sized by the tool to what it keeps in flight: the engines (aio_pipe,
+ *   buf_ring, uring_xfer) take their `depth` buffers from it at init and
+ *   hand them back at free, a synchronous loop takes one
+ * - buffers come from dma_mem, so --hugepages applies to them as well
+ */
+
+struct buf_item {
+  struct iocb iocb;             // first member: an iocb maps back to its item
+  struct buf_item *next;        // free list link
+  char *data;                   // blksize plus one guard page
+  size_t len;
+  void *priv;                   // owner's use
+};
+
+struct buf_pool {
+  struct buf_item *items;
+  char *allocated;
+  unsigned count;
+  size_t blksize;
+  size_t stride;
+
+  pthread_mutex_t lock;
+  struct buf_item *free_list;
+  unsigned nfree;
+  unsigned low;                 // fewest free items seen
+
+  /* statistics, locked operations only */
+  uint64_t gets;
+  uint64_t puts;
+  uint64_t empty;               // get found the pool exhausted
+};
+
+int buf_pool_init(struct buf_pool *p, unsigned count, size_t blksize);
+void buf_pool_free(struct buf_pool *p);
+
+/* NULL when all items are out */
+struct buf_item *buf_pool_get(struct buf_pool *p);
+void buf_pool_put(struct buf_pool *p, struct buf_item *it);
+
+void buf_pool_report(const struct buf_pool *p, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
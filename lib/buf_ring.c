@@ -0,0 +1,186 @@
+#include "buf_ring.h"
+#include "stat_shm.h"
+#include "trace_rec.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void put_slots(struct buf_ring *r)
+{
+  unsigned i;
+
+  for (i = 0; i < r->depth; i++) {
+    if (r->slots[i].item)
+      buf_pool_put(r->pool, r->slots[i].item);
+  }
+  free(r->slots);
+  r->slots = NULL;
+}
+
+int buf_ring_init(struct buf_ring *r, struct buf_pool *pool, unsigned depth)
+{
+  pthread_condattr_t attr;
+  unsigned i;
+
+  memset(r, 0, sizeof(*r));
+  if (!depth)
+    return -EINVAL;
+
+  /*
+   * every pool buffer is page aligned and carries one extra page, since the
+   * device may return more data than requested (transfer unit is 8 bytes)
+   */
+  r->depth = depth;
+  r->blksize = pool->blksize;
+  r->pool = pool;
+
+  r->slots = calloc(depth, sizeof(struct buf_slot));
+  if (!r->slots)
+    return -ENOMEM;
+  for (i = 0; i < depth; i++) {
+    r->slots[i].item = buf_pool_get(pool);
+    if (!r->slots[i].item) {
+      put_slots(r);
+      return -ENOBUFS;
+    }
+    r->slots[i].data = r->slots[i].item->data;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->not_full, NULL);
+  /* buf_ring_peek_until() deadlines are CLOCK_MONOTONIC */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&r->not_empty, &attr);
+  pthread_condattr_destroy(&attr);
+  return 0;
+}
+
+void buf_ring_free(struct buf_ring *r)
+{
+  if (!r->slots)
+    return;
+  pthread_cond_destroy(&r->not_empty);
+  pthread_cond_destroy(&r->not_full);
+  pthread_mutex_destroy(&r->lock);
+  put_slots(r);
+}
+
+struct buf_slot *buf_ring_acquire(struct buf_ring *r)
+{
+  struct buf_slot *slot = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  if (r->count == r->depth && !r->closed) {
+    uint64_t t0 = now_ns(), t1;
+    r->prod_stalls++;
+    stat_inc(r->st_full, 1);
+    while (r->count == r->depth && !r->closed)
+      pthread_cond_wait(&r->not_full, &r->lock);
+    t1 = now_ns();
+    r->prod_stall_ns += t1 - t0;
+    trace_span(TRACE_RING_FULL, t0, t1, r->count);
+  }
+  if (!r->closed)
+    slot = &r->slots[r->head];
+  pthread_mutex_unlock(&r->lock);
+
+  return slot;
+}
+
+void buf_ring_commit(struct buf_ring *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->head = (r->head + 1) % r->depth;
+  r->count++;
+  if (r->count > r->hwm)
+    r->hwm = r->count;
+  stat_set(r->st_level, r->count);
+  trace_mark(TRACE_ENQ, r->count);
+  pthread_cond_signal(&r->not_empty);
+  pthread_mutex_unlock(&r->lock);
+}
+
+struct buf_slot *buf_ring_peek(struct buf_ring *r)
+{
+  return buf_ring_peek_until(r, UINT64_MAX, NULL);
+}
+
+struct buf_slot *buf_ring_peek_until(struct buf_ring *r, uint64_t deadline_ns,
+                                     int *timed_out)
+{
+  struct buf_slot *slot = NULL;
+  struct timespec deadline = {(time_t)(deadline_ns / 1000000000ull),
+                              (long)(deadline_ns % 1000000000ull)};
+  int rc = 0;
+
+  pthread_mutex_lock(&r->lock);
+  if (!r->count && !r->closed) {
+    uint64_t t0 = now_ns(), t1;
+    r->cons_stalls++;
+    stat_inc(r->st_starved, 1);
+    while (!r->count && !r->closed && rc != ETIMEDOUT) {
+      if (deadline_ns == UINT64_MAX)
+        pthread_cond_wait(&r->not_empty, &r->lock);
+      else
+        rc = pthread_cond_timedwait(&r->not_empty, &r->lock, &deadline);
+    }
+    t1 = now_ns();
+    r->cons_stall_ns += t1 - t0;
+    trace_span(TRACE_RING_EMPTY, t0, t1, r->count);
+  }
+  if (r->count)
+    slot = &r->slots[r->tail];
+  if (timed_out)
+    *timed_out = !slot && !r->closed;
+  pthread_mutex_unlock(&r->lock);
+
+  return slot;
+}
+
+void buf_ring_release(struct buf_ring *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->tail = (r->tail + 1) % r->depth;
+  r->count--;
+  stat_set(r->st_level, r->count);
+  trace_mark(TRACE_DEQ, r->count);
+  pthread_cond_signal(&r->not_full);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void buf_ring_publish(struct buf_ring *r, struct stat_shm *shm, const char *name)
+{
+  r->st_level = stat_shm_add(shm, name, "ring", STAT_GAUGE);
+  r->st_full = stat_shm_add(shm, name, "ring full", STAT_COUNTER);
+  r->st_starved = stat_shm_add(shm, name, "ring empty", STAT_COUNTER);
+}
+
+void buf_ring_close(struct buf_ring *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->closed = 1;
+  pthread_cond_broadcast(&r->not_full);
+  pthread_cond_broadcast(&r->not_empty);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void buf_ring_report(const struct buf_ring *r, const char *name)
+{
+  fprintf(stdout, "%s ring: depth %u x %lu bytes, high-water %u/%u\n",
+          name, r->depth, r->blksize, r->hwm, r->depth);
+  fprintf(stdout, "%s ring: reader stalled %lu times, %.3f ms (ring full)\n",
+          name, r->prod_stalls, r->prod_stall_ns / 1e6);
+  fprintf(stdout, "%s ring: writer idled %lu times, %.3f ms (ring empty)\n",
+          name, r->cons_stalls, r->cons_stall_ns / 1e6);
+}
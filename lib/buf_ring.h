@@ -0,0 +1,89 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buf_pool.h"
+
+/*
+ * Bounded ring of page-aligned staging buffers shared by one producer
+ * (device reader) and one consumer (sink writer). The buffers are taken
+ * from the caller's buf_pool, blksize is the pool's.
+ *
+ * producer: buf_ring_acquire() -> fill slot -> buf_ring_commit()
+ * consumer: buf_ring_peek()    -> drain slot -> buf_ring_release()
+ *
+ * buf_ring_publish() shows the fill level and both sides' stalls in a
+ * stat_shm segment, updated under the ring's lock. Enqueue, dequeue and
+ * the stalls go to the pipeline trace while it records (trace_rec.h).
+ */
+
+struct stat_shm;
+
+struct buf_slot {
+  struct buf_item *item;
+  char *data;
+  size_t len;                   // valid bytes, set by producer
+  uint64_t ts;                  // producer's completion time (ns), optional
+};
+
+struct buf_ring {
+  struct buf_slot *slots;
+  struct buf_pool *pool;
+  unsigned depth;
+  size_t blksize;
+
+  unsigned head;                // next slot to fill
+  unsigned tail;                // next slot to drain
+  unsigned count;               // filled slots
+  int closed;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+
+  /* statistics */
+  unsigned hwm;                 // max filled slots seen
+  uint64_t prod_stalls;         // producer found the ring full
+  uint64_t prod_stall_ns;
+  uint64_t cons_stalls;         // consumer found the ring empty
+  uint64_t cons_stall_ns;
+
+  /* live counters, NULL: not published */
+  uint64_t *st_level;
+  uint64_t *st_full;
+  uint64_t *st_starved;
+};
+
+/* -ENOBUFS: fewer than `depth` buffers free in the pool */
+int buf_ring_init(struct buf_ring *r, struct buf_pool *pool, unsigned depth);
+void buf_ring_free(struct buf_ring *r);
+
+/* producer side: NULL once the ring is closed */
+struct buf_slot *buf_ring_acquire(struct buf_ring *r);
+void buf_ring_commit(struct buf_ring *r);
+
+/* consumer side: NULL once the ring is closed and drained */
+struct buf_slot *buf_ring_peek(struct buf_ring *r);
+/*
+ * as buf_ring_peek(), but gives up at `deadline_ns` (CLOCK_MONOTONIC):
+ * NULL with *timed_out set, so the consumer can do timed work
+ */
+struct buf_slot *buf_ring_peek_until(struct buf_ring *r, uint64_t deadline_ns,
+                                     int *timed_out);
+void buf_ring_release(struct buf_ring *r);
+
+/* wake both sides, no more slots will be produced */
+void buf_ring_close(struct buf_ring *r);
+
+void buf_ring_publish(struct buf_ring *r, struct stat_shm *shm, const char *name);
+void buf_ring_report(const struct buf_ring *r, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,205 @@
+#include "coalesce.h"
+#include "dma_mem.h"
+#include "lat_hist.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LEB128_MAX 10           // bytes for a 64-bit length
+
+int coalesce_init(struct coalesce *c, size_t cap, size_t max_packet,
+                  unsigned max_us, int index_fd, coalesce_write_fn write,
+                  void *arg)
+{
+  memset(c, 0, sizeof(*c));
+  if (cap < max_packet + COALESCE_ALIGN)
+    cap = max_packet + COALESCE_ALIGN;
+  cap = (cap + COALESCE_ALIGN - 1) / COALESCE_ALIGN * COALESCE_ALIGN;
+
+  c->buf = dma_mem_alloc(cap);
+  if (!c->buf)
+    return -ENOMEM;
+  if (index_fd >= 0) {
+    c->index = malloc(COALESCE_INDEX_SIZE);
+    if (!c->index) {
+      dma_mem_free(c->buf);
+      c->buf = NULL;
+      return -ENOMEM;
+    }
+  }
+  c->cap = cap;
+  c->max_ns = max_us * 1000ull;
+  c->write = write;
+  c->arg = arg;
+  c->index_fd = index_fd;
+  return 0;
+}
+
+void coalesce_free(struct coalesce *c)
+{
+  dma_mem_free(c->buf);
+  free(c->index);
+  c->buf = NULL;
+  c->index = NULL;
+}
+
+/* the varint at index[*pos], *pos moves past it */
+static uint64_t leb128_get(const uint8_t *index, size_t *pos)
+{
+  uint64_t v = 0;
+  unsigned shift = 0;
+  uint8_t b;
+
+  do {
+    b = index[(*pos)++];
+    v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return v;
+}
+
+/* the entries of packets now written in full may go to the index file */
+static void index_commit(struct coalesce *c)
+{
+  uint64_t written = c->bytes - c->used;
+
+  while (c->index_done < c->index_used) {
+    size_t pos = c->index_done;
+    uint64_t len = leb128_get(c->index, &pos);
+    if (c->index_end + len > written)
+      break;
+    c->index_end += len;
+    c->index_done = pos;
+  }
+}
+
+/* the committed entries out, those of buffered packets move to the front */
+static int write_index(struct coalesce *c)
+{
+  size_t done = 0;
+
+  while (done < c->index_done) {
+    ssize_t rc = write(c->index_fd, c->index + done, c->index_done - done);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    done += rc;
+  }
+  memmove(c->index, c->index + done, c->index_used - done);
+  c->index_bytes += done;
+  c->index_used -= done;
+  c->index_done = 0;
+  return 0;
+}
+
+/* the first `len` bytes go out, the rest moves to the front */
+static int write_out(struct coalesce *c, size_t len)
+{
+  size_t done = 0;
+  int rc;
+
+  if (!len)
+    return 0;
+  while (done < len) {
+    ssize_t n = c->write(c->arg, c->buf + done, len - done);
+    if (n < 0)
+      return n;
+    done += n;
+  }
+  if (c->lat_flush && c->first_ns)
+    lat_hist_since(c->lat_flush, c->first_ns);
+  memmove(c->buf, c->buf + len, c->used - len);
+  c->used -= len;
+  c->writes++;
+  /* the tail is the end of packets buffered since first_ns: still due then */
+  if (!c->used)
+    c->first_ns = 0;
+
+  /* the index never runs ahead of the data written */
+  if (c->index) {
+    index_commit(c);
+    if (c->index_done && (rc = write_index(c)) < 0)
+      return rc;
+  }
+  return 0;
+}
+
+int coalesce_add(struct coalesce *c, const char *pkt, size_t len)
+{
+  uint64_t v = len;
+  int rc;
+
+  if (c->used + len > c->cap) {
+    /* whole pages out: at most a page stays, the packet fits behind it */
+    rc = write_out(c, c->used / COALESCE_ALIGN * COALESCE_ALIGN);
+    if (rc < 0)
+      return rc;
+    c->full_writes++;
+    if (c->used + len > c->cap)
+      return -EMSGSIZE;
+  }
+
+  memcpy(c->buf + c->used, pkt, len);
+  c->used += len;
+  if (!c->first_ns)
+    c->first_ns = lat_hist_now();
+  c->packets++;
+  c->bytes += len;
+
+  if (c->index) {
+    if (c->index_used + LEB128_MAX > COALESCE_INDEX_SIZE && c->index_done &&
+        (rc = write_index(c)) < 0)
+      return rc;
+    /* still full: the entries wait for their packets, write those out */
+    if (c->index_used + LEB128_MAX > COALESCE_INDEX_SIZE &&
+        (rc = write_out(c, c->used)) < 0)
+      return rc;
+    do {
+      uint8_t b = v & 0x7f;
+      v >>= 7;
+      c->index[c->index_used++] = b | (v ? 0x80 : 0);
+    } while (v);
+  }
+  return 0;
+}
+
+uint64_t coalesce_deadline(const struct coalesce *c)
+{
+  return c->first_ns ? c->first_ns + c->max_ns : UINT64_MAX;
+}
+
+int coalesce_poll(struct coalesce *c, uint64_t now_ns)
+{
+  if (!c->used || now_ns < coalesce_deadline(c))
+    return 0;
+  c->timer_writes++;
+  return write_out(c, c->used);
+}
+
+int coalesce_flush(struct coalesce *c)
+{
+  int rc = write_out(c, c->used);
+
+  if (rc == 0 && c->index) {
+    index_commit(c);
+    if (c->index_done)
+      rc = write_index(c);
+  }
+  return rc;
+}
+
+void coalesce_report(const struct coalesce *c, const char *name)
+{
+  fprintf(stdout, "%s: coalesced %lu packets (avg %.0f bytes) into %lu writes "
+          "(avg %.1f KiB), %lu on a full buffer, %lu on the %.1f ms timer\n",
+          name, c->packets, c->packets ? (double)c->bytes / c->packets : 0.0,
+          c->writes, c->writes ? c->bytes / 1024.0 / c->writes : 0.0,
+          c->full_writes, c->timer_writes, c->max_ns / 1e6);
+  if (c->index_fd >= 0)
+    fprintf(stdout, "%s: packet index %lu bytes (%.2f per packet)\n", name,
+            c->index_bytes, c->packets ? (double)c->index_bytes / c->packets : 0.0);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Packs variable-length packets (EOP reads) into large sink writes
+ *
+ * - coalesce_add() copies a packet right behind the previous one into a
+ *   page-aligned buffer and notes its length
+ * - a full buffer writes out its whole pages, the unaligned tail moves to
+ *   the front: writes stay large, page sized and at page-aligned offsets
+ * - coalesce_poll() writes everything once the oldest buffered packet
+ *   waited max_us, so a slow trickle still reaches the disk in time;
+ *   coalesce_deadline() tells a consumer how long it may block
+ * - the packet lengths go to an index file in capture order, as LEB128
+ *   varints (7 bits per byte, high bit: more to come), two bytes for a
+ *   packet of a few hundred bytes; the data file itself stays a plain
+ *   concatenation of the packets. A length is only written once all of
+ *   its packet's bytes are, so the index never describes data the file
+ *   does not have
+ */
+
+#define COALESCE_SIZE_DEFAULT (4 * 1024 * 1024)
+#define COALESCE_US_DEFAULT 10000
+#define COALESCE_ALIGN 4096
+#define COALESCE_INDEX_SIZE 65536
+
+struct lat_hist;
+
+/* the data sink: bytes written or <0 (-errno) */
+typedef ssize_t (*coalesce_write_fn)(void *arg, const char *buf, size_t len);
+
+struct coalesce {
+  char *buf;
+  size_t cap;
+  size_t used;
+  uint64_t max_ns;
+  uint64_t first_ns;            // arrival of the oldest buffered packet, 0: none
+  coalesce_write_fn write;
+  void *arg;
+
+  int index_fd;                 // -1: no index kept
+  uint8_t *index;
+  size_t index_used;
+  size_t index_done;            // entries of packets written in full
+  uint64_t index_end;           // data offset those packets end at
+
+  struct lat_hist *lat_flush;   // oldest packet in -> written, NULL: not recorded
+
+  /* statistics */
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t writes;
+  uint64_t full_writes;         // buffer full
+  uint64_t timer_writes;        // max_us reached
+  uint64_t index_bytes;
+};
+
+/*
+ * `cap` bytes of buffer (rounded up to pages, at least max_packet plus a
+ * page), `index_fd` <0 keeps no index
+ */
+int coalesce_init(struct coalesce *c, size_t cap, size_t max_packet,
+                  unsigned max_us, int index_fd, coalesce_write_fn write,
+                  void *arg);
+void coalesce_free(struct coalesce *c);
+
+int coalesce_add(struct coalesce *c, const char *pkt, size_t len);
+/* write everything if the oldest packet is due at `now_ns` */
+int coalesce_poll(struct coalesce *c, uint64_t now_ns);
+/* when coalesce_poll() will write next, UINT64_MAX: nothing buffered */
+uint64_t coalesce_deadline(const struct coalesce *c);
+/* write everything, the index included */
+int coalesce_flush(struct coalesce *c);
+
+void coalesce_report(const struct coalesce *c, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,168 @@
+#include "device_channel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ChannelKind channel_kind(const std::string &path)
+{
+  static const struct {
+    const char *tag;
+    ChannelKind kind;
+  } tags[] = {
+    {"_h2c_", ChannelKind::H2C},     {"_c2h_", ChannelKind::C2H},
+    {"_user", ChannelKind::USER},    {"_bypass", ChannelKind::BYPASS},
+    {"_control", ChannelKind::CONTROL}, {"_events_", ChannelKind::EVENTS},
+  };
+  size_t slash = path.rfind('/');
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+  if (name.compare(0, 4, "xdma"))
+    return ChannelKind::OTHER;
+  for (const auto &t : tags)
+    if (name.find(t.tag) != std::string::npos)
+      return t.kind;
+  return ChannelKind::OTHER;
+}
+
+const char *channel_kind_name(ChannelKind kind)
+{
+  switch (kind) {
+  case ChannelKind::H2C: return "h2c";
+  case ChannelKind::C2H: return "c2h";
+  case ChannelKind::USER: return "user";
+  case ChannelKind::BYPASS: return "bypass";
+  case ChannelKind::CONTROL: return "control";
+  case ChannelKind::EVENTS: return "events";
+  default: return "other";
+  }
+}
+
+DeviceChannel::DeviceChannel(DeviceChannel &&o)
+{
+  *this = std::move(o);
+}
+
+DeviceChannel &DeviceChannel::operator=(DeviceChannel &&o)
+{
+  if (this != &o) {
+    close();
+    fd_ = o.fd_;
+    name_ = std::move(o.name_);
+    kind_ = o.kind_;
+    dir_ = o.dir_;
+    stream_ = o.stream_;
+    seekable_ = o.seekable_;
+    address_ = o.address_;
+    pos_ = o.pos_;
+    map_ = o.map_;
+    map_len_ = o.map_len_;
+    o.fd_ = -1;
+    o.map_ = nullptr;
+    o.map_len_ = 0;
+  }
+  return *this;
+}
+
+int DeviceChannel::open(const std::string &path, Direction dir,
+                        bool eop_flush)
+{
+  int flags;
+
+  close();
+  kind_ = channel_kind(path);
+  if (kind_ == ChannelKind::H2C)
+    dir = WRITE;
+  else if (kind_ == ChannelKind::C2H || kind_ == ChannelKind::EVENTS)
+    dir = READ;
+  else if (kind_ != ChannelKind::OTHER)
+    dir = BOTH;
+
+  if (dir == READ)
+    flags = O_RDONLY;
+  else if (dir == WRITE)
+    flags = O_WRONLY | (kind_ == ChannelKind::OTHER ? O_CREAT | O_TRUNC : 0);
+  else
+    flags = O_RDWR;
+  /* the driver reads O_TRUNC as "flush on EOP"; on a file it would wipe it */
+  if (eop_flush && kind_ == ChannelKind::C2H)
+    flags |= O_TRUNC;
+
+  fd_ = ::open(path.c_str(), flags, 0644);
+  if (fd_ < 0)
+    return -errno;
+  name_ = path;
+  dir_ = dir;
+  probe();
+  return 0;
+}
+
+int DeviceChannel::attach(int fd, const std::string &name, Direction dir)
+{
+  close();
+  if (fd < 0)
+    return -EBADF;
+  fd_ = fd;
+  name_ = name;
+  kind_ = channel_kind(name);
+  dir_ = dir;
+  probe();
+  return 0;
+}
+
+void DeviceChannel::probe()
+{
+  struct stat st;
+
+  stream_ = seekable_ = false;
+  address_ = pos_ = 0;
+  if (fstat(fd_, &st) < 0)
+    return;
+  stream_ = S_ISCHR(st.st_mode);
+  seekable_ = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+  if (seekable_) {
+    off_t cur = lseek(fd_, 0, SEEK_CUR);
+    pos_ = cur > 0 ? cur : 0;
+  }
+}
+
+int DeviceChannel::rewind()
+{
+  if (!seekable_)
+    return -ESPIPE;
+  if (lseek(fd_, 0, SEEK_SET) < 0)
+    return -errno;
+  pos_ = 0;
+  return 0;
+}
+
+void *DeviceChannel::map(size_t len, off_t off)
+{
+  int prot = dir_ == READ ? PROT_READ
+           : dir_ == WRITE ? PROT_WRITE : PROT_READ | PROT_WRITE;
+
+  if (map_) {
+    munmap(map_, map_len_);
+    map_ = nullptr;
+  }
+  void *p = mmap(NULL, len, prot, MAP_SHARED, fd_, off);
+  if (p == MAP_FAILED)
+    return NULL;
+  map_ = p;
+  map_len_ = len;
+  return p;
+}
+
+void DeviceChannel::close()
+{
+  if (map_) {
+    munmap(map_, map_len_);
+    map_ = nullptr;
+    map_len_ = 0;
+  }
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+}
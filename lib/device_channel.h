@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+/*
+ * One XDMA character device node, opened and closed with its owner
+ *
+ * - the node kind comes from its name: xdma0_h2c_N (host to card),
+ *   xdma0_c2h_N (card to host), xdma0_user / xdma0_bypass (register
+ *   windows), xdma0_control, xdma0_events_N
+ * - H2C nodes open write-only, C2H read-only (O_TRUNC for End-of-Packet
+ *   flush), everything else read-write; files and FIFOs standing in for a
+ *   node take the direction the caller asks for
+ * - is_stream(): a char device, where a 0-byte read is a timeout and not
+ *   the end of the data
+ * - offset(): where the next transfer goes, the AXI address on xdma nodes
+ *   and the running position on regular files
+ *
+ * open()/attach() return 0 or a negative errno; a channel is moved, never
+ * copied, and closes its fd (and unmaps its window) when destroyed.
+ */
+
+enum class ChannelKind {
+  H2C,
+  C2H,
+  USER,
+  BYPASS,
+  CONTROL,
+  EVENTS,
+  OTHER,                        // not an xdma node
+};
+
+ChannelKind channel_kind(const std::string &path);
+const char *channel_kind_name(ChannelKind kind);
+
+class DeviceChannel {
+public:
+  /* data flow of nodes that do not tell by their name */
+  enum Direction { READ, WRITE, BOTH };
+
+  DeviceChannel() {}
+  ~DeviceChannel() { close(); }
+  DeviceChannel(DeviceChannel &&o);
+  DeviceChannel &operator=(DeviceChannel &&o);
+  DeviceChannel(const DeviceChannel &) = delete;
+  DeviceChannel &operator=(const DeviceChannel &) = delete;
+
+  int open(const std::string &path, Direction dir, bool eop_flush = false);
+  /* take over an open fd ("-" on the command line) */
+  int attach(int fd, const std::string &name, Direction dir);
+  void close();
+
+  int fd() const { return fd_; }
+  const char *name() const { return name_.c_str(); }
+  ChannelKind kind() const { return kind_; }
+  Direction direction() const { return dir_; }
+  bool is_open() const { return fd_ >= 0; }
+  bool is_stream() const { return stream_; }
+  bool is_seekable() const { return seekable_; }
+
+  /* AXI address of memory-mapped engines, 0 on streaming ones */
+  void set_address(uint64_t addr) { address_ = addr; }
+  uint64_t address() const { return address_; }
+  uint64_t offset() const { return seekable_ ? pos_ : address_; }
+  void advance(size_t n) { pos_ += n; }
+  /* back to the start of a seekable node, runs longer than the file wrap */
+  int rewind();
+
+  /* user / bypass register window, NULL with errno set on failure */
+  void *map(size_t len, off_t off = 0);
+
+private:
+  void probe();
+
+  int fd_ = -1;
+  std::string name_;
+  ChannelKind kind_ = ChannelKind::OTHER;
+  Direction dir_ = BOTH;
+  bool stream_ = false;
+  bool seekable_ = false;
+  uint64_t address_ = 0;
+  uint64_t pos_ = 0;
+
+  void *map_ = nullptr;
+  size_t map_len_ = 0;
+};
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "dma_mem.h"
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SZ_2M (2ul << 20)
+#define SZ_1G (1ul << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/* <numaif.h> without linking libnuma */
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+
+enum dma_mem_kind {
+  DMA_MEM_MEMALIGN = 0,
+  DMA_MEM_PAGES,                // 4k, populated
+  DMA_MEM_THP,
+  DMA_MEM_THP_DENIED,           // madvised, but the kernel kept 4k pages
+  DMA_MEM_HUGETLB_2M,
+  DMA_MEM_HUGETLB_1G,
+  DMA_MEM_KINDS,
+};
+
+static const char *kind_names[] = {
+  "4 KiB pages (posix_memalign)", "4 KiB pages (pre-faulted)",
+  "transparent hugepages (madvised)",
+  "4 KiB pages (hugepages madvised, not all granted)",
+  "2 MiB hugetlb pages", "1 GiB hugetlb pages",
+};
+
+/* mapped allocations, so dma_mem_free() knows how to release them */
+struct dma_mem_map {
+  void *addr;                   // as handed out
+  void *base;                   // as mapped
+  size_t len;
+  struct dma_mem_map *next;
+};
+
+static size_t policy;
+static int bind_node = -1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dma_mem_map *maps;
+static uint64_t kind_bytes[DMA_MEM_KINDS];
+static unsigned kind_count[DMA_MEM_KINDS];
+static unsigned lock_failures;
+static uint64_t bound_bytes;
+static unsigned bind_failures;
+
+int dma_mem_parse(const char *str, size_t *page_size)
+{
+  if (!strcmp(str, "off"))
+    *page_size = 0;
+  else if (!strcmp(str, "4k"))
+    *page_size = sysconf(_SC_PAGESIZE);
+  else if (!strcmp(str, "2m"))
+    *page_size = SZ_2M;
+  else if (!strcmp(str, "1g"))
+    *page_size = SZ_1G;
+  else
+    return -EINVAL;
+  return 0;
+}
+
+void dma_mem_setup(size_t page_size)
+{
+  policy = page_size;
+}
+
+void dma_mem_set_node(int node)
+{
+  bind_node = node;
+}
+
+/* prefer the node for the whole range, moving what is already faulted in */
+static void bind(void *addr, size_t len)
+{
+  unsigned long mask[16] = {0};
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)addr / page * page;
+  int node = bind_node;
+  long rc;
+
+  if (node < 0)
+    return;
+  if (node >= (int)(sizeof(mask) * 8)) {
+    rc = -1;
+  } else {
+    mask[node / (8 * sizeof(long))] |= 1ul << (node % (8 * sizeof(long)));
+    rc = syscall(SYS_mbind, start, (uintptr_t)addr + len - start,
+                 MPOL_PREFERRED, mask, sizeof(mask) * 8, MPOL_MF_MOVE);
+  }
+
+  pthread_mutex_lock(&lock);
+  if (rc < 0)
+    bind_failures++;
+  else
+    bound_bytes += len;
+  pthread_mutex_unlock(&lock);
+}
+
+static size_t round_up(size_t size, size_t align)
+{
+  return (size + align - 1) / align * align;
+}
+
+static void *map_hugetlb(size_t len, int shift)
+{
+  void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB |
+                    (shift << MAP_HUGE_SHIFT), -1, 0);
+  return addr == MAP_FAILED ? NULL : addr;
+}
+
+/* 2 MiB aligned anonymous range with MADV_HUGEPAGE, faulted in afterwards */
+static void *map_thp(size_t len, size_t *maplen, void **mapbase)
+{
+  size_t total = len + SZ_2M;
+  char *base = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *addr;
+  size_t i;
+
+  if (base == MAP_FAILED)
+    return NULL;
+  addr = (char *)round_up((uintptr_t)base, SZ_2M);
+  if (madvise(addr, len, MADV_HUGEPAGE) < 0) {
+    munmap(base, total);
+    return NULL;
+  }
+  for (i = 0; i < len; i += sysconf(_SC_PAGESIZE))
+    addr[i] = 0;
+  *maplen = total;
+  *mapbase = base;
+  return addr;
+}
+
+/*
+ * AnonHugePages of the mapping holding addr: what the kernel really gave,
+ * MADV_HUGEPAGE is only a hint (THP "never", fragmentation, khugepaged)
+ */
+static size_t thp_bytes(const void *addr)
+{
+  FILE *f = fopen("/proc/self/smaps", "r");
+  char line[256];
+  uintptr_t start, end;
+  size_t kb = 0;
+  int found = 0;
+
+  if (!f)
+    return 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+      if (found)
+        break;
+      found = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+    } else if (found && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kb * 1024;
+}
+
+/* 0, or -ENOMEM: the caller unmaps, dma_mem_free() could not */
+static int track(void *addr, void *base, size_t len, enum dma_mem_kind kind)
+{
+  struct dma_mem_map *m = malloc(sizeof(*m));
+
+  if (!m)
+    return -ENOMEM;
+  pthread_mutex_lock(&lock);
+  m->addr = addr;
+  m->base = base;
+  m->len = len;
+  m->next = maps;
+  maps = m;
+  kind_bytes[kind] += len;
+  kind_count[kind]++;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+void *dma_mem_alloc(size_t size)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  enum dma_mem_kind kind = DMA_MEM_PAGES;
+  void *addr = NULL, *base = NULL;
+  size_t len = 0;
+
+  if (!policy) {
+    if (posix_memalign(&addr, page, size)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    kind_bytes[DMA_MEM_MEMALIGN] += size;
+    kind_count[DMA_MEM_MEMALIGN]++;
+    pthread_mutex_unlock(&lock);
+    bind(addr, size);
+    return addr;
+  }
+
+  if (policy >= SZ_1G) {
+    len = round_up(size, SZ_1G);
+    addr = map_hugetlb(len, 30);
+    kind = DMA_MEM_HUGETLB_1G;
+  }
+  if (!addr && policy >= SZ_2M) {
+    len = round_up(size, SZ_2M);
+    addr = map_hugetlb(len, 21);
+    kind = DMA_MEM_HUGETLB_2M;
+  }
+  if (!addr && policy >= SZ_2M) {
+    addr = map_thp(round_up(size, SZ_2M), &len, &base);
+    if (addr)
+      kind = thp_bytes(addr) >= round_up(size, SZ_2M) ? DMA_MEM_THP
+                                                       : DMA_MEM_THP_DENIED;
+  }
+  if (!addr) {
+    len = round_up(size, page);
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (addr == MAP_FAILED)
+      return NULL;
+    kind = DMA_MEM_PAGES;
+  }
+
+  bind(addr, size);
+
+  /* RLIMIT_MEMLOCK may be too small, the buffer still works unlocked */
+  if (mlock(addr, size) < 0) {
+    pthread_mutex_lock(&lock);
+    lock_failures++;
+    pthread_mutex_unlock(&lock);
+  }
+
+  if (track(addr, base ? base : addr, len, kind) < 0) {
+    munmap(base ? base : addr, len);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return addr;
+}
+
+void dma_mem_free(void *addr)
+{
+  struct dma_mem_map **pm, *m = NULL;
+
+  if (!addr)
+    return;
+
+  pthread_mutex_lock(&lock);
+  for (pm = &maps; *pm; pm = &(*pm)->next) {
+    if ((*pm)->addr == addr) {
+      m = *pm;
+      *pm = m->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (!m) {
+    free(addr);
+    return;
+  }
+  munmap(m->base, m->len);
+  free(m);
+}
+
+void dma_mem_report(const char *name)
+{
+  int i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < DMA_MEM_KINDS; i++) {
+    if (kind_count[i])
+      fprintf(stdout, "%s: %u staging buffers, %lu bytes on %s\n", name,
+              kind_count[i], kind_bytes[i], kind_names[i]);
+  }
+  if (bound_bytes)
+    fprintf(stdout, "%s: %lu bytes bound to the device's numa node\n", name,
+            bound_bytes);
+  if (bind_failures)
+    fprintf(stdout, "%s: %u buffers not bound to the device's numa node\n",
+            name, bind_failures);
+  if (policy && lock_failures)
+    fprintf(stdout, "%s: %u buffers not locked (raise RLIMIT_MEMLOCK)\n",
+            name, lock_failures);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Staging buffer allocator shared by the tools and lib/ engines
+ *
+ * off : posix_memalign() on the base page size (legacy, default)
+ * 4k  : anonymous mapping, pre-faulted and mlock()ed
+ * 2m  : hugetlbfs 2 MiB pages, else transparent hugepages (reported as
+ *       such only once smaps shows them), else 4k
+ * 1g  : hugetlbfs 1 GiB pages, else as 2m
+ *
+ * Fewer, larger pages mean a shorter scatter-gather list for the driver to
+ * build on every transfer, and no page faults in the middle of a run. The
+ * policy is process wide and set once from the tool's --hugepages flag.
+ *
+ * dma_mem_set_node() binds the following allocations to the device's NUMA
+ * node (mbind, preferred, already faulted pages are migrated).
+ */
+
+#define DMA_MEM_DEFAULT "off"
+
+int dma_mem_parse(const char *str, size_t *page_size);
+
+/* page_size 0: off; otherwise 4 KiB, 2 MiB or 1 GiB */
+void dma_mem_setup(size_t page_size);
+
+/* node < 0: no binding (default) */
+void dma_mem_set_node(int node);
+
+/* page aligned, NULL with errno set on failure */
+void *dma_mem_alloc(size_t size);
+void dma_mem_free(void *addr);
+
+/* what the allocations so far actually got */
+void dma_mem_report(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
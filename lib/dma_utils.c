@@ -1,4 +1,5 @@
 #include "dma_utils.h"
+#include "alog.h"
 #include <aio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -31,16 +32,15 @@ uint64_t getopt_integer(const char *optarg)
 ssize_t read_to_buffer(const char *fname, int fd, char *buffer, uint64_t size,
 			uint64_t base)
 {
-  fprintf(stdout, "read %s: 0x%lx@0x%lx.\n", fname, size, buffer);
+  alog(ALOG_DEBUG, "read %s: 0x%lx@%p.\n", fname, size, buffer);
 
 	ssize_t rc;
 	off_t offset = base;
   if (offset) {
     rc = lseek(fd, offset, SEEK_SET);
     if (rc != offset) {
-      fprintf(stderr, "%s, seek off 0x%lx != 0x%lx.\n",
-              fname, rc, offset);
-      perror("seek file");
+      alog(ALOG_ERROR, "%s, seek off 0x%lx != 0x%lx: %s.\n",
+           fname, rc, offset, strerror(errno));
       return -EIO;
     }
   }
@@ -48,13 +48,12 @@ ssize_t read_to_buffer(const char *fname, int fd, char *buffer, uint64_t size,
   /* read data from file into memory buffer */
   rc = read(fd, buffer, size);
   if (rc < 0) {
-    fprintf(stderr, "%s, read 0x%lx @ 0x%lx failed %ld.\n",
-            fname, size, offset, rc);
-    perror("read file");
+    alog(ALOG_ERROR, "%s, read 0x%lx @ 0x%lx failed: %s.\n",
+         fname, size, offset, strerror(errno));
     return -EIO;
   }
 
-  fprintf(stdout, "read %s: 0x%lx/0x%lx.\n", fname, rc, size);
+  alog(ALOG_DEBUG, "read %s: 0x%lx/0x%lx.\n", fname, rc, size);
 
 	return rc;
 }
@@ -78,9 +77,8 @@ ssize_t write_from_buffer(const char *fname, int fd, char *buffer, uint64_t size
 		if (offset) {
 			rc = lseek(fd, offset, SEEK_SET);
 			if (rc != offset) {
-				fprintf(stderr, "%s, seek off 0x%lx != 0x%lx.\n",
-					fname, rc, offset);
-				perror("seek file");
+				alog(ALOG_ERROR, "%s, seek off 0x%lx != 0x%lx: %s.\n",
+				     fname, rc, offset, strerror(errno));
 				return -EIO;
 			}
 		}
@@ -88,15 +86,14 @@ ssize_t write_from_buffer(const char *fname, int fd, char *buffer, uint64_t size
 		/* write data to file from memory buffer */
 		rc = write(fd, buf, bytes);
 		if (rc < 0) {
-			fprintf(stderr, "%s, write 0x%lx @ 0x%lx failed %ld.\n",
-				fname, bytes, offset, rc);
-			perror("write file");
+			alog(ALOG_ERROR, "%s, write 0x%lx @ 0x%lx failed: %s.\n",
+			     fname, bytes, offset, strerror(errno));
 			return -EIO;
 		}
 
 		if (rc != bytes) {
-			fprintf(stderr, "%s (loop-%d), write underflow 0x%lx/0x%lx @ 0x%lx.\n",
-              fname, loop, rc, bytes, offset);
+			alog(ALOG_WARN, "%s (loop-%d), write underflow 0x%lx/0x%lx @ 0x%lx.\n",
+			     fname, loop, rc, bytes, offset);
 		}
 
 		count += rc;
@@ -104,8 +101,8 @@ ssize_t write_from_buffer(const char *fname, int fd, char *buffer, uint64_t size
 		loop++;
 	}
 
-  fprintf(stdout, "write %s (final): 0x%lx/0x%lx.\n",
-          fname, count, size);
+  alog(ALOG_DEBUG, "write %s (final): 0x%lx/0x%lx.\n",
+       fname, count, size);
 
 	return count;
 }
@@ -127,13 +124,13 @@ static int timespec_check(struct timespec *t)
 void timespec_sub(struct timespec *t1, struct timespec *t2)
 {
 	if (timespec_check(t1) < 0) {
-		fprintf(stderr, "invalid time #1: %lld.%.9ld.\n",
-			(long long)t1->tv_sec, t1->tv_nsec);
+		alog(ALOG_ERROR, "invalid time #1: %lld.%.9ld.\n",
+		     (long long)t1->tv_sec, t1->tv_nsec);
 		return;
 	}
 	if (timespec_check(t2) < 0) {
-		fprintf(stderr, "invalid time #2: %lld.%.9ld.\n",
-			(long long)t2->tv_sec, t2->tv_nsec);
+		alog(ALOG_ERROR, "invalid time #2: %lld.%.9ld.\n",
+		     (long long)t2->tv_sec, t2->tv_nsec);
 		return;
 	}
 	t1->tv_sec -= t2->tv_sec;
@@ -146,3 +143,8 @@ void timespec_sub(struct timespec *t1, struct timespec *t2)
 		t1->tv_nsec += 1000000000;
 	}
 }
+
+uint64_t timespec_ns(const struct timespec *t)
+{
+	return t->tv_sec * 1000000000ull + t->tv_nsec;
+}
@@ -22,6 +22,9 @@ ssize_t write_from_buffer(const char *fname, int fd, char *buffer, uint64_t size
 
 void timespec_sub(struct timespec *t1, struct timespec *t2);
 
+/* a timespec_sub() difference in ns, seconds included */
+uint64_t timespec_ns(const struct timespec *t);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+/*
+ * Bounded lock-free queues for handing buffers between pipeline threads
+ *
+ * SpscQueue : one producer, one consumer; each side owns its cursor on a
+ *             cache line of its own and keeps a cached copy of the other
+ *             side's, so the shared lines only move when the cached view
+ *             runs out (full / empty as far as it knows)
+ * MpmcQueue : any number of both (Vyukov): a sequence number per cell
+ *             says whose turn it is, a slot is claimed with one CAS on
+ *             the shared cursor
+ *
+ * push()/pop() never block or allocate: false means full / empty and the
+ * caller decides whether to spin (handoff_relax()), yield or sleep.
+ * push_n()/pop_n() move up to n elements for one cursor update (one CAS
+ * on MpmcQueue) and return how many they moved.
+ *
+ * T is copied in and out (trivially copyable): pointers, indices or
+ * small PODs such as a buf_slot. init() sizes the ring to a power of two
+ * >= capacity. The objects are cache-line aligned: make them static, on
+ * the stack or members rather than plain new. jw_queue_bench measures
+ * both against a mutex queue, per core pair.
+ */
+
+#define HANDOFF_CACHE_LINE 64
+
+static inline void handoff_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static inline size_t handoff_pow2(size_t n)
+{
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+template <typename T>
+class SpscQueue {
+  static_assert(std::is_trivially_copyable<T>::value, "copied in and out of raw slots");
+
+public:
+  SpscQueue() {}
+  ~SpscQueue() { free(slots_); }
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  /* 0, -EINVAL or -ENOMEM; not while the queue is in use */
+  int init(size_t capacity)
+  {
+    void *mem;
+    if (!capacity)
+      return -EINVAL;
+    size_t cap = handoff_pow2(capacity);
+    if (posix_memalign(&mem, HANDOFF_CACHE_LINE, cap * sizeof(T)))
+      return -ENOMEM;
+    free(slots_);
+    slots_ = static_cast<T *>(mem);
+    mask_ = cap - 1;
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+    head_cache_ = tail_cache_ = 0;
+    return 0;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+  /* a snapshot, exact only when neither side runs */
+  size_t size() const
+  {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+  /* producer side */
+  bool push(const T &v) { return push_n(&v, 1) == 1; }
+  size_t push_n(const T *v, size_t n)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t room = capacity() - (head - tail_cache_);
+    if (room < n) {
+      tail_cache_ = tail_.load(std::memory_order_acquire);
+      room = capacity() - (head - tail_cache_);
+    }
+    if (n > room)
+      n = room;
+    for (size_t i = 0; i < n; i++)
+      slots_[(head + i) & mask_] = v[i];
+    if (n)
+      head_.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  /* consumer side */
+  bool pop(T &v) { return pop_n(&v, 1) == 1; }
+  size_t pop_n(T *v, size_t n)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t avail = head_cache_ - tail;
+    if (avail < n) {
+      head_cache_ = head_.load(std::memory_order_acquire);
+      avail = head_cache_ - tail;
+    }
+    if (n > avail)
+      n = avail;
+    for (size_t i = 0; i < n; i++)
+      v[i] = slots_[(tail + i) & mask_];
+    if (n)
+      tail_.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+private:
+  /* written by the producer */
+  alignas(HANDOFF_CACHE_LINE) std::atomic<size_t> head_{0};
+  size_t tail_cache_ = 0;
+  /* written by the consumer */
+  alignas(HANDOFF_CACHE_LINE) std::atomic<size_t> tail_{0};
+  size_t head_cache_ = 0;
+  /* read-only once running */
+  alignas(HANDOFF_CACHE_LINE) T *slots_ = nullptr;
+  size_t mask_ = 0;
+};
+
+template <typename T>
+class MpmcQueue {
+public:
+  MpmcQueue() {}
+  ~MpmcQueue() { release(); }
+  MpmcQueue(const MpmcQueue &) = delete;
+  MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+  /* 0, -EINVAL or -ENOMEM; not while the queue is in use */
+  int init(size_t capacity)
+  {
+    void *mem;
+    if (!capacity)
+      return -EINVAL;
+    size_t cap = handoff_pow2(capacity);
+    if (posix_memalign(&mem, HANDOFF_CACHE_LINE, cap * sizeof(Cell)))
+      return -ENOMEM;
+    release();
+    cells_ = static_cast<Cell *>(mem);
+    mask_ = cap - 1;
+    for (size_t i = 0; i < cap; i++)
+      new (&cells_[i]) Cell(i);
+    enq_.store(0, std::memory_order_relaxed);
+    deq_.store(0, std::memory_order_relaxed);
+    return 0;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+  /* a snapshot, exact only when nobody runs */
+  size_t size() const
+  {
+    size_t deq = deq_.load(std::memory_order_acquire);
+    size_t enq = enq_.load(std::memory_order_acquire);
+    return enq > deq ? enq - deq : 0;
+  }
+
+  bool push(const T &v) { return push_n(&v, 1) == 1; }
+  /*
+   * claims the longest run of free cells at the cursor, up to n, with one
+   * CAS; a cell still being read by a slow consumer ends the run early
+   */
+  size_t push_n(const T *v, size_t n)
+  {
+    size_t pos = enq_.load(std::memory_order_relaxed);
+    size_t k;
+    for (;;) {
+      intptr_t dif = (intptr_t)(seq(pos) - pos);
+      if (dif < 0 || !n)
+        return 0;               // full
+      if (dif > 0) {
+        pos = enq_.load(std::memory_order_relaxed);
+        continue;               // another producer took it
+      }
+      for (k = 1; k < n && seq(pos + k) == pos + k; k++)
+        ;
+      if (enq_.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < k; i++) {
+      Cell &c = cells_[(pos + i) & mask_];
+      c.value = v[i];
+      c.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return k;
+  }
+
+  bool pop(T &v) { return pop_n(&v, 1) == 1; }
+  size_t pop_n(T *v, size_t n)
+  {
+    size_t pos = deq_.load(std::memory_order_relaxed);
+    size_t k;
+    for (;;) {
+      intptr_t dif = (intptr_t)(seq(pos) - (pos + 1));
+      if (dif < 0 || !n)
+        return 0;               // empty
+      if (dif > 0) {
+        pos = deq_.load(std::memory_order_relaxed);
+        continue;               // another consumer took it
+      }
+      for (k = 1; k < n && seq(pos + k) == pos + k + 1; k++)
+        ;
+      if (deq_.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < k; i++) {
+      Cell &c = cells_[(pos + i) & mask_];
+      v[i] = c.value;
+      /* free for the producer one lap later */
+      c.seq.store(pos + i + mask_ + 1, std::memory_order_release);
+    }
+    return k;
+  }
+
+private:
+  struct Cell {
+    explicit Cell(size_t s) : seq(s) {}
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  size_t seq(size_t pos) const
+  {
+    return cells_[pos & mask_].seq.load(std::memory_order_acquire);
+  }
+
+  void release()
+  {
+    if (!cells_)
+      return;
+    for (size_t i = 0; i <= mask_; i++)
+      cells_[i].~Cell();
+    free(cells_);
+    cells_ = nullptr;
+  }
+
+  alignas(HANDOFF_CACHE_LINE) std::atomic<size_t> enq_{0};
+  alignas(HANDOFF_CACHE_LINE) std::atomic<size_t> deq_{0};
+  alignas(HANDOFF_CACHE_LINE) Cell *cells_ = nullptr;
+  size_t mask_ = 0;
+};
@@ -0,0 +1,298 @@
+#include "lat_hist.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LAT_HIST_MAGIC "# jw-dpu lat_hist 1"
+
+static struct lat_hist *registry[LAT_HIST_MAX];
+static unsigned registered;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void reset(struct lat_hist *h)
+{
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+int lat_hist_init(struct lat_hist *h, const char *fmt, ...)
+{
+  va_list ap;
+  int err = 0;
+
+  reset(h);
+  va_start(ap, fmt);
+  vsnprintf(h->name, sizeof(h->name), fmt, ap);
+  va_end(ap);
+
+  pthread_mutex_lock(&lock);
+  if (registered < LAT_HIST_MAX)
+    registry[registered++] = h;
+  else
+    err = -ENOSPC;
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+void lat_hist_unregister(struct lat_hist *h)
+{
+  unsigned i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < registered; i++) {
+    if (registry[i] == h) {
+      memmove(&registry[i], &registry[i + 1],
+              (registered - i - 1) * sizeof(registry[0]));
+      registered--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+uint64_t lat_hist_value(unsigned idx)
+{
+  unsigned e;
+
+  if (idx < LAT_HIST_SUB)
+    return idx;
+  e = idx / LAT_HIST_SUB + LAT_HIST_SUB_BITS - 1;
+  return (uint64_t)(LAT_HIST_SUB | idx % LAT_HIST_SUB) << (e - LAT_HIST_SUB_BITS);
+}
+
+void lat_hist_add(struct lat_hist *h, uint64_t value, uint64_t count)
+{
+  if (!count)
+    return;
+  h->buckets[lat_hist_index(value)] += count;
+  h->count += count;
+  h->sum += value * count;
+  if (value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+}
+
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+  unsigned i;
+
+  for (i = 0; i < LAT_HIST_BUCKETS; i++)
+    dst->buckets[i] += LAT_HIST_GET(&src->buckets[i]);
+  dst->count += LAT_HIST_GET(&src->count);
+  dst->sum += LAT_HIST_GET(&src->sum);
+  if (LAT_HIST_GET(&src->min) < dst->min)
+    dst->min = LAT_HIST_GET(&src->min);
+  if (LAT_HIST_GET(&src->max) > dst->max)
+    dst->max = LAT_HIST_GET(&src->max);
+}
+
+uint64_t lat_hist_percentile(const struct lat_hist *h, double pct)
+{
+  uint64_t count = LAT_HIST_GET(&h->count), max = LAT_HIST_GET(&h->max);
+  uint64_t want, seen = 0;
+  unsigned i;
+
+  if (!count)
+    return 0;
+  want = (uint64_t)(pct / 100 * count + 0.5);
+  if (want < 1)
+    want = 1;
+  for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+    seen += LAT_HIST_GET(&h->buckets[i]);
+    if (seen >= want) {
+      uint64_t top = i + 1 < LAT_HIST_BUCKETS ? lat_hist_value(i + 1) - 1 : UINT64_MAX;
+      return top < max ? top : max;
+    }
+  }
+  return max;                   // a report racing the writer
+}
+
+void lat_hist_print(FILE *f, const struct lat_hist *const *hists, unsigned n)
+{
+  static const double pcts[] = {50, 90, 99, 99.9, 99.99};
+  unsigned i, j;
+
+  fprintf(f, "%-40s %10s %9s %9s %9s %9s %9s %9s %9s %9s\n", "latency (us)",
+          "count", "min", "mean", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+  for (i = 0; i < n; i++) {
+    const struct lat_hist *h = hists[i];
+    uint64_t count = LAT_HIST_GET(&h->count);
+
+    if (!count)
+      continue;
+    fprintf(f, "%-40s %10lu %9.1f %9.1f", h->name, count,
+            LAT_HIST_GET(&h->min) / 1e3, LAT_HIST_GET(&h->sum) / 1e3 / count);
+    for (j = 0; j < sizeof(pcts) / sizeof(pcts[0]); j++)
+      fprintf(f, " %9.1f", lat_hist_percentile(h, pcts[j]) / 1e3);
+    fprintf(f, " %9.1f\n", LAT_HIST_GET(&h->max) / 1e3);
+  }
+  fflush(f);
+}
+
+void lat_hist_report(void)
+{
+  pthread_mutex_lock(&lock);
+  if (registered)
+    lat_hist_print(stdout, (const struct lat_hist *const *)registry, registered);
+  pthread_mutex_unlock(&lock);
+}
+
+static void *report_thread(void *arg)
+{
+  sigset_t *set = arg;
+  int sig;
+
+  while (!sigwait(set, &sig))
+    lat_hist_report();
+  return NULL;
+}
+
+int lat_hist_report_on(int sig)
+{
+  static sigset_t set;
+  sigset_t all, old;
+  pthread_t thread;
+  int err;
+
+  sigemptyset(&set);
+  sigaddset(&set, sig);
+  err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+  if (err)
+    return -err;
+  /* the helper takes no other signal, e.g. one meant for another helper */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  err = pthread_create(&thread, NULL, report_thread, &set);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err)
+    return -err;
+  pthread_detach(thread);
+  return 0;
+}
+
+int lat_hist_write(FILE *f, const struct lat_hist *const *hists, unsigned n)
+{
+  unsigned i, j;
+
+  fprintf(f, "%s\n", LAT_HIST_MAGIC);
+  for (i = 0; i < n; i++) {
+    const struct lat_hist *h = hists[i];
+
+    fprintf(f, "hist %s\n", h->name);
+    fprintf(f, "stats %lu %lu %lu %lu\n", LAT_HIST_GET(&h->count),
+            LAT_HIST_GET(&h->sum), LAT_HIST_GET(&h->min), LAT_HIST_GET(&h->max));
+    for (j = 0; j < LAT_HIST_BUCKETS; j++) {
+      uint64_t c = LAT_HIST_GET(&h->buckets[j]);
+      if (c)
+        fprintf(f, "%lu %lu\n", lat_hist_value(j), c);
+    }
+    fprintf(f, "end\n");
+  }
+  return ferror(f) ? -EIO : 0;
+}
+
+int lat_hist_save(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  int err;
+
+  if (!f)
+    return -errno;
+  pthread_mutex_lock(&lock);
+  err = lat_hist_write(f, (const struct lat_hist *const *)registry, registered);
+  pthread_mutex_unlock(&lock);
+  if (fclose(f) && !err)
+    err = -errno;
+  return err;
+}
+
+void lat_hist_done(const char *path)
+{
+  int err;
+
+  lat_hist_report();
+  if (!path || !*path)
+    return;
+  err = lat_hist_save(path);
+  if (err < 0)
+    fprintf(stderr, "%s: %s\n", path, strerror(-err));
+  else
+    fprintf(stdout, "latency histograms saved to %s\n", path);
+}
+
+static struct lat_hist *find(struct lat_hist *hists, unsigned max,
+                             unsigned *n, const char *name)
+{
+  unsigned i;
+
+  for (i = 0; i < *n; i++)
+    if (!strcmp(hists[i].name, name))
+      return &hists[i];
+  if (*n == max)
+    return NULL;
+  reset(&hists[*n]);
+  snprintf(hists[*n].name, sizeof(hists[*n].name), "%s", name);
+  return &hists[(*n)++];
+}
+
+int lat_hist_load(const char *path, struct lat_hist *hists, unsigned max,
+                  unsigned *n)
+{
+  char line[256];
+  struct lat_hist *cur = NULL, *dst = NULL;
+  unsigned long lineno = 1;
+  uint64_t a, b, c, d;
+  int err = 0;
+  FILE *f = fopen(path, "r");
+
+  if (!f)
+    return -errno;
+  if (!fgets(line, sizeof(line), f) || strncmp(line, LAT_HIST_MAGIC, strlen(LAT_HIST_MAGIC))) {
+    fclose(f);
+    return -EINVAL;
+  }
+  /* one histogram at a time: the stats line carries the exact sum/min/max */
+  cur = malloc(sizeof(*cur));
+  if (!cur) {
+    fclose(f);
+    return -ENOMEM;
+  }
+  while (!err && fgets(line, sizeof(line), f)) {
+    lineno++;
+    line[strcspn(line, "\n")] = 0;
+    if (!strncmp(line, "hist ", 5)) {
+      dst = find(hists, max, n, line + 5);
+      if (!dst)
+        err = -ENOSPC;
+      reset(cur);
+    }
+    else if (!dst)
+      err = -EINVAL;
+    else if (!strcmp(line, "end")) {
+      lat_hist_merge(dst, cur);
+      dst = NULL;
+    }
+    else if (sscanf(line, "stats %lu %lu %lu %lu", &a, &b, &c, &d) == 4) {
+      cur->sum = b;
+      cur->min = c;
+      cur->max = d;
+    }
+    else if (sscanf(line, "%lu %lu", &a, &b) == 2) {
+      cur->buckets[lat_hist_index(a)] += b;
+      cur->count += b;
+    }
+    else
+      err = -EINVAL;
+  }
+  if (!err && dst)
+    err = -EINVAL;              // cut short
+  if (err == -EINVAL)
+    fprintf(stderr, "%s:%lu: not a lat_hist line\n", path, lineno);
+  free(cur);
+  fclose(f);
+  return err;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Per-transfer latency histograms (HdrHistogram style)
+ *
+ * - log-linear buckets: values below 2^LAT_HIST_SUB_BITS ns are exact,
+ *   above that every power of two is split into 2^LAT_HIST_SUB_BITS
+ *   buckets, so a value is kept within 1/64 of itself over the whole
+ *   64-bit range
+ * - the buckets are part of the struct: lat_hist_record() never
+ *   allocates, locks or formats, it is an index computation and a few
+ *   relaxed stores; one thread records into a histogram, any other may
+ *   read it (a report during the run is a consistent-enough snapshot)
+ * - lat_hist_init() registers the histogram; lat_hist_report() prints a
+ *   percentile table of every registered one, lat_hist_report_on(SIGUSR1)
+ *   does so whenever the signal comes
+ * - lat_hist_save() dumps them as text, one "value count" line per
+ *   non-empty bucket; lat_hist_load() adds such a file into histograms of
+ *   the same name, so runs from several hosts merge into one table
+ *   (jw_lat_merge)
+ */
+
+#define LAT_HIST_SUB_BITS 6
+#define LAT_HIST_SUB (1u << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS ((64 - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB)
+#define LAT_HIST_NAME_MAX 64
+#define LAT_HIST_MAX 64         // registered histograms
+
+struct lat_hist {
+  char name[LAT_HIST_NAME_MAX];
+  uint64_t count;
+  uint64_t sum;                 // ns
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[LAT_HIST_BUCKETS];
+};
+
+/* zeroes `h`, names it "<fmt ...>" and registers it (-ENOSPC: not listed) */
+int lat_hist_init(struct lat_hist *h, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+/* before `h` goes away while others are still reported */
+void lat_hist_unregister(struct lat_hist *h);
+
+static inline uint64_t lat_hist_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline unsigned lat_hist_index(uint64_t v)
+{
+  unsigned e;
+
+  if (v < LAT_HIST_SUB)
+    return (unsigned)v;
+  e = 63 - __builtin_clzll(v);
+  return (e - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB +
+         (unsigned)((v >> (e - LAT_HIST_SUB_BITS)) & (LAT_HIST_SUB - 1));
+}
+
+#define LAT_HIST_SET(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define LAT_HIST_GET(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+
+/* single writer: plain read-modify-write, relaxed for the readers */
+static inline void lat_hist_record(struct lat_hist *h, uint64_t ns)
+{
+  uint64_t *b = &h->buckets[lat_hist_index(ns)];
+
+  LAT_HIST_SET(b, LAT_HIST_GET(b) + 1);
+  LAT_HIST_SET(&h->sum, h->sum + ns);
+  if (ns < h->min)
+    LAT_HIST_SET(&h->min, ns);
+  if (ns > h->max)
+    LAT_HIST_SET(&h->max, ns);
+  LAT_HIST_SET(&h->count, h->count + 1);
+}
+
+/* ns since `t0` (a lat_hist_now()), no-op on a NULL histogram */
+static inline void lat_hist_since(struct lat_hist *h, uint64_t t0)
+{
+  if (h)
+    lat_hist_record(h, lat_hist_now() - t0);
+}
+
+/* `count` samples of `value`, e.g. from a file */
+void lat_hist_add(struct lat_hist *h, uint64_t value, uint64_t count);
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+/* the smallest bucket bound that `pct` percent of the samples are under */
+uint64_t lat_hist_percentile(const struct lat_hist *h, double pct);
+/* lowest value kept in bucket `idx` */
+uint64_t lat_hist_value(unsigned idx);
+
+/* one table row per histogram, in us; empty ones are left out */
+void lat_hist_print(FILE *f, const struct lat_hist *const *hists, unsigned n);
+/* all registered histograms */
+void lat_hist_report(void);
+/*
+ * report whenever `sig` comes: the signal is blocked in the calling thread
+ * and a helper thread waits for it, so call it before any other thread is
+ * started (they inherit the mask)
+ */
+int lat_hist_report_on(int sig);
+
+/* end of a run: lat_hist_report(), then lat_hist_save() unless `path` is NULL or "" */
+void lat_hist_done(const char *path);
+
+/* text dump: all registered histograms, or the `n` given */
+int lat_hist_save(const char *path);
+int lat_hist_write(FILE *f, const struct lat_hist *const *hists, unsigned n);
+/*
+ * add the histograms of `path` into hists[0..*n), by name; the ones not
+ * there yet are appended (up to `max`, then -ENOSPC) without registering
+ */
+int lat_hist_load(const char *path, struct lat_hist *hists, unsigned max,
+                  unsigned *n);
+
+#ifdef __cplusplus
+}
+#endif
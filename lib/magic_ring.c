@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include "magic_ring.h"
+#include "stat_shm.h"
+#include "trace_rec.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SZ_2M (2ul << 20)
+#define SZ_1G (1ul << 30)
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t round_up(size_t size, size_t align)
+{
+  return (size + align - 1) / align * align;
+}
+
+static int open_memfd(size_t size, size_t page)
+{
+  unsigned flags = MFD_CLOEXEC;
+  int fd;
+
+  if (page >= SZ_2M)
+    flags |= MFD_HUGETLB | ((page >= SZ_1G ? 30u : 21u) << MFD_HUGE_SHIFT);
+  fd = memfd_create("jw magic ring", flags);
+  if (fd < 0)
+    return -errno;
+  if (ftruncate(fd, size) < 0) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  return fd;
+}
+
+/* the memfd twice, back to back, in a range aligned to its pages */
+static char *map_twice(int fd, size_t size, size_t page)
+{
+  size_t total = 2 * size + page;
+  char *res, *base;
+
+  res = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res == MAP_FAILED)
+    return NULL;
+  base = (char *)round_up((uintptr_t)res, page);
+  if (base > res)
+    munmap(res, base - res);
+  munmap(base + 2 * size, res + total - (base + 2 * size));
+
+  /* MAP_FIXED replaces the reservation, nobody else can take the range */
+  if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_POPULATE,
+           fd, 0) == MAP_FAILED ||
+      mmap(base + size, size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED) {
+    munmap(base, 2 * size);
+    return NULL;
+  }
+  return base;
+}
+
+int magic_ring_init(struct magic_ring *r, size_t size, size_t huge_page)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  int fd = -1;
+
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  if (!size)
+    return -EINVAL;
+
+  /* hugetlb pages, else the base page size */
+  if (huge_page >= SZ_2M) {
+    fd = open_memfd(round_up(size, huge_page), huge_page);
+    if (fd >= 0) {
+      r->base = map_twice(fd, round_up(size, huge_page), huge_page);
+      if (r->base) {
+        page = huge_page;
+      } else {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  if (!r->base) {
+    fd = open_memfd(round_up(size, page), page);
+    if (fd < 0)
+      return fd;
+    r->base = map_twice(fd, round_up(size, page), page);
+    if (!r->base) {
+      int err = -errno;
+      close(fd);
+      return err;
+    }
+  }
+  r->fd = fd;
+  r->page = page;
+  r->size = round_up(size, page);
+  /* RLIMIT_MEMLOCK may be too small, the ring still works unlocked */
+  mlock(r->base, r->size);
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->not_full, NULL);
+  pthread_cond_init(&r->not_empty, NULL);
+  return 0;
+}
+
+void magic_ring_free(struct magic_ring *r)
+{
+  if (!r->base)
+    return;
+  pthread_cond_destroy(&r->not_empty);
+  pthread_cond_destroy(&r->not_full);
+  pthread_mutex_destroy(&r->lock);
+  munmap(r->base, 2 * r->size);
+  close(r->fd);
+  r->base = NULL;
+  r->fd = -1;
+}
+
+static size_t filled(struct magic_ring *r)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) -
+         __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+}
+
+static int is_closed(struct magic_ring *r)
+{
+  return __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * the waiter announces itself before its last look at the cursors and the
+ * other side looks for it after moving its own cursor (both seq_cst):
+ * either the waiter sees the new cursor or the other side sees the waiter
+ */
+static void wake(struct magic_ring *r, int *waiting, pthread_cond_t *cond)
+{
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+char *magic_ring_reserve(struct magic_ring *r, size_t len)
+{
+  if (len > r->size)
+    return NULL;
+
+  if (r->size - filled(r) < len && !is_closed(r)) {
+    uint64_t t0 = now_ns(), t1;
+    r->prod_stalls++;
+    stat_inc(r->st_full, 1);
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->prod_waiting, 1, __ATOMIC_SEQ_CST);
+    while (r->size - filled(r) < len && !r->closed)
+      pthread_cond_wait(&r->not_full, &r->lock);
+    __atomic_store_n(&r->prod_waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&r->lock);
+    t1 = now_ns();
+    r->prod_stall_ns += t1 - t0;
+    trace_span(TRACE_RING_FULL, t0, t1, filled(r));
+  }
+  if (is_closed(r))
+    return NULL;
+  return r->base + r->head % r->size;
+}
+
+void magic_ring_produce(struct magic_ring *r, size_t len)
+{
+  size_t fill;
+
+  __atomic_store_n(&r->head, r->head + len, __ATOMIC_SEQ_CST);
+  fill = filled(r);
+  if (fill > r->hwm)
+    r->hwm = fill;
+  stat_set(r->st_level, fill);
+  trace_mark(TRACE_ENQ, fill);
+  wake(r, &r->cons_waiting, &r->not_empty);
+}
+
+char *magic_ring_peek(struct magic_ring *r, size_t *len)
+{
+  size_t fill = filled(r);
+
+  if (!fill && !is_closed(r)) {
+    uint64_t t0 = now_ns(), t1;
+    r->cons_stalls++;
+    stat_inc(r->st_starved, 1);
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->cons_waiting, 1, __ATOMIC_SEQ_CST);
+    while (!(fill = filled(r)) && !r->closed)
+      pthread_cond_wait(&r->not_empty, &r->lock);
+    __atomic_store_n(&r->cons_waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&r->lock);
+    t1 = now_ns();
+    r->cons_stall_ns += t1 - t0;
+    trace_span(TRACE_RING_EMPTY, t0, t1, fill);
+  }
+  *len = fill;
+  return fill ? r->base + r->tail % r->size : NULL;
+}
+
+void magic_ring_consume(struct magic_ring *r, size_t len)
+{
+  size_t fill;
+
+  __atomic_store_n(&r->tail, r->tail + len, __ATOMIC_SEQ_CST);
+  fill = filled(r);
+  stat_set(r->st_level, fill);
+  trace_mark(TRACE_DEQ, fill);
+  wake(r, &r->prod_waiting, &r->not_full);
+}
+
+void magic_ring_close(struct magic_ring *r)
+{
+  pthread_mutex_lock(&r->lock);
+  __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&r->not_full);
+  pthread_cond_broadcast(&r->not_empty);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void magic_ring_publish(struct magic_ring *r, struct stat_shm *shm, const char *name)
+{
+  r->st_level = stat_shm_add(shm, name, "ring bytes", STAT_GAUGE);
+  r->st_full = stat_shm_add(shm, name, "ring full", STAT_COUNTER);
+  r->st_starved = stat_shm_add(shm, name, "ring empty", STAT_COUNTER);
+}
+
+void magic_ring_report(const struct magic_ring *r, const char *name)
+{
+  fprintf(stdout, "%s magic ring: %lu bytes on %lu KiB pages, high-water %lu (%.0f%%)\n",
+          name, r->size, r->page / 1024, r->hwm, 100.0 * r->hwm / r->size);
+  fprintf(stdout, "%s magic ring: reader stalled %lu times, %.3f ms (ring full)\n",
+          name, r->prod_stalls, r->prod_stall_ns / 1e6);
+  fprintf(stdout, "%s magic ring: writer idled %lu times, %.3f ms (ring empty)\n",
+          name, r->cons_stalls, r->cons_stall_ns / 1e6);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Byte ring whose memory is mapped twice, back to back ("magic" ring)
+ *
+ * The same memfd backs [base, base + size) and [base + size, base + 2 size),
+ * so the free or filled range starting anywhere in the first half is
+ * contiguous in virtual memory: a variable-length packet is read in with
+ * one call and written out with one call, no split at the wrap point and
+ * no space left unused there.
+ *
+ * producer: magic_ring_reserve() -> fill -> magic_ring_produce()
+ * consumer: magic_ring_peek()    -> drain -> magic_ring_consume()
+ *
+ * One producer and one consumer. The cursors are plain atomics, the lock
+ * is only taken by a side that has to wait and by the other side to wake
+ * it. With a hugepage size the memfd is hugetlb backed (size rounded up
+ * to it), else 4 KiB pages; both are pre-faulted and locked like
+ * dma_mem_alloc()'s staging buffers.
+ */
+
+struct stat_shm;
+
+struct magic_ring {
+  char *base;
+  size_t size;
+  size_t page;                  // backing page size
+  int fd;
+
+  uint64_t head;                // bytes ever produced
+  uint64_t tail;                // bytes ever consumed
+  int closed;
+  int prod_waiting;
+  int cons_waiting;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+
+  /* statistics */
+  size_t hwm;                   // max filled bytes seen
+  uint64_t prod_stalls;
+  uint64_t prod_stall_ns;
+  uint64_t cons_stalls;
+  uint64_t cons_stall_ns;
+
+  /* live counters, NULL: not published */
+  uint64_t *st_level;
+  uint64_t *st_full;
+  uint64_t *st_starved;
+};
+
+/* huge_page: 0 or 4 KiB for normal pages, 2 MiB / 1 GiB (dma_mem_parse()) */
+int magic_ring_init(struct magic_ring *r, size_t size, size_t huge_page);
+void magic_ring_free(struct magic_ring *r);
+
+/* producer side: `len` (<= size) contiguous free bytes, NULL once closed */
+char *magic_ring_reserve(struct magic_ring *r, size_t len);
+void magic_ring_produce(struct magic_ring *r, size_t len);
+
+/*
+ * consumer side: all filled bytes, contiguous, in *len; NULL once the
+ * ring is closed and drained
+ */
+char *magic_ring_peek(struct magic_ring *r, size_t *len);
+void magic_ring_consume(struct magic_ring *r, size_t len);
+
+/* wake both sides, nothing more will be produced */
+void magic_ring_close(struct magic_ring *r);
+
+void magic_ring_publish(struct magic_ring *r, struct stat_shm *shm, const char *name);
+void magic_ring_report(const struct magic_ring *r, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
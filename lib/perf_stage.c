@@ -0,0 +1,227 @@
+#include "perf_stage.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define PERF_READ_FORMAT                                                       \
+  (PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |                        \
+   PERF_FORMAT_TOTAL_TIME_RUNNING)
+
+#define HW_CACHE_MISS(cache)                                                   \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                              \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counters[PERF_COUNTER_MAX] = {
+  [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  [PERF_LLC_MISSES] = {"LLC misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+  [PERF_DTLB_MISSES] = {"dTLB misses", PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+  [PERF_CTX_SWITCHES] = {"context switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+/* PERF_FORMAT_GROUP read: the group's values in the order they joined */
+struct group_read {
+  uint64_t nr;
+  uint64_t enabled;
+  uint64_t running;
+  uint64_t values[PERF_COUNTER_MAX];
+};
+
+struct perf_thread {
+  int opened;
+  int leader;                   // -1: no counter for this thread
+  int slot[PERF_COUNTER_MAX];   // index in values[], -1: not counted
+  int begun;
+  struct group_read start;
+};
+
+int perf_stage_on;
+
+static struct perf_stage *registry[PERF_STAGE_MAX];
+static unsigned registered;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int user_only = -1;      // decided by the first counter opened
+static int warned;
+
+static __thread struct perf_thread self;
+
+int perf_stage_init(struct perf_stage *s, const char *fmt, ...)
+{
+  va_list ap;
+  int err = 0;
+
+  memset(s, 0, sizeof(*s));
+  va_start(ap, fmt);
+  vsnprintf(s->name, sizeof(s->name), fmt, ap);
+  va_end(ap);
+
+  pthread_mutex_lock(&lock);
+  if (registered < PERF_STAGE_MAX)
+    registry[registered++] = s;
+  else
+    err = -ENOSPC;
+  pthread_mutex_unlock(&lock);
+  return err;
+}
+
+static int open_counter(int i, int group_fd, int exclude_kernel)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = counters[i].type;
+  attr.config = counters[i].config;
+  attr.read_format = PERF_READ_FORMAT;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  /* pid 0, cpu -1: the calling thread, wherever it runs */
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd,
+                      PERF_FLAG_FD_CLOEXEC);
+}
+
+int perf_stage_thread_init(void)
+{
+  int i, fd, excl, n = 0, first_err = 0;
+
+  if (self.opened)
+    return self.leader < 0 ? -ENODEV : 0;
+  self.opened = 1;
+  self.leader = -1;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < PERF_COUNTER_MAX; i++) {
+    self.slot[i] = -1;
+    excl = user_only > 0;
+    fd = open_counter(i, self.leader, excl);
+    /* kernel counting not allowed (perf_event_paranoid): user space only */
+    if (fd < 0 && (errno == EACCES || errno == EPERM) && user_only < 0)
+      fd = open_counter(i, self.leader, excl = 1);
+    if (fd < 0) {
+      if (!first_err)
+        first_err = errno;
+      continue;
+    }
+    if (user_only < 0)
+      user_only = excl;
+    if (self.leader < 0)
+      self.leader = fd;
+    self.slot[i] = n++;
+  }
+
+  if (self.leader < 0) {
+    if (!warned)
+      fprintf(stderr, "perf counters: none available (%s), see "
+              "/proc/sys/kernel/perf_event_paranoid\n", strerror(first_err));
+    warned = 1;
+    pthread_mutex_unlock(&lock);
+    return -first_err;
+  }
+  if (!warned && user_only > 0)
+    fprintf(stderr, "perf counters: user space only (perf_event_paranoid)\n");
+  if (!warned && n < PERF_COUNTER_MAX) {
+    const char *sep = "";
+    fprintf(stderr, "perf counters: ");
+    for (i = 0; i < PERF_COUNTER_MAX; i++) {
+      if (self.slot[i] < 0) {
+        fprintf(stderr, "%s%s", sep, counters[i].name);
+        sep = ", ";
+      }
+    }
+    fprintf(stderr, " not available (%s)\n", strerror(first_err));
+  }
+  warned = 1;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+int perf_stage_enable(void)
+{
+  int err = perf_stage_thread_init();
+
+  /* nothing on the first thread: the others will not fare better */
+  perf_stage_on = err == 0;
+  return err;
+}
+
+void perf_stage_begin_(void)
+{
+  if (!self.opened)
+    perf_stage_thread_init();
+  self.begun = self.leader >= 0 &&
+               read(self.leader, &self.start, sizeof(self.start)) > 0;
+}
+
+void perf_stage_end_(struct perf_stage *s, uint64_t bytes)
+{
+  struct group_read now;
+  int i;
+
+  if (!self.begun || read(self.leader, &now, sizeof(now)) <= 0)
+    return;
+  self.begun = 0;
+  s->calls++;
+  s->bytes += bytes;
+  s->enabled += now.enabled - self.start.enabled;
+  s->running += now.running - self.start.running;
+  for (i = 0; i < PERF_COUNTER_MAX; i++) {
+    int k = self.slot[i];
+    if (k < 0)
+      continue;
+    s->value[i] += now.values[k] - self.start.values[k];
+    s->counted |= 1u << i;
+  }
+}
+
+static void print_value(const struct perf_stage *s, int i, double per_gb,
+                        double unit, int width)
+{
+  if (s->counted & (1u << i))
+    printf(" %*.1f", width, s->value[i] * per_gb / unit);
+  else
+    printf(" %*s", width, "-");
+}
+
+void perf_stage_report(void)
+{
+  unsigned i, header = 0;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < registered; i++) {
+    const struct perf_stage *s = registry[i];
+    double gb = s->bytes / 1e9, scale, per_gb;
+
+    if (!s->calls || !s->bytes)
+      continue;
+    if (!header++)
+      printf("%-40s %9s %9s %9s %6s %10s %10s %8s\n", "perf per GB (M: 1e6, K: 1e3)",
+             "GB", "Mcycles", "Minstr", "IPC", "K LLC-miss", "K dTLB-mis", "ctx-sw");
+    /* multiplexed: the group counted only part of the time */
+    scale = s->running ? (double)s->enabled / s->running : 1.0;
+    per_gb = scale / gb;
+    printf("%-40s %9.3f", s->name, gb);
+    print_value(s, PERF_CYCLES, per_gb, 1e6, 9);
+    print_value(s, PERF_INSTRUCTIONS, per_gb, 1e6, 9);
+    if ((s->counted & 3) == 3 && s->value[PERF_CYCLES])
+      printf(" %6.2f", (double)s->value[PERF_INSTRUCTIONS] / s->value[PERF_CYCLES]);
+    else
+      printf(" %6s", "-");
+    print_value(s, PERF_LLC_MISSES, per_gb, 1e3, 10);
+    print_value(s, PERF_DTLB_MISSES, per_gb, 1e3, 10);
+    print_value(s, PERF_CTX_SWITCHES, per_gb, 1, 8);
+    if (scale > 1.001)
+      printf("  (scaled x%.2f)", scale);
+    printf("\n");
+  }
+  pthread_mutex_unlock(&lock);
+  fflush(stdout);
+}
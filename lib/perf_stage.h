@@ -0,0 +1,81 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Hardware counters per pipeline stage (perf_event_open)
+ *
+ * - every thread opens its own counter group on first use: cycles,
+ *   instructions, LLC misses, dTLB misses and context switches, counting
+ *   that thread only, kernel included where allowed
+ * - perf_stage_begin() / perf_stage_end() around a stage read the whole
+ *   group with one read(2) each and add the difference, and the bytes the
+ *   stage moved, to a perf_stage; one stage open per thread at a time
+ * - perf_stage_report() prints every registered stage per GB moved, so
+ *   hugepages, zero-copy or NUMA placement show up as fewer cycles,
+ *   misses or switches for the same data
+ *
+ * Off until perf_stage_enable(), then two syscalls per stage. Counters
+ * the kernel or container does not allow are left out ("-"); with none
+ * at all the first thread says why once and everything stays off.
+ * Multiplexed counts are scaled up by enabled / running time.
+ */
+
+enum perf_counter {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_CTX_SWITCHES,
+  PERF_COUNTER_MAX,
+};
+
+#define PERF_STAGE_NAME_MAX 64
+#define PERF_STAGE_MAX 32       // registered stages
+
+struct perf_stage {
+  char name[PERF_STAGE_NAME_MAX];
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t enabled;             // ns the group was enabled / running,
+  uint64_t running;             // apart when multiplexed
+  uint64_t value[PERF_COUNTER_MAX];
+  unsigned counted;             // bit per counter that was available
+};
+
+extern int perf_stage_on;
+
+/* zeroes `s`, names it "<fmt ...>" and registers it (-ENOSPC: not listed) */
+int perf_stage_init(struct perf_stage *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* turn counting on for all threads; <0 if this thread gets no counter */
+int perf_stage_enable(void);
+/* optional: open the calling thread's counters outside its hot loop */
+int perf_stage_thread_init(void);
+
+void perf_stage_begin_(void);
+void perf_stage_end_(struct perf_stage *s, uint64_t bytes);
+
+static inline void perf_stage_begin(void)
+{
+  if (perf_stage_on)
+    perf_stage_begin_();
+}
+
+static inline void perf_stage_end(struct perf_stage *s, uint64_t bytes)
+{
+  if (perf_stage_on)
+    perf_stage_end_(s, bytes);
+}
+
+/* one row per registered stage that ran, per GB (1e9 bytes) */
+void perf_stage_report(void);
+
+#ifdef __cplusplus
+}
+#endif
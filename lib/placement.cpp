@@ -0,0 +1,64 @@
+#include "placement.h"
+#include "dma_mem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+int LoopPlacement::parse(const std::string &numa, const std::string &pin,
+                         int rt_prio)
+{
+  int writer;                   // one thread: a writer cpu has nothing to pin
+
+  prio_ = rt_prio;
+  if (topology_parse_node(numa.c_str(), &node_) < 0 ||
+      topology_parse_pin(pin.c_str(), &cpu_, &writer) < 0)
+    return -EINVAL;
+  return 0;
+}
+
+void LoopPlacement::setup(const char *devnode, const std::string &root)
+{
+  bool pin_auto = cpu_ == TOPO_AUTO;
+
+  topology_discover(&topo_, root.c_str(), devnode);
+  topology_place(&topo_, &node_, &cpu_, NULL);
+  if (prio_ && pin_auto)
+    cpu_ = realtime_pick_cpu(cpu_,
+                             CPU_COUNT(&topo_.node_cpus) ? &topo_.node_cpus : NULL);
+  topology_report(&topo_, devnode);
+  fprintf(stdout, "%s: buffers on numa node %d, transfer loop on cpu %d (-1: any)\n",
+          devnode, node_, cpu_);
+  dma_mem_set_node(node_);
+  if (prio_) {
+    int err = realtime_lock();
+    if (err < 0)
+      fprintf(stderr, "mlockall: %s\n", strerror(-err));
+  }
+}
+
+void LoopPlacement::enter()
+{
+  if (entered_)
+    return;
+  entered_ = true;
+  if (prio_) {
+    realtime_thread(&rt_, prio_, cpu_);
+  } else {
+    int err = topology_pin(cpu_);
+    if (err < 0)
+      fprintf(stderr, "pin to cpu %d: %s\n", cpu_, strerror(-err));
+  }
+  realtime_begin(&rt_);
+}
+
+void LoopPlacement::leave()
+{
+  if (entered_)
+    realtime_end(&rt_);
+}
+
+void LoopPlacement::report(const char *name) const
+{
+  if (prio_ && entered_)
+    realtime_report(&rt_, name);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+
+#include "realtime.h"
+#include "topology.h"
+
+/*
+ * --numa, --pin, --topology-root and --realtime for the tools whose
+ * transfer loop runs in main (asio_*, file_*, dma_from_device), the same
+ * placement as jw_from_device with its reader and writer being one thread
+ *
+ *   parse()  : after the options, -EINVAL on a bad --numa or --pin;
+ *              rt_prio 0 is no realtime mode
+ *   setup()  : once the device is known and before the buffers are
+ *              allocated; discovers the topology, prints the summary and
+ *              binds the staging buffers to the device's node; realtime:
+ *              an isolated cpu for an auto pin, then mlockall
+ *   enter()  : in the loop thread, after the helper threads (alog) started,
+ *              they would inherit the pin and SCHED_FIFO; realtime: stack
+ *              pre-faulted, SCHED_FIFO, faults counted from here
+ *   leave()  : at the end of the loop
+ *   report() : the realtime line, nothing without --realtime
+ *
+ * A node that is no xdma device (a file standing in) has no topology:
+ * nothing is placed unless --numa / --pin say so.
+ */
+
+class LoopPlacement {
+public:
+  int parse(const std::string &numa, const std::string &pin, int rt_prio = 0);
+  void setup(const char *devnode, const std::string &root);
+  void enter();
+  void leave();
+  void report(const char *name) const;
+
+  int node() const { return node_; }
+  int cpu() const { return cpu_; }
+
+private:
+  int node_ = TOPO_AUTO;
+  int cpu_ = TOPO_AUTO;
+  int prio_ = 0;
+  bool entered_ = false;
+  struct topology topo_ = {};
+  struct realtime rt_ = {};
+};
@@ -0,0 +1,114 @@
+#include "realtime.h"
+#include "topology.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define STACK_PREFAULT (256 * 1024)
+
+static int locked;              // 1: locked, negative errno: failed, 0: not tried
+
+int realtime_lock(void)
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    locked = -errno;
+    return locked;
+  }
+  locked = 1;
+  return 0;
+}
+
+void realtime_isolated(cpu_set_t *set)
+{
+  char line[1024];
+  FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+
+  CPU_ZERO(set);
+  if (!f)
+    return;
+  if (fgets(line, sizeof(line), f))
+    topology_parse_cpulist(line, set);
+  fclose(f);
+}
+
+int realtime_pick_cpu(int cpu, const cpu_set_t *prefer)
+{
+  cpu_set_t iso, both;
+  int i;
+
+  realtime_isolated(&iso);
+  if (!CPU_COUNT(&iso) || (cpu >= 0 && CPU_ISSET(cpu, &iso)))
+    return cpu;
+  if (prefer) {
+    CPU_AND(&both, &iso, prefer);
+    if (CPU_COUNT(&both))
+      iso = both;
+  }
+  for (i = 0; i < CPU_SETSIZE; i++)
+    if (CPU_ISSET(i, &iso))
+      return i;
+  return cpu;
+}
+
+/* touch the stack the loop will use, so it does not fault in there */
+static void __attribute__((noinline)) prefault_stack(void)
+{
+  volatile char stack[STACK_PREFAULT];
+  size_t i;
+
+  for (i = 0; i < sizeof(stack); i += 4096)
+    stack[i] = 0;
+}
+
+void realtime_thread(struct realtime *rt, int prio, int cpu)
+{
+  struct sched_param sp;
+  cpu_set_t iso;
+
+  memset(rt, 0, sizeof(*rt));
+  rt->prio = prio;
+  rt->cpu = cpu;
+
+  prefault_stack();
+
+  if (cpu >= 0) {
+    rt->pin_err = topology_pin(cpu);
+    realtime_isolated(&iso);
+    rt->isolated = CPU_ISSET(cpu, &iso);
+  }
+
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = prio;
+  rt->sched_err = -pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+}
+
+void realtime_begin(struct realtime *rt)
+{
+  getrusage(RUSAGE_THREAD, &rt->ru_start);
+  rt->running = 1;
+}
+
+void realtime_end(struct realtime *rt)
+{
+  if (!rt->running)
+    return;
+  getrusage(RUSAGE_THREAD, &rt->ru_end);
+  rt->running = 0;
+}
+
+void realtime_report(const struct realtime *rt, const char *name)
+{
+  const struct rusage *a = &rt->ru_start, *b = &rt->ru_end;
+
+  fprintf(stdout, "%s: realtime: memory %s, SCHED_FIFO %d %s, cpu %d%s\n",
+          name, locked > 0 ? "locked" : locked < 0 ? strerror(-locked) : "not locked",
+          rt->prio, rt->sched_err ? strerror(-rt->sched_err) : "ok", rt->cpu,
+          rt->cpu < 0 ? " (not pinned)" : rt->pin_err ? " (pinning failed)" :
+          rt->isolated ? " (isolated)" : " (not isolated)");
+  fprintf(stdout, "%s: hot loop: %ld minor faults, %ld major faults, "
+          "%ld involuntary and %ld voluntary context switches\n", name,
+          b->ru_minflt - a->ru_minflt, b->ru_majflt - a->ru_majflt,
+          b->ru_nivcsw - a->ru_nivcsw, b->ru_nvcsw - a->ru_nvcsw);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <sys/resource.h>
+
+/*
+ * Realtime mode for a hot capture thread
+ *
+ * - realtime_lock(): mlockall(current | future), so the buffers allocated
+ *   so far are faulted in and later mappings come in locked
+ * - realtime_thread(): pre-faults the calling thread's stack, pins it and
+ *   moves it to SCHED_FIFO at `prio`
+ * - the thread's minor/major faults and context switches are counted
+ *   between realtime_begin() and realtime_end(), 0 is a clean run
+ *
+ * Failures (no CAP_SYS_NICE, RLIMIT_MEMLOCK too small) are remembered and
+ * shown in the report, the capture itself goes on.
+ */
+
+#define RT_PRIO_DEFAULT 50
+
+struct realtime {
+  int prio;
+  int cpu;                      // -1: not pinned here
+  int sched_err;                // negative errno
+  int pin_err;
+  int isolated;                 // cpu is in the isolated set
+
+  struct rusage ru_start;
+  struct rusage ru_end;
+  int running;
+};
+
+/* process wide, the report shows whether it worked */
+int realtime_lock(void);
+
+/* isolated cpus (isolcpus=), empty when none */
+void realtime_isolated(cpu_set_t *set);
+/*
+ * an isolated cpu for the hot thread: `cpu` if isolated, else the first
+ * isolated one in `prefer` (may be NULL), else any, else `cpu`
+ */
+int realtime_pick_cpu(int cpu, const cpu_set_t *prefer);
+
+/* in the hot thread: stack, pinning (cpu >= 0) and SCHED_FIFO */
+void realtime_thread(struct realtime *rt, int prio, int cpu);
+
+/* in the hot thread: around the transfer loop */
+void realtime_begin(struct realtime *rt);
+void realtime_end(struct realtime *rt);
+
+void realtime_report(const struct realtime *rt, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "segment.h"
+#include "trace_rec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* open <base>.NNNNNN.part, preallocating `prealloc` bytes */
+static struct segment *segment_create(struct segment_writer *w, unsigned index,
+                                      uint64_t prealloc)
+{
+  struct segment *seg = calloc(1, sizeof(*seg));
+  int fd, reserved;
+
+  if (!seg)
+    return NULL;
+  seg->index = index;
+  snprintf(seg->final, sizeof(seg->final), "%s.%06u", w->base, index);
+  snprintf(seg->part, sizeof(seg->part), "%s" SEGMENT_PART_SUFFIX, seg->final);
+
+  fd = open(seg->part, sink_open_flags(w->mode), 0666);
+  if (fd < 0) {
+    free(seg);
+    return NULL;
+  }
+
+  /* keep the size: the file still grows by appends, but into allocated extents */
+  reserved = prealloc && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc) == 0;
+
+  if (sink_attach(&seg->sink, fd, seg->part, w->mode, w->window) < 0) {
+    close(fd);
+    unlink(seg->part);
+    free(seg);
+    return NULL;
+  }
+  seg->sink.prealloc = reserved;
+  return seg;
+}
+
+/* flush, fsync, drop the preallocated tail and rename to the final name */
+static int segment_finalize(struct segment_writer *w, struct segment *seg)
+{
+  uint64_t t0 = now_ns(), dt;
+  int rc = sink_close(&seg->sink);
+
+  if (rename(seg->part, seg->final) < 0 && !rc)
+    rc = -errno;
+
+  dt = now_ns() - t0;
+  w->bytes += seg->sink.bytes;
+  w->syncs += seg->sink.syncs;
+  if (seg->sink.sync_max_ns > w->sync_max_ns)
+    w->sync_max_ns = seg->sink.sync_max_ns;
+  if (dt > w->finalize_max_ns)
+    w->finalize_max_ns = dt;
+  w->segments++;
+  return rc;
+}
+
+/* w->cond runs on CLOCK_MONOTONIC, see segment_open() */
+static void wait_until(struct segment_writer *w, uint64_t ns)
+{
+  struct timespec ts = {ns / 1000000000ull, ns % 1000000000ull};
+  pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+}
+
+/* housekeeping thread: prepare the next segment, finalize the old ones */
+static void *segment_thread(void *arg)
+{
+  struct segment_writer *w = arg;
+  uint64_t last_bytes = 0;
+
+  trace_thread_init("segments");
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->stop && !w->retire_head &&
+           (!w->want_next || now_ns() < w->retry_ns)) {
+      if (w->want_next)
+        wait_until(w, w->retry_ns);
+      else
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+
+    if (w->want_next && !w->stop) {
+      unsigned index = w->cur->index + 1;
+      uint64_t prealloc = w->max_bytes ? w->max_bytes : last_bytes;
+      struct segment *seg;
+
+      w->want_next = 0;
+      pthread_mutex_unlock(&w->lock);
+      seg = segment_create(w, index, prealloc);
+      if (!seg && !w->create_failures)
+        fprintf(stderr, "%s.%06u: %s, the current segment keeps growing\n",
+                w->base, index, strerror(errno));
+      pthread_mutex_lock(&w->lock);
+      if (seg) {
+        w->next = seg;
+      } else {
+        /* a full disk or a quota may clear up: try again later */
+        w->create_failures++;
+        w->want_next = 1;
+        w->retry_ns = now_ns() + SEGMENT_RETRY_MS * 1000000ull;
+      }
+      continue;
+    }
+
+    if (w->retire_head) {
+      struct segment *seg = w->retire_head;
+      int rc;
+
+      w->retire_head = seg->next;
+      if (!w->retire_head)
+        w->retire_tail = NULL;
+      pthread_mutex_unlock(&w->lock);
+      last_bytes = seg->sink.offset;
+      rc = segment_finalize(w, seg);
+      if (rc < 0)
+        fprintf(stderr, "%s: finalize failed: %s\n", seg->final, strerror(-rc));
+      free(seg);
+      pthread_mutex_lock(&w->lock);
+      if (rc < 0)
+        w->error = rc;
+      continue;
+    }
+
+    if (w->stop)
+      break;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+int segment_open(struct segment_writer *w, const char *base,
+                 enum sink_mode mode, size_t window, uint64_t max_bytes,
+                 unsigned max_secs)
+{
+  pthread_condattr_t attr;
+
+  memset(w, 0, sizeof(*w));
+  snprintf(w->base, sizeof(w->base), "%s", base);
+  w->mode = mode;
+  w->window = window;
+  w->max_bytes = max_bytes;
+  w->max_secs = max_secs;
+
+  w->cur = segment_create(w, 0, max_bytes);
+  if (!w->cur)
+    return -errno;
+  w->cur_start_ns = now_ns();
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&w->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  w->want_next = 1;
+  if (pthread_create(&w->thread, NULL, segment_thread, w)) {
+    sink_close(&w->cur->sink);
+    unlink(w->cur->part);
+    free(w->cur);
+    w->cur = NULL;
+    return -EAGAIN;
+  }
+  return 0;
+}
+
+static int rotation_due(const struct segment_writer *w)
+{
+  if (w->max_bytes && w->cur->sink.offset >= w->max_bytes)
+    return 1;
+  if (w->max_secs && now_ns() - w->cur_start_ns >= w->max_secs * 1000000000ull)
+    return 1;
+  return 0;
+}
+
+/* swap in the prepared segment, never waits for the housekeeping thread */
+static void rotate(struct segment_writer *w)
+{
+  struct segment *old = w->cur;
+
+  pthread_mutex_lock(&w->lock);
+  if (!w->next) {
+    if (!w->late)
+      w->late_rotations++;
+    w->late = 1;
+    pthread_mutex_unlock(&w->lock);
+    return;
+  }
+  w->late = 0;
+  w->cur = w->next;
+  w->next = NULL;
+  old->next = NULL;
+  if (w->retire_tail)
+    w->retire_tail->next = old;
+  else
+    w->retire_head = old;
+  w->retire_tail = old;
+  w->want_next = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  w->cur_start_ns = now_ns();
+}
+
+ssize_t segment_write(struct segment_writer *w, const char *buf, size_t len)
+{
+  if (rotation_due(w))
+    rotate(w);
+  return sink_write(&w->cur->sink, buf, len);
+}
+
+int segment_close(struct segment_writer *w)
+{
+  struct segment *unused;
+  int rc;
+
+  if (!w->cur)
+    return 0;
+
+  pthread_mutex_lock(&w->lock);
+  w->cur->next = NULL;
+  if (w->retire_tail)
+    w->retire_tail->next = w->cur;
+  else
+    w->retire_head = w->cur;
+  w->retire_tail = w->cur;
+  w->cur = NULL;
+  w->stop = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  pthread_join(w->thread, NULL);
+
+  /* the segment prepared for a rotation that never came */
+  unused = w->next;
+  if (unused) {
+    sink_close(&unused->sink);
+    unlink(unused->part);
+    free(unused);
+    w->next = NULL;
+  }
+
+  rc = w->error;
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->lock);
+  return rc;
+}
+
+void segment_report(const struct segment_writer *w)
+{
+  fprintf(stdout, "%s: %u segments (%s), %lu bytes, %u late rotations, "
+          "%u failed creates\n", w->base, w->segments, sink_mode_name(w->mode),
+          w->bytes, w->late_rotations, w->create_failures);
+  fprintf(stdout, "%s: %lu syncs, max %.3f ms, finalize max %.3f ms\n",
+          w->base, w->syncs, w->sync_max_ns / 1e6, w->finalize_max_ns / 1e6);
+}
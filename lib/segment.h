@@ -0,0 +1,87 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sink.h"
+
+/*
+ * Segmented capture output: <base>.000000, <base>.000001, ...
+ *
+ * - rotated once a segment reaches `max_bytes` or is `max_secs` old
+ * - a housekeeping thread opens and fallocate()s the next segment ahead
+ *   of time and finalizes the old one (flush, fsync, rename from
+ *   <name>.part), so the capture thread only swaps two pointers
+ * - if the next segment is not ready yet the current one keeps growing,
+ *   rotation never waits; a segment that could not be created is retried
+ *   every SEGMENT_RETRY_MS meanwhile
+ */
+
+#define SEGMENT_RETRY_MS 1000
+
+/* ".NNNNNN" grows to 10 digits past a million segments */
+#define SEGMENT_SUFFIX_MAX sizeof(".4294967295")
+#define SEGMENT_PART_SUFFIX ".part"
+
+struct segment {
+  struct sink sink;
+  char final[PATH_MAX + SEGMENT_SUFFIX_MAX];
+  char part[PATH_MAX + SEGMENT_SUFFIX_MAX + sizeof(SEGMENT_PART_SUFFIX)];
+  unsigned index;
+  struct segment *next;
+};
+
+struct segment_writer {
+  char base[PATH_MAX];
+  enum sink_mode mode;
+  size_t window;
+  uint64_t max_bytes;
+  unsigned max_secs;
+
+  struct segment *cur;
+  uint64_t cur_start_ns;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int want_next;
+  struct segment *next;         // opened and preallocated
+  struct segment *retire_head;  // waiting to be finalized
+  struct segment *retire_tail;
+  int error;
+  int late;
+  uint64_t retry_ns;            // create the next segment again from then on
+
+  /* statistics */
+  unsigned segments;
+  unsigned late_rotations;      // next segment was not ready in time
+  unsigned create_failures;
+  uint64_t bytes;
+  uint64_t syncs;
+  uint64_t sync_max_ns;
+  uint64_t finalize_max_ns;
+};
+
+int segment_open(struct segment_writer *w, const char *base,
+                 enum sink_mode mode, size_t window, uint64_t max_bytes,
+                 unsigned max_secs);
+
+/* write to the current segment, rotating first when it is due */
+ssize_t segment_write(struct segment_writer *w, const char *buf, size_t len);
+
+/* finalize the last segment and stop the housekeeping thread */
+int segment_close(struct segment_writer *w);
+
+void segment_report(const struct segment_writer *w);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include "sink.h"
+#include "trace_rec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const char *mode_names[] = {"sync", "direct", "writeback", "buffered",
+                                   "mmap"};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* `len`: bytes the sync made stable */
+static void account_sync(struct sink *s, uint64_t t0, uint64_t len)
+{
+  uint64_t t1 = now_ns(), dt = t1 - t0;
+  trace_span(TRACE_PERSIST, t0, t1, len);
+  s->syncs++;
+  s->sync_ns += dt;
+  if (dt > s->sync_max_ns)
+    s->sync_max_ns = dt;
+}
+
+int sink_parse_mode(const char *str, enum sink_mode *mode)
+{
+  unsigned i;
+  for (i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+    if (!strcmp(str, mode_names[i])) {
+      *mode = (enum sink_mode)i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *sink_mode_name(enum sink_mode mode)
+{
+  return mode_names[mode];
+}
+
+int sink_open_flags(enum sink_mode mode)
+{
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  if (mode == SINK_MMAP)
+    flags = O_RDWR | O_CREAT | O_TRUNC;     // a shared mapping needs read access
+  else if (mode == SINK_SYNC)
+    flags |= O_SYNC;
+  else if (mode == SINK_DIRECT)
+    flags |= O_DIRECT;
+  return flags;
+}
+
+int sink_attach(struct sink *s, int fd, const char *name, enum sink_mode mode,
+                size_t window)
+{
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+  s->name = name;
+  s->mode = mode;
+  s->window = window ? window : SINK_WINDOW_DEFAULT;
+
+  if (mode == SINK_DIRECT) {
+    /* coalescing block: a whole number of aligned units */
+    s->window = (s->window + SINK_DIRECT_ALIGN - 1) / SINK_DIRECT_ALIGN *
+                SINK_DIRECT_ALIGN;
+    if (posix_memalign((void **)&s->stage, SINK_DIRECT_ALIGN, s->window))
+      return -ENOMEM;
+  }
+  else if (mode == SINK_MMAP) {
+    /* mapping offsets are whole pages */
+    long page = sysconf(_SC_PAGESIZE);
+    s->window = (s->window + page - 1) / page * page;
+  }
+
+  s->fd = fd;
+  clock_gettime(CLOCK_MONOTONIC, &s->ts_start);
+  return 0;
+}
+
+int sink_open(struct sink *s, const char *path, enum sink_mode mode,
+              size_t window)
+{
+  int fd = open(path, sink_open_flags(mode), 0666);
+  int rc;
+
+  if (fd < 0) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    return -errno;
+  }
+
+  rc = sink_attach(s, fd, path, mode, window);
+  if (rc < 0)
+    close(fd);
+  return rc;
+}
+
+static ssize_t write_all(int fd, const char *buf, size_t len)
+{
+  size_t count = 0;
+
+  while (count < len) {
+    ssize_t rc = write(fd, buf + count, len - count);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    count += rc;
+  }
+  return count;
+}
+
+/* start writeback of the finished windows, wait for and drop the older ones */
+static int writeback(struct sink *s)
+{
+  while (s->offset - s->wb_issued >= s->window) {
+    if (sync_file_range(s->fd, s->wb_issued, s->window,
+                        SYNC_FILE_RANGE_WRITE) < 0)
+      return -errno;
+    s->wb_issued += s->window;
+
+    if (s->wb_issued - s->wb_done > s->window) {
+      uint64_t t0 = now_ns();
+      if (sync_file_range(s->fd, s->wb_done, s->window,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+        return -errno;
+      account_sync(s, t0, s->window);
+      posix_fadvise(s->fd, s->wb_done, s->window, POSIX_FADV_DONTNEED);
+      s->wb_done += s->window;
+    }
+  }
+  return 0;
+}
+
+int sink_account(struct sink *s, uint64_t end)
+{
+  if (end <= s->offset)
+    return 0;
+
+  s->bytes += end - s->offset;
+  s->offset = end;
+  if (s->mode == SINK_WRITEBACK || s->mode == SINK_MMAP)
+    return writeback(s);
+  return 0;
+}
+
+static void unmap_window(struct sink *s)
+{
+  if (s->map) {
+    munmap(s->map, s->map_len);
+    s->map = NULL;
+  }
+}
+
+/*
+ * map the window holding s->offset; the file is extended with fallocate
+ * first (blocks preallocated, a full disk fails here and not with SIGBUS)
+ */
+static int map_window(struct sink *s)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t off = s->offset / s->window * s->window;
+  size_t len = s->window + page;        // guard page: a device may overshoot
+  void *map;
+
+  unmap_window(s);
+  if (fallocate(s->fd, 0, off, len) < 0) {
+    if (errno != EOPNOTSUPP)
+      return -errno;
+    if (ftruncate(s->fd, off + len) < 0)
+      return -errno;
+  }
+  s->prealloc = 1;
+
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, off);
+  if (map == MAP_FAILED)
+    return -errno;
+  madvise(map, len, MADV_SEQUENTIAL);
+  s->map = map;
+  s->map_off = off;
+  s->map_len = len;
+  return 0;
+}
+
+char *sink_reserve(struct sink *s, size_t len, size_t *avail)
+{
+  uint64_t end;
+
+  *avail = 0;
+  if (s->mode != SINK_MMAP)
+    return NULL;
+
+  if (!s->map || s->offset >= s->map_off + s->window) {
+    int rc = map_window(s);
+    if (rc < 0) {
+      errno = -rc;
+      return NULL;
+    }
+  }
+
+  end = s->map_off + s->window;
+  *avail = end - s->offset < len ? end - s->offset : len;
+  return s->map + (s->offset - s->map_off);
+}
+
+int sink_commit(struct sink *s, size_t len)
+{
+  /* window done: drop the mapping, its dirty pages stay in the page cache
+   * for the writeback cycle */
+  if (s->map && s->offset + len >= s->map_off + s->window)
+    unmap_window(s);
+  return sink_account(s, s->offset + len);
+}
+
+static ssize_t mmap_write(struct sink *s, const char *buf, size_t len)
+{
+  size_t count = 0;
+
+  while (count < len) {
+    size_t avail;
+    char *dst = sink_reserve(s, len - count, &avail);
+    int rc;
+
+    if (!dst)
+      return -errno;
+    memcpy(dst, buf + count, avail);
+    rc = sink_commit(s, avail);
+    if (rc < 0)
+      return rc;
+    count += avail;
+  }
+  return count;
+}
+
+int sink_drop_direct(struct sink *s)
+{
+  int flags;
+
+  if (s->mode != SINK_DIRECT)
+    return 0;
+
+  flags = fcntl(s->fd, F_GETFL);
+  if (flags < 0 || fcntl(s->fd, F_SETFL, flags & ~O_DIRECT) < 0)
+    return -errno;
+  return 0;
+}
+
+static ssize_t direct_write(struct sink *s, const char *buf, size_t len)
+{
+  size_t count = 0;
+  ssize_t rc;
+
+  while (count < len) {
+    size_t bytes;
+
+    /* aligned whole blocks bypass the staging copy */
+    if (!s->stage_len && !((uintptr_t)(buf + count) % SINK_DIRECT_ALIGN) &&
+        len - count >= s->window) {
+      bytes = (len - count) / s->window * s->window;
+      rc = write_all(s->fd, buf + count, bytes);
+      if (rc < 0)
+        return rc;
+      count += bytes;
+      continue;
+    }
+
+    bytes = s->window - s->stage_len;
+    if (bytes > len - count)
+      bytes = len - count;
+    memcpy(s->stage + s->stage_len, buf + count, bytes);
+    s->stage_len += bytes;
+    count += bytes;
+
+    if (s->stage_len == s->window) {
+      rc = write_all(s->fd, s->stage, s->window);
+      if (rc < 0)
+        return rc;
+      s->stage_len = 0;
+    }
+  }
+  return count;
+}
+
+ssize_t sink_write(struct sink *s, const char *buf, size_t len)
+{
+  uint64_t t0 = trace_start();
+  ssize_t rc;
+
+  if (s->mode == SINK_MMAP)
+    rc = mmap_write(s, buf, len);
+  else if (s->mode == SINK_DIRECT)
+    rc = direct_write(s, buf, len);
+  else
+    rc = write_all(s->fd, buf, len);
+  if (t0 && rc > 0)
+    trace_span(TRACE_COPY, t0, trace_now(), rc);
+  if (rc < 0 || s->mode == SINK_MMAP)
+    return rc;
+
+  if (s->mode == SINK_WRITEBACK) {
+    int err = sink_account(s, s->offset + len);
+    if (err < 0)
+      return err;
+  } else {
+    s->offset += len;
+    s->bytes += len;
+  }
+  return rc;
+}
+
+/* O_DIRECT tail: aligned part direct, the remainder buffered */
+static int direct_flush(struct sink *s)
+{
+  size_t aligned = s->stage_len / SINK_DIRECT_ALIGN * SINK_DIRECT_ALIGN;
+  ssize_t rc;
+
+  if (aligned) {
+    rc = write_all(s->fd, s->stage, aligned);
+    if (rc < 0)
+      return rc;
+  }
+  if (s->stage_len > aligned) {
+    rc = sink_drop_direct(s);
+    if (rc < 0)
+      return rc;
+    rc = write_all(s->fd, s->stage + aligned, s->stage_len - aligned);
+    if (rc < 0)
+      return rc;
+  }
+  s->stage_len = 0;
+  return 0;
+}
+
+int sink_close(struct sink *s)
+{
+  uint64_t t0;
+  int rc = 0;
+
+  if (s->fd < 0)
+    return 0;
+
+  if (s->mode == SINK_DIRECT)
+    rc = direct_flush(s);
+
+  /* last window: write it out before the mapping goes away */
+  if (s->map) {
+    t0 = now_ns();
+    if (msync(s->map, s->map_len, MS_SYNC) < 0 && !rc)
+      rc = -errno;
+    account_sync(s, t0, s->offset - s->wb_done);
+    unmap_window(s);
+  }
+
+  /*
+   * release blocks preallocated past the end, EINVAL: not a regular file;
+   * offset only counts this sink's bytes, an appending fd has more before
+   */
+  if (s->prealloc && !(fcntl(s->fd, F_GETFL) & O_APPEND) &&
+      ftruncate(s->fd, s->offset) < 0 && errno != EINVAL && !rc)
+    rc = -errno;
+
+  t0 = now_ns();
+  if (fsync(s->fd) < 0 && errno != EINVAL && !rc)
+    rc = -errno;
+  account_sync(s, t0, s->offset - s->wb_done);
+
+  if (s->mode == SINK_WRITEBACK || s->mode == SINK_MMAP)
+    posix_fadvise(s->fd, s->wb_done, 0, POSIX_FADV_DONTNEED);
+
+  close(s->fd);
+  s->fd = -1;
+  free(s->stage);
+  s->stage = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &s->ts_end);
+
+  return rc;
+}
+
+void sink_report(const struct sink *s)
+{
+  struct timespec ts_end = s->ts_end;
+  double secs;
+
+  if (s->fd >= 0)
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  secs = (ts_end.tv_sec - s->ts_start.tv_sec) +
+         (ts_end.tv_nsec - s->ts_start.tv_nsec) / 1e9;
+
+  fprintf(stdout, "%s: sink %s, %lu bytes in %.3f s, %.2f MB/s\n",
+          s->name, sink_mode_name(s->mode), s->bytes, secs,
+          secs > 0 ? s->bytes / secs / 1e6 : 0.0);
+  fprintf(stdout, "%s: %lu syncs, avg %.3f ms, max %.3f ms\n",
+          s->name, s->syncs,
+          s->syncs ? s->sync_ns / 1e6 / s->syncs : 0.0, s->sync_max_ns / 1e6);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Output file write strategies shared by the capture tools
+ *
+ * sync      : O_SYNC, every write waits for stable storage (legacy)
+ * direct    : O_DIRECT, writes coalesced into aligned blocks, the unaligned
+ *             tail is written buffered at close
+ * writeback : buffered, every finished window is pushed out with
+ *             sync_file_range() and dropped from the page cache, so dirty
+ *             and cached memory stay bounded to ~2 windows
+ * buffered  : plain page cache writes, one fsync at close
+ * mmap      : a sliding window of the file is mapped, sink_reserve() hands
+ *             out the mapped pages so a device read() lands in the file
+ *             without a second copy; finished windows are unmapped and go
+ *             through the same writeback/drop cycle as writeback mode
+ *
+ * Writes (copy) and syncs (persist) go to the pipeline trace while it
+ * records (trace_rec.h).
+ */
+
+enum sink_mode {
+  SINK_SYNC = 0,
+  SINK_DIRECT,
+  SINK_WRITEBACK,
+  SINK_BUFFERED,
+  SINK_MMAP,
+};
+
+#define SINK_MODE_DEFAULT "sync"
+#define SINK_WINDOW_DEFAULT (8 * 1024 * 1024)
+#define SINK_DIRECT_ALIGN 4096
+
+struct sink {
+  int fd;
+  const char *name;
+  enum sink_mode mode;
+  size_t window;                // coalescing / writeback window
+
+  /* direct: staging block */
+  char *stage;
+  size_t stage_len;
+
+  /* writeback: [wb_done, wb_issued) is being written back */
+  uint64_t offset;              // bytes handed to the file
+  uint64_t wb_issued;
+  uint64_t wb_done;
+  int prealloc;                 // blocks reserved past offset, freed at close
+
+  /* mmap: [map_off, map_off + window) plus one guard page is mapped */
+  char *map;
+  uint64_t map_off;
+  size_t map_len;
+
+  /* statistics */
+  uint64_t bytes;
+  uint64_t syncs;
+  uint64_t sync_ns;
+  uint64_t sync_max_ns;
+  struct timespec ts_start;
+  struct timespec ts_end;
+};
+
+int sink_parse_mode(const char *str, enum sink_mode *mode);
+const char *sink_mode_name(enum sink_mode mode);
+
+int sink_open(struct sink *s, const char *path, enum sink_mode mode,
+              size_t window);
+
+/* open(2) flags of a mode, and taking over an fd opened with them */
+int sink_open_flags(enum sink_mode mode);
+int sink_attach(struct sink *s, int fd, const char *name, enum sink_mode mode,
+                size_t window);
+
+/* sequential write of all `len` bytes, returns len or a negative errno */
+ssize_t sink_write(struct sink *s, const char *buf, size_t len);
+
+/*
+ * for callers writing to s->fd themselves (aio, io_uring): everything
+ * below `end` has been written, run the writeback window on it
+ */
+int sink_account(struct sink *s, uint64_t end);
+
+/*
+ * mmap: pointer to the next `len` bytes of the file, *avail may be less at
+ * the window end; fill it and sink_commit() what was filled. NULL with
+ * *avail 0 if the mode has no mapping (use sink_write) or on error.
+ */
+char *sink_reserve(struct sink *s, size_t len, size_t *avail);
+int sink_commit(struct sink *s, size_t len);
+
+/* O_DIRECT cannot take an unaligned write: continue buffered */
+int sink_drop_direct(struct sink *s);
+
+/*
+ * flush the tail, fsync and close; the file is only truncated to what was
+ * written if this sink reserved blocks past it (mmap windows, or a caller
+ * setting prealloc after its fallocate), never for an O_APPEND fd
+ */
+int sink_close(struct sink *s);
+
+void sink_report(const struct sink *s);
+
+#ifdef __cplusplus
+}
+#endif
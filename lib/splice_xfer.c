@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include "splice_xfer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPLICE_BOUNCE_SIZE (64 * 1024)
+
+static int is_pipe(int fd)
+{
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+int splice_xfer_init(struct splice_xfer *x, int src_fd, int dst_fd,
+                     size_t blksize)
+{
+  memset(x, 0, sizeof(*x));
+  x->src_fd = src_fd;
+  x->dst_fd = dst_fd;
+  x->pipe_fds[0] = x->pipe_fds[1] = -1;
+  x->pipe_size = blksize;
+
+  if (!is_pipe(src_fd) && !is_pipe(dst_fd)) {
+    int sz;
+
+    if (pipe2(x->pipe_fds, O_CLOEXEC) < 0)
+      return -errno;
+    /* one block per round trip; the kernel may round up or refuse */
+    fcntl(x->pipe_fds[1], F_SETPIPE_SZ, (int)blksize);
+    sz = fcntl(x->pipe_fds[1], F_GETPIPE_SZ);
+    if (sz > 0 && (size_t)sz < blksize)
+      x->pipe_size = sz;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &x->ts_start);
+  return 0;
+}
+
+void splice_xfer_free(struct splice_xfer *x)
+{
+  if (x->pipe_fds[0] >= 0)
+    close(x->pipe_fds[0]);
+  if (x->pipe_fds[1] >= 0)
+    close(x->pipe_fds[1]);
+  x->pipe_fds[0] = x->pipe_fds[1] = -1;
+}
+
+int splice_xfer_unsupported(ssize_t rc)
+{
+  return rc == -EINVAL || rc == -ENOSYS || rc == -EOPNOTSUPP;
+}
+
+/* dst refused splice with data already in the pipe: copy that much out */
+static int bounce(struct splice_xfer *x)
+{
+  char buf[SPLICE_BOUNCE_SIZE];
+
+  while (x->in_pipe) {
+    size_t chunk = x->in_pipe < sizeof(buf) ? x->in_pipe : sizeof(buf);
+    ssize_t n = read(x->pipe_fds[0], buf, chunk), done = 0;
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    while (done < n) {
+      ssize_t rc = write(x->dst_fd, buf + done, n - done);
+      if (rc < 0) {
+        if (errno == EINTR)
+          continue;
+        return -errno;
+      }
+      done += rc;
+    }
+    x->in_pipe -= n;
+  }
+  return 0;
+}
+
+/* pipe --> dst until the pipe is empty */
+static int drain(struct splice_xfer *x)
+{
+  while (x->in_pipe) {
+    ssize_t rc = splice(x->pipe_fds[0], NULL, x->dst_fd, NULL, x->in_pipe,
+                        SPLICE_F_MOVE);
+    if (rc < 0) {
+      int err = -errno;
+      if (err == -EINTR)
+        continue;
+      if (!splice_xfer_unsupported(err))
+        return err;
+      /* report it on the next call, once this data is out */
+      x->error = err;
+      return bounce(x);
+    }
+    x->calls++;
+    x->in_pipe -= rc;
+  }
+  return 0;
+}
+
+ssize_t splice_xfer_move(struct splice_xfer *x, size_t len)
+{
+  ssize_t rc;
+  int err;
+
+  if (x->error)
+    return x->error;
+  if (len > x->pipe_size)
+    len = x->pipe_size;
+
+  /* src or dst is a pipe: one hop */
+  if (x->pipe_fds[0] < 0) {
+    do {
+      rc = splice(x->src_fd, NULL, x->dst_fd, NULL, len, SPLICE_F_MOVE);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0)
+      return -errno;
+    x->calls++;
+    x->bytes += rc;
+    return rc;
+  }
+
+  do {
+    rc = splice(x->src_fd, NULL, x->pipe_fds[1], NULL, len, SPLICE_F_MOVE);
+  } while (rc < 0 && errno == EINTR);
+  if (rc <= 0)
+    return rc < 0 ? -errno : 0;
+  x->calls++;
+  x->in_pipe += rc;
+
+  err = drain(x);
+  if (err < 0)
+    return err;
+  x->bytes += rc;
+  return rc;
+}
+
+void splice_xfer_report(const struct splice_xfer *x, const char *name)
+{
+  struct timespec ts_end;
+  struct rusage ru;
+  double secs, cpu = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  secs = (ts_end.tv_sec - x->ts_start.tv_sec) +
+         (ts_end.tv_nsec - x->ts_start.tv_nsec) / 1e9;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+          (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+
+  fprintf(stdout, "%s: splice %s, %lu bytes in %.3f s, %.2f MB/s\n", name,
+          x->pipe_fds[0] < 0 ? "direct" : "via pipe", x->bytes, secs,
+          secs > 0 ? x->bytes / secs / 1e6 : 0.0);
+  fprintf(stdout, "%s: %lu splice calls, process cpu %.3f s\n", name,
+          x->calls, cpu);
+}
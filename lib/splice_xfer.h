@@ -0,0 +1,58 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Zero-copy transfer with splice(2): src --> pipe --> dst
+ *
+ * - if src or dst already is a pipe (shell pipeline) the data is spliced
+ *   straight across, otherwise through an internal pipe sized to the
+ *   block size
+ * - the data never enters user space; both ends use their file position
+ * - a driver or filesystem without splice support fails the first call
+ *   with splice_xfer_unsupported(rc) true and nothing moved, the caller
+ *   then falls back to its read()/write() copy path
+ * - a capture makes one pass over a live stream, so the report only has
+ *   the splice figure; the gain over the copy path comes from dpu_bench,
+ *   which runs both on the same node (-t sync,splice --sink buffered)
+ */
+
+struct splice_xfer {
+  int src_fd;
+  int dst_fd;
+  int pipe_fds[2];              // internal pipe, -1 when not needed
+  size_t pipe_size;
+  size_t in_pipe;               // bytes spliced in but not yet out
+  int error;                    // deferred error of the out side
+
+  /* statistics */
+  uint64_t bytes;
+  uint64_t calls;
+  struct timespec ts_start;
+};
+
+int splice_xfer_init(struct splice_xfer *x, int src_fd, int dst_fd,
+                     size_t blksize);
+void splice_xfer_free(struct splice_xfer *x);
+
+/*
+ * move up to `len` bytes: returns the bytes that reached dst, 0 when src
+ * had nothing (eof, or a timeout on an xdma node), or a negative errno
+ */
+ssize_t splice_xfer_move(struct splice_xfer *x, size_t len);
+
+/* the error means "no splice here", not an io error */
+int splice_xfer_unsupported(ssize_t rc);
+
+void splice_xfer_report(const struct splice_xfer *x, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
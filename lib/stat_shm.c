@@ -0,0 +1,137 @@
+#include "stat_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the tail of a long name says more: /dev/xdma0_c2h_0 -> xdma0_c2h_0 */
+static void copy_tail(char *dst, size_t size, const char *src)
+{
+  size_t len;
+
+  if (!strncmp(src, "/dev/", 5))
+    src += 5;
+  len = strlen(src);
+  if (len >= size)
+    src += len - (size - 1);
+  snprintf(dst, size, "%s", src);
+}
+
+int stat_shm_create(struct stat_shm *s, const char *tool)
+{
+  struct stat_segment *seg;
+  struct timespec ts;
+  char path[72];
+  int fd;
+
+  memset(s, 0, sizeof(*s));
+  snprintf(s->name, sizeof(s->name), STAT_SHM_PREFIX "%s.%d", tool, (int)getpid());
+  snprintf(path, sizeof(path), "/%s", s->name);
+  fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -errno;
+  if (ftruncate(fd, sizeof(*seg)) < 0) {
+    int err = -errno;
+    close(fd);
+    shm_unlink(path);
+    return err;
+  }
+  seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED) {
+    shm_unlink(path);
+    return -errno;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  seg->hdr.version = STAT_SHM_VERSION;
+  seg->hdr.pid = getpid();
+  copy_tail(seg->hdr.tool, sizeof(seg->hdr.tool), tool);
+  seg->hdr.start_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  __atomic_store_n(&seg->hdr.magic, STAT_SHM_MAGIC, __ATOMIC_RELEASE);
+  s->seg = seg;
+  s->owner = 1;
+  return 0;
+}
+
+void stat_shm_remove(struct stat_shm *s)
+{
+  char path[72];
+
+  if (!s->seg)
+    return;
+  if (s->owner) {
+    snprintf(path, sizeof(path), "/%s", s->name);
+    shm_unlink(path);
+  }
+  munmap(s->seg, sizeof(*s->seg));
+  s->seg = NULL;
+}
+
+uint64_t *stat_shm_add(struct stat_shm *s, const char *group, const char *name,
+                       enum stat_kind kind)
+{
+  char g[STAT_GROUP_MAX];
+  struct stat_entry *e;
+  uint32_t n, i;
+
+  if (!s || !s->seg || !s->owner)
+    return NULL;
+  /* the same counter again (a transport replaced) carries on */
+  copy_tail(g, sizeof(g), group);
+  n = s->seg->hdr.count;
+  for (i = 0; i < n; i++) {
+    e = &s->seg->entries[i];
+    if (!strcmp(e->group, g) && !strncmp(e->name, name, STAT_NAME_MAX - 1))
+      return &e->value;
+  }
+  if (n == STAT_SHM_MAX)
+    return NULL;
+  e = &s->seg->entries[n];
+  memcpy(e->group, g, sizeof(g));
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  e->kind = kind;
+  e->value = 0;
+  /* the entry is complete before a reader can see it */
+  __atomic_store_n(&s->seg->hdr.count, n + 1, __ATOMIC_RELEASE);
+  return &e->value;
+}
+
+int stat_shm_attach(struct stat_shm *s, const char *name)
+{
+  struct stat_segment *seg;
+  struct stat st;
+  char path[72];
+  int fd;
+
+  memset(s, 0, sizeof(*s));
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  snprintf(path, sizeof(path), "/%s", s->name);
+  fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0)
+    return -errno;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*seg)) {
+    close(fd);
+    return -EINVAL;
+  }
+  seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (seg == MAP_FAILED)
+    return -errno;
+  if (__atomic_load_n(&seg->hdr.magic, __ATOMIC_ACQUIRE) != STAT_SHM_MAGIC ||
+      seg->hdr.version != STAT_SHM_VERSION) {
+    munmap(seg, sizeof(*seg));
+    return -EPROTO;
+  }
+  s->seg = seg;
+  return 0;
+}
+
+void stat_shm_detach(struct stat_shm *s)
+{
+  stat_shm_remove(s);
+}
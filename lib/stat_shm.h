@@ -0,0 +1,101 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Live counters in POSIX shared memory, read by jw_stat
+ *
+ * - a tool creates one segment, /dev/shm/jw-dpu.<tool>.<pid>, and adds
+ *   its counters while setting up; every counter has a cache line of its
+ *   own and exactly one writer thread
+ * - updates are a relaxed load and store on the counter, no lock, no
+ *   syscall, no shared line with another writer; a NULL counter (stats
+ *   off, segment full) is skipped
+ * - jw_stat maps the segment read-only and turns the counters into rates
+ *   (STAT_COUNTER, STAT_BYTES) or levels (STAT_GAUGE)
+ *
+ * The segment is removed by stat_shm_remove(); a killed tool leaves it
+ * behind, jw_stat shows such a segment as ended and -r removes it.
+ */
+
+#define STAT_SHM_PREFIX "jw-dpu."
+#define STAT_SHM_MAGIC 0x6a772d6470757374ull // "jw-dpust"
+#define STAT_SHM_VERSION 1
+#define STAT_SHM_MAX 64         // counters per segment
+#define STAT_GROUP_MAX 32
+#define STAT_NAME_MAX 16
+
+enum stat_kind {
+  STAT_COUNTER = 0,             // events, shown per second
+  STAT_BYTES,                   // bytes, shown in MB/s
+  STAT_GAUGE,                   // a level, shown as is
+};
+
+struct stat_entry {
+  char group[STAT_GROUP_MAX];   // device or file, tail kept
+  char name[STAT_NAME_MAX];
+  uint32_t kind;
+  uint32_t pad;
+  uint64_t value;
+} __attribute__((aligned(64)));
+
+struct stat_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t count;               // entries in use, published last
+  int32_t pid;
+  char tool[28];
+  uint64_t start_ns;            // CLOCK_MONOTONIC
+} __attribute__((aligned(64)));
+
+struct stat_segment {
+  struct stat_header hdr;
+  struct stat_entry entries[STAT_SHM_MAX];
+};
+
+struct stat_shm {
+  struct stat_segment *seg;
+  char name[64];                // shm name, without the leading '/'
+  int owner;
+};
+
+/* the calling process's segment; 0 and seg NULL if not created */
+int stat_shm_create(struct stat_shm *s, const char *tool);
+void stat_shm_remove(struct stat_shm *s);
+
+/*
+ * a counter of `kind` named `name` in `group`, the existing one if added
+ * before; NULL if no room or no segment. Not thread safe: set-up only.
+ */
+uint64_t *stat_shm_add(struct stat_shm *s, const char *group, const char *name,
+                       enum stat_kind kind);
+
+/* reader side, `name` as in /dev/shm */
+int stat_shm_attach(struct stat_shm *s, const char *name);
+void stat_shm_detach(struct stat_shm *s);
+
+static inline void stat_inc(uint64_t *c, uint64_t n)
+{
+  if (c)
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void stat_set(uint64_t *c, uint64_t v)
+{
+  if (c)
+    __atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_get(const uint64_t *c)
+{
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+#ifdef __cplusplus
+}
+#endif
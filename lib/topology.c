@@ -0,0 +1,412 @@
+#include "topology.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define MAX_CPUS CPU_SETSIZE
+
+/* -ENAMETOOLONG when it did not fit */
+static int fit(int n, size_t len)
+{
+  return n < 0 || (size_t)n >= len ? -ENAMETOOLONG : 0;
+}
+
+static int join(char *buf, size_t len, const char *root, const char *path)
+{
+  size_t n = strlen(root);
+
+  /* "/" + "/sys/..." should not become "//sys/..." */
+  while (n && root[n - 1] == '/')
+    n--;
+  return fit(snprintf(buf, len, "%.*s%s", (int)n, root, path), len);
+}
+
+/* a file below the device's sysfs directory */
+static int attr(char *buf, size_t len, const char *dir, const char *name)
+{
+  return fit(snprintf(buf, len, "%s/%s", dir, name), len);
+}
+
+/* first line of a small sysfs/proc file, trailing newline stripped */
+static int read_line(const char *path, char *buf, size_t len)
+{
+  FILE *f = fopen(path, "r");
+  int err = 0;
+
+  if (!f)
+    return -errno;
+  if (!fgets(buf, len, f))
+    err = -EIO;
+  else
+    buf[strcspn(buf, "\n")] = 0;
+  fclose(f);
+  return err;
+}
+
+int topology_parse_cpulist(const char *str, cpu_set_t *set)
+{
+  const char *p = str;
+
+  CPU_ZERO(set);
+  while (*p && *p != '\n') {
+    char *end;
+    long lo = strtol(p, &end, 10), hi = lo;
+
+    if (end == p || lo < 0)
+      return -EINVAL;
+    p = end;
+    if (*p == '-') {
+      hi = strtol(p + 1, &end, 10);
+      if (end == p + 1 || hi < lo)
+        return -EINVAL;
+      p = end;
+    }
+    for (; lo <= hi && lo < MAX_CPUS; lo++)
+      CPU_SET(lo, set);
+    if (*p == ',')
+      p++;
+    else if (*p && *p != '\n')
+      return -EINVAL;
+  }
+  return 0;
+}
+
+int topology_parse_node(const char *str, int *node)
+{
+  char *end;
+  long n;
+
+  if (!strcmp(str, "auto")) {
+    *node = TOPO_AUTO;
+    return 0;
+  }
+  if (!strcmp(str, "off")) {
+    *node = TOPO_OFF;
+    return 0;
+  }
+  n = strtol(str, &end, 10);
+  if (end == str || *end || n < 0)
+    return -EINVAL;
+  *node = n;
+  return 0;
+}
+
+int topology_parse_pin(const char *str, int *reader, int *writer)
+{
+  char *end;
+  long r, w;
+
+  if (!strcmp(str, "auto")) {
+    *reader = *writer = TOPO_AUTO;
+    return 0;
+  }
+  if (!strcmp(str, "off")) {
+    *reader = *writer = TOPO_OFF;
+    return 0;
+  }
+  r = strtol(str, &end, 10);
+  if (end == str || r < 0)
+    return -EINVAL;
+  w = TOPO_OFF;
+  if (*end == ',') {
+    const char *s = end + 1;
+    w = strtol(s, &end, 10);
+    if (end == s || w < 0)
+      return -EINVAL;
+  }
+  if (*end)
+    return -EINVAL;
+  /* reader only: the writer goes next to it */
+  if (w == TOPO_OFF)
+    w = TOPO_AUTO;
+  *reader = r;
+  *writer = w;
+  return 0;
+}
+
+/* sysfs directory of the PCIe function behind a device node */
+static int find_device(const char *root, const char *devnode, char *dir,
+                       size_t len)
+{
+  const char *name = strrchr(devnode, '/');
+  char path[PATH_MAX];
+  struct stat st;
+
+  name = name ? name + 1 : devnode;
+  if (fit(snprintf(path, sizeof(path), "/sys/class/xdma/%s/device", name),
+          sizeof(path)) == 0 &&
+      join(dir, len, root, path) == 0 && realpath(dir, path)) {
+    snprintf(dir, len, "%s", path);
+    return 0;
+  }
+
+  /* any char device, as long as it is the live system */
+  if (stat(devnode, &st) == 0 && S_ISCHR(st.st_mode)) {
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device",
+             major(st.st_rdev), minor(st.st_rdev));
+    if (join(dir, len, root, path) == 0 && realpath(dir, path)) {
+      snprintf(dir, len, "%s", path);
+      return 0;
+    }
+  }
+  return -ENODEV;
+}
+
+static void find_irqs(struct topology *t, const char *dir)
+{
+  char path[PATH_MAX], line[32];
+  struct dirent *de;
+  DIR *d;
+
+  d = attr(path, sizeof(path), dir, "msi_irqs") == 0 ? opendir(path) : NULL;
+  if (d) {
+    while ((de = readdir(d)) && t->nirqs < TOPO_MAX_IRQS) {
+      char *end;
+      long irq = strtol(de->d_name, &end, 10);
+      if (end != de->d_name && !*end)
+        t->irqs[t->nirqs++] = irq;
+    }
+    closedir(d);
+  }
+  if (t->nirqs)
+    return;
+
+  /* legacy INTx */
+  if (attr(path, sizeof(path), dir, "irq") == 0 &&
+      read_line(path, line, sizeof(line)) == 0 && atoi(line) > 0)
+    t->irqs[t->nirqs++] = atoi(line);
+}
+
+static int is_device_irq(const struct topology *t, long irq)
+{
+  unsigned i;
+
+  for (i = 0; i < t->nirqs; i++)
+    if (t->irqs[i] == irq)
+      return 1;
+  return 0;
+}
+
+/* the cpu that took most of the device's interrupts */
+static void find_irq_cpu(struct topology *t, const char *root)
+{
+  static unsigned long counts[MAX_CPUS];
+  int cols[MAX_CPUS];
+  unsigned ncols = 0, i;
+  char path[PATH_MAX], *line = NULL, *p, *end;
+  size_t cap = 0;
+  FILE *f;
+
+  f = join(path, sizeof(path), root, "/proc/interrupts") == 0 ? fopen(path, "r")
+                                                               : NULL;
+  if (!f)
+    return;
+
+  /* header: the cpu number of every column, offline cpus are left out */
+  if (getline(&line, &cap, f) > 0) {
+    for (p = line; (p = strstr(p, "CPU")) && ncols < MAX_CPUS; p += 3)
+      cols[ncols++] = atoi(p + 3);
+  }
+  memset(counts, 0, sizeof(counts));
+
+  while (getline(&line, &cap, f) > 0) {
+    long irq = strtol(line, &end, 10);
+    if (end == line || *end != ':' || !is_device_irq(t, irq))
+      continue;
+    p = end + 1;
+    for (i = 0; i < ncols; i++) {
+      unsigned long n = strtoul(p, &end, 10);
+      if (end == p)
+        break;
+      if (cols[i] >= 0 && cols[i] < MAX_CPUS)
+        counts[cols[i]] += n;
+      p = end;
+    }
+  }
+  free(line);
+  fclose(f);
+
+  for (i = 0; i < MAX_CPUS; i++) {
+    if (counts[i] > t->irq_count) {
+      t->irq_count = counts[i];
+      t->irq_cpu = i;
+    }
+  }
+  if (t->irq_cpu >= 0 || !t->nirqs)
+    return;
+
+  /* no interrupt yet: where the first vector is allowed to go */
+  {
+    char rel[64], list[256];
+    cpu_set_t set;
+
+    snprintf(rel, sizeof(rel), "/proc/irq/%d/smp_affinity_list", t->irqs[0]);
+    if (join(path, sizeof(path), root, rel) == 0 &&
+        read_line(path, list, sizeof(list)) == 0 &&
+        topology_parse_cpulist(list, &set) == 0) {
+      for (i = 0; i < MAX_CPUS; i++) {
+        if (CPU_ISSET(i, &set)) {
+          t->irq_cpu = i;
+          break;
+        }
+      }
+    }
+  }
+}
+
+/* next cpu of the node after `cpu`, wrapping around, -1 if none */
+static int next_cpu(const cpu_set_t *set, int cpu)
+{
+  int i;
+
+  for (i = 1; i <= MAX_CPUS; i++) {
+    int c = (cpu + i) % MAX_CPUS;
+    if (c != cpu && CPU_ISSET(c, set))
+      return c;
+  }
+  return -1;
+}
+
+int topology_discover(struct topology *t, const char *root,
+                      const char *devnode)
+{
+  char dir[PATH_MAX], path[PATH_MAX], line[1024];
+  const char *pci;
+
+  memset(t, 0, sizeof(*t));
+  t->numa_node = -1;
+  t->irq_cpu = t->reader_cpu = t->writer_cpu = -1;
+
+  if (find_device(root, devnode, dir, sizeof(dir)) < 0)
+    return -ENODEV;
+  pci = strrchr(dir, '/');
+  pci = pci ? pci + 1 : dir;
+  if (strlen(pci) >= sizeof(t->pci))
+    return -ENODEV;             // not a PCIe address
+  memcpy(t->pci, pci, strlen(pci) + 1);
+
+  if (attr(path, sizeof(path), dir, "numa_node") == 0 &&
+      read_line(path, line, sizeof(line)) == 0)
+    t->numa_node = atoi(line);
+  if (attr(path, sizeof(path), dir, "local_cpulist") < 0 ||
+      read_line(path, line, sizeof(line)) < 0 ||
+      topology_parse_cpulist(line, &t->node_cpus) < 0)
+    CPU_ZERO(&t->node_cpus);
+
+  find_irqs(t, dir);
+  find_irq_cpu(t, root);
+
+  /* reader next to the interrupts, writer on a neighbour of the same node */
+  if (t->irq_cpu >= 0 &&
+      (!CPU_COUNT(&t->node_cpus) || CPU_ISSET(t->irq_cpu, &t->node_cpus)))
+    t->reader_cpu = t->irq_cpu;
+  else if (CPU_COUNT(&t->node_cpus))
+    t->reader_cpu = next_cpu(&t->node_cpus, MAX_CPUS - 1);
+  if (t->reader_cpu >= 0 && CPU_COUNT(&t->node_cpus))
+    t->writer_cpu = next_cpu(&t->node_cpus, t->reader_cpu);
+  return 0;
+}
+
+int topology_cpu(const struct topology *t, unsigned n)
+{
+  int cpu = t->reader_cpu;
+
+  if (cpu < 0 || !CPU_COUNT(&t->node_cpus))
+    return n ? -1 : cpu;
+  n %= CPU_COUNT(&t->node_cpus);
+  while (n-- && cpu >= 0)
+    cpu = next_cpu(&t->node_cpus, cpu);
+  return cpu;
+}
+
+void topology_place(const struct topology *t, int *node, int *reader,
+                    int *writer)
+{
+  if (node && *node == TOPO_AUTO)
+    *node = t->numa_node >= 0 ? t->numa_node : TOPO_OFF;
+  if (reader && *reader == TOPO_AUTO)
+    *reader = t->reader_cpu >= 0 ? t->reader_cpu : TOPO_OFF;
+  if (writer && *writer == TOPO_AUTO) {
+    /* next to the reader actually chosen, which may be the user's */
+    if (reader && *reader >= 0 && CPU_COUNT(&t->node_cpus))
+      *writer = next_cpu(&t->node_cpus, *reader);
+    else
+      *writer = t->writer_cpu;
+    if (*writer < 0 || (reader && *writer == *reader))
+      *writer = TOPO_OFF;
+  }
+}
+
+int topology_pin(int cpu)
+{
+  cpu_set_t set;
+
+  if (cpu < 0)
+    return 0;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int topology_unpin(const struct topology *t, int avoid_cpu)
+{
+  cpu_set_t set;
+  int i, ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+  if (CPU_COUNT(&t->node_cpus)) {
+    set = t->node_cpus;
+  } else {
+    CPU_ZERO(&set);
+    for (i = 0; i < ncpus && i < MAX_CPUS; i++)
+      CPU_SET(i, &set);
+  }
+  if (avoid_cpu >= 0 && CPU_COUNT(&set) > 1)
+    CPU_CLR(avoid_cpu, &set);
+  return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void topology_report(const struct topology *t, const char *name)
+{
+  char irqs[128] = "", cpus[256] = "";
+  size_t n = 0;
+  unsigned i;
+  int c, lo = -1;
+
+  if (!t->pci[0]) {
+    fprintf(stdout, "%s: topology unknown (no PCIe device found)\n", name);
+    return;
+  }
+
+  for (i = 0; i < t->nirqs && n < sizeof(irqs); i++)
+    n += snprintf(irqs + n, sizeof(irqs) - n, "%s%d", i ? "," : "",
+                  t->irqs[i]);
+
+  /* local cpus back as a list */
+  n = 0;
+  for (c = 0; c <= MAX_CPUS && n < sizeof(cpus); c++) {
+    int set = c < MAX_CPUS && CPU_ISSET(c, &t->node_cpus);
+    if (set && lo < 0)
+      lo = c;
+    if (!set && lo >= 0) {
+      if (lo == c - 1)
+        n += snprintf(cpus + n, sizeof(cpus) - n, "%s%d", n ? "," : "", lo);
+      else
+        n += snprintf(cpus + n, sizeof(cpus) - n, "%s%d-%d", n ? "," : "",
+                      lo, c - 1);
+      lo = -1;
+    }
+  }
+
+  fprintf(stdout, "%s: pci %s, numa node %d, local cpus %s\n", name, t->pci,
+          t->numa_node, cpus[0] ? cpus : "?");
+  fprintf(stdout, "%s: irqs %s, served by cpu %d (%lu interrupts), "
+          "reader cpu %d, writer cpu %d\n", name, irqs[0] ? irqs : "none",
+          t->irq_cpu, t->irq_count, t->reader_cpu, t->writer_cpu);
+}
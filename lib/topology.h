@@ -0,0 +1,87 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+
+/*
+ * Locality of an XDMA device, for placing threads and staging buffers
+ *
+ * - the PCIe function behind a node (/dev/xdma0_c2h_0) is found through
+ *   <root>/sys/class/xdma/<node>/device, else <root>/sys/dev/char/M:m
+ * - its NUMA node and local cpus come from numa_node and local_cpulist
+ * - the cpu serving its MSI/MSI-X vectors (msi_irqs/, else irq) is the one
+ *   with most of their interrupts in <root>/proc/interrupts, else the
+ *   first of <root>/proc/irq/N/smp_affinity_list
+ * - the reader goes on the interrupt cpu, so the driver's wake-up is cpu
+ *   local, and the writer on the next cpu of the same node
+ *
+ * `root` is "/" on a live system; a fake tree works the same for tests.
+ */
+
+#define TOPO_ROOT_DEFAULT "/"
+#define TOPO_MAX_IRQS 64
+
+/* placement overrides: auto follows the topology, off leaves it alone */
+#define TOPO_AUTO -2
+#define TOPO_OFF -1
+
+struct topology {
+  char pci[64];                 // PCIe address, "" when unknown
+  int numa_node;                // -1 when unknown
+  cpu_set_t node_cpus;
+  int irqs[TOPO_MAX_IRQS];
+  unsigned nirqs;
+  int irq_cpu;                  // -1 when unknown
+  unsigned long irq_count;      // interrupts seen on irq_cpu
+
+  /* chosen placement */
+  int reader_cpu;
+  int writer_cpu;
+};
+
+int topology_discover(struct topology *t, const char *root,
+                      const char *devnode);
+
+/* "0-3,8,10-11" */
+int topology_parse_cpulist(const char *str, cpu_set_t *set);
+
+/* --numa: auto, off or a node number */
+int topology_parse_node(const char *str, int *node);
+/* --pin: auto, off, or reader[,writer] cpus (reader alone: writer auto) */
+int topology_parse_pin(const char *str, int *reader, int *writer);
+
+/*
+ * n-th local cpu counting from the reader cpu and wrapping around the node
+ * (0: reader, 1: writer), so several channels spread over the node; -1 if
+ * the topology is unknown
+ */
+int topology_cpu(const struct topology *t, unsigned n);
+
+/*
+ * resolve TOPO_AUTO values against the discovered topology; an auto writer
+ * goes on the node cpu after the reader, whichever way that was chosen, and
+ * never on the reader's cpu (TOPO_OFF if there is no other)
+ */
+void topology_place(const struct topology *t, int *node, int *reader,
+                    int *writer);
+
+/* pin the calling thread, cpu < 0 is a no-op */
+int topology_pin(int cpu);
+
+/*
+ * undo a pin inherited from the creating thread: the node's cpus if known,
+ * else all, without `avoid_cpu` (< 0: none) unless it is the only one
+ */
+int topology_unpin(const struct topology *t, int avoid_cpu);
+
+void topology_report(const struct topology *t, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,294 @@
+#include "trace_rec.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define TRACE_GRACE_NS 1000000  // a writer past trace_on() finishes its record
+
+struct trace_record {
+  uint64_t t0;
+  uint64_t t1;
+  uint64_t arg;
+  uint32_t ev;
+  uint32_t pad;
+};
+
+/* single writer (its thread); read by trace_save() once recording stopped */
+struct trace_buf {
+  struct trace_record *recs;
+  uint64_t head;                // records ever written
+  pid_t tid;
+  char name[32];
+  struct trace_buf *next;
+};
+
+static const struct {
+  const char *name;
+  const char *cat;
+  const char *arg;
+  int span;
+} events[TRACE_EVENT_MAX] = {
+  [TRACE_SUBMIT] = {"submit", "device", "requests", 0},
+  [TRACE_XFER] = {"transfer", "device", "bytes", 1},
+  [TRACE_REAP] = {"reap wait", "device", "reaped", 1},
+  [TRACE_COPY] = {"copy", "sink", "bytes", 1},
+  [TRACE_PERSIST] = {"persist", "sink", "bytes", 1},
+  [TRACE_ENQ] = {"enqueue", "ring", "fill", 0},
+  [TRACE_DEQ] = {"dequeue", "ring", "fill", 0},
+  [TRACE_RING_FULL] = {"ring full", "ring", "fill", 1},
+  [TRACE_RING_EMPTY] = {"ring empty", "ring", "fill", 1},
+};
+
+int trace_enabled;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_buf *bufs;
+static char tool[32] = "jw-dpu";
+static char path[256];
+static uint64_t since_ns;       // start of the current recording
+static unsigned saves;
+static uint64_t unregistered;   // events of threads without a buffer
+static int armed;               // trace_init() ran: threads get buffers
+
+static __thread struct trace_buf *self;
+
+static struct trace_buf *buf_new(const char *name)
+{
+  struct trace_buf *b = calloc(1, sizeof(*b));
+
+  if (!b)
+    return NULL;
+  b->recs = malloc(TRACE_EVENTS * sizeof(*b->recs));
+  if (!b->recs) {
+    free(b);
+    return NULL;
+  }
+  /* pre-faulted: no page fault on the first lap through the records */
+  memset(b->recs, 0, TRACE_EVENTS * sizeof(*b->recs));
+  b->tid = (pid_t)syscall(SYS_gettid);
+  if (name)
+    snprintf(b->name, sizeof(b->name), "%s", name);
+  else if (b->tid == getpid())
+    snprintf(b->name, sizeof(b->name), "main");
+  else
+    snprintf(b->name, sizeof(b->name), "thread %d", (int)b->tid);
+
+  pthread_mutex_lock(&lock);
+  b->next = bufs;
+  bufs = b;
+  pthread_mutex_unlock(&lock);
+  return b;
+}
+
+int trace_thread_init(const char *name)
+{
+  if (!__atomic_load_n(&armed, __ATOMIC_ACQUIRE))
+    return 0;
+  if (self) {
+    if (name)
+      snprintf(self->name, sizeof(self->name), "%s", name);
+    return 0;
+  }
+  self = buf_new(name);
+  return self ? 0 : -ENOMEM;
+}
+
+void trace_push(enum trace_event ev, uint64_t t0, uint64_t t1, uint64_t arg)
+{
+  struct trace_record *r;
+
+  /* no allocation here: the thread had to set up its buffer beforehand */
+  if (!self) {
+    __atomic_add_fetch(&unregistered, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  r = &self->recs[self->head & (TRACE_EVENTS - 1)];
+  r->t0 = t0;
+  r->t1 = t1;
+  r->arg = arg;
+  r->ev = ev;
+  __atomic_store_n(&self->head, self->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_init(const char *name, const char *file, int start)
+{
+  snprintf(tool, sizeof(tool), "%s", name);
+  if (file && *file)
+    snprintf(path, sizeof(path), "%s", file);
+  else
+    snprintf(path, sizeof(path), "/tmp/%s.%d.trace.json", name, (int)getpid());
+  __atomic_store_n(&armed, 1, __ATOMIC_RELEASE);
+  if (start)
+    trace_set(1);
+  return trace_thread_init(NULL);
+}
+
+void trace_set(int on)
+{
+  pthread_mutex_lock(&lock);
+  if (on && !trace_enabled)
+    since_ns = trace_now();
+  __atomic_store_n(&trace_enabled, on, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lock);
+}
+
+/* "x.json", then "x.2.json", "x.3.json" */
+static void save_path(char *buf, size_t size)
+{
+  size_t len = strlen(path);
+
+  if (saves <= 1)
+    snprintf(buf, size, "%s", path);
+  else if (len > 5 && !strcmp(path + len - 5, ".json"))
+    snprintf(buf, size, "%.*s.%u.json", (int)(len - 5), path, saves);
+  else
+    snprintf(buf, size, "%s.%u", path, saves);
+}
+
+static void write_event(FILE *f, pid_t pid, const struct trace_buf *b,
+                        const struct trace_record *r)
+{
+  double ts = (r->t0 - since_ns) / 1e3;
+
+  if (r->ev >= TRACE_EVENT_MAX)
+    return;
+  if (events[r->ev].span)
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%lu}}",
+            events[r->ev].name, events[r->ev].cat, ts, (r->t1 - r->t0) / 1e3,
+            (int)pid, (int)b->tid, events[r->ev].arg, (unsigned long)r->arg);
+  else
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%lu}}",
+            events[r->ev].name, events[r->ev].cat, ts, (int)pid, (int)b->tid,
+            events[r->ev].arg, (unsigned long)r->arg);
+  /* the ring level as a counter track of its own */
+  if (r->ev == TRACE_ENQ || r->ev == TRACE_DEQ)
+    fprintf(f, ",\n{\"name\":\"ring fill\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+            "\"args\":{\"fill\":%lu}}", ts, (int)pid, (unsigned long)r->arg);
+}
+
+int trace_save(void)
+{
+  pid_t pid = getpid();
+  uint64_t written = 0;
+  struct trace_buf *b;
+  char fname[300];
+  FILE *f;
+  int rc = 0;
+
+  pthread_mutex_lock(&lock);
+  saves++;
+  save_path(fname, sizeof(fname));
+  f = fopen(fname, "w");
+  if (!f) {
+    rc = -errno;
+    pthread_mutex_unlock(&lock);
+    fprintf(stderr, "trace: %s: %s\n", fname, strerror(-rc));
+    return rc;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+          (int)pid, tool);
+  for (b = bufs; b; b = b->next) {
+    uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+    uint64_t i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+    fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}", (int)pid, (int)b->tid, b->name);
+    for (; i < head; i++) {
+      const struct trace_record *r = &b->recs[i & (TRACE_EVENTS - 1)];
+      /* older ones belong to an earlier recording, already saved */
+      if (r->t0 < since_ns)
+        continue;
+      write_event(f, pid, b, r);
+      written++;
+    }
+  }
+  fprintf(f, "\n]}\n");
+  if (fclose(f))
+    rc = -errno;
+  pthread_mutex_unlock(&lock);
+
+  if (rc < 0)
+    fprintf(stderr, "trace: %s: %s\n", fname, strerror(-rc));
+  else
+    printf("trace: %lu events in %s\n", (unsigned long)written, fname);
+  if (__atomic_load_n(&unregistered, __ATOMIC_RELAXED))
+    printf("trace: %lu events of threads without trace_thread_init() lost\n",
+           (unsigned long)__atomic_load_n(&unregistered, __ATOMIC_RELAXED));
+  return rc;
+}
+
+static void stop_and_save(void)
+{
+  struct timespec grace = {0, TRACE_GRACE_NS};
+
+  trace_set(0);
+  nanosleep(&grace, NULL);
+  trace_save();
+}
+
+static void *toggle_thread(void *arg)
+{
+  sigset_t *set = arg;
+  int sig;
+
+  while (!sigwait(set, &sig)) {
+    if (trace_on()) {
+      stop_and_save();
+    } else {
+      trace_set(1);
+      printf("trace: recording, again to stop and save\n");
+    }
+    fflush(stdout);
+  }
+  return NULL;
+}
+
+int trace_toggle_on(int sig)
+{
+  static sigset_t set;
+  sigset_t all, old;
+  pthread_t thread;
+  int err;
+
+  sigemptyset(&set);
+  sigaddset(&set, sig);
+  err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+  if (err)
+    return -err;
+  /* the helper takes no other signal, e.g. one meant for another helper */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  err = pthread_create(&thread, NULL, toggle_thread, &set);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err)
+    return -err;
+  pthread_detach(thread);
+  return 0;
+}
+
+void trace_done(void)
+{
+  struct trace_buf *b;
+
+  if (trace_on())
+    stop_and_save();
+
+  /* the recording threads are gone, their buffers with them */
+  pthread_mutex_lock(&lock);
+  while ((b = bufs)) {
+    bufs = b->next;
+    free(b->recs);
+    free(b);
+  }
+  pthread_mutex_unlock(&lock);
+  self = NULL;
+}
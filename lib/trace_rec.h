@@ -0,0 +1,112 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-block pipeline trace, written as Chrome trace JSON
+ *
+ * - the transfer engines stamp their per-block events: read/write submit,
+ *   device complete, the wait for completions, the copy into the sink,
+ *   persist, ring enqueue/dequeue and ring stalls
+ * - every thread records into its own flight-recorder buffer of
+ *   TRACE_EVENTS records, overwriting the oldest; a record is a few
+ *   stores, no lock, no syscall, no page fault. Off (the default) costs
+ *   one relaxed load per event site
+ * - the buffers are allocated and pre-faulted up front: trace_init() for
+ *   its calling thread, trace_thread_init() for every other thread that
+ *   records; events of a thread without one are counted, not recorded
+ * - trace_toggle_on(SIGUSR2) starts and stops recording on a running tool;
+ *   stopping writes the events recorded since the start to the trace
+ *   file, and so does trace_done() at exit
+ *
+ * The file loads in chrome://tracing and in the Perfetto UI
+ * (ui.perfetto.dev): one track per thread, spans for the transfers and
+ * waits, a counter track for the ring fill level.
+ */
+
+#define TRACE_EVENTS (1u << 18)   // records per thread, power of 2
+
+enum trace_event {
+  TRACE_SUBMIT = 0,             // instant: arg requests submitted
+  TRACE_XFER,                   // span: submit -> device complete, arg bytes
+  TRACE_REAP,                   // span: waiting for completions, arg reaped
+  TRACE_COPY,                   // span: copy into the sink, arg bytes
+  TRACE_PERSIST,                // span: complete -> persisted, arg bytes
+  TRACE_ENQ,                    // instant: ring enqueue, arg fill level
+  TRACE_DEQ,                    // instant: ring dequeue, arg fill level
+  TRACE_RING_FULL,              // span: producer waiting for a free slot
+  TRACE_RING_EMPTY,             // span: consumer waiting for data
+  TRACE_EVENT_MAX,
+};
+
+extern int trace_enabled;
+
+static inline int trace_on(void)
+{
+  return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* the start of a span: 0 while not recording */
+static inline uint64_t trace_start(void)
+{
+  return trace_on() ? trace_now() : 0;
+}
+
+void trace_push(enum trace_event ev, uint64_t t0, uint64_t t1, uint64_t arg);
+
+/* a span from `t0` (a trace_start()) to `t1`; dropped if either end was off */
+static inline void trace_span(enum trace_event ev, uint64_t t0, uint64_t t1,
+                              uint64_t arg)
+{
+  if (t0 && t1 >= t0 && trace_on())
+    trace_push(ev, t0, t1, arg);
+}
+
+static inline void trace_mark(enum trace_event ev, uint64_t arg)
+{
+  if (trace_on()) {
+    uint64_t t = trace_now();
+    trace_push(ev, t, t, arg);
+  }
+}
+
+/*
+ * `tool` names the process in the trace; `path` NULL or "": /tmp/<tool>.<pid>.trace.json.
+ * `start`: record from now on, otherwise only once toggled.
+ * Sets up the calling thread's buffer; 0 or -ENOMEM.
+ */
+int trace_init(const char *tool, const char *path, int start);
+/*
+ * set up the calling thread's buffer before its first event and name its
+ * track; nothing to do (0) in a tool that never called trace_init()
+ */
+int trace_thread_init(const char *name);
+
+/*
+ * toggle recording whenever `sig` comes, writing the trace when it stops:
+ * the signal is blocked in the calling thread and a helper thread waits
+ * for it, so call it before any other thread is started
+ */
+int trace_toggle_on(int sig);
+
+void trace_set(int on);
+/* the events recorded since the last start; later files get .2, .3, ... */
+int trace_save(void);
+/* end of a run: stop and save if recording, free the buffers */
+void trace_done(void);
+
+#ifdef __cplusplus
+}
+#endif
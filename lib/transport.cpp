@@ -0,0 +1,361 @@
+#include "transport.h"
+#include "splice_xfer.h"
+#include "trace_rec.h"
+#include <libaio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+static const char *transport_names[] = {"sync", "aio", "uring", "splice"};
+
+int transport_parse(const char *str, TransportKind *kind)
+{
+  unsigned i;
+
+  for (i = 0; i < sizeof(transport_names) / sizeof(transport_names[0]); i++) {
+    if (!strcmp(str, transport_names[i])) {
+      *kind = (TransportKind)i;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+const char *transport_name(TransportKind kind)
+{
+  return transport_names[(int)kind];
+}
+
+static uint64_t elapsed_ns(const struct timespec &t0)
+{
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+}
+
+ssize_t Transport::account(ssize_t rc, size_t len, const struct timespec &t0)
+{
+  uint64_t t1 = lat_hist_now();
+  uint64_t ns = t1 - ((uint64_t)t0.tv_sec * 1000000000ull + t0.tv_nsec);
+
+  xfer_ns += ns;
+  done_ns = t1;
+  if (rc >= 0)
+    trace_span(TRACE_XFER, t1 - ns, t1, rc);
+  calls++;
+  stat_inc(st_calls_, 1);
+  if (rc < 0) {
+    errors++;
+    stat_inc(st_errors_, 1);
+    return rc;
+  }
+  if (rc == 0) {
+    empty++;
+    stat_inc(st_empty_, 1);
+    return 0;
+  }
+  bytes += rc;
+  stat_inc(st_bytes_, rc);
+  if (lat)
+    lat_hist_record(lat, ns);
+  if ((size_t)rc < len) {
+    short_xfers++;
+    stat_inc(st_short_, 1);
+  }
+  if (ch_.is_seekable())
+    ch_.advance(rc);
+  return rc;
+}
+
+ssize_t Transport::read(char *buf, size_t len)
+{
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  return account(do_read(buf, len), len, t0);
+}
+
+ssize_t Transport::write(const char *buf, size_t len)
+{
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  return account(do_write(buf, len), len, t0);
+}
+
+ssize_t Transport::move(size_t len)
+{
+  struct timespec t0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  return account(do_move(len), len, t0);
+}
+
+void Transport::report(const char *name) const
+{
+  double busy = xfer_ns / 1e9, wall = elapsed_ns(ts_start_) / 1e9;
+
+  fprintf(stdout, "%s: transport %s, %lu transfers, %lu bytes, %lu short, "
+          "%lu empty, %lu errors\n", name, this->name(), calls, bytes,
+          short_xfers, empty, errors);
+  fprintf(stdout, "%s: %.3f s in transfers of %.3f s, %.2f MB/s busy, "
+          "%.2f MB/s overall\n", name, busy, wall,
+          busy > 0 ? bytes / busy / 1e6 : 0, wall > 0 ? bytes / wall / 1e6 : 0);
+  do_report(name);
+}
+
+void Transport::publish(struct stat_shm *shm, const char *group)
+{
+  st_bytes_ = stat_shm_add(shm, group, "bytes", STAT_BYTES);
+  st_calls_ = stat_shm_add(shm, group, "xfers", STAT_COUNTER);
+  st_short_ = stat_shm_add(shm, group, "short", STAT_COUNTER);
+  st_empty_ = stat_shm_add(shm, group, "empty", STAT_COUNTER);
+  st_errors_ = stat_shm_add(shm, group, "errors", STAT_COUNTER);
+}
+
+/* read(2)/write(2); memory-mapped engines at their AXI address */
+class SyncTransport : public Transport {
+public:
+  using Transport::Transport;
+  TransportKind kind() const override { return TransportKind::SYNC; }
+
+protected:
+  ssize_t do_read(char *buf, size_t len) override
+  {
+    ssize_t rc = ch_.address() && !ch_.is_seekable()
+                     ? pread(ch_.fd(), buf, len, ch_.address())
+                     : ::read(ch_.fd(), buf, len);
+    return rc < 0 ? -errno : rc;
+  }
+
+  ssize_t do_write(const char *buf, size_t len) override
+  {
+    ssize_t rc = ch_.address() && !ch_.is_seekable()
+                     ? pwrite(ch_.fd(), buf, len, ch_.address())
+                     : ::write(ch_.fd(), buf, len);
+    return rc < 0 ? -errno : rc;
+  }
+};
+
+/* one libaio request in flight, waited for by an aio_waiter */
+class AioTransport : public Transport {
+public:
+  using Transport::Transport;
+  ~AioTransport()
+  {
+    if (ready_)
+      aio_waiter_free(&waiter_);
+    if (ctx_)
+      io_destroy(ctx_);
+  }
+  TransportKind kind() const override { return TransportKind::AIO; }
+
+protected:
+  int init(const TransportOptions &opt) override
+  {
+    int err = io_setup(1, &ctx_);
+    if (err < 0)
+      return err;
+    err = aio_waiter_init(&waiter_, ctx_, opt.wait_mode, opt.spin_us);
+    if (err < 0)
+      return err;
+    ready_ = true;
+    if (opt.user_reap && aio_waiter_user_reap(&waiter_) < 0)
+      fprintf(stderr, "%s: unknown aio ring layout, reaping with "
+              "io_getevents\n", ch_.name());
+    running_ = opt.running;
+    return 0;
+  }
+
+  ssize_t submit()
+  {
+    struct iocb *job = &iocb_;
+    struct io_event evt;
+    struct timespec timeout = {0, 1000000}; // 1 ms, to notice `running`
+    int rc;
+
+    aio_waiter_prep(&waiter_, job);
+    rc = io_submit(ctx_, 1, &job);
+    if (rc < 0)
+      return rc;
+    while (!(rc = aio_waiter_getevents(&waiter_, 1, 1, &evt, &timeout))) {
+      if (running_ && !*running_) {
+        /* not cancelled on the spot: the kernel still owns iocb_ and buf */
+        if (io_cancel(ctx_, job, &evt) != 0)
+          while (!aio_waiter_getevents(&waiter_, 1, 1, &evt, &timeout))
+            ;
+        return -EINTR;
+      }
+    }
+    if (rc < 0)
+      return rc;
+    return evt.res;
+  }
+
+  ssize_t do_read(char *buf, size_t len) override
+  {
+    io_prep_pread(&iocb_, ch_.fd(), buf, len, ch_.offset());
+    return submit();
+  }
+
+  ssize_t do_write(const char *buf, size_t len) override
+  {
+    io_prep_pwrite(&iocb_, ch_.fd(), (void *)buf, len, ch_.offset());
+    return submit();
+  }
+
+  void do_report(const char *name) const override
+  {
+    aio_waiter_report(&waiter_, name);
+  }
+
+private:
+  io_context_t ctx_ = 0;
+  struct aio_waiter waiter_;
+  struct iocb iocb_;
+  bool ready_ = false;
+  volatile sig_atomic_t *running_ = nullptr;
+};
+
+#ifdef HAVE_LIBURING
+/* one io_uring read/write per transfer, a single io_uring_enter each */
+class UringTransport : public Transport {
+public:
+  using Transport::Transport;
+  ~UringTransport()
+  {
+    if (ready_)
+      io_uring_queue_exit(&ring_);
+  }
+  TransportKind kind() const override { return TransportKind::URING; }
+
+protected:
+  int init(const TransportOptions &opt) override
+  {
+    int err = io_uring_queue_init(4, &ring_,
+                                  opt.sqpoll ? IORING_SETUP_SQPOLL : 0);
+    if (err < 0)
+      return err;
+    ready_ = true;
+    return 0;
+  }
+
+  ssize_t submit()
+  {
+    struct io_uring_cqe *cqe;
+    int rc = io_uring_submit_and_wait(&ring_, 1);
+    if (rc < 0)
+      return rc;
+    enters++;
+    rc = io_uring_wait_cqe(&ring_, &cqe);
+    if (rc < 0)
+      return rc;
+    rc = cqe->res;
+    io_uring_cqe_seen(&ring_, cqe);
+    return rc;
+  }
+
+  ssize_t do_read(char *buf, size_t len) override
+  {
+    io_uring_prep_read(io_uring_get_sqe(&ring_), ch_.fd(), buf, len,
+                       ch_.offset());
+    return submit();
+  }
+
+  ssize_t do_write(const char *buf, size_t len) override
+  {
+    io_uring_prep_write(io_uring_get_sqe(&ring_), ch_.fd(), buf, len,
+                        ch_.offset());
+    return submit();
+  }
+
+  void do_report(const char *name) const override
+  {
+    fprintf(stdout, "%s: %lu io_uring_enter calls%s\n", name, enters,
+            ring_.flags & IORING_SETUP_SQPOLL ? " (sqpoll)" : "");
+  }
+
+private:
+  struct io_uring ring_;
+  bool ready_ = false;
+  uint64_t enters = 0;
+};
+#endif
+
+/* splice(2) between the channel and a peer fd, copies otherwise */
+class SpliceTransport : public SyncTransport {
+public:
+  using SyncTransport::SyncTransport;
+  ~SpliceTransport()
+  {
+    if (ready_)
+      splice_xfer_free(&x_);
+  }
+  TransportKind kind() const override { return TransportKind::SPLICE; }
+
+protected:
+  int init(const TransportOptions &opt) override
+  {
+    int err;
+
+    if (opt.peer_fd < 0 || ch_.direction() == DeviceChannel::BOTH)
+      return -EBADF;
+    if (ch_.direction() == DeviceChannel::READ)
+      err = splice_xfer_init(&x_, ch_.fd(), opt.peer_fd, opt.blksize);
+    else
+      err = splice_xfer_init(&x_, opt.peer_fd, ch_.fd(), opt.blksize);
+    if (err < 0)
+      return err;
+    ready_ = true;
+    return 0;
+  }
+
+  ssize_t do_move(size_t len) override
+  {
+    return splice_xfer_move(&x_, len);
+  }
+
+  void do_report(const char *name) const override
+  {
+    if (x_.calls)
+      splice_xfer_report(&x_, name);
+  }
+
+private:
+  struct splice_xfer x_;
+  bool ready_ = false;
+};
+
+std::unique_ptr<Transport> make_transport(TransportKind kind,
+                                          DeviceChannel &ch,
+                                          const TransportOptions &opt,
+                                          int *err)
+{
+  std::unique_ptr<Transport> t;
+
+  switch (kind) {
+  case TransportKind::SYNC:
+    t.reset(new SyncTransport(ch));
+    break;
+  case TransportKind::AIO:
+    t.reset(new AioTransport(ch));
+    break;
+  case TransportKind::URING:
+#ifdef HAVE_LIBURING
+    t.reset(new UringTransport(ch));
+    break;
+#else
+    *err = -ENOSYS;
+    return nullptr;
+#endif
+  case TransportKind::SPLICE:
+    t.reset(new SpliceTransport(ch));
+    break;
+  }
+
+  *err = t->init(opt);
+  if (*err < 0)
+    return nullptr;
+  clock_gettime(CLOCK_MONOTONIC, &t->ts_start_);
+  return t;
+}
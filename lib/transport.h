@@ -0,0 +1,125 @@
+#pragma once
+
+#include "aio_waiter.h"
+#include "device_channel.h"
+#include "lat_hist.h"
+#include "stat_shm.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <memory>
+
+/*
+ * How a DeviceChannel's data moves, picked at run time
+ *
+ * sync   : read(2)/write(2), pread/pwrite at offset() on seekable nodes
+ * aio    : one libaio request per transfer, completions through an
+ *          aio_waiter (block, eventfd, poll or spin; optional user reap)
+ * uring  : one io_uring read/write per transfer, optional SQPOLL
+ * splice : move() runs channel <-> peer fd through a pipe, the data never
+ *          enters user space; read()/write() still copy as sync does
+ *
+ * A transfer returns the bytes moved, 0 when nothing came (a timeout on
+ * an xdma node, the end of a file) or a negative errno; a short transfer
+ * is not an error. Every transport counts its transfers the same way, so
+ * report() lines compare across transports.
+ */
+
+enum class TransportKind {
+  SYNC,
+  AIO,
+  URING,
+  SPLICE,
+};
+
+#define TRANSPORT_DEFAULT "sync"
+
+struct TransportOptions {
+  /* aio */
+  enum aio_wait_mode wait_mode = AIO_WAIT_BLOCK;
+  unsigned spin_us = AIO_WAIT_SPIN_US_DEFAULT;
+  bool user_reap = false;
+  /* uring */
+  bool sqpoll = false;
+  /* splice: the other end and the pipe size */
+  int peer_fd = -1;
+  size_t blksize = 0;
+  /* aio: a wait gives up (-EINTR) once this drops to 0 */
+  volatile sig_atomic_t *running = nullptr;
+};
+
+int transport_parse(const char *str, TransportKind *kind);
+const char *transport_name(TransportKind kind);
+
+class Transport {
+public:
+  explicit Transport(DeviceChannel &ch) : ch_(ch) {}
+  virtual ~Transport() {}
+  Transport(const Transport &) = delete;
+  Transport &operator=(const Transport &) = delete;
+
+  virtual TransportKind kind() const = 0;
+  const char *name() const { return transport_name(kind()); }
+
+  ssize_t read(char *buf, size_t len);
+  ssize_t write(const char *buf, size_t len);
+  /* channel -> peer (C2H) or peer -> channel; -EOPNOTSUPP but on splice */
+  ssize_t move(size_t len);
+
+  /* nothing moved, but an xdma node just timed out: try again */
+  bool timed_out(ssize_t rc) const
+  {
+    return (rc == 0 && ch_.is_stream()) || rc == -EIO || rc == -ETIMEDOUT ||
+           rc == -EAGAIN || rc == -EINTR;
+  }
+
+  void report(const char *name) const;
+  /* live copies of the statistics below in `shm`, under `group` */
+  void publish(struct stat_shm *shm, const char *group);
+
+  /* statistics */
+  uint64_t calls = 0;
+  uint64_t bytes = 0;
+  uint64_t short_xfers = 0;
+  uint64_t empty = 0;           // 0 bytes: timeout or end of data
+  uint64_t errors = 0;
+  uint64_t xfer_ns = 0;         // time spent inside transfers
+
+  /* optional: submit->complete of every transfer that moved data */
+  struct lat_hist *lat = nullptr;
+  uint64_t done_ns = 0;         // lat_hist_now() at the last completion
+
+protected:
+  virtual int init(const TransportOptions &opt) { (void)opt; return 0; }
+  virtual ssize_t do_read(char *buf, size_t len) = 0;
+  virtual ssize_t do_write(const char *buf, size_t len) = 0;
+  virtual ssize_t do_move(size_t len) { (void)len; return -EOPNOTSUPP; }
+  virtual void do_report(const char *name) const { (void)name; }
+
+  DeviceChannel &ch_;
+
+private:
+  ssize_t account(ssize_t rc, size_t len, const struct timespec &t0);
+  struct timespec ts_start_ = {0, 0};
+  uint64_t *st_bytes_ = nullptr;
+  uint64_t *st_calls_ = nullptr;
+  uint64_t *st_short_ = nullptr;
+  uint64_t *st_empty_ = nullptr;
+  uint64_t *st_errors_ = nullptr;
+
+  friend std::unique_ptr<Transport> make_transport(TransportKind,
+                                                   DeviceChannel &,
+                                                   const TransportOptions &,
+                                                   int *);
+};
+
+/*
+ * a transport for `ch`, NULL with *err set when it cannot be set up (no
+ * io_uring in the build or kernel, no aio context, no pipe)
+ */
+std::unique_ptr<Transport> make_transport(TransportKind kind,
+                                          DeviceChannel &ch,
+                                          const TransportOptions &opt,
+                                          int *err);
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include "uring_xfer.h"
+#include "lat_hist.h"
+#include "trace_rec.h"
+#include "stat_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define XFER_READ 0
+#define XFER_DATA(i, kind) (((uint64_t)(i) << 2) | (kind))
+#define XFER_IDX(data) ((data) >> 2)
+#define XFER_KIND(data) ((data) & 3)
+
+static int fd_mode(int fd, mode_t *mode)
+{
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return -1;
+  *mode = st.st_mode;
+  return 0;
+}
+
+int uring_xfer_init(struct uring_xfer *x, struct buf_pool *pool, int src_fd,
+                    const int *dst_fds, int ndst, int depth, int sqpoll)
+{
+  struct io_uring_params params;
+  int files[1 + URING_XFER_MAX_DST];
+  struct iovec *iov;
+  mode_t mode;
+  int i, rc;
+
+  memset(x, 0, sizeof(*x));
+  if (depth <= 0 || ndst < 0 || ndst > URING_XFER_MAX_DST)
+    return -EINVAL;
+
+  x->src_fd = src_fd;
+  x->ndst = ndst;
+  x->depth = depth;
+  x->blksize = pool->blksize;
+  x->pool = pool;
+  x->sqpoll = sqpoll;
+  if (fd_mode(src_fd, &mode) == 0) {
+    x->src_seekable = S_ISREG(mode) || S_ISBLK(mode);
+    x->src_chrdev = S_ISCHR(mode);
+  }
+  files[0] = src_fd;
+  for (i = 0; i < ndst; i++) {
+    files[1 + i] = dst_fds[i];
+    x->dst_fds[i] = dst_fds[i];
+    if (fd_mode(dst_fds[i], &mode) == 0)
+      x->dst_seekable[i] = S_ISREG(mode) || S_ISBLK(mode);
+    if (!x->dst_seekable[i])
+      x->dst_serial = 1;
+  }
+
+  x->blocks = calloc(depth, sizeof(struct uring_block));
+  iov = calloc(depth, sizeof(struct iovec));
+  if (!x->blocks || !iov) {
+    free(iov);
+    uring_xfer_free(x);
+    return -ENOMEM;
+  }
+  /* the pool's guard page takes what the device returns beyond blksize */
+  for (i = 0; i < depth; i++) {
+    x->blocks[i].item = buf_pool_get(pool);
+    if (!x->blocks[i].item) {
+      free(iov);
+      uring_xfer_free(x);
+      return -ENOBUFS;
+    }
+    iov[i].iov_base = x->blocks[i].item->data;
+    iov[i].iov_len = pool->stride;
+  }
+
+  memset(&params, 0, sizeof(params));
+  if (sqpoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 2000; // ms
+  }
+  rc = io_uring_queue_init_params(depth * (1 + ndst), &x->ring, &params);
+  if (rc < 0) {
+    free(iov);
+    x->ring.ring_fd = 0;
+    uring_xfer_free(x);
+    return rc;
+  }
+
+  rc = io_uring_register_buffers(&x->ring, iov, depth);
+  free(iov);
+  if (rc == 0)
+    rc = io_uring_register_files(&x->ring, files, 1 + ndst);
+  if (rc < 0) {
+    uring_xfer_free(x);
+    return rc;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &x->ts_start);
+  return 0;
+}
+
+void uring_xfer_free(struct uring_xfer *x)
+{
+  int i;
+
+  if (x->ring.ring_fd > 0)
+    io_uring_queue_exit(&x->ring);
+  for (i = 0; x->blocks && i < x->depth; i++) {
+    if (x->blocks[i].item)
+      buf_pool_put(x->pool, x->blocks[i].item);
+  }
+  free(x->blocks);
+  memset(x, 0, sizeof(*x));
+}
+
+/* a timestamp for the histograms or the trace, 0 if neither wants one */
+static uint64_t stamp(const struct uring_xfer *x)
+{
+  return x->lat_xfer || x->lat_persist || trace_on() ? lat_hist_now() : 0;
+}
+
+static struct uring_block *block(struct uring_xfer *x, uint64_t n)
+{
+  return &x->blocks[n % x->depth];
+}
+
+static char *block_buf(struct uring_xfer *x, uint64_t n)
+{
+  return block(x, n)->item->data;
+}
+
+/*
+ * synchronous fixup of a short write, rare path; the following offsets
+ * are unaligned, so an O_DIRECT dst continues buffered
+ */
+static int write_tail(int fd, int seekable, const char *buf, size_t len,
+                      off_t offset)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags >= 0 && (flags & O_DIRECT))
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+
+  while (len) {
+    ssize_t rc = seekable ? pwrite(fd, buf, len, offset) : write(fd, buf, len);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    buf += rc;
+    len -= rc;
+    offset += rc;
+  }
+  return 0;
+}
+
+/*
+ * a read into every buffer whose block retired, up to `count` blocks with
+ * data; a stream src only once its previous chain completed, the new
+ * reads linked so the device serves them in order
+ */
+static int queue_reads(struct uring_xfer *x, uint64_t count)
+{
+  struct io_uring_sqe *prev = NULL;
+  int queued = 0;
+
+  if (x->eof || (!x->src_seekable && x->reads_inflight))
+    return 0;
+
+  while (x->next_read < x->next_retire + x->depth &&
+         x->filled + x->reads_inflight < count) {
+    uint64_t n = x->next_read;
+    struct uring_block *b = block(x, n);
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&x->ring);
+
+    if (!sqe)
+      break;
+    io_uring_prep_read_fixed(sqe, 0, block_buf(x, n), x->blksize,
+                             x->src_seekable ? x->read_offset : 0, n % x->depth);
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    sqe->user_data = XFER_DATA(n % x->depth, XFER_READ);
+    if (prev)
+      prev->flags |= IOSQE_IO_LINK;
+    if (!x->src_seekable)
+      prev = sqe;
+
+    *b = (struct uring_block){.item = b->item};
+    b->reading = 1;
+    b->submit_ns = stamp(x);
+    x->read_offset += x->blksize;
+    x->next_read++;
+    x->reads_inflight++;
+    queued++;
+  }
+  return queued;
+}
+
+/* the writes of every block read, in block order, at the offsets reached */
+static int queue_writes(struct uring_xfer *x)
+{
+  int queued = 0, d;
+
+  while (x->next_write < x->next_read) {
+    uint64_t n = x->next_write;
+    struct uring_block *b = block(x, n);
+
+    if (b->reading)
+      break;
+    if (b->res > 0 && x->ndst) {
+      if (x->dst_serial && x->writes_inflight)
+        break;
+      b->write_offset = x->write_offset;
+      for (d = 0; d < x->ndst; d++) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&x->ring);
+        if (!sqe)
+          return -EBUSY;        // the ring holds depth * (1 + ndst)
+        io_uring_prep_write_fixed(sqe, 1 + d, block_buf(x, n), b->res,
+                                  x->dst_seekable[d] ? b->write_offset : 0,
+                                  n % x->depth);
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+        sqe->user_data = XFER_DATA(n % x->depth, 1 + d);
+      }
+      b->writes = x->ndst;
+      x->writes_inflight += x->ndst;
+      x->write_offset += b->res;
+      queued += x->ndst;
+    }
+    x->next_write++;
+  }
+  return queued;
+}
+
+static int complete(struct uring_xfer *x, const struct io_uring_cqe *cqe)
+{
+  unsigned i = XFER_IDX(cqe->user_data), kind = XFER_KIND(cqe->user_data);
+  struct uring_block *b = &x->blocks[i];
+  int d = kind - 1, rc;
+
+  if (kind == XFER_READ) {
+    b->res = cqe->res;
+    b->read_ns = stamp(x);
+    b->reading = 0;
+    x->reads_inflight--;
+    if (cqe->res > 0)
+      x->filled++;
+    return 0;
+  }
+
+  b->writes--;
+  x->writes_inflight--;
+  b->wres[d] = cqe->res;
+  if (cqe->res < 0)
+    return cqe->res;
+  if (cqe->res < b->res) {
+    rc = write_tail(x->dst_fds[d], x->dst_seekable[d],
+                    x->blocks[i].item->data + cqe->res,
+                    b->res - cqe->res, b->write_offset + cqe->res);
+    if (rc < 0)
+      return rc;
+  }
+  b->persist_ns = stamp(x);
+  return 0;
+}
+
+/* account the blocks whose writes all completed, in order */
+static int retire(struct uring_xfer *x)
+{
+  int retired = 0;
+
+  while (x->next_retire < x->next_write) {
+    struct uring_block *b = block(x, x->next_retire);
+    long len = b->res;
+
+    if (b->writes)
+      break;
+    if (len <= 0) {
+      /* cancelled: a short read ended its chain, no data */
+      if (len == -ECANCELED)
+        ;
+      /* xdma returns no data on timeout, a file/fifo stand-in is at eof */
+      else if (x->src_chrdev) {
+        x->timeouts++;
+        stat_inc(x->st_empty, 1);
+      } else if (len == 0) {
+        x->eof = 1;
+      } else {
+        return len;
+      }
+    } else {
+      uint64_t persisted = x->ndst ? b->persist_ns : b->read_ns;
+
+      if (x->lat_xfer)
+        lat_hist_record(x->lat_xfer, b->read_ns - b->submit_ns);
+      if (x->lat_persist && x->ndst)
+        lat_hist_record(x->lat_persist, persisted - b->read_ns);
+      trace_span(TRACE_XFER, b->submit_ns, b->read_ns, len);
+      if (x->ndst)
+        trace_span(TRACE_PERSIST, b->read_ns, persisted, len);
+
+      x->src_offset += len;
+      x->dst_offset += len;
+      x->bytes += len;
+      x->transfers++;
+      stat_inc(x->st_bytes, len);
+      stat_inc(x->st_xfers, 1);
+      if ((size_t)len < x->blksize) {
+        x->short_reads++;
+        stat_inc(x->st_short, 1);
+      }
+    }
+    x->next_retire++;
+    retired++;
+  }
+  if (retired && x->on_batch)
+    x->on_batch(x->on_batch_arg, x->dst_offset);
+  return retired;
+}
+
+int64_t uring_xfer_run(struct uring_xfer *x, uint64_t count,
+                       volatile sig_atomic_t *running)
+{
+  uint64_t start = x->transfers;
+  struct io_uring_cqe *cqe;
+  int rc;
+
+  x->filled = 0;
+  for (;;) {
+    int stop = running && !*running;
+    int queued = 0, reaped = 0;
+    uint64_t t0;
+
+    if (!stop)
+      queued = queue_reads(x, count);
+    rc = queue_writes(x);
+    if (rc < 0)
+      return rc;
+    queued += rc;
+
+    if (!x->reads_inflight && !x->writes_inflight && !queued) {
+      rc = retire(x);
+      if (rc < 0)
+        return rc;
+      /* nothing in flight and nothing left to queue: done */
+      if (stop || x->eof || x->filled >= count || !rc)
+        break;
+      continue;
+    }
+
+    if (queued) {
+      x->batches++;
+      trace_mark(TRACE_SUBMIT, queued);
+    }
+    t0 = trace_on() ? trace_now() : 0;
+    /* without SQPOLL submit and wait for a completion in one enter */
+    if (x->sqpoll) {
+      if (IO_URING_READ_ONCE(*x->ring.sq.kflags) & IORING_SQ_NEED_WAKEUP)
+        x->enters++;
+      rc = io_uring_submit(&x->ring);
+    } else {
+      x->enters++;
+      rc = io_uring_submit_and_wait(&x->ring, 1);
+    }
+    if (rc == -EINTR && stop)
+      break;
+    if (rc < 0 && rc != -EINTR)
+      return rc;
+
+    while (io_uring_peek_cqe(&x->ring, &cqe) == 0) {
+      rc = complete(x, cqe);
+      io_uring_cqe_seen(&x->ring, cqe);
+      if (rc < 0)
+        return rc;
+      reaped++;
+    }
+    if (reaped && t0)
+      trace_span(TRACE_REAP, t0, trace_now(), reaped);
+
+    rc = retire(x);
+    if (rc < 0)
+      return rc;
+  }
+  return x->transfers - start;
+}
+
+void uring_xfer_publish(struct uring_xfer *x, struct stat_shm *shm,
+                        const char *name)
+{
+  x->st_bytes = stat_shm_add(shm, name, "bytes", STAT_BYTES);
+  x->st_xfers = stat_shm_add(shm, name, "xfers", STAT_COUNTER);
+  x->st_short = stat_shm_add(shm, name, "short", STAT_COUNTER);
+  x->st_empty = stat_shm_add(shm, name, "empty", STAT_COUNTER);
+}
+
+void uring_xfer_report(const struct uring_xfer *x, const char *name)
+{
+  struct timespec ts_end;
+  double secs;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  secs = (ts_end.tv_sec - x->ts_start.tv_sec) +
+         (ts_end.tv_nsec - x->ts_start.tv_nsec) / 1e9;
+
+  fprintf(stdout, "%s: io_uring%s, depth %d, blk-size %lu, %lu transfers, %lu bytes in %.3f s\n",
+          name, x->sqpoll ? " (sqpoll)" : "", x->depth, x->blksize,
+          x->transfers, x->bytes, secs);
+  fprintf(stdout, "%s: throughput %.2f MB/s, %lu batches, %.2f transfers per enter, %lu short reads, %lu timeouts\n",
+          name, secs > 0 ? x->bytes / secs / 1e6 : 0.0, x->batches,
+          x->enters ? (double)x->transfers / x->enters : (double)x->transfers,
+          x->short_reads, x->timeouts);
+}
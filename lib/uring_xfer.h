@@ -0,0 +1,127 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <liburing.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "buf_pool.h"
+
+/*
+ * io_uring transfer engine: src --read--> buffer --write--> dst[0..ndst)
+ *
+ * - `depth` buffers are taken from the caller's buf_pool (blksize is the
+ *   pool's); they and the files are registered once (READ_FIXED/WRITE_FIXED
+ *   on fixed file slots), no per-transfer pinning or fd lookup
+ * - `depth` buffers cycle independently: read, write (to every dst),
+ *   read again as soon as their writes completed, so reads of later
+ *   blocks overlap the writes of earlier ones
+ * - blocks are numbered in read order, buffer = block % depth; a block's
+ *   writes are queued in that order once its read completed, at the dst
+ *   offset the blocks before it actually reached, so short reads leave no
+ *   holes; a buffer is reused only once every block before it retired
+ * - a stream src (xdma node, fifo) keeps its reads in one linked chain,
+ *   a new chain starts when the last one completed: the device hands out
+ *   data in order; a short read ends the chain (the rest is cancelled)
+ * - a stream dst (fifo, stdout) gets one block's write at a time, a
+ *   seekable one any number
+ * - optional SQPOLL: a kernel thread picks up submissions and completions
+ *   are polled from the mapped CQ ring, no syscall in steady state
+ * - optional live counters in a stat_shm segment (uring_xfer_publish)
+ * - optional latency histograms: lat_xfer gets read submit -> read
+ *   complete, lat_persist read complete -> last write of it complete; the
+ *   same stamps go to the pipeline trace while it records (trace_rec.h)
+ */
+
+#define URING_XFER_MAX_DST 2
+
+struct lat_hist;
+struct stat_shm;
+
+struct uring_block {
+  struct buf_item *item;        // the buffer, fixed index = block % depth
+  long res;                     // read result
+  int reading;                  // read in flight
+  long wres[URING_XFER_MAX_DST];
+  int writes;                   // writes in flight
+  off_t write_offset;
+  uint64_t submit_ns;
+  uint64_t read_ns;
+  uint64_t persist_ns;
+};
+
+struct uring_xfer {
+  struct io_uring ring;
+  int src_fd;
+  int ndst;
+  int src_seekable;
+  int src_chrdev;
+  int dst_fds[URING_XFER_MAX_DST];
+  int dst_seekable[URING_XFER_MAX_DST];
+  int depth;
+  size_t blksize;
+  int sqpoll;
+  int dst_serial;               // a dst is a stream: one block's writes at a time
+
+  struct buf_pool *pool;
+  struct uring_block *blocks;   // depth entries, block n in blocks[n % depth]
+
+  struct lat_hist *lat_xfer;    // NULL: not recorded
+  struct lat_hist *lat_persist;
+
+  /* called whenever blocks retired, with the dst offset written so far */
+  void (*on_batch)(void *arg, uint64_t written);
+  void *on_batch_arg;
+
+  uint64_t next_read;           // block numbers: next to read,
+  uint64_t next_write;          // next to queue its writes,
+  uint64_t next_retire;         // next to retire
+  int reads_inflight;
+  int writes_inflight;
+  uint64_t filled;              // blocks read with data, retired or not
+  off_t read_offset;            // seekable src: offset of the next read
+  off_t write_offset;           // seekable dst: offset of the next write
+  off_t src_offset;             // retired, in order
+  off_t dst_offset;
+  int eof;
+
+  /* statistics */
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t batches;             // submissions
+  uint64_t short_reads;
+  uint64_t timeouts;
+  uint64_t enters;              // calls that may enter the kernel
+  struct timespec ts_start;
+
+  /* live counters, NULL: not published */
+  uint64_t *st_bytes;
+  uint64_t *st_xfers;
+  uint64_t *st_short;
+  uint64_t *st_empty;
+};
+
+/* -ENOBUFS: fewer than `depth` buffers free in the pool */
+int uring_xfer_init(struct uring_xfer *x, struct buf_pool *pool, int src_fd,
+                    const int *dst_fds, int ndst, int depth, int sqpoll);
+void uring_xfer_free(struct uring_xfer *x);
+
+/*
+ * move up to `count` blocks, stops early on eof or once *running drops to
+ * 0; returns the number of blocks moved or a negative errno
+ */
+int64_t uring_xfer_run(struct uring_xfer *x, uint64_t count,
+                       volatile sig_atomic_t *running);
+
+void uring_xfer_publish(struct uring_xfer *x, struct stat_shm *shm,
+                        const char *name);
+void uring_xfer_report(const struct uring_xfer *x, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
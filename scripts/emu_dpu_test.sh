@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Run one of the DMA test scripts without a card: the xdma nodes come from
+# the emulator in tests/emu, e.g.
+#   ./emu_dpu_test.sh asio_dpu_test.sh infile outfile 16 100
+# Emulator options (bandwidth, latency, FIFO depth, packets) go in EMU_OPTS:
+#   EMU_OPTS="-b 800 -L 20 -f 262144" ./emu_dpu_test.sh ...
+
+script=$1
+shift
+
+emuDir=${XDMA_EMU_DIR:-/tmp/xdma_emu}
+emuShim=$(realpath ../tests/emu/libjw_xdma_emu_shim.so)
+
+../tests/emu/jw_xdma_emu -d $emuDir $EMU_OPTS &
+emuPid=$!
+
+# Wait for the emulator to set up its FIFOs.
+sleep 1s
+
+XDMA_EMU_DIR=$emuDir LD_PRELOAD=$emuShim $(dirname $0)/$script "$@"
+returnVal=$?
+
+# The emulator prints its statistics on the way out.
+kill $emuPid
+wait $emuPid
+exit $returnVal
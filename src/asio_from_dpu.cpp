@@ -1,10 +1,21 @@
+#include "alloc_count.h"
+#include "alog.h"
+#include "buf_pool.h"
+#include "dma_mem.h"
 #include "dma_utils.h"
+#include "lat_hist.h"
+#include "perf_stage.h"
+#include "placement.h"
+#include "sink.h"
+#include "splice_xfer.h"
+#include "stat_shm.h"
+#include "trace_rec.h"
+#include "transport.h"
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <errno.h>
 #include <fcntl.h>
-#include <libaio.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,39 +32,23 @@
 
 #define FATAL(...)                                                             \
   do {                                                                         \
+    alog_stop();                                                               \
+    trace_done();                                                              \
+    stat_shm_remove(&shm);                                                     \
     fprintf(stderr, __VA_ARGS__);                                              \
     fprintf(stderr, "\n");                                                     \
     assert(0);                                                                 \
     exit(-1);                                                                  \
   } while (0)
 
-static const void handle_error(int err) {
-#define DECL_ERR(X)                                                            \
-  case -X:                                                                     \
-    FATAL("Error " #X "\n");                                                   \
-    break;
-  switch (err) {
-    DECL_ERR(EFAULT);
-    DECL_ERR(EINVAL);
-    DECL_ERR(ENOSYS);
-    DECL_ERR(EAGAIN);
-  };
-  if (err < 0)
-    FATAL("Unknown error");
-#undef DECL_ERR
-}
-
-#define IO_RUN(F, ...)                                                         \
-  do {                                                                         \
-    int err = F(__VA_ARGS__);                                                  \
-    handle_error(err);                                                         \
-  } while (0)
-
 // 
 #include <iostream>
 #include <string>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
+#ifdef HAVE_LIBURING
+#include "uring_xfer.h"
+#endif
 
 namespace po = boost::program_options;
 
@@ -61,20 +56,23 @@ namespace po = boost::program_options;
 #define FILENAME_DEFAULT "output.dat"
 #define SIZE_DEFAULT 1
 #define COUNT_DEFAULT 1
+#define TRANSPORT_TOOL_DEFAULT "aio"
+#define DEPTH_DEFAULT 8
 
-int dpu_fd = -1;
-int out_fd = -1;
+struct sink sink;
+struct buf_pool pool;
 char *allocated = NULL;
 uint64_t size;
+struct lat_hist lat_xfer;    // device read submit -> complete
+struct lat_hist lat_persist; // read complete -> written to the output
+struct stat_shm shm;         // live counters for jw_stat
+struct perf_stage perf_read;  // device -> buffer (splice: -> output)
+struct perf_stage perf_write; // buffer -> output
+struct perf_stage perf_batch; // io_uring: read -> write buffer cycles
 
-// save to file
-void save(io_context_t ctx, struct iocb *iocb, long res, long res2) {
-  if (res2)
-    FATAL("Error in async IO");
-  int rc = write_from_buffer("", out_fd, allocated, res, 0);
-  std::cout << res << "bytes saved\n";
-  if (rc < 0 || rc < res)
-    FATAL("Error writing output file");
+// writeback bookkeeping for data written by io_uring
+void written(void *arg, uint64_t end) {
+  sink_account(static_cast<struct sink *>(arg), end);
 }
 
 //
@@ -89,15 +87,31 @@ int main(int argc, char *argv[])
 {
   //
   signal(SIGINT, sigHandler);
+  lat_hist_report_on(SIGUSR1);
+  trace_toggle_on(SIGUSR2);
 
-  //
   long page_size = sysconf(_SC_PAGESIZE);
 
   std::string device;
   uint64_t count;
   std::string outfile;
+  std::string sink_mode_str;
   bool verbose = false;
+  std::string transport_str, engine;
+  int depth;
+  bool sqpoll = false;
   bool flush = false;
+  std::string hugepages;
+  std::string numa_str, pin_str, topology_root;
+  int rt_prio = 0;                // 0: no realtime mode
+  std::string wait_mode_str;
+  unsigned spin_us;
+  bool user_reap = false;
+  std::string log_level_str;
+  std::string latency_file, trace_file;
+  bool no_stats = false;
+  bool trace = false;
+  bool perf = false;
 
   po::options_description desc("Command options");
   desc.add_options()
@@ -107,100 +121,270 @@ int main(int argc, char *argv[])
     ("size,s", po::value<uint64_t>(&size)->default_value(SIZE_DEFAULT),"size (in 4096 bytes) of a single transfer")
     ("count,c", po::value<uint64_t>(&count)->default_value(COUNT_DEFAULT), "total number of transfers")
     ("output,o", po::value<std::string>(&outfile)->default_value(FILENAME_DEFAULT), "name of output file")
-    ("flush,e", po::bool_switch(&flush), "truncate mode");
+    ("sink", po::value<std::string>(&sink_mode_str)->default_value(SINK_MODE_DEFAULT), "output write mode: sync, direct, writeback, buffered or mmap")
+    ("transport,t", po::value<std::string>(&transport_str)->default_value(TRANSPORT_TOOL_DEFAULT), "transport: sync, aio, uring or splice")
+    ("depth,q", po::value<int>(&depth)->default_value(DEPTH_DEFAULT), "io_uring: buffers in flight, each cycling read -> write on its own (1: one read per transfer)")
+    ("sqpoll", po::bool_switch(&sqpoll), "io_uring: kernel side submission polling")
+    ("flush,e", po::bool_switch(&flush), "truncate mode")
+    ("wait-mode", po::value<std::string>(&wait_mode_str)->default_value(AIO_WAIT_DEFAULT), "completion wait: block, eventfd, poll or spin")
+    ("spin-us", po::value<unsigned>(&spin_us)->default_value(AIO_WAIT_SPIN_US_DEFAULT), "spin: busy-poll budget (us) before sleeping")
+    ("user-reap", po::bool_switch(&user_reap), "reap completions from the kernel's aio ring in user space")
+    ("log-level", po::value<std::string>(&log_level_str)->default_value(ALOG_LEVEL_DEFAULT), "error, warn, info or debug (-v: debug)")
+    ("no-stats", po::bool_switch(&no_stats), "do not publish live counters for jw_stat")
+    ("latency-file", po::value<std::string>(&latency_file), "save the latency histograms here at exit (merge with jw_lat_merge); SIGUSR1 prints them")
+    ("trace", po::bool_switch(&trace), "record the pipeline trace from the start; SIGUSR2 starts/stops it at any time")
+    ("trace-file", po::value<std::string>(&trace_file), "write the pipeline trace here, Chrome/Perfetto JSON (default /tmp/asio_from_dpu.<pid>.trace.json)")
+    ("perf", po::bool_switch(&perf), "count cycles, instructions, LLC/dTLB misses and context switches per stage (perf_event_open), per GB at exit")
+    ("numa", po::value<std::string>(&numa_str)->default_value("auto"), "staging buffers' numa node: auto (the device's), off or a node number")
+    ("pin", po::value<std::string>(&pin_str)->default_value("auto"), "transfer loop cpu: auto (next to the device's interrupts), off or a cpu number")
+    ("topology-root", po::value<std::string>(&topology_root)->default_value(TOPO_ROOT_DEFAULT), "root of the sysfs/proc tree the topology is read from")
+    ("realtime", po::value<int>(&rt_prio)->implicit_value(RT_PRIO_DEFAULT), "mlockall, pre-faulted stack, SCHED_FIFO transfer loop at this priority (default 50) on an isolated cpu")
+    ("hugepages", po::value<std::string>(&hugepages)->default_value(DMA_MEM_DEFAULT)->implicit_value("2m"), "staging buffers: off, 4k (pre-faulted, locked), 2m or 1g hugepages");
+
+  // the old name of --transport, still taken but not shown
+  po::options_description hidden;
+  hidden.add_options()
+    ("engine", po::value<std::string>(&engine));
+  po::options_description all;
+  all.add(desc).add(hidden);
 
   po::variables_map vm;
-  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::store(po::parse_command_line(argc, argv, all), vm);
   po::notify(vm);
 
   if (vm.count("help")) {
     std::cout << desc << "\n";
     return 0;
   }
+  if (vm.count("engine"))
+    transport_str = engine;
+
+  size_t huge_page;
+  if (dma_mem_parse(hugepages.c_str(), &huge_page) < 0) {
+    std::cout << "unknown hugepages size: " << hugepages << "\n";
+    return -EINVAL;
+  }
+  dma_mem_setup(huge_page);
+
+  TransportOptions opt;
+  TransportKind kind;
+  if (transport_parse(transport_str.c_str(), &kind) < 0) {
+    std::cout << "unknown transport: " << transport_str << "\n";
+    return -EINVAL;
+  }
+  if (aio_waiter_parse_mode(wait_mode_str.c_str(), &opt.wait_mode) < 0) {
+    std::cout << "unknown wait mode: " << wait_mode_str << "\n";
+    return -EINVAL;
+  }
+  enum alog_level log_level;
+  if (alog_parse_level(log_level_str.c_str(), &log_level) < 0) {
+    std::cout << "unknown log level: " << log_level_str << "\n";
+    return -EINVAL;
+  }
+  if (verbose)
+    log_level = ALOG_DEBUG;
+  LoopPlacement place;
+  if (place.parse(numa_str, pin_str, rt_prio) < 0) {
+    std::cout << "bad --numa or --pin: " << numa_str << ", " << pin_str << "\n";
+    return -EINVAL;
+  }
 
   // 
   size = size * page_size;
 
   //
-  if(flush)
-    dpu_fd = open(device.c_str(), O_RDWR | O_TRUNC);
-  else
-    dpu_fd = open(device.c_str(), O_RDWR);
-  if (dpu_fd < 0) {
+  DeviceChannel dev;
+  int err = dev.open(device, DeviceChannel::READ, flush);
+  if (err < 0) {
     std::cout << "can't open device node: " << device << "\n";
     return -EINVAL;
   }
+  place.setup(device.c_str(), topology_root);
 
   //
-  ssize_t rc = 0;
-  out_fd = open(outfile.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_SYNC, 0666);
-  if (out_fd < 0) {
+  enum sink_mode mode;
+  if (sink_parse_mode(sink_mode_str.c_str(), &mode) < 0) {
+    std::cout << "unknown sink mode: " << sink_mode_str << "\n";
+    return -EINVAL;
+  }
+  if (sink_open(&sink, outfile.c_str(), mode, 0) < 0) {
     std::cout << "unable to open output file: " << outfile << "\n";
-    rc = -EINVAL;
-    close(dpu_fd);
-    if (out_fd >= 0)
-      close(out_fd);
+    return -EINVAL;
   }
 
   //
-  posix_memalign((void **)&allocated, page_size, size);
-  if (!allocated) {
+  // what is in flight: depth buffers for io_uring, else one
+  int nbufs = kind == TransportKind::URING && depth > 1 ? depth : 1;
+  if (buf_pool_init(&pool, nbufs, size) < 0) {
     std::cout << "OOM " << size << "\n";
-    rc = -ENOMEM;
-    close(dpu_fd);
-    if (out_fd >= 0)
-      close(out_fd);
+    sink_close(&sink);
+    return -ENOMEM;
+  }
+
+  lat_hist_init(&lat_xfer, "%s submit->complete", device.c_str());
+  lat_hist_init(&lat_persist, "%s complete->persisted", device.c_str());
+  perf_stage_init(&perf_read, "%s read", device.c_str());
+  perf_stage_init(&perf_write, "%s write", outfile.c_str());
+  perf_stage_init(&perf_batch, "%s uring batches", device.c_str());
+  if (perf)
+    perf_stage_enable();
+
+  trace_init("asio_from_dpu", trace_file.c_str(), trace);
+  if (!no_stats) {
+    int err = stat_shm_create(&shm, "asio_from_dpu");
+    if (err < 0)
+      fprintf(stderr, "live counters: %s\n", strerror(-err));
+  }
+
+  // io_uring: registered buffers/files, depth buffers cycling read -> write
+  if (kind == TransportKind::URING && depth > 1) {
+#ifdef HAVE_LIBURING
+    struct uring_xfer xfer;
+    int dst_fds[] = {sink.fd};
+    int err = uring_xfer_init(&xfer, &pool, dev.fd(), dst_fds, 1, depth, sqpoll);
+    if (err == 0) {
+      if (huge_page)
+        dma_mem_report(device.c_str());
+      xfer.on_batch = written;
+      xfer.on_batch_arg = &sink;
+      xfer.lat_xfer = &lat_xfer;
+      xfer.lat_persist = &lat_persist;
+      uring_xfer_publish(&xfer, &shm, device.c_str());
+      place.enter();
+      perf_stage_begin();
+      int64_t done = uring_xfer_run(&xfer, count, &keepRunning);
+      place.leave();
+      perf_stage_end(&perf_batch, xfer.bytes);
+      if (done < 0)
+        std::cout << "io_uring transfer failed: " << strerror(-done) << "\n";
+      uring_xfer_report(&xfer, device.c_str());
+      place.report(device.c_str());
+      lat_hist_done(latency_file.c_str());
+      perf_stage_report();
+      stat_shm_remove(&shm);
+      uring_xfer_free(&xfer);
+
+      buf_pool_free(&pool);
+      sink_close(&sink);
+      trace_done();
+      sink_report(&sink);
+      return done < 0 ? 1 : 0;
+    }
+    std::cout << "io_uring init failed: " << strerror(-err) << ", falling back to libaio\n";
+#else
+    std::cout << "io_uring not built in, falling back to libaio\n";
+#endif
+    kind = TransportKind::AIO;
   }
 
+  // the other transfers: one transport call per block, one buffer
+  allocated = buf_pool_get(&pool)->data;
+  opt.spin_us = spin_us;
+  opt.user_reap = user_reap;
+  opt.sqpoll = sqpoll;
+  opt.running = &keepRunning;
+  opt.peer_fd = sink.fd;
+  opt.blksize = size;
+  bool zero_copy = kind == TransportKind::SPLICE;
+  if (zero_copy && mode != SINK_SYNC && mode != SINK_BUFFERED &&
+      mode != SINK_WRITEBACK) {
+    std::cout << "splice: " << sink_mode_str << " sink stages in user space, copying\n";
+    zero_copy = false;
+  }
+  std::unique_ptr<Transport> xfer = make_transport(kind, dev, opt, &err);
+  if (!xfer) {
+    std::cout << transport_str << " transport: " << strerror(-err) << ", falling back to sync\n";
+    xfer = make_transport(TransportKind::SYNC, dev, opt, &err);
+    zero_copy = false;
+  }
+  xfer->lat = &lat_xfer; // splice: device -> output in one call
+  xfer->publish(&shm, device.c_str());
+
+  if (huge_page)
+    dma_mem_report(device.c_str());
+
   //
   struct timespec ts_start, ts_end;
-  long total_time = 0;
-
-  io_context_t ctx;
-  memset(&ctx, 0, sizeof(ctx));
-  int maxEvents= 10;
-  IO_RUN(io_queue_init, maxEvents, &ctx);
-  /* This is the read job we asynchronously run */
-  iocb *job = (iocb *)new iocb[1];
-  struct timespec timeout = {0, 1000000};
+  uint64_t total_time = 0;
+  int transfers = 0;
+  uint64_t allocs = alloc_count();
 
+  alog_start(log_level, ALOG_RATE_DEFAULT);
+  alog_thread_init();
+  place.enter();
   for (int i = 0; i < count; i++) {
+    if (i == 1) // steady state from the second transfer on
+      allocs = alloc_count();
+    if (!zero_copy)
+      memset(allocated, 0, size);
     clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-    memset(allocated, 0, size);
-    io_prep_pread(job, dpu_fd, allocated, size, 0);
-    IO_RUN(io_submit, ctx, 1, &job);
-    struct io_event evt;
-    while (!io_getevents(ctx, 1, 1, &evt, &timeout) && keepRunning) {
-      std::cout << "waiting new data...\n";
+    ssize_t rc;
+    perf_stage_begin();
+    for (;;) {
+      if (zero_copy) {
+        rc = xfer->move(size);
+        if (rc < 0 && splice_xfer_unsupported(rc) && !xfer->bytes) {
+          alog(ALOG_WARN, "%s: no splice support (%s), copying\n", dev.name(), strerror(-rc));
+          zero_copy = false;
+          continue;
+        }
+      }
+      else
+        rc = xfer->read(allocated, size);
+      if (!keepRunning || !xfer->timed_out(rc))
+        break;
+      alog(ALOG_DEBUG, "waiting new data...\n");
     }
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    perf_stage_end(&perf_read, rc > 0 ? rc : 0);
 
     //
     if (!keepRunning) {
-      io_cancel(ctx, job, NULL);
-      std::cout << "grace exit\n";
+      alog(ALOG_INFO, "grace exit\n");
       break;
     }
+    if (rc < 0)
+      FATAL("Error in async IO: %s", strerror(-rc));
+    if (rc == 0) // end of a file standing in for the device
+      break;
 
-    save(ctx, evt.obj, evt.res, evt.res2);
+    perf_stage_begin();
+    int erc = zero_copy ? sink_account(&sink, sink.offset + rc)
+                        : sink_write(&sink, allocated, rc);
+    perf_stage_end(&perf_write, zero_copy ? 0 : rc);
+    alog(ALOG_DEBUG, "%ldbytes saved\n", rc);
+    if (erc < 0 || (!zero_copy && erc < rc))
+      FATAL("Error writing output file");
+    if (!zero_copy)
+      lat_hist_since(&lat_persist, xfer->done_ns);
 
     //
-    std::cout << "transfered counts: " << i << "\n";
+    alog(ALOG_DEBUG, "transfered counts: %d\n", i);
 
-    /* subtract the start time from the end time */
-    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+    /* device time only: the file write and the log line are not in it */
     timespec_sub(&ts_end, &ts_start);
-    total_time += ts_end.tv_nsec;
+    total_time += timespec_ns(&ts_end);
+    transfers++;
 	}
 
-  float avg_time = (float)total_time/(float)count;
-  float result = ((float)size)*1000/avg_time;
+  allocs = alloc_count() - allocs;
+  place.leave();
+  alog_stop();
+  float avg_time = transfers ? (float)total_time/(float)transfers : 0;
+  float result = avg_time > 0 ? ((float)size)*1000/avg_time : 0;
   std::cout << device << ": average BW = " << size << ", " << result << "\n";
+  alloc_count_report(device.c_str(), allocs);
+  place.report(device.c_str());
+  xfer->report(device.c_str());
+  lat_hist_done(latency_file.c_str());
+  perf_stage_report();
+  stat_shm_remove(&shm);
 
-  free(allocated);
-  close(out_fd);
-  close(dpu_fd);
+  buf_pool_free(&pool);
+  sink_close(&sink);
+  trace_done();
+  sink_report(&sink);
   
   return 0;
 }
-
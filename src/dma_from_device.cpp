@@ -0,0 +1,482 @@
+/*
+ * This file is part of the Xilinx DMA IP Core driver tool for Linux
+ *
+ * Copyright (c) 2016-present,  Xilinx, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under BSD-style license (found in the
+ * LICENSE file in the root directory of this source tree)
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "alloc_count.h"
+#include "alog.h"
+#include "buf_pool.h"
+#include "dma_mem.h"
+#include "dma_utils.h"
+#include "lat_hist.h"
+#include "placement.h"
+#include "stat_shm.h"
+#include "sink.h"
+#include "transport.h"
+
+#define DEVICE_NAME_DEFAULT "/dev/xdma0_c2h_0"
+#define SIZE_DEFAULT (4096)
+#define COUNT_DEFAULT (1)
+
+int verbose = 0;
+
+static struct option const long_opts[] = {
+	{"device", required_argument, NULL, 'd'},
+	{"address", required_argument, NULL, 'a'},
+	{"size", required_argument, NULL, 's'},
+	{"offset", required_argument, NULL, 'o'},
+	{"count", required_argument, NULL, 'c'},
+	{"file", required_argument, NULL, 'f'},
+	{"sink", required_argument, NULL, 'w'},
+	{"eop_flush", no_argument, NULL, 'e'},
+	{"help", no_argument, NULL, 'h'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"transport", required_argument, NULL, 't'},
+	{"hugepages", optional_argument, NULL, 'H'},
+	{"latency-file", required_argument, NULL, 'L'},
+	{"no-stats", no_argument, NULL, 'S'},
+	{"numa", required_argument, NULL, 'N'},
+	{"pin", required_argument, NULL, 'P'},
+	{"topology-root", required_argument, NULL, 'R'},
+	{"realtime", optional_argument, NULL, 'r'},
+	{0, 0, 0, 0}
+};
+
+static int test_dma(const char *devname, uint64_t addr,
+		uint64_t size, uint64_t offset, uint64_t count,
+                    const char *ofname, uint32_t);
+static int eop_flush = 0;
+static enum sink_mode sink_mode = SINK_SYNC;
+static TransportKind transport = TransportKind::SYNC;
+static size_t huge_page = 0;
+static const char *latency_file = NULL;
+static int no_stats = 0;
+static struct stat_shm shm;	/* live counters for jw_stat */
+static struct lat_hist lat_xfer;	/* transfer start -> all bytes read */
+static struct lat_hist lat_persist;	/* -> written to the output file */
+static LoopPlacement place;
+static const char *topology_root = TOPO_ROOT_DEFAULT;
+
+static void usage(const char *name)
+{
+	int i = 0;
+	fprintf(stdout, "%s\n\n", name);
+	fprintf(stdout, "usage: %s [OPTIONS]\n\n", name);
+	fprintf(stdout, "Read via SGDMA, optionally save output to a file\n\n");
+
+	fprintf(stdout, "  -%c (--%s) device (defaults to %s)\n",
+		long_opts[i].val, long_opts[i].name, DEVICE_NAME_DEFAULT);
+	i++;
+	fprintf(stdout, "  -%c (--%s) the start address on the AXI bus\n",
+	       long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) size of a single transfer in bytes, default %d.\n",
+		long_opts[i].val, long_opts[i].name, SIZE_DEFAULT);
+	i++;
+	fprintf(stdout, "  -%c (--%s) page offset of transfer\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) number of transfers, default is %d.\n",
+	       long_opts[i].val, long_opts[i].name, COUNT_DEFAULT);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) file to write the data of the transfers\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) file write mode: sync, direct, writeback, buffered or mmap, default %s\n",
+		long_opts[i].val, long_opts[i].name, SINK_MODE_DEFAULT);
+	i++;
+	fprintf(stdout,
+		 "  -%c (--%s) end dma when ST end-of-packet(eop) is rcved\n",
+		long_opts[i].val, long_opts[i].name);
+	fprintf(stdout,
+		 "\t\t* streaming only, ignored for memory-mapped channels\n");
+	fprintf(stdout,
+		 "\t\t* acutal # of bytes dma'ed could be smaller than specified\n");
+	i++;
+	fprintf(stdout, "  -%c (--%s) print usage help and exit\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) verbose output\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) device reads: sync, aio or uring, default %s\n",
+		long_opts[i].val, long_opts[i].name, TRANSPORT_DEFAULT);
+	i++;
+	fprintf(stdout,
+		"  -%c[SIZE] (--%s[=SIZE]) staging buffer pages: off, 4k (pre-faulted,\n"
+		"       locked), 2m or 1g hugepages; default %s, 2m if SIZE is omitted\n",
+		long_opts[i].val, long_opts[i].name, DMA_MEM_DEFAULT);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) save the per-transfer latency histograms to this file\n"
+		"       at exit (merge with jw_lat_merge); SIGUSR1 prints them\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) do not publish live counters for jw_stat\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) staging buffer's numa node: auto (the device's), off\n"
+		"       or a node number, default auto\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) transfer loop cpu: auto (next to the device's\n"
+		"       interrupts), off or a cpu number, default auto\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) root of the sysfs/proc tree the topology is read from,\n"
+		"       default %s\n",
+		long_opts[i].val, long_opts[i].name, TOPO_ROOT_DEFAULT);
+	i++;
+	fprintf(stdout,
+		"  -%c[PRIO] (--%s[=PRIO]) mlockall, pre-faulted stack, SCHED_FIFO\n"
+		"       transfer loop at PRIO (default %d) on an isolated cpu\n",
+		long_opts[i].val, long_opts[i].name, RT_PRIO_DEFAULT);
+	i++;
+
+	fprintf(stdout, "\nReturn code:\n");
+	fprintf(stdout, "  0: all bytes were dma'ed successfully\n");
+	fprintf(stdout, "     * with -e set, the bytes dma'ed could be smaller\n");
+	fprintf(stdout, "  < 0: error\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int cmd_opt;
+	const char *device = DEVICE_NAME_DEFAULT;
+	uint64_t address = 0;
+	uint64_t size = SIZE_DEFAULT;
+	uint64_t offset = 0;
+	uint64_t count = COUNT_DEFAULT;
+  uint32_t wait_us = 0;
+	char *ofname = NULL;
+	const char *numa = "auto", *pin = "auto";
+	int rt_prio = 0;	/* 0: no realtime mode */
+
+	lat_hist_report_on(SIGUSR1);
+	while ((cmd_opt = getopt_long(argc, argv, "vhet:H::c:f:d:a:k:s:o:u:w:L:SN:P:R:r::", long_opts,
+			    NULL)) != -1) {
+		switch (cmd_opt) {
+		case 0:
+			/* long option */
+			break;
+		case 'd':
+			/* device node name */
+			device = strdup(optarg);
+			break;
+		case 'a':
+			/* RAM address on the AXI bus in bytes */
+			address = getopt_integer(optarg);
+			break;
+		case 's':
+			/* RAM size in bytes */
+			size = getopt_integer(optarg);
+			break;
+		case 'o':
+			offset = getopt_integer(optarg) & 4095;
+			break;
+			/* count */
+		case 'c':
+			count = getopt_integer(optarg);
+			break;
+			/* count */
+		case 'f':
+			ofname = strdup(optarg);
+			break;
+			/* print usage help and exit */
+		case 'w':
+			if (sink_parse_mode(optarg, &sink_mode) < 0) {
+				fprintf(stderr, "unknown sink mode %s.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'e':
+			eop_flush = 1;
+			break;
+		case 't':
+			if (transport_parse(optarg, &transport) < 0 ||
+			    transport == TransportKind::SPLICE) {
+				fprintf(stderr, "unknown transport %s.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'H':
+			if (dma_mem_parse(optarg ? optarg : "2m", &huge_page) < 0) {
+				fprintf(stderr, "unknown hugepages size %s.\n", optarg);
+				exit(1);
+			}
+			dma_mem_setup(huge_page);
+			break;
+		case 'u':
+			wait_us = getopt_integer(optarg);
+			break;
+		case 'L':
+			latency_file = optarg;
+			break;
+		case 'S':
+			no_stats = 1;
+			break;
+		case 'N':
+			numa = optarg;
+			break;
+		case 'P':
+			pin = optarg;
+			break;
+		case 'R':
+			topology_root = optarg;
+			break;
+		case 'r':
+			rt_prio = optarg ? atoi(optarg) : RT_PRIO_DEFAULT;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+	if (place.parse(numa, pin, rt_prio) < 0) {
+		fprintf(stderr, "bad --numa or --pin: %s, %s.\n", numa, pin);
+		exit(1);
+	}
+	if (verbose)
+	fprintf(stdout,
+		"dev %s, addr 0x%lx, size 0x%lx, offset 0x%lx, "
+		"count %lu\n",
+		device, address, size, offset, count);
+
+	return test_dma(device, address, size, offset, count, ofname, wait_us);
+}
+
+static int test_dma(const char *devname, uint64_t addr,
+			uint64_t size, uint64_t offset, uint64_t count,
+                    const char *ofname, uint32_t wait_us)
+{
+	ssize_t rc = 0;
+	uint64_t i;
+	char *buffer = NULL;
+	char *allocated = NULL;
+	struct buf_pool pool = {0};
+	struct buf_item *item = NULL;
+	uint64_t allocs = 0;
+	struct timespec ts_start, ts_end;
+	int out_fd = -1;
+	struct sink sink;
+	DeviceChannel dev;
+	std::unique_ptr<Transport> xfer;
+	TransportOptions opt;
+	uint64_t total_time = 0;
+	uint64_t t_done;
+	float result;
+	float avg_time = 0;
+	int underflow = 0;
+	int mapped = 0;
+	int err;
+
+	/*
+	 * O_TRUNC tells the driver to flush the data up based on EOP
+	 * (end-of-packet), streaming mode only
+	 */
+	err = dev.open(devname, DeviceChannel::READ, eop_flush);
+	if (err < 0) {
+                fprintf(stderr, "unable to open device %s, %s.\n",
+                        devname, strerror(-err));
+                return -EINVAL;
+  }
+	dev.set_address(addr);
+	place.setup(devname, topology_root);
+	xfer = make_transport(transport, dev, opt, &err);
+	if (!xfer) {
+		fprintf(stderr, "%s: %s transport: %s, using sync\n", devname,
+			transport_name(transport), strerror(-err));
+		xfer = make_transport(TransportKind::SYNC, dev, opt, &err);
+	}
+
+	/* create file to write data to */
+	if (ofname) {
+		rc = sink_open(&sink, ofname, sink_mode, 0);
+		if (rc < 0) {
+      fprintf(stderr, "unable to open output file %s, %s.\n",
+              ofname, strerror(-rc));
+      rc = -EINVAL;
+      goto out;
+    }
+		out_fd = sink.fd;
+		mapped = sink.mode == SINK_MMAP;
+	}
+
+	/* data plus a guard page, the page offset fits in the guard page */
+	if (buf_pool_init(&pool, 1, size) == 0 &&
+	    (item = buf_pool_get(&pool)))
+		allocated = item->data;
+	if (!allocated) {
+		fprintf(stderr, "OOM %lu.\n", size + 4096);
+		rc = -ENOMEM;
+		goto out;
+	}
+	if (huge_page)
+		dma_mem_report(devname);
+
+	buffer = allocated + offset;
+	if (verbose)
+	fprintf(stdout, "host buffer 0x%lx, %p.\n", size + 4096, buffer);
+
+	lat_hist_init(&lat_xfer, "%s submit->complete", devname);
+	lat_hist_init(&lat_persist, "%s complete->persisted", devname);
+
+	if (!no_stats) {
+		int err = stat_shm_create(&shm, "dma_from_device");
+		if (err < 0)
+			fprintf(stderr, "live counters: %s\n", strerror(-err));
+	}
+	xfer->publish(&shm, devname);
+
+	/* the transfer loop only logs through alog */
+	alog_start(verbose ? ALOG_DEBUG : ALOG_INFO, ALOG_RATE_DEFAULT);
+	alog_thread_init();
+	place.enter();
+
+	for (i = 0; i < count; i++) {
+		if (i == 1) /* steady state from the second transfer on */
+			allocs = alloc_count();
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    //
+    uint64_t bytes_done = 0;
+    char* buf=buffer;
+    int loop = 0;
+
+    while(bytes_done < size) {
+      uint64_t bytes = size - bytes_done;
+      char *dst = buf;
+
+      /* mmap sink: the device reads straight into the output file */
+      if (mapped) {
+        size_t avail;
+        dst = sink_reserve(&sink, bytes, &avail);
+        if (!dst) {
+          perror("map output file");
+          rc = -errno;
+          goto out;
+        }
+        bytes = avail;
+      }
+
+      rc = xfer->read(dst, bytes);
+      if (rc < 0) { // ignore the any error and continue 
+        /* goto out; */
+        alog(ALOG_WARN, "%s: wait new data ...\n", devname);
+        continue;
+    }
+      if (rc == 0 && !dev.is_stream()) // end of a file standing in for the device
+        break;
+
+      if ((uint64_t)rc != bytes) { // underflow is not error
+        alog(ALOG_WARN, "%s (loop-%d), read underflow 0x%lx/0x%lx @ 0x%lx.\n",
+             devname, loop, rc, bytes, offset);
+      }
+
+      if (mapped) {
+        int err = sink_commit(&sink, rc);
+        if (err < 0) {
+          rc = err;
+          goto out;
+        }
+      }
+
+      bytes_done += rc;
+      buf +=rc;
+      loop++;
+    }
+
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		t_done = timespec_ns(&ts_end);
+
+    alog(ALOG_INFO, "%s (loop-%d, the end), read 0x%lx/0x%lx.\n",
+         devname, loop, bytes_done, size);
+
+		/* subtract the start time from the end time */
+		timespec_sub(&ts_end, &ts_start);
+		total_time += timespec_ns(&ts_end);
+		lat_hist_record(&lat_xfer, timespec_ns(&ts_end));
+
+		/* a bit less accurate but side-effects are accounted for */
+		alog(ALOG_DEBUG,
+		     "#%lu: CLOCK_MONOTONIC %ld.%09ld sec. read %ld/%ld bytes\n",
+		     i, ts_end.tv_sec, ts_end.tv_nsec, bytes_done, size);
+
+		/* file argument given? */
+		if (out_fd >= 0 && !mapped) {
+			rc = sink_write(&sink, buffer, bytes_done);
+			if (rc < 0 || (uint64_t)rc < bytes_done)
+				goto out;
+			lat_hist_since(&lat_persist, t_done);
+		}
+
+    //
+    if(wait_us) usleep(wait_us);
+	}
+	place.leave();
+	alog_stop();
+
+	if (!underflow) {
+		avg_time = (float)total_time/(float)count;
+		result = ((float)size)*1000/avg_time;
+		if (verbose)
+			printf("** Avg time device %s, total time %lu nsec, avg_time = %f, size = %lu, BW = %f \n",
+				devname, total_time, avg_time, size, result);
+		printf("%s ** Average BW = %lu, %f\n", devname, size, result);
+		rc = 0;
+	} else if (eop_flush) {
+		/* allow underflow with -e option */
+		rc = 0;
+	} else 
+		rc = -EIO;
+
+out:
+	place.leave();
+	alog_stop();
+	allocs = alloc_count() - allocs;
+	alloc_count_report(devname, allocs);
+	place.report(devname);
+	lat_hist_done(latency_file);
+	stat_shm_remove(&shm);
+	xfer->report(devname);
+	if (out_fd >= 0) {
+		sink_close(&sink);
+		sink_report(&sink);
+	}
+	buf_pool_free(&pool);
+
+	return rc;
+}
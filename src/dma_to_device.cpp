@@ -0,0 +1,486 @@
+/*
+ * This file is part of the Xilinx DMA IP Core driver tools for Linux
+ *
+ * Copyright (c) 2016-present,  Xilinx, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under BSD-style license (found in the
+ * LICENSE file in the root directory of this source tree)
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "alloc_count.h"
+#include "alog.h"
+#include "buf_pool.h"
+#include "dma_mem.h"
+#include "dma_utils.h"
+#include "lat_hist.h"
+#include "splice_xfer.h"
+#include "stat_shm.h"
+#include "transport.h"
+
+int verbose = 0;
+
+static struct option const long_opts[] = {
+	{"device", required_argument, NULL, 'd'},
+	{"address", required_argument, NULL, 'a'},
+	{"size", required_argument, NULL, 's'},
+	{"offset", required_argument, NULL, 'o'},
+	{"count", required_argument, NULL, 'c'},
+	{"data infile", required_argument, NULL, 'f'},
+	{"data outfile", required_argument, NULL, 'w'},
+	{"interval", required_argument, NULL, '1'},
+	{"help", no_argument, NULL, 'h'},
+	{"verbose", no_argument, NULL, 'v'},
+	{"transport", required_argument, NULL, 't'},
+	{"splice", no_argument, NULL, 'p'},
+	{"hugepages", optional_argument, NULL, 'H'},
+	{"latency-file", required_argument, NULL, 'L'},
+	{"no-stats", no_argument, NULL, 'S'},
+	{0, 0, 0, 0}
+};
+
+#define DEVICE_NAME_DEFAULT "/dev/xdma0_h2c_0"
+#define SIZE_DEFAULT (32)
+#define COUNT_DEFAULT (1)
+
+static size_t huge_page = 0;
+static const char *latency_file = NULL;
+static int no_stats = 0;
+static struct stat_shm shm;	/* live counters for jw_stat */
+static struct lat_hist lat_xfer;	/* transfer start -> all bytes written */
+
+
+static int test_dma(const char *devname, uint64_t addr,
+		    uint64_t size, uint64_t offset, uint64_t count,
+                    const char *filename, const char *, uint32_t,
+                    TransportKind);
+
+static void usage(const char *name)
+{
+	int i = 0;
+
+	fprintf(stdout, "%s\n\n", name);
+	fprintf(stdout, "usage: %s [OPTIONS]\n\n", name);
+	fprintf(stdout, 
+		"Write via SGDMA, optionally read input from a file.\n\n");
+
+	fprintf(stdout, "  -%c (--%s) device (defaults to %s)\n",
+		long_opts[i].val, long_opts[i].name, DEVICE_NAME_DEFAULT);
+	i++;
+	fprintf(stdout, "  -%c (--%s) the start address on the AXI bus\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) size of a single transfer in bytes, default %d,\n",
+		long_opts[i].val, long_opts[i].name, SIZE_DEFAULT);
+	i++;
+	fprintf(stdout, "  -%c (--%s) page offset of transfer\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) number of transfers, default %d\n",
+		long_opts[i].val, long_opts[i].name, COUNT_DEFAULT);
+	i++;
+	fprintf(stdout, "  -%c (--%s) filename to read the data from.\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) filename to write the data of the transfers\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) print usage help and exit\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) verbose output\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) device writes: sync, aio, uring or splice (as -p),\n"
+		"       default %s\n",
+		long_opts[i].val, long_opts[i].name, TRANSPORT_DEFAULT);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) move the input file ('-': stdin) to the device with splice,\n"
+		"       no user space copy; falls back to read/write when unsupported\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout,
+		"  -%c[SIZE] (--%s[=SIZE]) staging buffer pages: off, 4k (pre-faulted,\n"
+		"       locked), 2m or 1g hugepages; default %s, 2m if SIZE is omitted\n",
+		long_opts[i].val, long_opts[i].name, DMA_MEM_DEFAULT);
+	i++;
+	fprintf(stdout,
+		"  -%c (--%s) save the per-transfer latency histograms to this file\n"
+		"       at exit (merge with jw_lat_merge); SIGUSR1 prints them\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+	fprintf(stdout, "  -%c (--%s) do not publish live counters for jw_stat\n",
+		long_opts[i].val, long_opts[i].name);
+	i++;
+
+	fprintf(stdout, "\nReturn code:\n");
+	fprintf(stdout, "  0: all bytes were dma'ed successfully\n");
+	fprintf(stdout, "  < 0: error\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int cmd_opt;
+	const char *device = DEVICE_NAME_DEFAULT;
+	uint64_t address = 0;
+	uint64_t size = SIZE_DEFAULT;
+	uint64_t offset = 0;
+	uint64_t count = COUNT_DEFAULT;
+	char *infname = NULL;
+	char *ofname = NULL;
+  uint32_t wait_us = 0;
+	TransportKind kind = TransportKind::SYNC;
+
+	lat_hist_report_on(SIGUSR1);
+	while ((cmd_opt =
+		getopt_long(argc, argv, "vhpt:H::c:f:d:a:k:s:o:w:u:L:S", long_opts,
+			    NULL)) != -1) {
+		switch (cmd_opt) {
+		case 0:
+			/* long option */
+			break;
+		case 'd':
+			/* device node name */
+			//fprintf(stdout, "'%s'\n", optarg);
+			device = strdup(optarg);
+			break;
+		case 'a':
+			/* RAM address on the AXI bus in bytes */
+			address = getopt_integer(optarg);
+			break;
+		case 's':
+			/* size in bytes */
+			size = getopt_integer(optarg);
+			break;
+		case 'o':
+			offset = getopt_integer(optarg) & 4095;
+			break;
+			/* count */
+		case 'c':
+			count = getopt_integer(optarg);
+			break;
+			/* count */
+		case 'f':
+			infname = strdup(optarg);
+			break;
+		case 'w':
+			ofname = strdup(optarg);
+			break;
+			/* print usage help and exit */
+		case 'u':
+			wait_us = getopt_integer(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 't':
+			if (transport_parse(optarg, &kind) < 0) {
+				fprintf(stderr, "unknown transport %s.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			kind = TransportKind::SPLICE;
+			break;
+		case 'H':
+			if (dma_mem_parse(optarg ? optarg : "2m", &huge_page) < 0) {
+				fprintf(stderr, "unknown hugepages size %s.\n", optarg);
+				exit(1);
+			}
+			dma_mem_setup(huge_page);
+			break;
+		case 'L':
+			latency_file = optarg;
+			break;
+		case 'S':
+			no_stats = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+
+	if (verbose)
+		fprintf(stdout, 
+		"dev %s, addr 0x%lx, size 0x%lx, offset 0x%lx, "
+	        "count %lu\n",
+		device, address, size, offset, count);
+
+	return test_dma(device, address, size, offset, count,
+                  infname, ofname, wait_us, kind);
+}
+
+/* input -> device without a user space copy, stops early at end of input */
+static ssize_t splice_to_device(Transport *x, uint64_t size, uint64_t *moved)
+{
+	while (*moved < size) {
+		ssize_t rc = x->move(size - *moved);
+		if (rc <= 0)
+			return rc;
+		*moved += rc;
+	}
+	return 0;
+}
+
+static int test_dma(const char *devname, uint64_t addr,
+		    uint64_t size, uint64_t offset, uint64_t count,
+                    const char *infname, const char *ofname, uint32_t wait_us,
+                    TransportKind kind)
+{
+	uint64_t i;
+	ssize_t rc = 0;
+	size_t out_offset = 0;
+	char *buffer = NULL;
+	char *allocated = NULL;
+	struct buf_pool pool = {0};
+	struct buf_item *item = NULL;
+	uint64_t allocs = 0;
+	struct timespec ts_start, ts_end;
+	int infile_fd = -1;
+	int outfile_fd = -1;
+	DeviceChannel dev;
+	std::unique_ptr<Transport> xfer;
+	TransportOptions opt;
+	uint64_t total_time = 0;
+	float result;
+	float avg_time = 0;
+	int underflow = 0;
+	int splice_on = 0;
+	const char *data_path = "copy";
+	int err;
+
+	err = dev.open(devname, DeviceChannel::WRITE);
+	if (err < 0) {
+		fprintf(stderr, "unable to open device %s, %s.\n",
+			devname, strerror(-err));
+		return -EINVAL;
+	}
+	dev.set_address(addr);
+
+	if (infname && !strcmp(infname, "-")) {
+		infile_fd = STDIN_FILENO;
+	} else if (infname) {
+		infile_fd = open(infname, O_RDONLY);
+		if (infile_fd < 0) {
+			fprintf(stderr, "unable to open input file %s, %d.\n",
+				infname, infile_fd);
+			perror("open input file");
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (ofname) {
+		outfile_fd =
+		    open(ofname, O_RDWR | O_CREAT | O_TRUNC | O_SYNC,
+			 0666);
+		if (outfile_fd < 0) {
+			fprintf(stderr, "unable to open output file %s, %d.\n",
+				ofname, outfile_fd);
+			perror("open output file");
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+
+  // buffer allocation
+	/* data plus a guard page, the page offset fits in the guard page */
+	if (buf_pool_init(&pool, 1, size) == 0 &&
+	    (item = buf_pool_get(&pool)))
+		allocated = item->data;
+	if (!allocated) {
+		fprintf(stderr, "OOM %lu.\n", size + 4096);
+		rc = -ENOMEM;
+		goto out;
+	}
+	if (huge_page)
+		dma_mem_report(devname);
+	buffer = allocated + offset;
+
+	if (verbose)
+		fprintf(stdout, "host buffer 0x%lx = %p\n",
+			size + 4096, buffer);
+
+	/* the output file copy needs the data in user space anyway */
+	if (kind == TransportKind::SPLICE) {
+		if (infile_fd < 0)
+			data_path = "copy (splice: no input file)";
+		else if (outfile_fd >= 0)
+			data_path = "copy (splice: output file given)";
+		else
+			splice_on = 1;
+		if (!splice_on)
+			kind = TransportKind::SYNC;
+	}
+	opt.peer_fd = infile_fd;
+	opt.blksize = size;
+	xfer = make_transport(kind, dev, opt, &err);
+	if (!xfer) {
+		fprintf(stderr, "%s: %s transport: %s, using sync\n", devname,
+			transport_name(kind), strerror(-err));
+		if (splice_on)
+			data_path = "copy (splice: no pipe)";
+		splice_on = 0;
+		xfer = make_transport(TransportKind::SYNC, dev, opt, &err);
+	}
+
+	lat_hist_init(&lat_xfer, "%s submit->complete", devname);
+
+	if (!no_stats) {
+		int err = stat_shm_create(&shm, "dma_to_device");
+		if (err < 0)
+			fprintf(stderr, "live counters: %s\n", strerror(-err));
+	}
+	xfer->publish(&shm, devname);
+
+	/* the transfer loop only logs through alog */
+	alog_start(verbose ? ALOG_DEBUG : ALOG_INFO, ALOG_RATE_DEFAULT);
+	alog_thread_init();
+	for (i = 0; i < count; i++) {
+		if (i == 1) /* steady state from the second transfer on */
+			allocs = alloc_count();
+		uint64_t moved = 0;
+
+		if (splice_on) {
+			clock_gettime(CLOCK_MONOTONIC, &ts_start);
+			rc = splice_to_device(xfer.get(), size, &moved);
+			if (rc < 0 && splice_xfer_unsupported(rc)) {
+				/* the rest of this transfer and all later ones copy */
+				fprintf(stderr, "%s: no splice support (%s), using read/write\n",
+					devname, strerror(-rc));
+				data_path = "copy (no splice)";
+				splice_on = 0;
+			} else if (rc < 0) {
+				perror("splice");
+				goto out;
+			} else if (moved < size) {
+				goto out;
+			} else {
+				data_path = "splice";
+			}
+		}
+
+		if (moved < size) {
+			uint64_t got = moved;
+
+			while (infile_fd >= 0 && got < size) {
+				rc = read_to_buffer(infname, infile_fd, buffer + got,
+						    size - got, 0);
+				if (rc <= 0)
+					break;
+				got += rc;
+			}
+			if (infile_fd >= 0 && got < size)
+				goto out;
+		}
+
+		/* write buffer to AXI MM address using SGDMA */
+		if (!moved)
+			rc = clock_gettime(CLOCK_MONOTONIC, &ts_start);
+
+    //
+    uint64_t bytes_done = moved;
+    char* buf=buffer + moved;
+    int loop = 0;
+
+    while(bytes_done < size) {
+      
+      uint64_t bytes = size - bytes_done;
+      rc = xfer->write(buf, bytes);
+      if (rc < 0) {
+        alog(ALOG_WARN, "%s: write more data ...\n", devname);
+        /* goto out; */
+        continue;
+      }
+      
+      if ((uint64_t)rc != bytes) { // underflow is not error
+        alog(ALOG_WARN, "%s (loop-%d), write underflow 0x%lx/0x%lx.\n",
+             devname, loop, rc, bytes);
+      }
+
+      bytes_done += rc;
+      buf += rc;
+      loop++;
+    }
+
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    alog(ALOG_INFO, "%s (loop-%d, the end), write 0x%lx/0x%lx.\n",
+         devname, loop, bytes_done, size);
+
+		/* subtract the start time from the end time */
+		timespec_sub(&ts_end, &ts_start);
+		total_time += timespec_ns(&ts_end);
+		lat_hist_record(&lat_xfer, timespec_ns(&ts_end));
+
+		/* a bit less accurate but side-effects are accounted for */
+		alog(ALOG_DEBUG,
+		     "#%lu: CLOCK_MONOTONIC %ld.%09ld sec. write %ld bytes\n",
+		     i, ts_end.tv_sec, ts_end.tv_nsec, size);
+			
+		if (outfile_fd >= 0) {
+			rc = write_from_buffer(ofname, outfile_fd, buffer,
+						 bytes_done, out_offset);
+			if (rc < 0 || (uint64_t)rc < bytes_done)
+				goto out;
+			out_offset += bytes_done;
+		}
+
+    //
+    if(wait_us) usleep(wait_us);
+	}
+	alog_stop();
+
+	if (!underflow) {
+		avg_time = (float)total_time/(float)count;
+		result = ((float)size)*1000/avg_time;
+		if (verbose)
+			printf("** Avg time device %s, total time %lu nsec, avg_time = %f, size = %lu, BW = %f \n",
+			devname, total_time, avg_time, size, result);
+		printf("%s ** Average BW = %lu, %f\n", devname, size, result);
+	}
+
+out:
+	alog_stop();
+	allocs = alloc_count() - allocs;
+	alloc_count_report(devname, allocs);
+	lat_hist_done(latency_file);
+	stat_shm_remove(&shm);
+	printf("%s ** Data path: %s\n", devname, data_path);
+	if (xfer)
+		xfer->report(devname);
+	if (infile_fd > STDIN_FILENO)
+		close(infile_fd);
+	if (outfile_fd >= 0)
+		close(outfile_fd);
+	buf_pool_free(&pool);
+
+	if (rc < 0)
+		return rc;
+	/* treat underflow as error */
+	return underflow ? -EIO : 0;
+}
@@ -0,0 +1,713 @@
+// dpu_bench: DMA data path throughput and latency, swept over block size x
+// queue depth x transport x sink mode x threads against an xdma node, a
+// regular file or a FIFO; one CSV line / JSON object per repetition
+#include <errno.h>
+#include <fcntl.h>
+#include <libaio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dma_mem.h"
+#include "sink.h"
+#include "transport.h"
+
+namespace po = boost::program_options;
+
+#define BS_DEFAULT "4k,64k,1m"
+#define LENGTH_DEFAULT "64m"
+#define WARMUP_DEFAULT "8m"
+#define REPS_DEFAULT 3
+#define MAX_TIME_DEFAULT 30
+
+static volatile sig_atomic_t keepRunning = 1;
+
+static void sigHandler(int)
+{
+  keepRunning = 0;
+}
+
+/* one point of the sweep */
+struct config {
+  bool write;                   // buffer -> node (h2c), else node -> sink
+  TransportKind kind;
+  size_t bs;
+  unsigned qd;
+  std::string sink;             // "none" or a sink mode
+  unsigned threads;
+};
+
+/* one thread's node, buffers and output */
+struct worker {
+  unsigned index;
+  DeviceChannel dev;
+  std::unique_ptr<Transport> xfer; // qd 1, after dev: released first
+  io_context_t ctx = 0;            // qd > 1 on aio
+#ifdef HAVE_LIBURING
+  struct io_uring ring;            // qd > 1 on uring
+  bool ring_ready = false;
+#endif
+  char *mem = nullptr;             // qd buffers of bs bytes
+  std::string out_name;
+  bool has_sink = false;
+  struct sink sink = {};
+  int null_fd = -1;                // splice without an output
+  uint64_t size = 0;               // seekable node: reads wrap here
+  uint64_t pos = 0;                // qd > 1: next offset on a seekable node
+
+  /* statistics of the current run */
+  std::vector<uint32_t> lat_ns;
+  uint64_t bytes = 0;
+  uint64_t transfers = 0;
+  uint64_t timeouts = 0;
+  int error = 0;
+
+  ~worker()
+  {
+    xfer.reset();
+    if (ctx)
+      io_destroy(ctx);
+#ifdef HAVE_LIBURING
+    if (ring_ready)
+      io_uring_queue_exit(&ring);
+#endif
+    if (has_sink)
+      sink_close(&sink);
+    if (null_fd >= 0)
+      close(null_fd);
+    if (mem)
+      dma_mem_free(mem);
+  }
+};
+
+struct result {
+  uint64_t bytes;
+  uint64_t transfers;
+  uint64_t timeouts;
+  int error;
+  double secs;
+  double cpu_secs;
+  double p50_us, p99_us, p999_us;
+};
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double cpu_secs(const struct rusage &ru)
+{
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* "4k,64k,1m" */
+static int parse_sizes(const std::string &str, std::vector<uint64_t> *out)
+{
+  std::stringstream ss(str);
+  std::string item;
+
+  while (std::getline(ss, item, ',')) {
+    char *end;
+    uint64_t v = strtoull(item.c_str(), &end, 0);
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (item.empty() || *end || !v)
+      return -EINVAL;
+    out->push_back(v);
+  }
+  return out->empty() ? -EINVAL : 0;
+}
+
+static std::vector<std::string> split(const std::string &str)
+{
+  std::vector<std::string> out;
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    out.push_back(item);
+  return out;
+}
+
+/* "%u" in a node or output name stands for the thread index */
+static std::string thread_name(const std::string &pattern, unsigned index)
+{
+  std::string name = pattern;
+  size_t pos = name.find("%u");
+  if (pos != std::string::npos)
+    name.replace(pos, 2, std::to_string(index));
+  return name;
+}
+
+static void done(worker &w, uint64_t ns, ssize_t n)
+{
+  w.lat_ns.push_back(std::min<uint64_t>(ns, UINT32_MAX));
+  w.bytes += n;
+  w.transfers++;
+}
+
+static int to_sink(worker &w, const config &c, const char *buf, ssize_t n)
+{
+  if (c.write || !w.has_sink)
+    return 0;
+  if (c.kind == TransportKind::SPLICE)
+    return sink_account(&w.sink, w.sink.offset + n);
+  ssize_t rc = sink_write(&w.sink, buf, n);
+  return rc < 0 ? rc : 0;
+}
+
+/* qd 1: one transfer at a time through the tools' transports */
+static void run_single(worker &w, const config &c, uint64_t len,
+                       uint64_t deadline)
+{
+  while (w.bytes < len && keepRunning) {
+    uint64_t t0 = now_ns();
+    ssize_t rc = c.kind == TransportKind::SPLICE ? w.xfer->move(c.bs)
+               : c.write ? w.xfer->write(w.mem, c.bs)
+               : w.xfer->read(w.mem, c.bs);
+    uint64_t t1 = now_ns();
+
+    if (rc > 0) {
+      done(w, t1 - t0, rc);
+      if ((w.error = to_sink(w, c, w.mem, rc)) < 0)
+        return;
+    }
+    else if (rc == 0 && !c.write && w.dev.is_seekable()) {
+      if ((w.error = w.dev.rewind()) < 0) // a file shorter than the run
+        return;
+    }
+    else if (w.xfer->timed_out(rc))
+      w.timeouts++;
+    else {
+      w.error = rc;                       // 0: the FIFO's writer is gone
+      return;
+    }
+    if (t1 > deadline)
+      return;
+  }
+}
+
+/* qd > 1: where the next request goes, wrapping around a file's end */
+static uint64_t next_offset(worker &w, const config &c)
+{
+  if (!w.dev.is_seekable())
+    return w.dev.address();
+  if (!c.write && w.pos + c.bs > w.size)
+    w.pos = 0;
+  uint64_t off = w.pos;
+  w.pos += c.bs;
+  return off;
+}
+
+/*
+ * qd > 1: `qd` requests in flight, retired in submission order so the
+ * sink gets the data in device order; latency is submit to completion
+ */
+struct slot {
+  uint64_t t_submit;
+  long res;
+  bool done;
+};
+
+/* a retired request; false once the run has to stop */
+static bool retire(worker &w, const config &c, const slot &s, const char *buf,
+                   uint64_t *requested)
+{
+  if (s.res > 0) {
+    if ((size_t)s.res < c.bs)
+      *requested -= c.bs - s.res;         // short: ask for the rest again
+    if ((w.error = to_sink(w, c, buf, s.res)) < 0)
+      return false;
+    return true;
+  }
+  *requested -= c.bs;
+  if (s.res == 0 ? w.dev.is_stream() || w.dev.is_seekable()
+                 : s.res == -EIO || s.res == -ETIMEDOUT || s.res == -EAGAIN ||
+                   s.res == -EINTR) {
+    w.timeouts++;
+    return true;
+  }
+  w.error = s.res;
+  return false;
+}
+
+static void run_aio(worker &w, const config &c, uint64_t len,
+                    uint64_t deadline)
+{
+  unsigned qd = c.qd;
+  std::vector<struct iocb> iocbs(qd);
+  std::vector<struct io_event> events(qd);
+  std::vector<slot> slots(qd);
+  uint64_t head = 0, tail = 0, requested = 0;
+  bool stop = false;
+
+  for (;;) {
+    while (!stop && tail - head < qd && requested < len && keepRunning) {
+      unsigned k = tail % qd;
+      struct iocb *cb = &iocbs[k];
+      if (c.write)
+        io_prep_pwrite(cb, w.dev.fd(), w.mem + k * c.bs, c.bs,
+                       next_offset(w, c));
+      else
+        io_prep_pread(cb, w.dev.fd(), w.mem + k * c.bs, c.bs,
+                      next_offset(w, c));
+      cb->data = (void *)(uintptr_t)k;
+      slots[k].done = false;
+      slots[k].t_submit = now_ns();
+      int rc = io_submit(w.ctx, 1, &cb);
+      if (rc < 0) {
+        w.error = rc;
+        stop = true;
+        break;
+      }
+      tail++;
+      requested += c.bs;
+    }
+    if (head == tail)
+      return;
+
+    struct timespec timeout = {0, 100000000}; // to notice the deadline
+    int n = io_getevents(w.ctx, 1, qd, events.data(), &timeout);
+    if (n < 0 && n != -EINTR) {
+      w.error = n;
+      return;                             // requests may still be in flight
+    }
+    uint64_t t = now_ns();
+    for (int i = 0; i < n; i++) {
+      slot &s = slots[(uintptr_t)events[i].data];
+      s.res = events[i].res;
+      s.done = true;
+      if (s.res > 0)
+        done(w, t - s.t_submit, s.res);
+    }
+    while (head < tail && slots[head % qd].done) {
+      unsigned k = head++ % qd;
+      if (!retire(w, c, slots[k], w.mem + k * c.bs, &requested))
+        stop = true;
+    }
+    if (t > deadline || !keepRunning)
+      stop = true;
+  }
+}
+
+#ifdef HAVE_LIBURING
+static void run_uring(worker &w, const config &c, uint64_t len,
+                      uint64_t deadline)
+{
+  unsigned qd = c.qd;
+  std::vector<slot> slots(qd);
+  uint64_t head = 0, tail = 0, requested = 0;
+  bool stop = false;
+
+  for (;;) {
+    while (!stop && tail - head < qd && requested < len && keepRunning) {
+      unsigned k = tail % qd;
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&w.ring);
+      if (c.write)
+        io_uring_prep_write(sqe, w.dev.fd(), w.mem + k * c.bs, c.bs,
+                            next_offset(w, c));
+      else
+        io_uring_prep_read(sqe, w.dev.fd(), w.mem + k * c.bs, c.bs,
+                           next_offset(w, c));
+      io_uring_sqe_set_data(sqe, (void *)(uintptr_t)k);
+      slots[k].done = false;
+      slots[k].t_submit = now_ns();
+      tail++;
+      requested += c.bs;
+    }
+    if (head == tail)
+      return;
+
+    /* xdma reads time out by themselves, a wait always ends */
+    int rc = io_uring_submit_and_wait(&w.ring, 1);
+    if (rc < 0 && rc != -EINTR) {
+      w.error = rc;
+      return;
+    }
+    struct io_uring_cqe *cqe;
+    uint64_t t = now_ns();
+    while (io_uring_peek_cqe(&w.ring, &cqe) == 0) {
+      slot &s = slots[(uintptr_t)io_uring_cqe_get_data(cqe)];
+      s.res = cqe->res;
+      s.done = true;
+      io_uring_cqe_seen(&w.ring, cqe);
+      if (s.res > 0)
+        done(w, t - s.t_submit, s.res);
+    }
+    while (head < tail && slots[head % qd].done) {
+      unsigned k = head++ % qd;
+      if (!retire(w, c, slots[k], w.mem + k * c.bs, &requested))
+        stop = true;
+    }
+    if (t > deadline || !keepRunning)
+      stop = true;
+  }
+}
+#endif
+
+static void run_worker(worker &w, const config &c, uint64_t len,
+                       uint64_t deadline)
+{
+  if (c.qd > 1 && c.kind == TransportKind::AIO)
+    run_aio(w, c, len, deadline);
+#ifdef HAVE_LIBURING
+  else if (c.qd > 1)
+    run_uring(w, c, len, deadline);
+#endif
+  else
+    run_single(w, c, len, deadline);
+}
+
+/* why a point of the sweep cannot run, NULL if it can */
+static const char *unsupported(const config &c)
+{
+  if (c.qd > 1 && c.kind != TransportKind::AIO &&
+      c.kind != TransportKind::URING)
+    return "queue depth > 1 needs aio or uring";
+  if (c.kind == TransportKind::SPLICE && c.write)
+    return "splice: reads only";
+  if (c.kind == TransportKind::SPLICE && c.sink == "mmap")
+    return "splice: no mmap sink";
+#ifndef HAVE_LIBURING
+  if (c.kind == TransportKind::URING)
+    return "no io_uring in this build";
+#endif
+  return NULL;
+}
+
+static int setup(worker &w, const config &c, const std::string &node,
+                 const std::string &output)
+{
+  int err;
+
+  err = w.dev.open(thread_name(node, w.index),
+                   c.write ? DeviceChannel::WRITE : DeviceChannel::READ);
+  if (err < 0)
+    return err;
+  if (w.dev.is_seekable() && !c.write) {
+    struct stat st;
+    if (fstat(w.dev.fd(), &st) < 0)
+      return -errno;
+    w.size = st.st_size;
+    if (w.size < c.bs)
+      return -EINVAL;                     // not even one block to read
+  }
+  w.mem = (char *)dma_mem_alloc(c.bs * c.qd);
+  if (!w.mem)
+    return -errno;
+  memset(w.mem, 0xa5, c.bs * c.qd);
+
+  if (!c.write && c.sink != "none") {
+    enum sink_mode mode;
+    sink_parse_mode(c.sink.c_str(), &mode);
+    w.out_name = thread_name(output, w.index);
+    err = sink_open(&w.sink, w.out_name.c_str(), mode, 0);
+    if (err < 0)
+      return err;
+    w.has_sink = true;
+  }
+
+  if (c.qd > 1 && c.kind == TransportKind::AIO)
+    return io_setup(c.qd, &w.ctx);
+#ifdef HAVE_LIBURING
+  if (c.qd > 1) {
+    err = io_uring_queue_init(c.qd, &w.ring, 0);
+    w.ring_ready = err == 0;
+    return err;
+  }
+#endif
+  TransportOptions opt;
+  opt.running = &keepRunning;
+  opt.blksize = c.bs;
+  if (c.kind == TransportKind::SPLICE) {
+    if (!w.has_sink && (w.null_fd = open("/dev/null", O_WRONLY)) < 0)
+      return -errno;
+    opt.peer_fd = w.has_sink ? w.sink.fd : w.null_fd;
+  }
+  w.xfer = make_transport(c.kind, w.dev, opt, &err);
+  return w.xfer ? 0 : err;
+}
+
+static void run(std::vector<std::unique_ptr<worker>> &workers,
+                const config &c, uint64_t len, unsigned max_secs,
+                struct result *r)
+{
+  std::atomic<unsigned> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  struct rusage ru0, ru1;
+  uint64_t t0, deadline = 0;
+
+  for (auto &w : workers) {
+    w->lat_ns.clear();
+    w->lat_ns.reserve(len / c.bs + 1);
+    w->bytes = w->transfers = w->timeouts = 0;
+    w->error = 0;
+  }
+  for (auto &w : workers) {
+    worker *wp = w.get();
+    threads.emplace_back([&, wp] {
+      ready++;
+      while (!go)
+        ;
+      run_worker(*wp, c, len, deadline);
+    });
+  }
+  while (ready < workers.size())
+    std::this_thread::yield();
+
+  getrusage(RUSAGE_SELF, &ru0);
+  t0 = now_ns();
+  deadline = t0 + max_secs * 1000000000ull;
+  go = true;
+  for (auto &t : threads)
+    t.join();
+  r->secs = (now_ns() - t0) / 1e9;
+  getrusage(RUSAGE_SELF, &ru1);
+  r->cpu_secs = cpu_secs(ru1) - cpu_secs(ru0);
+
+  std::vector<uint32_t> lat;
+  r->bytes = r->transfers = r->timeouts = 0;
+  r->error = 0;
+  for (auto &w : workers) {
+    r->bytes += w->bytes;
+    r->transfers += w->transfers;
+    r->timeouts += w->timeouts;
+    if (!r->error)
+      r->error = w->error;
+    lat.insert(lat.end(), w->lat_ns.begin(), w->lat_ns.end());
+  }
+  double *pct[] = {&r->p50_us, &r->p99_us, &r->p999_us};
+  double q[] = {0.5, 0.99, 0.999};
+  for (int i = 0; i < 3; i++) {
+    *pct[i] = 0;
+    if (lat.empty())
+      continue;
+    auto nth = lat.begin() + (size_t)(q[i] * (lat.size() - 1));
+    std::nth_element(lat.begin(), nth, lat.end());
+    *pct[i] = *nth / 1e3;
+  }
+}
+
+static const char *columns[] = {
+  "direction", "transport", "bs", "qd", "sink", "threads", "rep", "bytes",
+  "secs", "mb_s", "transfers", "lat_p50_us", "lat_p99_us", "lat_p999_us",
+  "cpu_secs", "cpu_secs_per_gb", "timeouts", "error",
+};
+
+static void print_row(bool json, bool first, const config &c, unsigned rep,
+                      const struct result &r)
+{
+  char v[18][64];
+  snprintf(v[0], 64, "%s", c.write ? "write" : "read");
+  snprintf(v[1], 64, "%s", transport_name(c.kind));
+  snprintf(v[2], 64, "%zu", c.bs);
+  snprintf(v[3], 64, "%u", c.qd);
+  snprintf(v[4], 64, "%s", c.sink.c_str());
+  snprintf(v[5], 64, "%u", c.threads);
+  snprintf(v[6], 64, "%u", rep);
+  snprintf(v[7], 64, "%lu", r.bytes);
+  snprintf(v[8], 64, "%.6f", r.secs);
+  snprintf(v[9], 64, "%.2f", r.secs > 0 ? r.bytes / r.secs / 1e6 : 0);
+  snprintf(v[10], 64, "%lu", r.transfers);
+  snprintf(v[11], 64, "%.2f", r.p50_us);
+  snprintf(v[12], 64, "%.2f", r.p99_us);
+  snprintf(v[13], 64, "%.2f", r.p999_us);
+  snprintf(v[14], 64, "%.4f", r.cpu_secs);
+  snprintf(v[15], 64, "%.4f", r.bytes ? r.cpu_secs / (r.bytes / 1e9) : 0);
+  snprintf(v[16], 64, "%lu", r.timeouts);
+  snprintf(v[17], 64, "%s", r.error ? strerror(-r.error) : "");
+
+  if (!json) {
+    for (int i = 0; i < 18; i++)
+      printf("%s%s", i ? "," : "", v[i]);
+    printf("\n");
+  }
+  else {
+    printf("%s  {", first ? "" : ",\n");
+    for (int i = 0; i < 18; i++) {
+      bool text = i <= 1 || i == 4 || i == 17;
+      printf("%s\"%s\": %s%s%s", i ? ", " : "", columns[i], text ? "\"" : "",
+             v[i], text ? "\"" : "");
+    }
+    printf("}");
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  std::string node, output, direction, bs_str, qd_str, transport_str,
+      sink_str, threads_str, length_str, warmup_str, format, hugepages;
+  unsigned reps, max_secs;
+
+  //
+  signal(SIGINT, sigHandler);
+
+  //
+  po::options_description desc("allowed opitons");
+  desc.add_options()
+    ("help,h","help message")
+    ("device,d", po::value<std::string>(&node)->default_value("/dev/xdma0_c2h_0"), "xdma node, regular file or FIFO (%u: thread index)")
+    ("output,o", po::value<std::string>(&output), "read: output file per thread for the sink modes (%u: thread index)")
+    ("direction", po::value<std::string>(&direction), "read or write (default: write on h2c nodes, read otherwise)")
+    ("bs,s", po::value<std::string>(&bs_str)->default_value(BS_DEFAULT), "block sizes, k/m/g suffixes")
+    ("qd,q", po::value<std::string>(&qd_str)->default_value("1"), "queue depths (> 1: aio and uring only)")
+    ("transport,t", po::value<std::string>(&transport_str)->default_value(TRANSPORT_DEFAULT), "transports: sync, aio, uring, splice")
+    ("sink", po::value<std::string>(&sink_str)->default_value("none"), "read: sink modes, none (data dropped), sync, direct, writeback, buffered, mmap")
+    ("threads,j", po::value<std::string>(&threads_str)->default_value("1"), "thread counts, one node and output per thread")
+    ("length,l", po::value<std::string>(&length_str)->default_value(LENGTH_DEFAULT), "bytes per thread and repetition")
+    ("warmup", po::value<std::string>(&warmup_str)->default_value(WARMUP_DEFAULT), "bytes per thread moved untimed before the repetitions (0: none)")
+    ("reps,r", po::value<unsigned>(&reps)->default_value(REPS_DEFAULT), "repetitions of every point")
+    ("max-time", po::value<unsigned>(&max_secs)->default_value(MAX_TIME_DEFAULT), "seconds a repetition may take, for sources that run dry")
+    ("format,f", po::value<std::string>(&format)->default_value("csv"), "csv or json")
+    ("hugepages", po::value<std::string>(&hugepages)->default_value(DMA_MEM_DEFAULT)->implicit_value("2m"), "buffers: off, 4k (pre-faulted, locked), 2m or 1g hugepages");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    std::cout << "latency: per transfer, submit to completion at qd > 1; "
+                 "cpu: user + system time of the process; the final sink "
+                 "fsync is not timed\n";
+    return 0;
+  }
+
+  std::vector<uint64_t> bss, qds, nthreads, length, warmup;
+  if (parse_sizes(bs_str, &bss) < 0 || parse_sizes(qd_str, &qds) < 0 ||
+      parse_sizes(threads_str, &nthreads) < 0 ||
+      parse_sizes(length_str, &length) < 0) {
+    std::cout << "bad size list\n";
+    return 1;
+  }
+  if (warmup_str != "0" && parse_sizes(warmup_str, &warmup) < 0) {
+    std::cout << "bad warmup: " << warmup_str << "\n";
+    return 1;
+  }
+
+  std::vector<TransportKind> kinds;
+  for (auto &t : split(transport_str)) {
+    TransportKind kind;
+    if (transport_parse(t.c_str(), &kind) < 0) {
+      std::cout << "unknown transport: " << t << "\n";
+      return 1;
+    }
+    kinds.push_back(kind);
+  }
+  std::vector<std::string> sinks = split(sink_str);
+  for (auto &s : sinks) {
+    enum sink_mode mode;
+    if (s != "none" && sink_parse_mode(s.c_str(), &mode) < 0) {
+      std::cout << "unknown sink mode: " << s << "\n";
+      return 1;
+    }
+    if (s != "none" && output.empty()) {
+      std::cout << "sink " << s << " needs --output\n";
+      return 1;
+    }
+  }
+
+  bool write = channel_kind(node) == ChannelKind::H2C;
+  if (vm.count("direction")) {
+    if (direction != "read" && direction != "write") {
+      std::cout << "unknown direction: " << direction << "\n";
+      return 1;
+    }
+    write = direction == "write";
+  }
+  if (write)
+    sinks = {"none"};
+  if (std::max_element(nthreads.begin(), nthreads.end())[0] > 1 &&
+      ((channel_kind(node) != ChannelKind::OTHER || write) &&
+       node.find("%u") == std::string::npos)) {
+    std::cout << "more than one thread needs %u in the node name\n";
+    return 1;
+  }
+  if (!output.empty() && output.find("%u") == std::string::npos &&
+      std::max_element(nthreads.begin(), nthreads.end())[0] > 1) {
+    std::cout << "more than one thread needs %u in the output name\n";
+    return 1;
+  }
+
+  size_t huge_page;
+  if (dma_mem_parse(hugepages.c_str(), &huge_page) < 0) {
+    std::cout << "unknown hugepages size: " << hugepages << "\n";
+    return 1;
+  }
+  dma_mem_setup(huge_page);
+
+  bool json = format == "json", first = true;
+  if (json)
+    printf("[\n");
+  else {
+    for (unsigned i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+      printf("%s%s", i ? "," : "", columns[i]);
+    printf("\n");
+  }
+
+  for (uint64_t threads : nthreads)
+  for (TransportKind kind : kinds)
+  for (const std::string &sink : sinks)
+  for (uint64_t bs : bss)
+  for (uint64_t qd : qds) {
+    if (!keepRunning)
+      break;
+    config c = {write, kind, bs, (unsigned)qd, sink, (unsigned)threads};
+    const char *why = unsupported(c);
+    if (why) {
+      fprintf(stderr, "skip %s bs %zu qd %u: %s\n", transport_name(kind), bs,
+              c.qd, why);
+      continue;
+    }
+
+    std::vector<std::unique_ptr<worker>> workers;
+    int err = 0;
+    for (unsigned i = 0; i < threads && !err; i++) {
+      workers.emplace_back(new worker);
+      workers.back()->index = i;
+      err = setup(*workers.back(), c, node, output);
+    }
+    if (err < 0) {
+      fprintf(stderr, "skip %s bs %zu qd %u: %s\n", transport_name(kind), bs,
+              c.qd, strerror(-err));
+      continue;
+    }
+
+    struct result r;
+    if (!warmup.empty())
+      run(workers, c, warmup[0], max_secs, &r);
+    for (unsigned rep = 0; rep < reps && keepRunning; rep++) {
+      run(workers, c, length[0], max_secs, &r);
+      print_row(json, first, c, rep, r);
+      first = false;
+    }
+  }
+  if (json)
+    printf("\n]\n");
+  return 0;
+}
@@ -1,52 +1,62 @@
 #include <unistd.h> // (posix header)
 #include <sys/types.h> // (posix header)
 #include <stdio.h> // (glibc)
-#include <sys/stat.h> // for fstat (glibc)
-#include <sys/param.h> // for howmany macro (glibc)
+#include <string.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <errno.h>
 
-#include <libaio.h>
 #include <boost/program_options.hpp>
+#include <algorithm>
 #include <iostream>
 #include <string>
 
+#include "aio_pipe.h"
+#include "alloc_count.h"
+#include "alog.h"
+#include "buf_pool.h"
+#include "dma_mem.h"
+#include "lat_hist.h"
+#include "placement.h"
+#include "sink.h"
+#include "splice_xfer.h"
+#include "stat_shm.h"
+#include "trace_rec.h"
+#include "transport.h"
+
 namespace po = boost::program_options;
 
+#define DEVICE_NAME_DEFAULT "/dev/xdma0_c2h_0"
 #define AIO_BLKSIZE	(64*1024)
 #define AIO_MAXIO	1
 #define AIO_MAXWAIT 10000
+#define ENGINE_DEFAULT "aio"
 
 static bool verbose = false;
-static int sleeped = 0;
-static bool first_sleeped = false;
-static char *buf = NULL;
-static int64_t length = 0;
-static off_t offset = 0;
-static bool busy = false;		// # of I/O's in flight
-static int srcfd = -1;		// destination file descriptor
+static DeviceChannel dev;	// source: the C2H node
 static int dstfd = -1;		// destination file descriptor
 static const char *dstname = NULL;
 static const char *srcname = NULL;
-
-/* io wait */
-int io_wait(io_context_t ctx, struct timespec *timeout)
-{
-	return io_getevents(ctx, 0, 0, NULL, timeout);
-}
+static struct sink sink;
+static struct lat_hist lat_xfer;    // device read submit -> complete
+static struct lat_hist lat_persist; // read complete -> written to the output
+static struct stat_shm shm;         // live counters for jw_stat
+static LoopPlacement place;
 
 /* Fatal error handler */
 static void io_error(const char *func, int rc)
 {
+  alog_stop();
   if (rc == -ENOSYS)
     fprintf(stderr, "AIO not in this kernel\n");
-  else if (rc < 0 && -rc < sys_nerr)
-    fprintf(stderr, "%s: %s\n", func, sys_errlist[-rc]);
+  else if (rc < 0)
+    fprintf(stderr, "%s: %s\n", func, strerror(-rc));
   else
     fprintf(stderr, "%s: error %d\n", func, rc);
 
-  if (srcfd > 0)
-    close(srcfd);
+  dev.close();
+  trace_done();
+  stat_shm_remove(&shm);
 
   if (dstfd > 0)
     close(dstfd);
@@ -56,92 +66,127 @@ static void io_error(const char *func, int rc)
   exit(1);
 }
 
-/*
- * Write complete callback.
- * Adjust counts and free resources
- */
-static void wr_done(io_context_t ctx, struct iocb *iocb, long res, long res2)
+/* max wait reached: close the output, later data is read and dropped */
+static void close_output(uint64_t saved)
 {
-  if(verbose) std::cout << "in wr_done\n";
-
-  if (res2 != 0) {
-    io_error("aio write", res2);
-  }
-  if (res != iocb->u.c.nbytes) {
-    fprintf(stderr, "write missed bytes expect %d got %d\n", iocb->u.c.nbytes, res);
-    exit(1);
+  if(dstfd > 0) {
+    sink_account(&sink, saved);
+    sink_close(&sink);
+    sink_report(&sink);
   }
+  dstfd=-1;
 
-  offset += res;
-  length -= res;
-  // memset(iocb, 0xff, sizeof(iocb));	// paranoia
-  // free(iocb);
-
-  busy=false;
-  sleeped = 0;
-
-  if(verbose)
-    std::cout <<"wd_done: current:" << res << " , total: " << offset << " bytes received\n";
-  write(2, "w\n", 2);
+  alog(ALOG_WARN, "WARN:\n \tmax wait time reached\n"
+       "\tdata file closed, totally %lu bytes saved.\n"
+       "\tand future arrived data will be dumped\n", saved);
 }
 
 /*
- * Read complete callback.
- * Change read iocb into a write iocb and start it.
+ * sync, uring and splice: one device read at a time through the transport,
+ * written out before the next one; aio stays on aio_pipe, --max deep
  */
-static void rd_done(io_context_t ctx, struct iocb *iocb, long res, long res2)
+static void run_transport(TransportKind kind, TransportOptions &opt,
+                          struct buf_pool *pool, size_t blksize,
+                          uint64_t length, int aio_wait,
+                          enum alog_level log_level)
 {
-  if(verbose) std::cout << "in rd_done\n";
-  
-  /* library needs accessors to look at iocb? */
-  int iosize = iocb->u.c.nbytes;
-  char *buf = static_cast<char*>(iocb->u.c.buf);
-  // off_t offset = iocb->u.c.offset;
-
-  if (res2 != 0)
-    io_error("aio read", res2);
-  if (res != iosize) {
-    fprintf(stderr, "read unexpected nr of bytes: expect %d, got %d\n", iosize, res);
-    // exit(1);
+  int err;
+  char *buf = buf_pool_get(pool)->data;
+  bool zero_copy = kind == TransportKind::SPLICE && dstfd > 0;
+
+  // sync/buffered/writeback take spliced pages, the others stage in user space
+  if (zero_copy && sink.mode != SINK_SYNC && sink.mode != SINK_BUFFERED &&
+      sink.mode != SINK_WRITEBACK) {
+    std::cout << "splice: " << sink_mode_name(sink.mode) << " sink stages in user space, copying\n";
+    zero_copy = false;
   }
-
-  /* turn read into write */
-  if(dstfd > 0) {
-    io_prep_pwrite(iocb, dstfd, buf, res, offset);
-    io_set_callback(iocb, wr_done);
-    if (1 != (res = io_submit(ctx, 1, &iocb)))
-      io_error("io_submit write", res);
+  opt.peer_fd = dstfd;
+  opt.blksize = blksize;
+  std::unique_ptr<Transport> xfer = make_transport(kind, dev, opt, &err);
+  if (!xfer) {
+    std::cout << transport_name(kind) << " transport: " << strerror(-err) << ", falling back to sync\n";
+    xfer = make_transport(TransportKind::SYNC, dev, opt, &err);
+    zero_copy = false;
   }
-  else {
-    offset += res;
-    length -= res;
-    // memset(iocb, 0xff, sizeof(iocb));	// paranoia
-    // free(iocb);
-
-    busy=false;
-    sleeped = 0;
-    if(verbose)
-      std::cout <<"rd_done: current:" << res << " , total: " << offset << " bytes received\n";
-
+  xfer->lat = &lat_xfer; // splice: device -> output in one call
+  xfer->publish(&shm, srcname);
+
+  uint64_t received = 0, saved = 0, allocs = 0;
+  uint64_t idle_since = lat_hist_now();
+  alog_start(log_level, ALOG_RATE_DEFAULT);
+  alog_thread_init();
+  place.enter();
+  while (received < length) {
+    size_t want = std::min<uint64_t>(blksize, length - received);
+    ssize_t rc;
+    if (zero_copy) {
+      rc = xfer->move(want);
+      if (rc < 0 && splice_xfer_unsupported(rc) && !xfer->bytes) {
+        alog(ALOG_WARN, "%s: no splice support (%s), copying\n", srcname, strerror(-rc));
+        zero_copy = false;
+        continue;
+      }
+    } else {
+      rc = xfer->read(buf, want);
+    }
+    if (xfer->calls == 2) // steady state from the second transfer on
+      allocs = alloc_count();
+    if (rc < 0 && !xfer->timed_out(rc))
+      io_error(xfer->name(), rc);
+    if (rc == 0 && !dev.is_stream()) // end of a file standing in for the device
+      break;
+
+    if (rc <= 0) {
+      if (dstfd > 0 && lat_hist_now() - idle_since > aio_wait * 1000000ull) {
+        close_output(saved);
+        zero_copy = false;
+      }
+      continue;
+    }
+    idle_since = xfer->done_ns;
+    received += rc;
+    if (dstfd > 0) {
+      ssize_t erc = zero_copy ? sink_account(&sink, sink.offset + rc)
+                              : sink_write(&sink, buf, rc);
+      if (erc < 0)
+        io_error("write", erc);
+      if (!zero_copy)
+        lat_hist_since(&lat_persist, xfer->done_ns);
+      saved += rc;
+    }
+    alog(ALOG_DEBUG, "total: %lu bytes received\n", received);
   }
-
-  write(2, "r", 1);
+  allocs = alloc_count() - allocs;
+  place.leave();
+  alog_stop();
+  std::cout <<"app: end reading\n";
+  xfer->report(srcname);
+  alloc_count_report(srcname, allocs);
+  place.report(srcname);
 }
 
 
 /* main */
 int main(int argc, char* argv[])
 {
-  long page_size = sysconf(_SC_PAGESIZE);
-
   // args config
-  io_context_t myctx;
-
-  std::string outfile;
+  std::string infile, outfile, sink_mode_str, hugepages, wait_mode_str, engine;
+  unsigned spin_us;
+  std::string log_level_str, latency_file, trace_file;
+  std::string numa_str, pin_str, topology_root;
+  int rt_prio = 0;                // 0: no realtime mode
+  bool user_reap = false;
+  bool sqpoll = false;
+  int64_t length = 0;
   int aio_max;
   int aio_blksize;
   int aio_wait;
   bool eop_flush = false;
+  bool no_stats = false;
+  bool trace = false;
+
+  lat_hist_report_on(SIGUSR1);
+  trace_toggle_on(SIGUSR2);
 
   po::options_description desc("allowed opitons");
   desc.add_options()
@@ -149,10 +194,27 @@ int main(int argc, char* argv[])
     ("verbose,v", po::bool_switch(&verbose), "verbose mode")
     ("eopflush,e", po::bool_switch(&eop_flush), "End-of-Packet flush of XDMA")
     ("length,l", po::value<int64_t>(&length)->default_value(0), "total length of reading (in bytes)")
-    ("max,m", po::value<int>(&aio_max)->default_value(AIO_MAXIO), "max number of aio requests")
+    ("transport,t", po::value<std::string>(&engine)->default_value(ENGINE_DEFAULT), "device reads: aio (--max deep pipeline), sync, uring or splice (device -> output)")
+    ("max,m", po::value<int>(&aio_max)->default_value(AIO_MAXIO), "max number of aio requests in flight")
     ("size,s", po::value<int>(&aio_blksize)->default_value(AIO_BLKSIZE), "block size of a single aio copy")
-    ("wait,w", po::value<int>(&aio_wait)->default_value(AIO_MAXWAIT), "max wait time (s) without new data from xdma")
-    ("output,o", po::value<std::string>(&outfile), "outfile file");
+    ("wait,w", po::value<int>(&aio_wait)->default_value(AIO_MAXWAIT), "max wait time (ms) without new data from xdma")
+    ("wait-mode", po::value<std::string>(&wait_mode_str)->default_value(AIO_WAIT_DEFAULT), "completion wait: block, eventfd, poll or spin")
+    ("spin-us", po::value<unsigned>(&spin_us)->default_value(AIO_WAIT_SPIN_US_DEFAULT), "spin: busy-poll budget (us) before sleeping")
+    ("user-reap", po::bool_switch(&user_reap), "reap completions from the kernel's aio ring in user space")
+    ("sqpoll", po::bool_switch(&sqpoll), "uring: kernel thread polls the submission queue")
+    ("input,i", po::value<std::string>(&infile)->default_value(DEVICE_NAME_DEFAULT), "xdma C2H device node")
+    ("output,o", po::value<std::string>(&outfile), "outfile file")
+    ("sink", po::value<std::string>(&sink_mode_str)->default_value(SINK_MODE_DEFAULT), "output write mode: sync, direct, writeback, buffered or mmap")
+    ("log-level", po::value<std::string>(&log_level_str)->default_value(ALOG_LEVEL_DEFAULT), "error, warn, info or debug (-v: debug)")
+    ("no-stats", po::bool_switch(&no_stats), "do not publish live counters for jw_stat")
+    ("latency-file", po::value<std::string>(&latency_file), "save the latency histograms here at exit (merge with jw_lat_merge); SIGUSR1 prints them")
+    ("trace", po::bool_switch(&trace), "record the pipeline trace from the start; SIGUSR2 starts/stops it at any time")
+    ("trace-file", po::value<std::string>(&trace_file), "write the pipeline trace here, Chrome/Perfetto JSON (default /tmp/file_sink.<pid>.trace.json)")
+    ("numa", po::value<std::string>(&numa_str)->default_value("auto"), "staging buffers' numa node: auto (the device's), off or a node number")
+    ("pin", po::value<std::string>(&pin_str)->default_value("auto"), "transfer loop cpu: auto (next to the device's interrupts), off or a cpu number")
+    ("topology-root", po::value<std::string>(&topology_root)->default_value(TOPO_ROOT_DEFAULT), "root of the sysfs/proc tree the topology is read from")
+    ("realtime", po::value<int>(&rt_prio)->implicit_value(RT_PRIO_DEFAULT), "mlockall, pre-faulted stack, SCHED_FIFO transfer loop at this priority (default 50) on an isolated cpu")
+    ("hugepages", po::value<std::string>(&hugepages)->default_value(DMA_MEM_DEFAULT)->implicit_value("2m"), "staging buffers: off, 4k (pre-faulted, locked), 2m or 1g hugepages");
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -163,120 +225,183 @@ int main(int argc, char* argv[])
     return 0;
   }
 
+  size_t huge_page;
+  if (dma_mem_parse(hugepages.c_str(), &huge_page) < 0) {
+    std::cout << "unknown hugepages size: " << hugepages << "\n";
+    exit(1);
+  }
+  dma_mem_setup(huge_page);
+
+  TransportKind kind;
+  if (transport_parse(engine.c_str(), &kind) < 0) {
+    std::cout << "unknown transport: " << engine << "\n";
+    exit(1);
+  }
+  enum aio_wait_mode wait_mode;
+  if (aio_waiter_parse_mode(wait_mode_str.c_str(), &wait_mode) < 0) {
+    std::cout << "unknown wait mode: " << wait_mode_str << "\n";
+    exit(1);
+  }
+
+  enum alog_level log_level;
+  if (alog_parse_level(log_level_str.c_str(), &log_level) < 0) {
+    std::cout << "unknown log level: " << log_level_str << "\n";
+    exit(1);
+  }
+  if (verbose)
+    log_level = ALOG_DEBUG;
+  if (place.parse(numa_str, pin_str, rt_prio) < 0) {
+    std::cout << "bad --numa or --pin: " << numa_str << ", " << pin_str << "\n";
+    exit(1);
+  }
+
   // output init
   if(vm.count("output")) {
     dstname = outfile.c_str();
-    if ((dstfd = open(dstname, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, 0666)) < 0) {
-      perror(dstname);
+    enum sink_mode mode;
+    if (sink_parse_mode(sink_mode_str.c_str(), &mode) < 0) {
+      std::cout << "unknown sink mode: " << sink_mode_str << "\n";
       exit(1);
     }
+    int err = sink_open(&sink, dstname, mode, 0);
+    if (err < 0) {
+      fprintf(stderr, "%s: %s\n", dstname, strerror(-err));
+      exit(1);
+    }
+    dstfd = sink.fd;
   }
 
   // dpu init
-  srcname = "/dev/xdma0_c2h_0";
-  if(!eop_flush)
-    srcfd = open(srcname, O_RDONLY);
-  else
-    srcfd = open(srcname, O_RDONLY | O_TRUNC);
-
-  if (srcfd < 0) {
-    perror(srcname);
+  srcname = infile.c_str();
+  int rc = dev.open(infile, DeviceChannel::READ, eop_flush);
+  if (rc < 0) {
+    fprintf(stderr, "%s: %s\n", srcname, strerror(-rc));
     if(dstfd > 0) close(dstfd);
     exit(1);
   }
-
-  // buffer init
-  posix_memalign((void **)&buf, page_size, aio_blksize + page_size);
-  if (!buf) {
-    perror("can't allocate memory");
-    close(srcfd);
-    if(dstfd > 0) close(dstfd);
-    exit(1);
+  place.setup(srcname, topology_root);
+
+  // what is in flight: aio_max buffers for the aio pipeline, else one
+  struct buf_pool pool;
+  rc = buf_pool_init(&pool, kind == TransportKind::AIO ? aio_max : 1, aio_blksize);
+  if (rc < 0)
+    io_error("buf_pool_init", rc);
+  lat_hist_init(&lat_xfer, "%s submit->complete", srcname);
+  lat_hist_init(&lat_persist, "%s complete->persisted", srcname);
+  trace_init("file_sink", trace_file.c_str(), trace);
+  if (!no_stats) {
+    int err = stat_shm_create(&shm, "file_sink");
+    if (err < 0)
+      fprintf(stderr, "live counters: %s\n", strerror(-err));
   }
-
-  // til input eof
-  memset(&myctx, 0, sizeof(myctx));
-  io_queue_init(aio_max, &myctx);
-
-  struct iocb *io = (struct iocb*) malloc(sizeof(struct iocb));
-  if (NULL == io) {
-    fprintf(stderr, "out of memory\n");
-    exit(1);
+  if (huge_page)
+    dma_mem_report(srcname);
+
+  if (kind != TransportKind::AIO) {
+    TransportOptions opt;
+    opt.wait_mode = wait_mode;
+    opt.spin_us = spin_us;
+    opt.sqpoll = sqpoll;
+    if(verbose)
+      std::cout << "dev: " << srcname << ", blk-size: " << aio_blksize
+                << ", transport: " << engine << ", length: " << length << "\n";
+    run_transport(kind, opt, &pool, aio_blksize, length, aio_wait, log_level);
+    lat_hist_done(latency_file.c_str());
+    if(dstfd > 0) {
+      if ((rc = sink_close(&sink)) < 0)
+        fprintf(stderr, "%s: %s\n", dstname, strerror(-rc));
+      sink_report(&sink);
+    }
+    buf_pool_free(&pool);
+    dev.close();
+    trace_done();
+    stat_shm_remove(&shm);
+    std::cout <<"app: all closed\n";
+    std::cout <<"app: eol\n";
+    exit(0);
   }
 
-  while(length >0) {
-    int rc;
-    int n = howmany(length, aio_blksize);
+  // engine init: aio_max slots, each with its own iocb and a buffer from the pool
+  struct aio_pipe pipe;
+  rc = aio_pipe_init(&pipe, &pool, dev.fd(), dstfd, aio_max, length);
+  if (rc < 0)
+    io_error("aio_pipe_init", rc);
+  struct aio_waiter waiter;
+  rc = aio_waiter_init(&waiter, pipe.ctx, wait_mode, spin_us);
+  if (rc < 0)
+    io_error("aio_waiter_init", rc);
+  pipe.waiter = &waiter;
+  pipe.lat_xfer = &lat_xfer;
+  pipe.lat_persist = &lat_persist;
+  aio_pipe_publish(&pipe, &shm, srcname);
+  if (user_reap && aio_waiter_user_reap(&waiter) < 0)
+    std::cout << "unknown aio ring layout, reaping with io_getevents\n";
 
-    // if(verbose) {
-    //   std::cout << "remaining bytes to read: " << length  << ", busy: " << busy << " , n=" << n<< "\n";
-    // }
-
-    if (!busy && n > 0) {
-      int iosize = MIN(length, aio_blksize);
-      io_prep_pread(io, srcfd, buf, iosize, 0);
-      io_set_callback(io, rd_done);
-      rc = io_submit(myctx, 1, &io);
-      if (rc < 0)
-        io_error("io_submit", rc);
-
-      busy = true;
-    }
-    
-    // Handle IO's that have completed
-    rc = io_queue_run(myctx);
+  if(verbose)
+    std::cout << "dev: " << srcname << ", blk-size: " << aio_blksize
+              << ", depth: " << aio_max << ", length: " << length << "\n";
+
+  // til all bytes received
+  struct timespec timeout = {0, 1000000}; // 1 ms
+  // idle: no new bytes, empty completions (xdma timeouts) included
+  uint64_t idle_since = lat_hist_now(), last_read = 0;
+  bool first_sleeped = false;
+  uint64_t allocs = 0, runs = 0;
+  alog_start(log_level, ALOG_RATE_DEFAULT);
+  alog_thread_init();
+  place.enter();
+  while(!aio_pipe_done(&pipe)) {
+    rc = aio_pipe_run(&pipe, &timeout);
     if (rc < 0)
-      io_error("io_queue_run", rc);
-
-    // wait
-    // if (busy) {
-    //   if(verbose)
-    //     std::cout << "max io nr reached, passive waiting for available io slot...\n";
-
-    //   rc = io_wait(myctx, NULL);
-    //   if (rc < 0)
-    //     io_error("io_queue_wait", rc);
-    // }
-
-    //
-    if(busy) {
-      usleep(1000);
-      sleeped += 1;
+      io_error("aio_pipe_run", rc);
+    if (++runs == 2) // steady state from the second reap on
+      allocs = alloc_count();
+
+    if (rc > 0 && dstfd > 0) {
+      int err = sink_account(&sink, aio_pipe_persisted(&pipe));
+      if (err < 0)
+        io_error("writeback", err);
+    }
+    if (pipe.bytes_read != last_read) {
+      last_read = pipe.bytes_read;
+      idle_since = lat_hist_now();
+      alog(ALOG_DEBUG, "reaped %d, total: %lu bytes received\n", rc, pipe.bytes_read);
+      continue;
     }
 
-    //
-    if(sleeped > aio_wait) {
-      if(verbose && first_sleeped && sleeped%10000==0) {
-        std::cout << "wainted " <<sleeped << " ms\n";
-      }
-      
-      if(!first_sleeped) {
-        // struct io_event event;
-        // rc = io_cancel(myctx, io, &event);
-
-        if(dstfd > 0)
-          close(dstfd);
-        dstfd=-1;
-
-        std::cout << "WARN:\n \tmax wait time reached\n"
-                  << "\tdata file closed, totally " << offset << " bytes saved.\n"
-                  << "\tand future arrived data will be dumped\n";
-
-        first_sleeped = true;
-        // sleeped = 0;
-        // busy = false;
-      }
+    if(!first_sleeped && lat_hist_now() - idle_since > aio_wait * 1000000ull) {
+      // no write may land behind sink_close()'s truncate
+      if ((rc = aio_pipe_drop_output(&pipe)) < 0)
+        io_error("aio_pipe_drop_output", rc);
+      close_output(aio_pipe_persisted(&pipe));
+      first_sleeped = true;
     }
   }
+  allocs = alloc_count() - allocs;
+  place.leave();
+  alog_stop();
   std::cout <<"app: end reading\n";
+  aio_pipe_report(&pipe, srcname);
+  aio_waiter_report(&waiter, srcname);
+  alloc_count_report(srcname, allocs);
+  place.report(srcname);
+  lat_hist_done(latency_file.c_str());
 
-  // 
-  close(srcfd);
-  if(dstfd > 0)
-    close(dstfd);
+  //
+  if(dstfd > 0) {
+    sink_account(&sink, aio_pipe_persisted(&pipe));
+    if ((rc = sink_close(&sink)) < 0)
+      fprintf(stderr, "%s: %s\n", dstname, strerror(-rc));
+    sink_report(&sink);
+  }
+  aio_waiter_free(&waiter);
+  aio_pipe_free(&pipe);
+  buf_pool_free(&pool);
+  dev.close();
+  trace_done();
+  stat_shm_remove(&shm);
   std::cout <<"app: all closed\n";
-  free(buf);
   std::cout <<"app: eol\n";
-  
+
   exit(0);
 }
@@ -1,124 +1,140 @@
 #include <unistd.h> // (posix header)
 #include <sys/types.h> // (posix header)
 #include <stdio.h> // (glibc)
+#include <string.h>
 #include <sys/stat.h> // for fstat (glibc)
-#include <sys/param.h> // for howmany macro (glibc)
 #include <fcntl.h>
+#include <signal.h>
 #include <errno.h>
 
-#include <libaio.h>
-
 #include <boost/program_options.hpp>
+#include <algorithm>
 #include <iostream>
 #include <string>
 
+#include "aio_pipe.h"
+#include "alloc_count.h"
+#include "alog.h"
+#include "buf_pool.h"
+#include "dma_mem.h"
+#include "lat_hist.h"
+#include "placement.h"
+#include "splice_xfer.h"
+#include "stat_shm.h"
+#include "trace_rec.h"
+#include "transport.h"
+
 namespace po = boost::program_options;
 
+#define DEVICE_NAME_DEFAULT "/dev/xdma0_h2c_0"
 #define AIO_BLKSIZE	(1024*1024)
 #define AIO_MAXIO	1
+#define ENGINE_DEFAULT "aio"
 
-static char *buf = NULL;
-static off_t length = 0;
-static off_t offset = 0;
-static bool busy = false;		// # of I/O's in flight
 static int srcfd = -1;
-static int dstfd = -1;		// destination file descriptor
+static DeviceChannel dev;	// destination: the H2C node
 static const char *dstname = NULL;
 static const char *srcname = NULL;
-
-/* io wait */
-int io_wait(io_context_t ctx, struct timespec *timeout)
-{
-	return io_getevents(ctx, 0, 0, NULL, timeout);
-}
+static struct lat_hist lat_xfer;    // input read submit -> complete
+static struct lat_hist lat_persist; // read complete -> written to the device
+static struct stat_shm shm;         // live counters for jw_stat
+static LoopPlacement place;
 
 /* Fatal error handler */
 static void io_error(const char *func, int rc)
 {
+  alog_stop();
   if (rc == -ENOSYS)
     fprintf(stderr, "AIO not in this kernel\n");
-  else if (rc < 0 && -rc < sys_nerr)
-    fprintf(stderr, "%s: %s\n", func, sys_errlist[-rc]);
+  else if (rc < 0)
+    fprintf(stderr, "%s: %s\n", func, strerror(-rc));
   else
     fprintf(stderr, "%s: error %d\n", func, rc);
 
   if (srcfd > 0)
     close(srcfd);
-  if (srcname)
-    unlink(srcname);
-  if (dstfd > 0)
-    close(dstfd);
-
-  free(buf);
+  dev.close();
+  trace_done();
+  stat_shm_remove(&shm);
 
   exit(1);
 }
 
 /*
- * Write complete callback.
- * Adjust counts and free resources
+ * sync and uring: the input is read a block at a time and written to the
+ * device through the transport before the next one; aio stays on
+ * aio_pipe, --max deep, and splice has its own loop in main()
  */
-static void wr_done(io_context_t ctx, struct iocb *iocb, long res, long res2)
+static void run_transport(TransportKind kind, TransportOptions &opt,
+                          struct buf_pool *pool, size_t blksize, off_t length)
 {
-  if (res2 != 0) {
-    io_error("aio write", res2);
-  }
-  if (res != iocb->u.c.nbytes) {
-    fprintf(stderr, "write missed bytes expect %d got %d\n", iocb->u.c.nbytes, res2);
-    // exit(1);
+  int err;
+  char *buf = buf_pool_get(pool)->data;
+  std::unique_ptr<Transport> xfer = make_transport(kind, dev, opt, &err);
+  if (!xfer) {
+    std::cout << transport_name(kind) << " transport: " << strerror(-err) << ", falling back to sync\n";
+    xfer = make_transport(TransportKind::SYNC, dev, opt, &err);
   }
+  xfer->publish(&shm, dstname);
 
-  offset += res;
-  length -= res;
-  // memset(iocb, 0xff, sizeof(iocb));	// paranoia
-  free(iocb);
-
-  busy=false;
-  write(2, "w", 1);
-}
-
-/*
- * Read complete callback.
- * Change read iocb into a write iocb and start it.
- */
-static void rd_done(io_context_t ctx, struct iocb *iocb, long res, long res2)
-{
-  /* library needs accessors to look at iocb? */
-  int iosize = iocb->u.c.nbytes;
-  // char *buf = static_cast<char*>(iocb->u.c.buf);
-  off_t offset = iocb->u.c.offset;
-
-  if (res2 != 0)
-    io_error("aio read", res2);
-  if (res != iosize) {
-    fprintf(stderr, "read missing bytes expect %d got %d\n", iosize, res);
-    exit(1);
+  uint64_t allocs = 0, blocks = 0;
+  place.enter();
+  while (length > 0) {
+    uint64_t t0 = lat_hist_now();
+    ssize_t n = read(srcfd, buf, std::min<off_t>(length, blksize));
+    if (n < 0)
+      io_error("read", -errno);
+    if (n == 0)
+      break;
+    uint64_t t_read = lat_hist_now();
+    lat_hist_record(&lat_xfer, t_read - t0);
+
+    for (ssize_t done = 0; done < n;) {
+      ssize_t rc = xfer->write(buf + done, n - done);
+      if (rc < 0 && !xfer->timed_out(rc))
+        io_error(xfer->name(), rc);
+      if (rc > 0)
+        done += rc;
+    }
+    lat_hist_since(&lat_persist, t_read);
+    length -= n;
+    if (++blocks == 2) // steady state from the second block on
+      allocs = alloc_count();
+    alog(ALOG_DEBUG, "total: %lu bytes sent\n", xfer->bytes);
   }
-
-
-  /* turn read into write */
-  io_prep_pwrite(iocb, dstfd, buf, res, 0);
-  io_set_callback(iocb, wr_done);
-  if (1 != (res = io_submit(ctx, 1, &iocb)))
-    io_error("io_submit write", res);
-  write(2, "r", 1);
+  allocs = alloc_count() - allocs;
+  place.leave();
+  alog_stop();
+  xfer->report(dstname);
+  alloc_count_report(dstname, allocs);
+  place.report(dstname);
 }
 
 
 int main(int argc, char *const *argv)
 {
-  long page_size = sysconf(_SC_PAGESIZE);
-
   //
   struct stat st;
-  io_context_t myctx;
 
   //
-  std::string infile;
+  std::string infile, device, hugepages, wait_mode_str, engine;
+  unsigned spin_us;
+  std::string log_level_str, latency_file, trace_file;
+  std::string numa_str, pin_str, topology_root;
+  int rt_prio = 0;                // 0: no realtime mode
+  bool user_reap = false;
+  bool sqpoll = false;
+  off_t length = 0;
   int aio_max;
   int aio_blksize;
   bool verbose = false;
   bool fix_len = false;
+  bool use_splice = false;
+  bool no_stats = false;
+  bool trace = false;
+
+  lat_hist_report_on(SIGUSR1);
+  trace_toggle_on(SIGUSR2);
 
   po::options_description desc("allowed opitons");
   desc.add_options()
@@ -126,9 +142,26 @@ int main(int argc, char *const *argv)
     ("verbose,v", po::bool_switch(&verbose), "verbose mode")
     ("length,l", po::value<off_t>(&length)->default_value(0), "total length of reading (in bytes)")
     ("fixed", po::bool_switch(&fix_len), "fixed length")
-    ("max,m", po::value<int>(&aio_max)->default_value(AIO_MAXIO), "max number of aio requests")
+    ("transport,t", po::value<std::string>(&engine)->default_value(ENGINE_DEFAULT), "device writes: aio (--max deep pipeline), sync, uring or splice (as --splice)")
+    ("max,m", po::value<int>(&aio_max)->default_value(AIO_MAXIO), "max number of aio requests in flight")
     ("size,s", po::value<int>(&aio_blksize)->default_value(AIO_BLKSIZE), "block size of a single aio copy")
-    ("input,i", po::value<std::string>(&infile), "input file");
+    ("device,d", po::value<std::string>(&device)->default_value(DEVICE_NAME_DEFAULT), "xdma H2C device node")
+    ("wait-mode", po::value<std::string>(&wait_mode_str)->default_value(AIO_WAIT_DEFAULT), "completion wait: block, eventfd, poll or spin")
+    ("spin-us", po::value<unsigned>(&spin_us)->default_value(AIO_WAIT_SPIN_US_DEFAULT), "spin: busy-poll budget (us) before sleeping")
+    ("user-reap", po::bool_switch(&user_reap), "reap completions from the kernel's aio ring in user space")
+    ("sqpoll", po::bool_switch(&sqpoll), "uring: kernel thread polls the submission queue")
+    ("input,i", po::value<std::string>(&infile), "input file")
+    ("splice", po::bool_switch(&use_splice), "zero-copy input -> device with splice(2), falls back to libaio when unsupported")
+    ("log-level", po::value<std::string>(&log_level_str)->default_value(ALOG_LEVEL_DEFAULT), "error, warn, info or debug (-v: debug)")
+    ("no-stats", po::bool_switch(&no_stats), "do not publish live counters for jw_stat")
+    ("latency-file", po::value<std::string>(&latency_file), "save the latency histograms here at exit (merge with jw_lat_merge); SIGUSR1 prints them")
+    ("trace", po::bool_switch(&trace), "record the pipeline trace from the start; SIGUSR2 starts/stops it at any time")
+    ("trace-file", po::value<std::string>(&trace_file), "write the pipeline trace here, Chrome/Perfetto JSON (default /tmp/file_source.<pid>.trace.json)")
+    ("numa", po::value<std::string>(&numa_str)->default_value("auto"), "staging buffers' numa node: auto (the device's), off or a node number")
+    ("pin", po::value<std::string>(&pin_str)->default_value("auto"), "transfer loop cpu: auto (next to the device's interrupts), off or a cpu number")
+    ("topology-root", po::value<std::string>(&topology_root)->default_value(TOPO_ROOT_DEFAULT), "root of the sysfs/proc tree the topology is read from")
+    ("realtime", po::value<int>(&rt_prio)->implicit_value(RT_PRIO_DEFAULT), "mlockall, pre-faulted stack, SCHED_FIFO transfer loop at this priority (default 50) on an isolated cpu")
+    ("hugepages", po::value<std::string>(&hugepages)->default_value(DMA_MEM_DEFAULT)->implicit_value("2m"), "staging buffers: off, 4k (pre-faulted, locked), 2m or 1g hugepages");
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -139,6 +172,38 @@ int main(int argc, char *const *argv)
     return 0;
   }
 
+  size_t huge_page;
+  if (dma_mem_parse(hugepages.c_str(), &huge_page) < 0) {
+    std::cout << "unknown hugepages size: " << hugepages << "\n";
+    exit(1);
+  }
+  dma_mem_setup(huge_page);
+
+  TransportKind kind;
+  if (transport_parse(engine.c_str(), &kind) < 0) {
+    std::cout << "unknown transport: " << engine << "\n";
+    exit(1);
+  }
+  if (kind == TransportKind::SPLICE)
+    use_splice = true;
+  enum aio_wait_mode wait_mode;
+  if (aio_waiter_parse_mode(wait_mode_str.c_str(), &wait_mode) < 0) {
+    std::cout << "unknown wait mode: " << wait_mode_str << "\n";
+    exit(1);
+  }
+
+  enum alog_level log_level;
+  if (alog_parse_level(log_level_str.c_str(), &log_level) < 0) {
+    std::cout << "unknown log level: " << log_level_str << "\n";
+    exit(1);
+  }
+  if (verbose)
+    log_level = ALOG_DEBUG;
+  if (place.parse(numa_str, pin_str, rt_prio) < 0) {
+    std::cout << "bad --numa or --pin: " << numa_str << ", " << pin_str << "\n";
+    exit(1);
+  }
+
   //
   srcname = infile.c_str();
   if ((srcfd = open(srcname, O_RDONLY)) < 0) {
@@ -153,61 +218,162 @@ int main(int argc, char *const *argv)
   else if(!fix_len)
     length = st.st_size;
 
-  dstname = "/dev/xdma0_h2c_0";
-  if ((dstfd = open(dstname, O_WRONLY | O_CREAT, 0666)) < 0) {
+  dstname = device.c_str();
+  int rc = dev.open(device, DeviceChannel::WRITE);
+  if (rc < 0) {
     close(srcfd);
-    perror(dstname);
+    fprintf(stderr, "%s: %s\n", dstname, strerror(-rc));
     exit(1);
   }
-
-  // buffer init
-  posix_memalign((void **)&buf, page_size, aio_blksize + page_size);
-  if (!buf) {
-    perror("can't allocate memory");
-    close(srcfd);
-    close(dstfd);
-    exit(1);
+  place.setup(dstname, topology_root);
+
+  lat_hist_init(&lat_xfer, "%s submit->complete", srcname);
+  lat_hist_init(&lat_persist, "%s complete->persisted", dstname);
+  trace_init("file_source", trace_file.c_str(), trace);
+  if (!no_stats) {
+    int err = stat_shm_create(&shm, "file_source");
+    if (err < 0)
+      fprintf(stderr, "live counters: %s\n", strerror(-err));
   }
 
-  /* initialize state machine */
-  memset(&myctx, 0, sizeof(myctx));
-  io_queue_init(aio_max, &myctx);
-
-  while (length > 0) {
-    int rc;
-    int n = howmany(length, aio_blksize);
-    if (!busy && n > 0) {
-	    struct iocb *ioq[1];
-      struct iocb *io = (struct iocb*) malloc(sizeof(struct iocb));
-      int iosize = MIN(length, aio_blksize);
-      if (NULL == io) {
-        fprintf(stderr, "out of memory\n");
-        exit(1);
+  // one log thread for whichever loop runs, started before main is pinned
+  alog_start(log_level, ALOG_RATE_DEFAULT);
+  alog_thread_init();
+
+  /* zero-copy mode, the libaio engine below only runs if unsupported */
+  if (use_splice) {
+    TransportOptions opt;
+    opt.peer_fd = srcfd;
+    opt.blksize = aio_blksize;
+    std::unique_ptr<Transport> sx = make_transport(TransportKind::SPLICE, dev, opt, &rc);
+    if (!sx)
+      io_error("splice_xfer_init", rc);
+    sx->lat = &lat_persist; // input -> device in one call
+    sx->publish(&shm, dstname);
+
+    bool fallback = false;
+    place.enter();
+    while (length > 0) {
+      ssize_t n = sx->move(std::min<off_t>(length, aio_blksize));
+      if (n < 0 && splice_xfer_unsupported(n)) {
+        // the first refused block was bounced: libaio goes on behind it
+        std::cout << "data path: libaio (no splice: " << strerror(-n) << ")";
+        if (sx->bytes)
+          std::cout << " after " << sx->bytes << " bytes spliced";
+        std::cout << "\n";
+        fallback = true;
+        break;
       }
+      if (n < 0)
+        io_error("splice", n);
+      if (n == 0)
+        break;
+      length -= n;
+    }
 
-      io_prep_pread(io, srcfd, buf, iosize, offset);
-      io_set_callback(io, rd_done);
-
-      ioq[0] = io;
-	    rc = io_submit(myctx, 1, ioq);
-	    if (rc < 0)
-        io_error("io_submit", rc);
-
-	    busy = true;
+    if (fallback && sx->bytes)
+      sx->report(dstname);
+    if (!fallback) {
+      place.leave();
+      alog_stop();
+      std::cout << "data path: splice\n";
+      sx->report(dstname);
+      place.report(dstname);
+      lat_hist_done(latency_file.c_str());
+      trace_done();
+      sx.reset();
+      close(srcfd);
+      dev.close();
+      stat_shm_remove(&shm);
+      exit(0);
     }
+  }
 
-    // Handle IO's that have completed
-    rc = io_queue_run(myctx);
+  /* one block in flight through the transport */
+  if (kind == TransportKind::SYNC || kind == TransportKind::URING) {
+    TransportOptions opt;
+    opt.wait_mode = wait_mode;
+    opt.spin_us = spin_us;
+    opt.sqpoll = sqpoll;
+    struct buf_pool pool;
+    rc = buf_pool_init(&pool, 1, aio_blksize);
     if (rc < 0)
-      io_error("io_queue_run", rc);
-
+      io_error("buf_pool_init", rc);
+    if (huge_page)
+      dma_mem_report(dstname);
     if(verbose)
-      sleep(1);
+      std::cout << "dev: " << dstname << ", blk-size: " << aio_blksize
+                << ", transport: " << engine << ", length: " << length << "\n";
+    run_transport(kind, opt, &pool, aio_blksize, length);
+    lat_hist_done(latency_file.c_str());
+    trace_done();
+    buf_pool_free(&pool);
+    close(srcfd);
+    dev.close();
+    stat_shm_remove(&shm);
+    exit(0);
   }
 
+  /* initialize state machine: aio_max slots, writes kept in file order */
+  struct aio_pipe pipe;
+  struct buf_pool pool;
+  rc = buf_pool_init(&pool, aio_max, aio_blksize);
+  if (rc < 0)
+    io_error("buf_pool_init", rc);
+  rc = aio_pipe_init(&pipe, &pool, srcfd, dev.fd(), aio_max, length);
+  if (rc < 0)
+    io_error("aio_pipe_init", rc);
+  // after a splice fallback: both fds stand behind the bytes it moved
+  if (pipe.src_seekable)
+    pipe.src_offset = lseek(srcfd, 0, SEEK_CUR);
+  if (pipe.dst_seekable)
+    pipe.dst_offset = lseek(dev.fd(), 0, SEEK_CUR);
+  struct aio_waiter waiter;
+  rc = aio_waiter_init(&waiter, pipe.ctx, wait_mode, spin_us);
+  if (rc < 0)
+    io_error("aio_waiter_init", rc);
+  pipe.waiter = &waiter;
+  pipe.lat_xfer = &lat_xfer;
+  pipe.lat_persist = &lat_persist;
+  aio_pipe_publish(&pipe, &shm, dstname);
+  if (user_reap && aio_waiter_user_reap(&waiter) < 0)
+    std::cout << "unknown aio ring layout, reaping with io_getevents\n";
+  if (huge_page)
+    dma_mem_report(dstname);
+
+  if(verbose)
+    std::cout << "dev: " << dstname << ", blk-size: " << aio_blksize
+              << ", depth: " << aio_max << ", length: " << length << "\n";
+
+  uint64_t allocs = 0, runs = 0;
+  place.enter();
+  while (!aio_pipe_done(&pipe)) {
+    // Handle IO's that have completed
+    rc = aio_pipe_run(&pipe, NULL);
+    if (rc < 0)
+      io_error("aio_pipe_run", rc);
+    if (++runs == 2) // steady state from the second reap on
+      allocs = alloc_count();
+
+    if (rc > 0)
+      alog(ALOG_DEBUG, "reaped %d, total: %lu bytes sent\n", rc, pipe.bytes_written);
+  }
+  allocs = alloc_count() - allocs;
+  place.leave();
+  alog_stop();
+  aio_pipe_report(&pipe, dstname);
+  aio_waiter_report(&waiter, dstname);
+  alloc_count_report(dstname, allocs);
+  place.report(dstname);
+  lat_hist_done(latency_file.c_str());
+  trace_done();
+
+  aio_waiter_free(&waiter);
+  aio_pipe_free(&pipe);
+  buf_pool_free(&pool);
   close(srcfd);
-  close(dstfd);
-  free(buf);
+  dev.close();
+  stat_shm_remove(&shm);
 
   exit(0);
 }
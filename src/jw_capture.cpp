@@ -0,0 +1,414 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <iostream>
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alog.h"
+#include "buf_pool.h"
+#include "buf_ring.h"
+#include "dma_mem.h"
+#include "lat_hist.h"
+#include "realtime.h"
+#include "sink.h"
+#include "stat_shm.h"
+#include "topology.h"
+#include "transport.h"
+
+#define DEVICE_NAME_DEFAULT "/dev/xdma0_c2h_0"
+#define BLKSIZE_DEFAULT 4096
+#define LENGTH_DEFAULT 4096
+#define RING_DEPTH_DEFAULT 8
+
+namespace po = boost::program_options;
+
+/* one C2H channel: pinned reader -> own ring -> writer -> own output */
+struct channel {
+  unsigned index;
+  std::string srcname;
+  std::string dstname;
+  DeviceChannel dev;
+  std::unique_ptr<Transport> xfer; // after dev: released first
+  bool has_sink = false;
+  struct sink sink = {};
+  struct buf_pool pool = {};     // the ring's buffers, on the device's node
+  struct buf_ring ring = {};
+  struct topology topo;
+  int cpu = -1;                 // reader cpu, -1: not pinned
+  int writer_cpu = -1;
+  struct realtime rt = {};
+  struct lat_hist lat_xfer;     // device read submit -> complete
+  struct lat_hist lat_persist;  // read complete -> in the sink
+
+  /* statistics */
+  uint64_t bytes = 0;
+  uint64_t reads = 0;
+  uint64_t timeouts = 0;
+  int error = 0;
+  double secs = 0;
+};
+
+static bool verbose = false;
+static bool eop_flush = false;
+static uint64_t size = BLKSIZE_DEFAULT;
+static uint64_t length = LENGTH_DEFAULT;
+static int rt_prio = 0;         // 0: no realtime mode
+
+//
+volatile sig_atomic_t keepRunning = 1;
+void sigHandler(int sig) {
+  keepRunning = 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* device reader: drains one channel into its ring */
+static void reader(struct channel *ch)
+{
+  if (rt_prio)
+    realtime_thread(&ch->rt, rt_prio, ch->cpu);
+  else {
+    int err = topology_pin(ch->cpu);
+    if (err < 0)
+      fprintf(stderr, "%s: pin reader to cpu %d: %s\n", ch->srcname.c_str(),
+              ch->cpu, strerror(-err));
+  }
+
+  alog_thread_init();
+  realtime_begin(&ch->rt);
+  double t0 = now();
+  uint64_t bytes_remaining = length;
+  while (keepRunning && bytes_remaining > 0 && !ch->error) {
+    struct buf_slot *slot = buf_ring_acquire(&ch->ring);
+    if (!slot)
+      break;
+
+    uint64_t bytes = std::min(bytes_remaining, size);
+    ssize_t rc = ch->xfer->read(slot->data, bytes);
+    if (rc < 0) { // ignore timeout
+      ch->timeouts++;
+      if (!ch->xfer->timed_out(rc)) {
+        ch->error = rc;
+        break;
+      }
+      continue;
+    }
+    if (rc == 0) {
+      if (ch->dev.is_stream()) {
+        ch->timeouts++;
+        continue;
+      }
+      break;
+    }
+
+    if (rc != (ssize_t)bytes)
+      alog(ALOG_DEBUG, "%s: read underflow 0x%lx/0x%lx.\n",
+           ch->srcname.c_str(), rc, bytes);
+
+    slot->len = rc;
+    slot->ts = ch->xfer->done_ns;
+    buf_ring_commit(&ch->ring);
+    ch->reads++;
+    ch->bytes += rc;
+    bytes_remaining -= rc;
+  }
+  ch->secs = now() - t0;
+  realtime_end(&ch->rt);
+
+  buf_ring_close(&ch->ring);
+}
+
+/* sink writer: persists the filled slots of one channel */
+static void writer(struct channel *ch)
+{
+  struct buf_slot *slot;
+  alog_thread_init();
+  int err = topology_pin(ch->writer_cpu);
+  if (err < 0)
+    fprintf(stderr, "%s: pin writer to cpu %d: %s\n", ch->srcname.c_str(),
+            ch->writer_cpu, strerror(-err));
+
+  while ((slot = buf_ring_peek(&ch->ring))) {
+    if (ch->has_sink && !ch->error) {
+      ssize_t rc = sink_write(&ch->sink, slot->data, slot->len);
+      if (rc < 0) {
+        alog(ALOG_ERROR, "%s, write 0x%lx failed: %s.\n",
+             ch->dstname.c_str(), slot->len, strerror(-rc));
+        ch->error = rc;
+        buf_ring_close(&ch->ring);
+      }
+      else
+        lat_hist_since(&ch->lat_persist, slot->ts);
+    }
+    buf_ring_release(&ch->ring);
+  }
+}
+
+/* "%u" in an output name stands for the channel index */
+static std::string channel_name(const std::string &pattern, unsigned index)
+{
+  std::string name = pattern;
+  size_t pos = name.find("%u");
+  if (pos != std::string::npos)
+    name.replace(pos, 2, std::to_string(index));
+  return name;
+}
+
+static void report(const struct channel *ch)
+{
+  fprintf(stdout, "%s: %lu bytes in %.3f s, %.2f MB/s, %lu reads, "
+          "%lu timeouts%s%s\n", ch->srcname.c_str(), ch->bytes, ch->secs,
+          ch->secs > 0 ? ch->bytes / ch->secs / 1e6 : 0.0, ch->reads,
+          ch->timeouts, ch->error ? ", error: " : "",
+          ch->error ? strerror(-ch->error) : "");
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::string> inputs, outputs;
+  std::vector<int> cpus;
+  std::string sink_mode_str, hugepages, numa_str, topology_root, log_level_str, transport_str;
+  std::string latency_file;
+  bool no_stats = false;
+  struct stat_shm shm = {};
+  unsigned ring_depth;
+
+  //
+  signal(SIGINT, sigHandler);
+  lat_hist_report_on(SIGUSR1);
+
+  //
+  po::options_description desc("allowed opitons");
+  desc.add_options()
+    ("help,h","help message")
+    ("verbose,v", po::bool_switch(&verbose), "verbose mode")
+    ("eopflush,e", po::bool_switch(&eop_flush), "End-of-Packet flush of XDMA")
+    ("length,l", po::value<uint64_t>(&length)->default_value(LENGTH_DEFAULT), "length to read per channel (in bytes)")
+    ("size,s", po::value<uint64_t>(&size)->default_value(BLKSIZE_DEFAULT), "block size of a single dma request")
+    ("ring,r", po::value<unsigned>(&ring_depth)->default_value(RING_DEPTH_DEFAULT), "depth of each channel's buffer ring")
+    ("input,i", po::value<std::vector<std::string>>(&inputs)->multitoken(), "xdma C2H device nodes, one per channel (files or FIFOs work too)")
+    ("output,o", po::value<std::vector<std::string>>(&outputs)->multitoken(), "output file per channel, or one name with %u for the channel index")
+    ("cpus,c", po::value<std::vector<int>>(&cpus)->multitoken(), "reader cpu per channel (default: next to the device's interrupts, else channel i on cpu i; -1: not pinned)")
+    ("numa", po::value<std::string>(&numa_str)->default_value("auto"), "staging buffers' numa node: auto (each device's), off or a node number")
+    ("topology-root", po::value<std::string>(&topology_root)->default_value(TOPO_ROOT_DEFAULT), "root of the sysfs/proc tree the topology is read from")
+    ("transport", po::value<std::string>(&transport_str)->default_value(TRANSPORT_DEFAULT), "device reads: sync, aio or uring")
+    ("sink", po::value<std::string>(&sink_mode_str)->default_value(SINK_MODE_DEFAULT), "output write mode: sync, direct, writeback, buffered or mmap")
+    ("realtime", po::value<int>(&rt_prio)->implicit_value(RT_PRIO_DEFAULT), "mlockall, pre-faulted stacks, SCHED_FIFO readers at this priority (default 50)")
+    ("log-level", po::value<std::string>(&log_level_str)->default_value(ALOG_LEVEL_DEFAULT), "error, warn, info or debug (-v: debug)")
+    ("no-stats", po::bool_switch(&no_stats), "do not publish live counters for jw_stat")
+    ("latency-file", po::value<std::string>(&latency_file), "save the channels' latency histograms here at exit (merge with jw_lat_merge); SIGUSR1 prints them")
+    ("hugepages", po::value<std::string>(&hugepages)->default_value(DMA_MEM_DEFAULT)->implicit_value("2m"), "staging buffers: off, 4k (pre-faulted, locked), 2m or 1g hugepages");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+
+  if (inputs.empty())
+    inputs.push_back(DEVICE_NAME_DEFAULT);
+  if (outputs.size() > 1 && outputs.size() != inputs.size()) {
+    std::cout << "need one output per channel or a single %u pattern\n";
+    return 1;
+  }
+  if (outputs.size() == 1 && inputs.size() > 1 &&
+      outputs[0].find("%u") == std::string::npos) {
+    std::cout << "output name needs %u for more than one channel\n";
+    return 1;
+  }
+  if (!cpus.empty() && cpus.size() != inputs.size()) {
+    std::cout << "need one cpu per channel\n";
+    return 1;
+  }
+
+  size_t huge_page;
+  if (dma_mem_parse(hugepages.c_str(), &huge_page) < 0) {
+    std::cout << "unknown hugepages size: " << hugepages << "\n";
+    return 1;
+  }
+  dma_mem_setup(huge_page);
+
+  int numa_node;
+  if (topology_parse_node(numa_str.c_str(), &numa_node) < 0) {
+    std::cout << "bad --numa: " << numa_str << "\n";
+    return 1;
+  }
+
+  enum alog_level log_level;
+  if (alog_parse_level(log_level_str.c_str(), &log_level) < 0) {
+    std::cout << "unknown log level: " << log_level_str << "\n";
+    return 1;
+  }
+  if (verbose)
+    log_level = ALOG_DEBUG;
+
+  enum sink_mode mode;
+  if (sink_parse_mode(sink_mode_str.c_str(), &mode) < 0) {
+    std::cout << "unknown sink mode: " << sink_mode_str << "\n";
+    return 1;
+  }
+
+  // every reader stages through its ring, so no splice here
+  TransportKind transport_kind;
+  if (transport_parse(transport_str.c_str(), &transport_kind) < 0 ||
+      transport_kind == TransportKind::SPLICE) {
+    std::cout << "unknown transport: " << transport_str << "\n";
+    return 1;
+  }
+  TransportOptions opt;
+  opt.running = &keepRunning;
+
+  if (!no_stats) {
+    int err = stat_shm_create(&shm, "jw_capture");
+    if (err < 0)
+      fprintf(stderr, "live counters: %s\n", strerror(-err));
+  }
+
+  // open all channels before any starts, so a bad node fails early
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  std::vector<struct channel> channels(inputs.size());
+  int rc = 0;
+  for (unsigned i = 0; i < channels.size() && !rc; i++) {
+    struct channel &ch = channels[i];
+    ch.index = i;
+    ch.srcname = inputs[i];
+
+    /*
+     * xdma device init: use O_TRUNC to indicate to the driver to flush the data up based on
+     * EOP (end-of-packet), streaming mode only
+     */
+    int err = ch.dev.open(ch.srcname, DeviceChannel::READ, eop_flush);
+    if (err < 0) {
+      fprintf(stderr, "%s: %s\n", ch.srcname.c_str(), strerror(-err));
+      rc = 1;
+      break;
+    }
+    /* the vector never grows, so the transport's channel stays put */
+    ch.xfer = make_transport(transport_kind, ch.dev, opt, &err);
+    if (!ch.xfer) {
+      fprintf(stderr, "%s: %s transport: %s\n", ch.srcname.c_str(),
+              transport_name(transport_kind), strerror(-err));
+      rc = 1;
+      break;
+    }
+    lat_hist_init(&ch.lat_xfer, "%s submit->complete", ch.srcname.c_str());
+    lat_hist_init(&ch.lat_persist, "%s complete->persisted", ch.srcname.c_str());
+    ch.xfer->lat = &ch.lat_xfer;
+    ch.xfer->publish(&shm, ch.srcname.c_str());
+
+    /*
+     * channels of one card share its node; each takes the next reader and
+     * writer cpus there, starting next to the interrupts
+     */
+    int node = numa_node;
+    topology_discover(&ch.topo, topology_root.c_str(), ch.srcname.c_str());
+    topology_place(&ch.topo, &node, NULL, NULL);
+    if (!cpus.empty())
+      ch.cpu = cpus[i];
+    else if (ch.topo.reader_cpu >= 0)
+      ch.cpu = topology_cpu(&ch.topo, 2 * i);
+    else
+      ch.cpu = (int)(i % ncpus);
+    if (cpus.empty())
+      ch.writer_cpu = topology_cpu(&ch.topo, 2 * i + 1);
+    dma_mem_set_node(node);
+
+    if (!outputs.empty()) {
+      ch.dstname = outputs.size() == 1 ? channel_name(outputs[0], i) : outputs[i];
+      int err = sink_open(&ch.sink, ch.dstname.c_str(), mode, 0);
+      if (err < 0) {
+        fprintf(stderr, "%s: %s\n", ch.dstname.c_str(), strerror(-err));
+        rc = 1;
+        break;
+      }
+      ch.has_sink = true;
+    }
+
+    if (buf_pool_init(&ch.pool, ring_depth, size) < 0 ||
+        buf_ring_init(&ch.ring, &ch.pool, ring_depth) < 0) {
+      std::cout << "Error allocating buffer ring\n";
+      rc = 1;
+      break;
+    }
+    buf_ring_publish(&ch.ring, &shm, ch.srcname.c_str());
+  }
+
+  if (!rc) {
+    if (huge_page || numa_node != TOPO_OFF)
+      dma_mem_report("capture");
+    for (auto &ch : channels) {
+      topology_report(&ch.topo, ch.srcname.c_str());
+      std::cout << ch.srcname << " -> " << (ch.has_sink ? ch.dstname : "(none)")
+                << ", reader cpu " << ch.cpu << ", writer cpu " << ch.writer_cpu
+                << " (-1: any)\n";
+    }
+
+    if (rt_prio) {
+      int err = realtime_lock();
+      if (err < 0)
+        fprintf(stderr, "mlockall: %s\n", strerror(-err));
+    }
+
+    alog_start(log_level, ALOG_RATE_DEFAULT);
+    double t0 = now();
+    std::vector<std::thread> threads;
+    for (auto &ch : channels) {
+      threads.emplace_back(writer, &ch);
+      threads.emplace_back(reader, &ch);
+    }
+    for (auto &t : threads)
+      t.join();
+    double secs = now() - t0;
+    alog_stop();
+
+    uint64_t total = 0;
+    for (auto &ch : channels) {
+      report(&ch);
+      if (rt_prio)
+        realtime_report(&ch.rt, ch.srcname.c_str());
+      buf_ring_report(&ch.ring, ch.srcname.c_str());
+      ch.xfer->report(ch.srcname.c_str());
+      total += ch.bytes;
+      if (ch.error)
+        rc = 1;
+    }
+    fprintf(stdout, "aggregate: %zu channels, %lu bytes in %.3f s, %.2f MB/s\n",
+            channels.size(), total, secs, secs > 0 ? total / secs / 1e6 : 0.0);
+    lat_hist_done(latency_file.c_str());
+  }
+
+  for (auto &ch : channels) {
+    if (ch.has_sink) {
+      if (sink_close(&ch.sink) < 0)
+        perror("close outfile");
+      if (!rc)
+        sink_report(&ch.sink);
+    }
+    buf_ring_free(&ch.ring);
+    buf_pool_free(&ch.pool);
+    lat_hist_unregister(&ch.lat_xfer);
+    lat_hist_unregister(&ch.lat_persist);
+    ch.xfer.reset();
+    ch.dev.close();
+  }
+  stat_shm_remove(&shm);
+  return rc;
+}
@@ -1,7 +1,9 @@
 #include <sys/types.h>
+#include <sys/stat.h>
 // #include <sys/mman.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 // #include <stdlib.h>
 #include <fcntl.h>
 // #include <unistd.h>
@@ -12,101 +14,472 @@
 #include <algorithm>
 #include <boost/program_options.hpp>
 #include <string>
-
+#include <thread>
+
+#include "aio_waiter.h"
+#include "alloc_count.h"
+#include "alog.h"
+#include "buf_pool.h"
+#include "buf_ring.h"
+#include "coalesce.h"
+#include "dma_mem.h"
+#include "lat_hist.h"
+#include "magic_ring.h"
+#include "perf_stage.h"
+#include "realtime.h"
+#include "segment.h"
+#include "sink.h"
+#include "splice_xfer.h"
+#include "stat_shm.h"
+#include "topology.h"
+#include "trace_rec.h"
+#include "transport.h"
 
 #define DEVICE_NAME_DEFAULT "/dev/xdma0_c2h_0"
 #define BLKSIZE_DEFAULT 4096
 #define LENGTH_DEFAULT 4096
+#define RING_DEPTH_DEFAULT 0
+#define COALESCE_RING_DEPTH 64  // --coalesce without --ring
+#define MAGIC_RING_DEFAULT (64ul << 20)
 
 namespace po = boost::program_options;
 
 static bool verbose = false;
 static bool eop_flush = false;
 static bool daemon_flag = false;
-static int srcfd = -1;		// destination file descriptor
+static bool no_stats = false;
+static bool trace = false;
+static bool perf = false;
+static DeviceChannel dev;
+static std::unique_ptr<Transport> xfer; // after dev: released first
 static int dstfd = -1;		// destination file descriptor
 static const char *dstname = NULL;
 static const char *srcname = NULL;
-static std::string infile, outfile;
+static std::string infile, outfile, sink_mode_str, hugepages, wait_mode_str, transport_str;
+static std::string numa_str, pin_str, topology_root, log_level_str, latency_file, trace_file;
+static std::string packet_index;
+static struct sink sink;
+static struct segment_writer segments;
+static uint64_t segment_size = 0;
+static unsigned segment_time = 0;
+static bool segmented = false;
+static struct buf_pool pool;  // staging buffers: one per ring slot, else one
 static char *allocated = NULL;
+static uint64_t allocs = 0;
 static uint64_t size = BLKSIZE_DEFAULT;
 static uint64_t length = LENGTH_DEFAULT;
 static uint64_t total_length = 0;
+static unsigned ring_depth = RING_DEPTH_DEFAULT;
+static struct buf_ring ring;
+static uint64_t magic_size = 0; // 0: no magic ring
+static struct magic_ring mring;
+static int write_error = 0;
+static uint64_t coalesce_size = 0; // 0: one sink write per read
+static unsigned coalesce_us = COALESCE_US_DEFAULT;
+static struct coalesce coal;
+static int index_fd = -1;       // packet lengths of the coalesced output
+static bool use_splice = false;
+static TransportKind transport_kind = TransportKind::SYNC;
+static std::string data_path = "copy";
+static enum aio_wait_mode wait_mode = AIO_WAIT_BLOCK;
+static unsigned spin_us = AIO_WAIT_SPIN_US_DEFAULT;
+static struct timespec idle_since = {0, 0}; // first failed read of an idle run
+static int numa_node = TOPO_AUTO;
+static int reader_cpu = TOPO_AUTO;
+static int writer_cpu = TOPO_AUTO;
+static struct topology topo;
+static int rt_prio = 0;         // 0: no realtime mode
+static struct realtime rt;
+static struct lat_hist lat_xfer;    // device read submit -> complete
+static struct lat_hist lat_persist; // read complete -> in the sink
+static struct lat_hist lat_coalesce; // oldest coalesced packet -> written
+static struct stat_shm shm;         // live counters for jw_stat
+static struct perf_stage perf_read; // device -> staging buffer (or mapped file)
+static struct perf_stage perf_write; // staging buffer -> sink
 
 //
 volatile sig_atomic_t keepRunning = 1;
 void sigHandler(int sig) {
+  // no close() here: cleanup() owns the fd, a number closed twice may by
+  // then be a segment file; the loops stop on keepRunning / the read timeout
   keepRunning = 0;
-  if(srcfd) close(srcfd);
-  
+
   std::cout << "\nWARN: transfer to be cloesd, waiting for last timeout ...\n";
 }
 
 /* restarts */
 void restart()
 {
-  if(srcfd) close(srcfd);
+  dev.open(srcname, DeviceChannel::READ, eop_flush);
+}
 
-  if(!eop_flush)
-    srcfd = open(srcname, O_RDONLY);
-  else
-    srcfd = open(srcname, O_RDONLY | O_TRUNC);
+/* end of the transfer loop: allocations since the steady state snapshot */
+void loop_done()
+{
+  static bool done = false;
+  if (!done) {
+    allocs = alloc_count() - allocs;
+    realtime_end(&rt);
+  }
+  done = true;
 }
 
 /* Fatal error handler */
 void cleanup(const char *func, int rc)
 {
+  loop_done();
+  alog_stop();
   if(rc<0)
     perror(func);
   else
     std::cout << func << std::endl;
   
-  if (srcfd > 0)
-    close(srcfd);
-
-  if (dstfd > 0)
-    close(dstfd);
-
-  if(allocated)
-    free(allocated);
+  if (xfer)
+    xfer->report(srcname);
+  xfer.reset();
+  dev.close();
+
+  if (segmented) {
+    int err = segment_close(&segments);
+    if (err < 0)
+      fprintf(stderr, "close segments: %s\n", strerror(-err));
+    segment_report(&segments);
+  }
+  else if (dstfd > 0) {
+    if (sink_close(&sink) < 0)
+      perror("close outfile");
+    sink_report(&sink);
+  }
+  if (coal.buf) {
+    coalesce_report(&coal, dstname);
+    coalesce_free(&coal);
+  }
+  if (index_fd >= 0 && close(index_fd) < 0)
+    perror("close packet index");
+
+  buf_pool_free(&pool);
+  alloc_count_report(srcname, allocs);
+  if (rt_prio)
+    realtime_report(&rt, srcname);
+  lat_hist_done(latency_file.c_str());
+  perf_stage_report();
+  trace_done();
+  stat_shm_remove(&shm);
   
+  std::cout << "Data path: " << data_path << "\n";
   std::cout << "Total: " << total_length << " bytes read\n";
   exit(0);
 }
 
+/*
+ * back off after a failed read: the read itself already sleeps in the
+ * driver up to its timeout, so block and eventfd keep the legacy short
+ * sleep, poll retries at once and spin retries at once for spin_us
+ */
+static void retry_backoff()
+{
+  if (wait_mode == AIO_WAIT_POLL)
+    return;
+  if (wait_mode == AIO_WAIT_SPIN) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!idle_since.tv_sec && !idle_since.tv_nsec)
+      idle_since = now;
+    if ((now.tv_sec - idle_since.tv_sec) * 1000000 +
+        (now.tv_nsec - idle_since.tv_nsec) / 1000 < (long)spin_us)
+      return;
+  }
+  usleep(100);
+}
+
 /* read from xdma */
-ssize_t read_to_buffer(const char *fname, int fd, char *buffer, uint64_t size)
+ssize_t read_to_buffer(const char *fname, char *buffer, uint64_t size)
 {
 	ssize_t rc;
-  rc = read(fd, buffer, size);
+  perf_stage_begin();
+  rc = xfer->read(buffer, size);
+  perf_stage_end(&perf_read, rc > 0 ? rc : 0);
   if (rc < 0) {
-    perror("read file");
+    alog(ALOG_WARN, "read file: %s\n", strerror(-rc));
     return -EIO;
   }
+  idle_since.tv_sec = idle_since.tv_nsec = 0;
 
-  if(verbose)
-    fprintf(stdout, "read %s: 0x%lx/0x%lx.\n", fname, rc, size);
+  alog(ALOG_DEBUG, "read %s: 0x%lx/0x%lx.\n", fname, rc, size);
 
 	return rc;
 }
 
 /* write until all requested bytes out */
-ssize_t write_from_buffer(const char *fname, int fd, char *buffer, uint64_t size)
+ssize_t write_from_buffer(const char *fname, char *buffer, uint64_t size)
 {
 	ssize_t rc;
-  rc = write(fd, buffer, size);
+  perf_stage_begin();
+  if (segmented)
+    rc = segment_write(&segments, buffer, size);
+  else
+    rc = sink_write(&sink, buffer, size);
+  perf_stage_end(&perf_write, rc > 0 ? rc : 0);
   if (rc < 0) {
-    fprintf(stderr, "%s, write 0x%lx failed %ld.\n", fname, size, rc);
-    perror("write file");
+    alog(ALOG_ERROR, "%s, write 0x%lx failed: %s.\n", fname, size, strerror(-rc));
     return -EIO;
   }
 
-  if(verbose)
-    fprintf(stdout, "write %s (final): 0x%lx/0x%lx.\n", fname, rc, size);
+  alog(ALOG_DEBUG, "write %s (final): 0x%lx/0x%lx.\n", fname, rc, size);
 
   return rc;
 }
 
+/* device reader thread: only drains the device into the ring */
+void ring_reader(uint64_t bytes_remaining)
+{
+  uint64_t blocks = 0;
+  while (keepRunning && bytes_remaining > 0) {
+    struct buf_slot *slot = buf_ring_acquire(&ring);
+    if (!slot)
+      break;
+
+    uint64_t bytes = std::min(bytes_remaining, size);
+    ssize_t rc = read_to_buffer(srcname, slot->data, bytes);
+    if (rc < 0) { // ignore timeout
+      retry_backoff();
+      alog(ALOG_WARN, "%s: wait new data ...\n", srcname);
+      continue;
+    }
+    if (rc == 0) {
+      if (dev.is_stream())
+        continue;
+      break;
+    }
+
+    if (rc != (ssize_t)bytes)
+      alog(ALOG_DEBUG, "%s: read underflow 0x%lx/0x%lx.\n", srcname, rc, bytes);
+
+    slot->len = rc;
+    slot->ts = xfer->done_ns;
+    buf_ring_commit(&ring);
+    if (++blocks == 2)
+      allocs = alloc_count();
+
+    total_length += rc;
+    if(!daemon_flag)
+      bytes_remaining -= rc;
+  }
+
+  buf_ring_close(&ring);
+}
+
+static ssize_t coalesce_sink(void *, const char *buf, size_t len)
+{
+  return write_from_buffer(dstname, (char *)buf, len);
+}
+
+static void writer_failed(int erc)
+{
+  write_error = erc;
+  keepRunning = 0;
+  buf_ring_close(&ring);
+}
+
+/*
+ * main turns into the reader: pinned, and SCHED_FIFO with --realtime;
+ * called once the helper threads (alog, writer) run, they would inherit both
+ */
+static void become_reader()
+{
+  static bool done = false;
+
+  if (done)
+    return;
+  done = true;
+  if (rt_prio) {
+    realtime_thread(&rt, rt_prio, reader_cpu);
+    return;
+  }
+  int err = topology_pin(reader_cpu);
+  if (err < 0)
+    fprintf(stderr, "pin reader to cpu %d: %s\n", reader_cpu, strerror(-err));
+}
+
+/* the writer's own cpu, else any but the reader's (main's, at worst) */
+static void pin_writer()
+{
+  int err = 0;
+
+  if (writer_cpu >= 0)
+    err = topology_pin(writer_cpu);
+  else if (reader_cpu >= 0)
+    err = topology_unpin(&topo, reader_cpu);
+  if (err < 0)
+    fprintf(stderr, "pin writer to cpu %d: %s\n", writer_cpu, strerror(-err));
+}
+
+/* sink writer thread: only persists the filled slots */
+void ring_writer()
+{
+  struct buf_slot *slot;
+  alog_thread_init();
+  trace_thread_init("writer");
+  pin_writer();
+
+  /* coalescing: packets are packed, written on a full buffer or when due */
+  if (coal.buf) {
+    int timed_out;
+    for (;;) {
+      slot = buf_ring_peek_until(&ring, coalesce_deadline(&coal), &timed_out);
+      if (!slot && !timed_out)
+        break;
+      if (write_error) {        // drain what the reader still committed
+        if (slot)
+          buf_ring_release(&ring);
+        continue;
+      }
+      int erc = slot ? coalesce_add(&coal, slot->data, slot->len)
+                     : coalesce_poll(&coal, lat_hist_now());
+      if (erc < 0)
+        writer_failed(erc);
+      if (!slot)
+        continue;
+      /* in the sink's staging buffer; the coalescing delay is lat_coalesce */
+      if (erc == 0)
+        lat_hist_since(&lat_persist, slot->ts);
+      buf_ring_release(&ring);
+    }
+    int err;
+    if (!write_error && (err = coalesce_flush(&coal)) < 0)
+      write_error = err;
+    return;
+  }
+
+  while ((slot = buf_ring_peek(&ring))) {
+    if (dstfd > 0 && !write_error) {
+      int erc = write_from_buffer(dstname, slot->data, slot->len);
+      if (erc < 0)
+        writer_failed(erc);
+      else
+        lat_hist_since(&lat_persist, slot->ts);
+    }
+    buf_ring_release(&ring);
+  }
+}
+
+/* magic ring reader: packets land back to back, never split at the wrap */
+void magic_reader(uint64_t bytes_remaining)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint64_t blocks = 0;
+  while (keepRunning && bytes_remaining > 0) {
+    uint64_t bytes = std::min(bytes_remaining, size);
+    /* one page of slack: the device may return more than requested */
+    char *dst = magic_ring_reserve(&mring, bytes + page_size);
+    if (!dst)
+      break;
+
+    ssize_t rc = read_to_buffer(srcname, dst, bytes);
+    if (rc < 0) { // ignore timeout
+      retry_backoff();
+      alog(ALOG_WARN, "%s: wait new data ...\n", srcname);
+      continue;
+    }
+    if (rc == 0) {
+      if (dev.is_stream())
+        continue;
+      break;
+    }
+
+    if (rc != (ssize_t)bytes)
+      alog(ALOG_DEBUG, "%s: read underflow 0x%lx/0x%lx.\n", srcname, rc, bytes);
+
+    magic_ring_produce(&mring, rc);
+    if (++blocks == 2)
+      allocs = alloc_count();
+
+    total_length += rc;
+    if(!daemon_flag)
+      bytes_remaining -= rc;
+  }
+
+  magic_ring_close(&mring);
+}
+
+/* magic ring writer: whatever is staged goes out in one contiguous write */
+void magic_writer()
+{
+  alog_thread_init();
+  trace_thread_init("writer");
+  pin_writer();
+
+  char *src;
+  size_t len;
+  while ((src = magic_ring_peek(&mring, &len))) {
+    /* a quarter of the ring at most, so the reader gets space back early */
+    len = std::min(len, mring.size / 4);
+    if (dstfd > 0 && !write_error) {
+      int erc = write_from_buffer(dstname, src, len);
+      if (erc < 0) {
+        write_error = erc;
+        keepRunning = 0;
+        magic_ring_close(&mring);
+      }
+    }
+    magic_ring_consume(&mring, len);
+  }
+}
+
+/* zero-copy mode: device -> pipe -> file, false to fall back to the copy path */
+bool splice_loop(uint64_t &bytes_remaining)
+{
+  TransportOptions opt;
+  opt.peer_fd = dstfd;
+  opt.blksize = size;
+  int err;
+  xfer = make_transport(TransportKind::SPLICE, dev, opt, &err);
+  if (!xfer) {
+    data_path = std::string("copy (splice: ") + strerror(-err) + ")";
+    return false;
+  }
+  xfer->lat = &lat_xfer; // device -> file in one call, no persist stage
+  xfer->publish(&shm, srcname);
+
+  while (keepRunning && bytes_remaining > 0) {
+    perf_stage_begin();
+    ssize_t rc = xfer->move(std::min(bytes_remaining, size));
+    perf_stage_end(&perf_read, rc > 0 ? rc : 0);
+    if (rc < 0 && splice_xfer_unsupported(rc)) {
+      data_path = std::string("copy (no splice: ") + strerror(-rc) + ")";
+      if (xfer->bytes)
+        xfer->report(srcname);
+      xfer.reset();
+      return false;
+    }
+    if (rc < 0 && xfer->timed_out(rc)) { // ignore timeout
+      retry_backoff();
+      alog(ALOG_WARN, "%s: wait new data ...\n", srcname);
+      continue;
+    }
+    if (rc < 0)
+      cleanup("splice", rc);
+    if (rc == 0) {
+      if (dev.is_stream())
+        continue;
+      break;
+    }
+
+    alog(ALOG_DEBUG, "splice %s -> %s: 0x%lx.\n", srcname, dstname, rc);
+
+    err = sink_account(&sink, sink.offset + rc);
+    if (err < 0)
+      cleanup("write outfile", err);
+
+    total_length += rc;
+    if(!daemon_flag)
+      bytes_remaining -= rc;
+  }
+
+  data_path = "splice";
+  return true;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -114,6 +487,8 @@ int main(int argc, char *argv[])
 
   //
   signal(SIGINT, sigHandler);
+  lat_hist_report_on(SIGUSR1);
+  trace_toggle_on(SIGUSR2);
 
   //
   po::options_description desc("allowed opitons");
@@ -124,8 +499,31 @@ int main(int argc, char *argv[])
     ("daemon_flag,d", po::bool_switch(&daemon_flag), "As daemon_flag servic")
     ("length,l", po::value<uint64_t>(&length)->default_value(LENGTH_DEFAULT), "total length of reading (in bytes)")
     ("size,s", po::value<uint64_t>(&size)->default_value(BLKSIZE_DEFAULT), "block size of a single dma request")
+    ("ring,r", po::value<unsigned>(&ring_depth)->default_value(RING_DEPTH_DEFAULT), "depth of the buffer ring between reader and writer threads (0: single thread)")
+    ("magic-ring", po::value<uint64_t>(&magic_size)->implicit_value(MAGIC_RING_DEFAULT), "stage reads back to back in a double-mapped ring of this many bytes (default 64 MiB), written out by a writer thread as they come; replaces --ring")
+    ("coalesce", po::value<uint64_t>(&coalesce_size)->implicit_value(COALESCE_SIZE_DEFAULT), "pack packets into sink writes of this many bytes (default 4 MiB; 0: off), in the ring's writer thread")
+    ("coalesce-us", po::value<unsigned>(&coalesce_us)->default_value(COALESCE_US_DEFAULT), "--coalesce: write out at the latest this long (us) after a packet came in")
+    ("packet-index", po::value<std::string>(&packet_index), "--coalesce: file of the packet lengths, LEB128 varints (default <output>.idx, 'none': not kept)")
     ("input,i", po::value<std::string>(&infile)->default_value(DEVICE_NAME_DEFAULT), "xdma C2H device node")
-    ("output,o", po::value<std::string>(&outfile), "name of the file saving data");
+    ("output,o", po::value<std::string>(&outfile), "name of the file saving data ('-': stdout)")
+    ("sink", po::value<std::string>(&sink_mode_str)->default_value(SINK_MODE_DEFAULT), "output write mode: sync, direct, writeback, buffered or mmap")
+    ("segment-size", po::value<uint64_t>(&segment_size)->default_value(0), "rotate the output into numbered segments of this many bytes (0: off)")
+    ("segment-time", po::value<unsigned>(&segment_time)->default_value(0), "rotate the output into numbered segments every N seconds (0: off)")
+    ("splice", po::bool_switch(&use_splice), "zero-copy device -> output with splice(2), falls back to read/write when unsupported")
+    ("transport", po::value<std::string>(&transport_str)->default_value(TRANSPORT_DEFAULT), "device reads: sync, aio, uring or splice (as --splice)")
+    ("wait-mode", po::value<std::string>(&wait_mode_str)->default_value(AIO_WAIT_DEFAULT), "retry after a failed read: block/eventfd (short sleep), poll or spin (retry at once)")
+    ("spin-us", po::value<unsigned>(&spin_us)->default_value(AIO_WAIT_SPIN_US_DEFAULT), "spin: immediate retries (us) before sleeping")
+    ("numa", po::value<std::string>(&numa_str)->default_value("auto"), "staging buffers' numa node: auto (the device's), off or a node number")
+    ("pin", po::value<std::string>(&pin_str)->default_value("auto"), "reader[,writer] cpus: auto (next to the device's interrupts), off or e.g. 2,3")
+    ("topology-root", po::value<std::string>(&topology_root)->default_value(TOPO_ROOT_DEFAULT), "root of the sysfs/proc tree the topology is read from")
+    ("realtime", po::value<int>(&rt_prio)->implicit_value(RT_PRIO_DEFAULT), "mlockall, pre-faulted stack, SCHED_FIFO reader at this priority (default 50) on an isolated cpu")
+    ("log-level", po::value<std::string>(&log_level_str)->default_value(ALOG_LEVEL_DEFAULT), "error, warn, info or debug (-v: debug)")
+    ("no-stats", po::bool_switch(&no_stats), "do not publish live counters for jw_stat")
+    ("latency-file", po::value<std::string>(&latency_file), "save the latency histograms here at exit (merge with jw_lat_merge); SIGUSR1 prints them")
+    ("trace", po::bool_switch(&trace), "record the pipeline trace from the start; SIGUSR2 starts/stops it at any time")
+    ("trace-file", po::value<std::string>(&trace_file), "write the pipeline trace here, Chrome/Perfetto JSON (default /tmp/jw_from_device.<pid>.trace.json)")
+    ("perf", po::bool_switch(&perf), "count cycles, instructions, LLC/dTLB misses and context switches per stage and thread (perf_event_open), per GB at exit")
+    ("hugepages", po::value<std::string>(&hugepages)->default_value(DMA_MEM_DEFAULT)->implicit_value("2m"), "staging buffers: off, 4k (pre-faulted, locked), 2m or 1g hugepages");
 
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -135,13 +533,68 @@ int main(int argc, char *argv[])
     return 0;
   }
 
+  size_t huge_page;
+  if (dma_mem_parse(hugepages.c_str(), &huge_page) < 0) {
+    std::cout << "unknown hugepages size: " << hugepages << "\n";
+    exit(1);
+  }
+  dma_mem_setup(huge_page);
+
+  if (aio_waiter_parse_mode(wait_mode_str.c_str(), &wait_mode) < 0) {
+    std::cout << "unknown wait mode: " << wait_mode_str << "\n";
+    exit(1);
+  }
+  if (transport_parse(transport_str.c_str(), &transport_kind) < 0) {
+    std::cout << "unknown transport: " << transport_str << "\n";
+    exit(1);
+  }
+  if (transport_kind == TransportKind::SPLICE) {
+    use_splice = true;
+    transport_kind = TransportKind::SYNC; // when splice falls back
+  }
+  if (topology_parse_node(numa_str.c_str(), &numa_node) < 0 ||
+      topology_parse_pin(pin_str.c_str(), &reader_cpu, &writer_cpu) < 0) {
+    std::cout << "bad --numa or --pin: " << numa_str << ", " << pin_str << "\n";
+    exit(1);
+  }
+  enum alog_level log_level;
+  if (alog_parse_level(log_level_str.c_str(), &log_level) < 0) {
+    std::cout << "unknown log level: " << log_level_str << "\n";
+    exit(1);
+  }
+  if (verbose)
+    log_level = ALOG_DEBUG;
+
   // output file
   if(vm.count("output")) {
     dstname = outfile.c_str();
-    if ((dstfd = open(dstname, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, 0666)) < 0) {
-      perror(dstname);
+    enum sink_mode mode;
+    if (sink_parse_mode(sink_mode_str.c_str(), &mode) < 0) {
+      std::cout << "unknown sink mode: " << sink_mode_str << "\n";
       exit(1);
     }
+    segmented = segment_size || segment_time;
+    int err;
+    if (outfile == "-") {
+      if (segmented) {
+        std::cout << "segmented output needs a file name\n";
+        exit(1);
+      }
+      // data owns the original stdout, messages go to stderr
+      int fd = dup(STDOUT_FILENO);
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+      dstname = "stdout";
+      err = fd < 0 ? -errno : sink_attach(&sink, fd, dstname, mode, 0);
+    }
+    else if (segmented)
+      err = segment_open(&segments, dstname, mode, 0, segment_size, segment_time);
+    else
+      err = sink_open(&sink, dstname, mode, 0);
+    if (err < 0) {
+      fprintf(stderr, "%s: %s\n", dstname, strerror(-err));
+      exit(1);
+    }
+    dstfd = segmented ? segments.cur->sink.fd : sink.fd;
   }
 
 	/*
@@ -149,29 +602,198 @@ int main(int argc, char *argv[])
 	 * EOP (end-of-packet), streaming mode only
 	 */
   srcname = infile.c_str();
-  if(!eop_flush)
-    srcfd = open(srcname, O_RDONLY);
-  else
-    srcfd = open(srcname, O_RDONLY | O_TRUNC);
-  if (srcfd < 0) {
-    perror(srcname);
+  int open_err = dev.open(infile, DeviceChannel::READ, eop_flush);
+  if (open_err < 0) {
+    fprintf(stderr, "%s: %s\n", srcname, strerror(-open_err));
     if(dstfd > 0) close(dstfd);
     exit(1);
   }
 
+  lat_hist_init(&lat_xfer, "%s submit->complete", srcname);
+  trace_init("jw_from_device", trace_file.c_str(), trace);
+  if (!no_stats) {
+    int err = stat_shm_create(&shm, "jw_from_device");
+    if (err < 0)
+      fprintf(stderr, "live counters: %s\n", strerror(-err));
+  }
+  lat_hist_init(&lat_persist, "%s complete->persisted", srcname);
+  perf_stage_init(&perf_read, "%s read", srcname);
+  perf_stage_init(&perf_write, "%s write", dstname ? dstname : "-");
+  if (perf)
+    perf_stage_enable();
+
+  /* place buffers and threads next to the device */
+  topology_discover(&topo, topology_root.c_str(), srcname);
+  bool pin_auto = reader_cpu == TOPO_AUTO;
+  topology_place(&topo, &numa_node, &reader_cpu, &writer_cpu);
+  if (rt_prio && pin_auto)
+    reader_cpu = realtime_pick_cpu(reader_cpu,
+                                   CPU_COUNT(&topo.node_cpus) ? &topo.node_cpus : NULL);
+  if (writer_cpu == reader_cpu)
+    writer_cpu = TOPO_OFF;      // moved onto an isolated cpu the writer had
+  topology_report(&topo, srcname);
+  fprintf(stdout, "%s: buffers on numa node %d, reader cpu %d, writer cpu %d (-1: any)\n",
+          srcname, numa_node, reader_cpu, writer_cpu);
+  dma_mem_set_node(numa_node);
+  if (rt_prio) {
+    int err = realtime_lock();
+    if (err < 0)
+      fprintf(stderr, "mlockall: %s\n", strerror(-err));
+  }
+
+  // the transfer loops below only log through alog
+  alog_start(log_level, ALOG_RATE_DEFAULT);
+  alog_thread_init();
+
+  //
+  uint64_t bytes_remaining = daemon_flag ? size : length;
+
+  /* zero-copy mode replaces both copy paths below unless unsupported */
+  if (use_splice) {
+    if (coalesce_size && dstfd > 0)
+      data_path = "copy (splice: coalesced output)";
+    else if (dstfd <= 0)
+      data_path = "copy (splice: no output)";
+    else if (segmented)
+      data_path = "copy (splice: segmented output)";
+    else if (sink.mode == SINK_DIRECT)
+      data_path = "copy (splice: direct sink stages in user space)";
+    else {
+      become_reader();
+      realtime_begin(&rt);
+      if (splice_loop(bytes_remaining))
+        cleanup("Normal exit", 0);
+    }
+  }
+
+  /* copy paths: the device is read through the chosen transport */
+  TransportOptions opt;
+  opt.wait_mode = wait_mode;
+  opt.spin_us = spin_us;
+  opt.running = &keepRunning;
+  int xfer_err;
+  xfer = make_transport(transport_kind, dev, opt, &xfer_err);
+  if (!xfer) {
+    std::cout << transport_name(transport_kind) << " transport: " << strerror(-xfer_err)
+              << ", falling back to sync\n";
+    xfer = make_transport(TransportKind::SYNC, dev, opt, &xfer_err);
+  }
+  xfer->lat = &lat_xfer;
+  xfer->publish(&shm, srcname);
+
+  /* coalescing runs in the writer thread, so it needs the ring */
+  if (coalesce_size && dstfd > 0) {
+    if (magic_size) {
+      std::cout << "--magic-ring: not with --coalesce, using the buffer ring\n";
+      magic_size = 0;
+    }
+    if (!ring_depth) {
+      ring_depth = COALESCE_RING_DEPTH;
+      std::cout << "--coalesce: ring mode, depth " << ring_depth << "\n";
+    }
+    if (packet_index.empty() && outfile != "-")
+      packet_index = outfile + ".idx";
+    if (!packet_index.empty() && packet_index != "none") {
+      index_fd = open(packet_index.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (index_fd < 0) {
+        perror(packet_index.c_str());
+        exit(1);
+      }
+    }
+    if (coalesce_init(&coal, coalesce_size, size, coalesce_us, index_fd,
+                      coalesce_sink, NULL) < 0) {
+      std::cout << "Error allocating coalescing buffer\n";
+      exit(1);
+    }
+    lat_hist_init(&lat_coalesce, "%s coalesced->written", dstname);
+    coal.lat_flush = &lat_coalesce;
+  }
+
+  /* decoupled mode, variable-length reads: reader -> magic ring -> writer */
+  if (magic_size) {
+    int err = magic_ring_init(&mring, std::max<uint64_t>(magic_size, 4 * (size + page_size)),
+                              huge_page);
+    if (err < 0) {
+      std::cout << "Error mapping magic ring: " << strerror(-err) << "\n";
+      if(dstfd > 0) close(dstfd);
+      dev.close();
+      exit(1);
+    }
+    magic_ring_publish(&mring, &shm, srcname);
+    if (ring_depth)
+      std::cout << "--magic-ring replaces --ring " << ring_depth << "\n";
+
+    trace_thread_init("reader");
+    std::thread writer(magic_writer);
+    become_reader();
+    realtime_begin(&rt);
+    magic_reader(daemon_flag ? UINT64_MAX : bytes_remaining);
+    writer.join();
+    loop_done();
+
+    magic_ring_report(&mring, srcname);
+    magic_ring_free(&mring);
+    if (write_error)
+      cleanup("write outfile", write_error);
+    cleanup("Normal exit", 0);
+  }
+
+  /* decoupled mode: reader (this thread) -> ring -> writer thread */
+  if (ring_depth) {
+    if (buf_pool_init(&pool, ring_depth, size) < 0 ||
+        buf_ring_init(&ring, &pool, ring_depth) < 0) {
+      std::cout << "Error allocating buffer ring\n";
+      if(dstfd > 0) close(dstfd);
+      dev.close();
+      exit(1);
+    }
+    buf_ring_publish(&ring, &shm, srcname);
+
+    if(verbose) {
+      std::cout << "page-size: " << page_size << ", ";
+      std::cout << "dev: " << infile << ", ";
+      std::cout << "blk-size: " << size << ", ";
+      std::cout << "ring-depth: " << ring_depth << ", ";
+      if(daemon_flag)
+        std::cout << "in daemon mode\n";
+      else
+        std::cout << "length to read: " << bytes_remaining << "\n";
+    }
+
+    if (huge_page || numa_node >= 0)
+      dma_mem_report(srcname);
+
+    trace_thread_init("reader");
+    std::thread writer(ring_writer);
+    become_reader();
+    realtime_begin(&rt);
+    ring_reader(daemon_flag ? UINT64_MAX : bytes_remaining);
+    writer.join();
+    loop_done();
+
+    buf_ring_report(&ring, srcname);
+    buf_ring_free(&ring);
+    if (write_error)
+      cleanup("write outfile", write_error);
+    cleanup("Normal exit", 0);
+  }
+
   /* buffer init */
   /* - must aligned with memory page size
    * - one extra page is allocated since may be more data than requested (the transfer unit is 8 bytes)
    */
-	int err = posix_memalign((void **)&allocated, page_size, size + page_size);
-	if (err || !allocated) {
+	struct buf_item *item = NULL;
+	if (buf_pool_init(&pool, 1, size) == 0)
+	  item = buf_pool_get(&pool);
+	allocated = item ? item->data : NULL;
+	if (!allocated) {
     std::cout << "Error allocating aligned memory\n";
     if(dstfd > 0) close(dstfd);
-    if(srcfd > 0) close(srcfd);
+    dev.close();
+    exit(1);
 	}
-
-  //
-  uint64_t bytes_remaining = daemon_flag ? size : length;
+  if (huge_page || numa_node >= 0)
+    dma_mem_report(srcname);
 
 	if(verbose) {
     std::cout << "page-size: " << page_size << ", ";
@@ -184,45 +806,62 @@ int main(int argc, char *argv[])
       std::cout << "length to read: " << bytes_remaining << "\n";
   }
 
-  uint64_t loop = 0;
+  /* mmap sink: no user buffer in between, one copy less */
+  bool mapped = dstfd > 0 && !segmented && sink.mode == SINK_MMAP;
+  if (mapped)
+    data_path = "mmap";
+
+  uint64_t loop = 0, blocks = 0;
+  become_reader();
+  realtime_begin(&rt);
 	while (keepRunning && bytes_remaining > 0) {
-    if(verbose)
-      std::cout << "\n" << ++loop << " blk, remaining bytes: " << bytes_remaining  << std::endl;
+    alog(ALOG_DEBUG, "\n%lu blk, remaining bytes: %lu\n", ++loop, bytes_remaining);
+    if (++blocks == 2) // steady state from the second block on
+      allocs = alloc_count();
     
     int bytes_done = 0;
     char* buffer = allocated;
     int iosize = std::min(bytes_remaining, size);
 
     while(bytes_done < iosize) {
-      if(verbose)
-        std::cout << "inside one dma blk transfer (" << bytes_done << " / " << iosize << ")" << std::endl;
+      alog(ALOG_DEBUG, "inside one dma blk transfer (%d / %d)\n", bytes_done, iosize);
 
       uint64_t bytes = iosize - bytes_done;
-      int rc = read_to_buffer(srcname, srcfd, buffer, bytes);
+      char *dst = buffer;
+      if (mapped) { // the device reads straight into the output file
+        size_t avail;
+        dst = sink_reserve(&sink, bytes, &avail);
+        if (!dst)
+          cleanup("map outfile", -errno);
+        bytes = avail;
+      }
+      int rc = read_to_buffer(srcname, dst, bytes);
       if (rc < 0) { // ignore timeout
-        usleep(100);
-        fprintf(stderr, "%s: wait new data ...\n", srcname);
+        retry_backoff();
+        alog(ALOG_WARN, "%s: wait new data ...\n", srcname);
         if(keepRunning)
           continue;
         else
           cleanup("Grace exit", 0);
       }
+      if (rc == 0 && !dev.is_stream())
+        cleanup("End of input", 0);
 
       // if (rc < 0) {
       //   fprintf(stderr, "%s: IO error\n", devname);
       //   goto out;
       // }
 
-      if (rc != bytes) {
-        fprintf(stderr, "%s: read underflow 0x%lx/0x%lx.\n",
-                srcname, rc, bytes);
-      }
+      if (rc != bytes)
+        alog(ALOG_WARN, "%s: read underflow 0x%x/0x%lx.\n", srcname, rc, bytes);
 
       if (dstfd > 0) {
-        int erc = write_from_buffer(dstname, dstfd, buffer, rc);
+        int erc = mapped ? sink_commit(&sink, rc)
+                         : write_from_buffer(dstname, buffer, rc);
         if (erc < 0) {
           cleanup("write outfile", erc);
         }
+        lat_hist_since(&lat_persist, xfer->done_ns);
       }
 
       //
@@ -234,8 +873,7 @@ int main(int argc, char *argv[])
         bytes_remaining -= rc;
     }
 
-    if(verbose)
-      std::cout <<"ready for next blk\n";
+    alog(ALOG_DEBUG, "ready for next blk\n");
 	}
 
   cleanup("Normal exit", 0);
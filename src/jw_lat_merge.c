@@ -0,0 +1,88 @@
+/*
+ * Merge the latency histograms saved by the tools' --latency-file (one
+ * file per host or run), print the combined percentile table and
+ * optionally save the merged histograms again.
+ *
+ *   jw_lat_merge [-o merged.lat] host1.lat host2.lat ...
+ *
+ * Histograms are matched by name, so the same device on several hosts
+ * adds up; give each host its own node names to keep them apart.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lat_hist.h"
+
+static struct option const long_opts[] = {
+	{"output", required_argument, NULL, 'o'},
+	{"help", no_argument, NULL, 'h'},
+	{0, 0, 0, 0}
+};
+
+static void usage(const char *name)
+{
+	fprintf(stdout, "usage: %s [OPTIONS] FILE...\n\n", name);
+	fprintf(stdout, "Merge latency histogram files (--latency-file) by name\n\n");
+	fprintf(stdout, "  -%c (--%s) save the merged histograms to this file\n",
+		long_opts[0].val, long_opts[0].name);
+	fprintf(stdout, "  -%c (--%s) print usage help and exit\n",
+		long_opts[1].val, long_opts[1].name);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct lat_hist *list[LAT_HIST_MAX];
+	struct lat_hist *hists;
+	const char *ofname = NULL;
+	unsigned n = 0, i;
+	int cmd_opt, rc;
+
+	while ((cmd_opt = getopt_long(argc, argv, "ho:", long_opts, NULL)) != -1) {
+		switch (cmd_opt) {
+		case 'o':
+			ofname = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(0);
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	hists = calloc(LAT_HIST_MAX, sizeof(*hists));
+	if (!hists) {
+		fprintf(stderr, "OOM\n");
+		exit(1);
+	}
+	for (; optind < argc; optind++) {
+		rc = lat_hist_load(argv[optind], hists, LAT_HIST_MAX, &n);
+		if (rc < 0) {
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(-rc));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		list[i] = &hists[i];
+	lat_hist_print(stdout, list, n);
+
+	if (ofname) {
+		FILE *f = fopen(ofname, "w");
+		rc = f ? lat_hist_write(f, list, n) : -errno;
+		if (f && fclose(f) && !rc)
+			rc = -errno;
+		if (rc < 0) {
+			fprintf(stderr, "%s: %s\n", ofname, strerror(-rc));
+			exit(1);
+		}
+	}
+	free(hists);
+	return 0;
+}
@@ -0,0 +1,222 @@
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <string>
+#include <vector>
+
+#include "stat_shm.h"
+
+#define SHM_DIR "/dev/shm"
+#define HEADER_EVERY 20
+
+namespace po = boost::program_options;
+
+//
+volatile sig_atomic_t keepRunning = 1;
+void sigHandler(int sig) {
+  keepRunning = 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool alive(pid_t pid)
+{
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/* the jw-dpu segments in /dev/shm */
+static std::vector<std::string> segments()
+{
+  std::vector<std::string> names;
+  DIR *dir = opendir(SHM_DIR);
+  if (!dir)
+    return names;
+  while (struct dirent *de = readdir(dir)) {
+    if (!strncmp(de->d_name, STAT_SHM_PREFIX, strlen(STAT_SHM_PREFIX)))
+      names.push_back(de->d_name);
+  }
+  closedir(dir);
+  return names;
+}
+
+/* "jw-dpu.<tool>.<pid>": matches the full name, the tool or the pid */
+static bool matches(const std::string &name, const std::string &what)
+{
+  if (name == what || name == STAT_SHM_PREFIX + what)
+    return true;
+  size_t dot = name.rfind('.');
+  std::string tool = name.substr(strlen(STAT_SHM_PREFIX), dot - strlen(STAT_SHM_PREFIX));
+  return tool == what || name.substr(dot + 1) == what;
+}
+
+static void list(bool remove_stale)
+{
+  for (auto &name : segments()) {
+    struct stat_shm s;
+    int err = stat_shm_attach(&s, name.c_str());
+    if (err < 0) {
+      printf("%-40s %s\n", name.c_str(), strerror(-err));
+      continue;
+    }
+    pid_t pid = s.seg->hdr.pid;
+    bool running = alive(pid);
+    printf("%-40s %-16s pid %-8d %u counters%s\n", name.c_str(), s.seg->hdr.tool,
+           pid, s.seg->hdr.count, running ? "" : " (ended)");
+    stat_shm_detach(&s);
+    if (!running && remove_stale) {
+      std::string path = "/" + name;
+      if (shm_unlink(path.c_str()) == 0)
+        printf("%-40s removed\n", name.c_str());
+    }
+  }
+}
+
+struct column {
+  const struct stat_entry *e;
+  std::string label;            // bytes are shown in MB/s
+  unsigned width;
+  uint64_t last;
+};
+
+/* vmstat style: the groups over their columns, then the counter names */
+static void header(const std::vector<column> &cols)
+{
+  std::string groups = "      ", names = "  secs";
+  size_t i = 0;
+  while (i < cols.size()) {
+    size_t j = i;
+    unsigned span = 0;
+    while (j < cols.size() && !strcmp(cols[j].e->group, cols[i].e->group))
+      span += cols[j++].width + 1;
+    std::string g = cols[i].e->group;
+    if (g.size() > span - 1)
+      g = g.substr(g.size() - (span - 1));
+    size_t dashes = span - 1 - g.size();
+    groups += " " + std::string(dashes / 2, '-') + g + std::string(dashes - dashes / 2, '-');
+    for (; i < j; i++) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), " %*s", cols[i].width, cols[i].label.c_str());
+      names += buf;
+    }
+  }
+  printf("%s\n%s\n", groups.c_str(), names.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+  std::string what;
+  double interval;
+  unsigned count;
+  bool list_only = false, remove_stale = false;
+
+  //
+  signal(SIGINT, sigHandler);
+  signal(SIGTERM, sigHandler);
+
+  //
+  po::options_description desc("allowed opitons");
+  desc.add_options()
+    ("help,h","help message")
+    ("segment", po::value<std::string>(&what), "segment to watch: its name, tool or pid (default: the only one)")
+    ("interval,i", po::value<double>(&interval)->default_value(1.0), "seconds between lines")
+    ("count,c", po::value<unsigned>(&count)->default_value(0), "lines to print (0: until the tool ends)")
+    ("list,l", po::bool_switch(&list_only), "list the segments and exit")
+    ("remove-stale,r", po::bool_switch(&remove_stale), "with --list: remove the segments of ended tools");
+  po::positional_options_description pos;
+  pos.add("segment", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << "usage: jw_stat [segment] [options]: counters per second, levels as they are\n";
+    std::cout << desc << "\n";
+    return 0;
+  }
+  if (list_only) {
+    list(remove_stale);
+    return 0;
+  }
+
+  std::vector<std::string> found;
+  for (auto &name : segments())
+    if (what.empty() || matches(name, what))
+      found.push_back(name);
+  if (found.size() != 1) {
+    std::cout << (found.empty() ? "no segment" : "more than one segment")
+              << (what.empty() ? "" : " for " + what) << ", running tools:\n";
+    list(false);
+    return 1;
+  }
+
+  struct stat_shm s;
+  int err = stat_shm_attach(&s, found[0].c_str());
+  if (err < 0) {
+    fprintf(stderr, "%s: %s\n", found[0].c_str(), strerror(-err));
+    return 1;
+  }
+  const struct stat_header *hdr = &s.seg->hdr;
+  printf("%s: %s, pid %d\n", found[0].c_str(), hdr->tool, hdr->pid);
+
+  std::vector<column> cols;
+  double t_last = now(), t_start = hdr->start_ns / 1e9;
+  unsigned lines = 0, since_header = 0;
+  bool ended = false;
+  while (keepRunning && !ended && (!count || lines < count)) {
+    /* counters are only ever added, at set-up */
+    uint32_t n = __atomic_load_n(&s.seg->hdr.count, __ATOMIC_ACQUIRE);
+    if (n != cols.size()) {
+      for (uint32_t i = cols.size(); i < n; i++) {
+        const struct stat_entry *e = &s.seg->entries[i];
+        std::string label = e->name;
+        if (e->kind == STAT_BYTES)
+          label = label == "bytes" ? "MB/s" : label + " MB/s";
+        unsigned w = std::max<unsigned>(label.size(), 8);
+        cols.push_back({e, label, w, stat_get(&e->value)});
+      }
+      since_header = 0;
+    }
+
+    struct timespec ts = {(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+    while (nanosleep(&ts, &ts) && keepRunning)
+      ;
+    ended = !alive(hdr->pid);
+    double t = now(), secs = t - t_last;
+    t_last = t;
+
+    if (since_header++ % HEADER_EVERY == 0)
+      header(cols);
+    printf("%6.0f", t - t_start);
+    for (auto &c : cols) {
+      uint64_t v = stat_get(&c.e->value);
+      if (c.e->kind == STAT_GAUGE)
+        printf(" %*lu", c.width, v);
+      else if (c.e->kind == STAT_BYTES)
+        printf(" %*.1f", c.width, secs > 0 ? (v - c.last) / secs / 1e6 : 0.0);
+      else
+        printf(" %*.0f", c.width, secs > 0 ? (v - c.last) / secs : 0.0);
+      c.last = v;
+    }
+    printf("\n");
+    fflush(stdout);
+    lines++;
+  }
+  if (ended)
+    printf("%s: pid %d ended\n", hdr->tool, hdr->pid);
+  stat_shm_detach(&s);
+  return 0;
+}
@@ -10,6 +10,7 @@
 
 #include <sys/types.h>
 #include "dma_utils.h"
+#include "transport.h"
 
 /* ltoh: little endian to host */
 /* htol: host to little endian */
@@ -44,7 +45,9 @@ int main(int argc, char **argv)
   int blk_size=8;
 
   //
-	int fd;
+	DeviceChannel dev;
+	std::unique_ptr<Transport> xfer;
+	TransportOptions opt;
 	int err = 0;
 	uint64_t read_result, writeval;
 	char access_width = 'l';
@@ -83,16 +86,19 @@ int main(int argc, char **argv)
 	else {
 		printf("default to long (64-bits)\n");
 	}
+	blk_size = size;
 
   /* open the device */
-	if ((fd = open(argv[1], O_RDWR)) == -1) {
-		printf("character device %s opened failed: %s.\n", argv[1], strerror(errno));
-		return -errno;
+	err = dev.open(argv[1], argc >= 4 ? DeviceChannel::WRITE : DeviceChannel::READ);
+	if (err < 0) {
+		printf("character device %s opened failed: %s.\n", argv[1], strerror(-err));
+		return err;
 	}
 	printf("character device %s opened.\n", argv[1]);
+	xfer = make_transport(TransportKind::SYNC, dev, opt, &err);
 
   /* memory alignment */
-  char* allocated;
+  char* allocated = NULL;
 	err = posix_memalign((void **)&allocated, page_size, page_size);
 	if (err || !allocated) {
     printf("Error allocating aligned memory\n");
@@ -103,37 +109,42 @@ int main(int argc, char **argv)
 	if (argc <= 3) {
     /* read until required nr of bytes */
     while (1) {
-      err = read_to_buffer(argv[1], fd, allocated, blk_size, 0);
-      if (err < 0) { // ignore the any error and continue
+      err = xfer->read(allocated, blk_size);
+      if (err <= 0 && xfer->timed_out(err)) { // ignore the timeout and continue
         fprintf(stderr, "%s: wait new data ...\n", argv[1]);
         usleep(100);
         continue;
       }
       break;
     }
-    
+    if (err < blk_size) {
+      fprintf(stderr, "%s: %s\n", argv[1], err < 0 ? strerror(-err) : "no data");
+      err = 1;
+      goto close;
+    }
+
 		switch (access_width) {
 		case 'b':
 			read_result = *((uint8_t *) allocated);
-			printf ("Read 8-bits value : 0x%02x\n", (uint64_t)read_result);
+			printf ("Read 8-bits value : 0x%02x\n", (unsigned)read_result);
 			break;
 		case 'h':
 			read_result = *((uint16_t *) allocated);
 			/* swap 16-bit endianess if host is not little-endian */
 			/* read_result = ltohs(read_result); */
-			printf ("Read 16-bit value: 0x%04x\n", (uint64_t)read_result);
+			printf ("Read 16-bit value: 0x%04x\n", (unsigned)read_result);
 			break;
 		case 'w':
 			read_result = *((uint32_t *) allocated);
 			/* swap 32-bit endianess if host is not little-endian */
 			/* read_result = ltohl(read_result); */
-			printf ("Read 32-bit value : 0x%08x\n", (uint64_t)read_result);
+			printf ("Read 32-bit value : 0x%08x\n", (unsigned)read_result);
 			break;
 		case 'l':
 			read_result = *((uint64_t *) allocated);
 			/* swap 32-bit endianess if host is not little-endian */
 			/* read_result = ltohl(read_result); */
-			printf ("Read 32-bit value : 0x%16lx\n", (uint64_t)read_result);
+			printf ("Read 64-bit value : 0x%016lx\n", (uint64_t)read_result);
 			break;
 		default:
 			fprintf(stderr, "Illegal data type '%c'.\n", access_width);
@@ -143,7 +154,7 @@ int main(int argc, char **argv)
 
     printf("Read %d bytes (hex): ", blk_size);
     for(int i=0;i<blk_size;i++) {
-      printf("%02x ", allocated[i]);
+      printf("%02x ", (unsigned char)allocated[i]);
     }
     printf("\n");
 	}
@@ -152,28 +163,30 @@ int main(int argc, char **argv)
 	if (argc >= 4) {
 		writeval = strtoul(argv[3], 0, 0);
     push_to_buffer(writeval, allocated);
-    err = write_from_buffer(argv[1], fd, allocated, blk_size, 0);
-    if (err < 0) {
+    err = xfer->write(allocated, blk_size);
+    if (err < blk_size) {
       fprintf(stderr, "%s: can't write data\n", argv[1]);
+      err = 1;
       goto close;
     }
+    err = 0;
 
 		switch (access_width) {
 		case 'b':
-			printf("Write 8-bits value 0x%02x\n", writeval);
+			printf("Write 8-bits value 0x%02x\n", (unsigned)writeval);
 			break;
 		case 'h':
-			printf("Write 16-bits value 0x%04x\n", writeval);
+			printf("Write 16-bits value 0x%04x\n", (unsigned)writeval);
 			/* swap 16-bit endianess if host is not little-endian */
 			/* writeval = htols(writeval); */
 			break;
 		case 'w':
-			printf("Write 32-bits value 0x%08x\n", writeval);
+			printf("Write 32-bits value 0x%08x\n", (unsigned)writeval);
 			/* swap 32-bit endianess if host is not little-endian */
 			/* writeval = htoll(writeval); */
 			break;
 		case 'l':
-			printf("Write 64-bits value 0x%16lx\n", writeval);
+			printf("Write 64-bits value 0x%016lx\n", writeval);
       break;
 		default:
 			fprintf(stderr, "Illegal data type '%c'.\n",
@@ -183,7 +196,7 @@ int main(int argc, char **argv)
 	}
 
 close:
-	close(fd);
+	dev.close();
   free(allocated);
 
 	return err;
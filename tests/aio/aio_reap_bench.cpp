@@ -0,0 +1,182 @@
+// libaio completion reaping: io_getevents() vs the userspace ring reaper,
+// `depth` reads kept in flight against a regular file
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "aio_ring.h"
+
+namespace po = boost::program_options;
+
+#define FILENAME_DEFAULT "aio_reap_bench.dat"
+#define FILESIZE_DEFAULT (64 << 20)
+
+struct result {
+  uint64_t completions;
+  uint64_t reaps;
+  uint64_t syscalls;
+  double secs;
+};
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(int fd, off_t file_size, size_t blksize, int depth,
+               uint64_t count, bool user_reap, struct result *r)
+{
+  io_context_t ctx = 0;
+  int rc = io_setup(depth, &ctx);
+  if (rc < 0)
+    return rc;
+  if (user_reap && !aio_ring_usable(ctx)) {
+    io_destroy(ctx);
+    return -EOPNOTSUPP;
+  }
+
+  char *bufs;
+  if (posix_memalign((void **)&bufs, 4096, blksize * depth)) {
+    io_destroy(ctx);
+    return -ENOMEM;
+  }
+  std::vector<struct iocb> iocbs(depth);
+  std::vector<struct iocb *> batch(depth);
+  std::vector<struct io_event> events(depth);
+  uint64_t blocks = file_size / blksize, next = 0, submitted = 0;
+
+  memset(r, 0, sizeof(*r));
+  double t0 = now();
+
+  for (int i = 0; i < depth && submitted < count; i++, submitted++) {
+    io_prep_pread(&iocbs[i], fd, bufs + i * blksize, blksize,
+                  (next++ % blocks) * blksize);
+    batch[i] = &iocbs[i];
+  }
+  rc = io_submit(ctx, submitted, batch.data());
+
+  while (rc >= 0 && r->completions < count) {
+    int n;
+    r->reaps++;
+    if (user_reap) {
+      n = aio_ring_reap(ctx, depth, events.data());
+      if (!n) {
+        r->syscalls++;
+        n = io_getevents(ctx, 1, depth, events.data(), NULL);
+      }
+    }
+    else {
+      r->syscalls++;
+      n = io_getevents(ctx, 1, depth, events.data(), NULL);
+    }
+    if (n < 0) {
+      rc = n;
+      break;
+    }
+
+    int nb = 0;
+    for (int i = 0; i < n; i++) {
+      if ((long)events[i].res != (long)blksize) {
+        rc = (long)events[i].res < 0 ? (long)events[i].res : -EIO;
+        break;
+      }
+      r->completions++;
+      if (submitted < count) {
+        struct iocb *io = events[i].obj;
+        io_prep_pread(io, fd, io->u.c.buf, blksize, (next++ % blocks) * blksize);
+        batch[nb++] = io;
+        submitted++;
+      }
+    }
+    if (rc >= 0 && nb)
+      rc = io_submit(ctx, nb, batch.data());
+  }
+
+  r->secs = now() - t0;
+  io_destroy(ctx);
+  free(bufs);
+  return rc < 0 ? rc : 0;
+}
+
+static void print(const char *name, const struct result *r)
+{
+  std::cout << name << ": " << r->completions << " completions in "
+            << r->secs << " s, " << r->completions / r->secs / 1e3
+            << " kIOPS, " << r->secs * 1e9 / r->completions << " ns each, "
+            << (double)r->completions / r->reaps << " per reap, "
+            << (double)r->syscalls / r->completions
+            << " reap syscalls per completion\n";
+}
+
+int main(int argc, char *argv[])
+{
+  std::string filename;
+  size_t blksize;
+  int depth;
+  uint64_t count;
+  bool direct = false;
+
+  po::options_description desc("Command options");
+  desc.add_options()
+    ("help,h", "help messages")
+    ("file,f", po::value<std::string>(&filename)->default_value(FILENAME_DEFAULT), "regular file to read (created with 64 MiB if missing)")
+    ("size,s", po::value<size_t>(&blksize)->default_value(4096), "block size of a single read")
+    ("depth,q", po::value<int>(&depth)->default_value(32), "reads kept in flight")
+    ("count,c", po::value<uint64_t>(&count)->default_value(1000000), "reads per method")
+    ("direct", po::bool_switch(&direct), "O_DIRECT reads (completions arrive from the device instead of at submit)");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+
+  struct stat st;
+  if (stat(filename.c_str(), &st) < 0) {
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, FILESIZE_DEFAULT) < 0) {
+      std::cout << "can't create " << filename << ": " << strerror(errno) << "\n";
+      return 1;
+    }
+    close(fd);
+    stat(filename.c_str(), &st);
+  }
+  if (st.st_size < (off_t)blksize) {
+    std::cout << filename << " is smaller than a block\n";
+    return 1;
+  }
+
+  int fd = open(filename.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+  if (fd < 0) {
+    std::cout << "can't open " << filename << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+
+  struct result r;
+  const char *names[] = {"io_getevents", "user ring"};
+  for (int m = 0; m < 2; m++) {
+    int rc = run(fd, st.st_size, blksize, depth, count, m == 1, &r);
+    if (rc < 0) {
+      std::cout << names[m] << ": " << strerror(-rc) << "\n";
+      continue;
+    }
+    print(names[m], &r);
+  }
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,410 @@
+// XDMA card stand-in: every H2C stream loops back to its C2H stream through
+// named FIFOs, with the card's bandwidth, latency, FIFO depth and
+// End-of-Packet behaviour. Tools reach it with libjw_xdma_emu_shim.so
+// preloaded (see xdma_emu_shim.c), or open the FIFOs directly.
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace po = boost::program_options;
+
+#define EMU_DIR_DEFAULT "/tmp/xdma_emu"
+#define FIFO_DEPTH_DEFAULT (1 << 20)
+#define PIPE_SIZE_DEFAULT (64 << 10)
+#define BURST_MAX (64 << 10)    // most bytes moved per step
+#define EOP_IDLE_S 0.01         // H2C quiet this long ends a short packet
+
+/* one DMA channel pair: h2c -> card FIFO -> c2h */
+struct lane {
+  unsigned index;
+  std::string h2c_path, c2h_path;
+  int h2c = -1, c2h = -1;
+  std::vector<char> fifo;       // the card's FIFO
+  uint64_t head = 0;            // bytes handed to the host
+  uint64_t ready = 0;           // bytes past their latency
+  uint64_t tail = 0;            // bytes taken in
+  std::deque<std::pair<uint64_t, double>> landing; // (tail, may leave at)
+  double last_in = 0;
+  double next_send = 0;         // bandwidth pacing
+  uint64_t pkt_left = 0;        // bytes of the packet on its way out
+  uint64_t gen = 0;             // generated 64-bit words
+  bool stalled = false;         // c2h pipe full: the host is not reading
+  bool dropping = false;
+
+  /* statistics */
+  uint64_t in = 0;
+  uint64_t out = 0;
+  uint64_t packets = 0;
+  uint64_t dropped = 0;
+  uint64_t overflows = 0;
+  uint64_t stalls = 0;
+  double t_first = 0, t_last = 0;
+};
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t report_now = 0;
+
+static double bandwidth = 0;    // bytes/s, 0: unlimited
+static double latency = 0;      // s
+static uint64_t packet = 0;     // 0: plain stream
+static bool drop = false;
+static bool generate = false;
+static uint64_t count = 0;
+
+static void sigHandler(int sig)
+{
+  if (sig == SIGUSR1)
+    report_now = 1;
+  else
+    running = 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int make_fifo(const std::string &path, size_t pipe_size)
+{
+  struct stat st;
+
+  if (!stat(path.c_str(), &st)) {
+    if (!S_ISFIFO(st.st_mode)) {
+      fprintf(stderr, "%s exists and is no FIFO\n", path.c_str());
+      return -1;
+    }
+  }
+  else if (mkfifo(path.c_str(), 0666) < 0) {
+    perror(path.c_str());
+    return -1;
+  }
+  /* read-write: never blocks on open, never sees the host hang up */
+  int fd = open(path.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror(path.c_str());
+    return -1;
+  }
+  int got = fcntl(fd, F_SETPIPE_SZ, (int)pipe_size);
+  if (got < (int)pipe_size) {
+    got = fcntl(fd, F_GETPIPE_SZ);
+    if ((uint64_t)got < packet) {
+      fprintf(stderr, "%s: pipe of %d bytes cannot hold a %lu byte packet "
+              "(fs.pipe-max-size)\n", path.c_str(), got, packet);
+      close(fd);
+      return -1;
+    }
+    fprintf(stderr, "%s: pipe size %d, not %zu\n", path.c_str(), got,
+            pipe_size);
+  }
+  return fd;
+}
+
+/* the link owes n bytes; a late wake-up is made good for up to one burst */
+static void paced(lane &l, double t, size_t n)
+{
+  if (bandwidth)
+    l.next_send = std::max(l.next_send, t - BURST_MAX / bandwidth) +
+                  n / bandwidth;
+}
+
+static void overflow(lane &l, size_t n)
+{
+  if (!l.dropping)
+    l.overflows++;
+  l.dropping = true;
+  l.dropped += n;
+}
+
+/* counter words at --bandwidth, as a detector would send them */
+static void take_generated(lane &l, double t)
+{
+  size_t cap = l.fifo.size();
+
+  if ((count && l.gen * 8 >= count) || (bandwidth && t < l.next_send))
+    return;
+  size_t n = BURST_MAX;
+  if (count)
+    n = std::min<uint64_t>(n, count - l.gen * 8);
+  size_t space = (cap - (l.tail - l.head)) & ~(size_t)7;
+  if (space < n) {
+    if (!drop || !bandwidth) {
+      n = space;                // block: the source waits for room
+      if (!n)
+        return;
+    }
+    else {
+      overflow(l, n - space);   // drop: the words are lost, the counter runs on
+      l.gen += (n - space) / 8;
+      paced(l, t, n - space);
+      n = space;
+    }
+  }
+  if (n)
+    l.dropping = false;
+  for (size_t i = 0; i < n / 8; i++, l.tail += 8, l.gen++)
+    memcpy(&l.fifo[l.tail % cap], &l.gen, 8);
+  l.in += n;
+  paced(l, t, n);
+  if (n) {
+    l.landing.push_back(std::make_pair(l.tail, t + latency));
+    l.last_in = t;
+  }
+}
+
+/* whatever the host wrote to h2c, until the FIFO is full */
+static void take_h2c(lane &l, double t)
+{
+  static char scratch[BURST_MAX];
+  size_t cap = l.fifo.size();
+
+  for (int i = 0; i < 16; i++) {
+    size_t space = cap - (l.tail - l.head);
+    ssize_t n;
+    if (!space) {
+      if (!drop)
+        return;                 // block: h2c backs up, the host's writes stall
+      n = read(l.h2c, scratch, sizeof(scratch));
+      if (n <= 0)
+        return;
+      overflow(l, n);
+      continue;
+    }
+    n = read(l.h2c, &l.fifo[l.tail % cap],
+             std::min(space, cap - l.tail % cap));
+    if (n <= 0)
+      return;
+    l.dropping = false;
+    l.tail += n;
+    l.in += n;
+    l.landing.push_back(std::make_pair(l.tail, t + latency));
+    l.last_in = t;
+  }
+}
+
+/* FIFO -> c2h, paced, one packet at a time in --packet mode */
+static void give_c2h(lane &l, double t)
+{
+  size_t cap = l.fifo.size();
+
+  while (!l.landing.empty() && l.landing.front().second <= t) {
+    l.ready = l.landing.front().first;
+    l.landing.pop_front();
+  }
+  for (;;) {
+    uint64_t avail = l.ready - l.head;
+    size_t n = std::min<uint64_t>(avail, BURST_MAX);
+    if (!avail)
+      return;
+    if (packet) {
+      if (!l.pkt_left) {
+        /* the host takes the last packet first: a read ends at its EOP */
+        int queued;
+        if (ioctl(l.c2h, FIONREAD, &queued) < 0 || queued)
+          return;
+        if (avail < packet && !(l.ready == l.tail && t - l.last_in >= EOP_IDLE_S))
+          return;
+        l.pkt_left = std::min<uint64_t>(avail, packet);
+        l.packets++;
+      }
+      n = l.pkt_left;           // in one write, so no read sees half of it
+    }
+    if (!generate && bandwidth && t < l.next_send)
+      return;
+
+    size_t off = l.head % cap, first = std::min(n, cap - off);
+    struct iovec iov[2] = {{&l.fifo[off], first}, {&l.fifo[0], n - first}};
+    ssize_t w = writev(l.c2h, iov, n > first ? 2 : 1);
+    if (w <= 0) {
+      if (!l.stalled)
+        l.stalls++;
+      l.stalled = true;
+      return;
+    }
+    l.stalled = false;
+    l.head += w;
+    l.out += w;
+    if (!l.t_first)
+      l.t_first = t;
+    l.t_last = t;
+    if (packet)
+      l.pkt_left -= w;
+    if (!generate)
+      paced(l, t, w);
+  }
+}
+
+/* when something may happen next on this lane */
+static double next_wake(const lane &l, double t)
+{
+  double wake = t + 0.1;
+
+  if (!l.landing.empty())
+    wake = std::min(wake, l.landing.front().second);
+  if (generate && !bandwidth && l.tail - l.head < l.fifo.size() &&
+      (!count || l.gen * 8 < count))
+    wake = t;
+  if (bandwidth && (generate || l.ready > l.head))
+    wake = std::min(wake, l.next_send);
+  if (packet && l.ready > l.head) {
+    wake = std::min(wake, t + 100e-6); // no poll event for "pipe drained"
+    if (l.ready - l.head < packet)
+      wake = std::min(wake, l.last_in + EOP_IDLE_S);
+  }
+  return wake;
+}
+
+static void report(const std::vector<lane> &lanes)
+{
+  for (const lane &l : lanes) {
+    double secs = l.t_last - l.t_first;
+    fprintf(stdout, "%s: %lu bytes in, %lu out, %.2f MB/s", l.c2h_path.c_str(),
+            l.in, l.out, secs > 0 ? l.out / secs / 1e6 : 0);
+    if (packet)
+      fprintf(stdout, ", %lu packets", l.packets);
+    fprintf(stdout, ", %lu bytes dropped in %lu overflows, %lu host stalls\n",
+            l.dropped, l.overflows, l.stalls);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+  std::string dir, overflow_str;
+  unsigned card, channels;
+  double bandwidth_mb, latency_us;
+  size_t fifo_depth, pipe_size;
+  bool keep;
+
+  //
+  signal(SIGINT, sigHandler);
+  signal(SIGTERM, sigHandler);
+  signal(SIGUSR1, sigHandler);
+  signal(SIGPIPE, SIG_IGN);
+
+  //
+  po::options_description desc("allowed opitons");
+  desc.add_options()
+    ("help,h","help message")
+    ("dir,d", po::value<std::string>(&dir)->default_value(EMU_DIR_DEFAULT), "where the xdmaN_h2c_M / xdmaN_c2h_M FIFOs go (XDMA_EMU_DIR of the shim)")
+    ("card", po::value<unsigned>(&card)->default_value(0), "card index N in the node names")
+    ("channels,n", po::value<unsigned>(&channels)->default_value(1), "number of h2c/c2h channel pairs")
+    ("bandwidth,b", po::value<double>(&bandwidth_mb)->default_value(0), "link bandwidth in MB/s, 0: unlimited")
+    ("latency,L", po::value<double>(&latency_us)->default_value(0), "card latency in us, h2c in to c2h out")
+    ("fifo-depth,f", po::value<size_t>(&fifo_depth)->default_value(FIFO_DEPTH_DEFAULT), "card FIFO depth in bytes")
+    ("pipe-size", po::value<size_t>(&pipe_size)->default_value(PIPE_SIZE_DEFAULT), "c2h FIFO buffer in bytes, the host side of the DMA")
+    ("packet,p", po::value<uint64_t>(&packet)->default_value(0), "End-of-Packet every this many bytes, a c2h read never spans two (0: plain stream)")
+    ("overflow", po::value<std::string>(&overflow_str)->default_value("block"), "full card FIFO: block (h2c backs up) or drop (data is lost and counted)")
+    ("generate,g", po::bool_switch(&generate), "c2h only: 64-bit counter words at --bandwidth (0: as fast as the host reads), no h2c needed")
+    ("count,c", po::value<uint64_t>(&count)->default_value(0), "bytes to generate per channel, 0: until stopped")
+    ("keep", po::bool_switch(&keep), "leave the FIFOs behind on exit");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    std::cout << "SIGUSR1 prints the statistics, SIGINT/SIGTERM stop\n";
+    return 0;
+  }
+
+  if (overflow_str == "drop")
+    drop = true;
+  else if (overflow_str != "block") {
+    std::cout << "unknown overflow mode: " << overflow_str << "\n";
+    return 1;
+  }
+  if (!channels || fifo_depth < 8 || fifo_depth < packet) {
+    std::cout << "need a channel and a FIFO of at least 8 bytes and one packet\n";
+    return 1;
+  }
+  bandwidth = bandwidth_mb * 1e6;
+  latency = latency_us / 1e6;
+  fifo_depth = (fifo_depth + 7) & ~(size_t)7; // whole counter words
+  count = (count + 7) & ~(uint64_t)7;
+  pipe_size = std::max<size_t>(pipe_size, packet);
+
+  if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+    perror(dir.c_str());
+    return 1;
+  }
+
+  std::vector<lane> lanes(channels);
+  int rc = 0;
+  for (unsigned i = 0; i < channels; i++) {
+    lane &l = lanes[i];
+    l.index = i;
+    l.h2c_path = dir + "/xdma" + std::to_string(card) + "_h2c_" + std::to_string(i);
+    l.c2h_path = dir + "/xdma" + std::to_string(card) + "_c2h_" + std::to_string(i);
+    l.fifo.resize(fifo_depth);
+    if ((l.h2c = make_fifo(l.h2c_path, PIPE_SIZE_DEFAULT)) < 0 ||
+        (l.c2h = make_fifo(l.c2h_path, pipe_size)) < 0) {
+      rc = 1;
+      goto cleanup;
+    }
+  }
+  fprintf(stdout, "xdma emu: %u channel(s) in %s, %s\n", channels, dir.c_str(),
+          generate ? "generating" : "h2c looped back to c2h");
+  fflush(stdout);
+
+  while (running) {
+    std::vector<struct pollfd> fds;
+    double t = now(), wake = t + 0.1;
+
+    for (lane &l : lanes) {
+      if (generate)
+        take_generated(l, t);
+      else
+        take_h2c(l, t);
+      give_c2h(l, t);
+      wake = std::min(wake, next_wake(l, t));
+
+      if (!generate && (drop || l.tail - l.head < l.fifo.size()))
+        fds.push_back({l.h2c, POLLIN, 0});
+      if (l.stalled)
+        fds.push_back({l.c2h, POLLOUT, 0});
+    }
+    if (report_now) {
+      report_now = 0;
+      report(lanes);
+    }
+
+    double dt = std::max(0.0, wake - now());
+    struct timespec ts = {(time_t)dt, (long)((dt - (time_t)dt) * 1e9)};
+    ppoll(fds.data(), fds.size(), &ts, NULL);
+  }
+  report(lanes);
+
+cleanup:
+  for (lane &l : lanes) {
+    if (l.h2c >= 0) {
+      close(l.h2c);
+      if (!keep)
+        unlink(l.h2c_path.c_str());
+    }
+    if (l.c2h >= 0) {
+      close(l.c2h);
+      if (!keep)
+        unlink(l.c2h_path.c_str());
+    }
+  }
+  return rc;
+}
@@ -0,0 +1,282 @@
+/*
+ * LD_PRELOAD shim: the /dev/xdma* nodes of a tool come from jw_xdma_emu
+ *
+ * - open() of /dev/xdmaN_* opens $XDMA_EMU_DIR/xdmaN_* instead, the
+ *   emulator's FIFOs (default /tmp/xdma_emu)
+ * - fstat() reports them as character devices, so the tools treat a
+ *   0-byte read as a timeout, as on the card
+ * - read() on a C2H node behaves like the driver: it fills the whole
+ *   buffer, or returns at the first packet end when opened with O_TRUNC
+ *   (EOP flush), and gives up after $XDMA_EMU_TIMEOUT_MS (default 1000)
+ *   with what it has, 0 if nothing
+ * - a libaio read of a C2H node is that read() inside io_submit(); the
+ *   bytes then go to the kernel as a read from a memfd, so the completion
+ *   (0 bytes on a timeout) comes through the real aio ring and every
+ *   reaping mode sees it
+ * - write(), other libaio requests, io_uring and splice(2) go to the FIFO
+ *   as they are; the kernel completes them with pipe semantics (short
+ *   reads, no driver timeout: stop those with the tool's own count)
+ *
+ *   LD_PRELOAD=libjw_xdma_emu_shim.so jw_from_device -i /dev/xdma0_c2h_0 ...
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libaio.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EMU_DIR_DEFAULT "/tmp/xdma_emu"
+#define EMU_TIMEOUT_MS_DEFAULT 1000
+#define EMU_MAX_FD 4096
+
+/* per fd: 0 not ours, else EMU_NODE plus EMU_C2H / EMU_EOP */
+#define EMU_NODE 1
+#define EMU_C2H 2
+#define EMU_EOP 4
+
+static unsigned char fds[EMU_MAX_FD];
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static int (*real_close)(int);
+static int (*real_fstat)(int, struct stat *);
+static int (*real_fxstat)(int, int, struct stat *);
+static int (*real_io_submit)(io_context_t, long, struct iocb **);
+
+/* per thread: the kernel has copied out of it when io_submit() returns */
+static __thread int stage_fd = -1;
+
+static void *next(const char *sym)
+{
+  void *p = dlsym(RTLD_NEXT, sym);
+  if (!p)
+    fprintf(stderr, "xdma emu: no %s\n", sym);
+  return p;
+}
+
+/* /dev/xdma0_c2h_0 -> <dir>/xdma0_c2h_0, 0 if not an xdma node */
+static int redirect(const char *path, char *buf, size_t len)
+{
+  const char *dir = getenv("XDMA_EMU_DIR");
+
+  if (!path || strncmp(path, "/dev/xdma", 9))
+    return 0;
+  snprintf(buf, len, "%s/%s", dir ? dir : EMU_DIR_DEFAULT, path + 5);
+  return 1;
+}
+
+static int track(int fd, const char *path, int flags)
+{
+  if (fd >= 0 && fd < EMU_MAX_FD) {
+    unsigned char f = EMU_NODE;
+    if (strstr(path, "_c2h_"))
+      f |= EMU_C2H | (flags & O_TRUNC ? EMU_EOP : 0);
+    __atomic_store_n(&fds[fd], f, __ATOMIC_RELAXED);
+  }
+  return fd;
+}
+
+static unsigned char flags_of(int fd)
+{
+  return fd >= 0 && fd < EMU_MAX_FD ? __atomic_load_n(&fds[fd], __ATOMIC_RELAXED) : 0;
+}
+
+static int open_emu(int dirfd, const char *path, int flags, mode_t mode)
+{
+  char emu[PATH_MAX];
+
+  if (!real_open) {
+    real_open = next("open");
+    real_openat = next("openat");
+  }
+  if (redirect(path, emu, sizeof(emu)))
+    /* a FIFO is no file to truncate, O_TRUNC only selects EOP mode */
+    return track(real_open(emu, flags & ~(O_TRUNC | O_CREAT), 0), path, flags);
+  if (dirfd == AT_FDCWD)
+    return real_open(path, flags, mode);
+  return real_openat(dirfd, path, flags, mode);
+}
+
+#define MODE_ARG(flags, mode)                                                  \
+  do {                                                                         \
+    if ((flags) & (O_CREAT | O_TMPFILE)) {                                     \
+      va_list ap;                                                              \
+      va_start(ap, flags);                                                     \
+      mode = va_arg(ap, int);                                                  \
+      va_end(ap);                                                              \
+    }                                                                          \
+  } while (0)
+
+int open(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  MODE_ARG(flags, mode);
+  return open_emu(AT_FDCWD, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  MODE_ARG(flags, mode);
+  return open_emu(AT_FDCWD, path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  MODE_ARG(flags, mode);
+  return open_emu(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+  mode_t mode = 0;
+  MODE_ARG(flags, mode);
+  return open_emu(dirfd, path, flags, mode);
+}
+
+static long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+  unsigned char f = flags_of(fd);
+  const char *env;
+  long timeout, deadline;
+  size_t got = 0;
+
+  if (!real_read)
+    real_read = next("read");
+  if (!(f & EMU_C2H))
+    return real_read(fd, buf, len);
+
+  env = getenv("XDMA_EMU_TIMEOUT_MS");
+  timeout = env ? atol(env) : EMU_TIMEOUT_MS_DEFAULT;
+  deadline = now_ms() + timeout;
+  while (got < len) {
+    struct pollfd p = {fd, POLLIN, 0};
+    long left = deadline - now_ms();
+    int rc = poll(&p, 1, left > 0 ? left : 0);
+    if (rc < 0 && errno == EINTR)
+      return got ? (ssize_t)got : -1;
+    if (rc <= 0)
+      break;                    // driver timeout: what came so far
+    ssize_t n = real_read(fd, (char *)buf + got, len - got);
+    if (n < 0)
+      return got ? (ssize_t)got : -1;
+    if (n == 0)
+      break;
+    got += n;
+    /* the emulator hands out one packet at a time, the read ends there */
+    if (f & EMU_EOP)
+      break;
+  }
+  return got;
+}
+
+/* the driver's read, answered through the kernel's aio ring */
+static int submit_c2h_read(io_context_t ctx, struct iocb *cb)
+{
+  int fd = cb->aio_fildes;
+  unsigned long nbytes = cb->u.c.nbytes;
+  long long offset = cb->u.c.offset;
+  ssize_t n;
+  int rc;
+
+  if (stage_fd < 0 && (stage_fd = memfd_create("xdma emu aio", MFD_CLOEXEC)) < 0)
+    return -errno;
+  n = read(fd, cb->u.c.buf, nbytes);
+  if (n < 0)
+    n = 0;                      // as the driver's timeout
+  if (n && pwrite(stage_fd, cb->u.c.buf, n, 0) != n)
+    return -EIO;
+
+  /* the kernel copies the iocb in, obj/data/eventfd stay the caller's */
+  cb->aio_fildes = stage_fd;
+  cb->u.c.nbytes = n;
+  cb->u.c.offset = 0;
+  rc = real_io_submit(ctx, 1, &cb);
+  cb->aio_fildes = fd;
+  cb->u.c.nbytes = nbytes;
+  cb->u.c.offset = offset;
+  return rc;
+}
+
+int io_submit(io_context_t ctx, long nr, struct iocb **iocbs)
+{
+  long i;
+
+  if (!real_io_submit)
+    real_io_submit = next("io_submit");
+  for (i = 0; i < nr; i++) {
+    struct iocb *cb = iocbs[i];
+    int rc;
+    if (cb->aio_lio_opcode == IO_CMD_PREAD && (flags_of(cb->aio_fildes) & EMU_C2H))
+      rc = submit_c2h_read(ctx, cb);
+    else
+      rc = real_io_submit(ctx, 1, &cb);
+    if (rc != 1)
+      return i ? i : rc;
+  }
+  return nr;
+}
+
+int close(int fd)
+{
+  if (!real_close)
+    real_close = next("close");
+  if (fd >= 0 && fd < EMU_MAX_FD)
+    __atomic_store_n(&fds[fd], 0, __ATOMIC_RELAXED);
+  return real_close(fd);
+}
+
+/* the FIFOs look like the driver's character devices */
+static void as_chrdev(int fd, int rc, struct stat *st)
+{
+  if (rc == 0 && flags_of(fd))
+    st->st_mode = (st->st_mode & ~S_IFMT) | S_IFCHR;
+}
+
+int fstat(int fd, struct stat *st)
+{
+  if (!real_fstat)
+    real_fstat = next("fstat");
+  int rc = real_fstat(fd, st);
+  as_chrdev(fd, rc, st);
+  return rc;
+}
+
+int fstat64(int fd, struct stat64 *st)
+{
+  return fstat(fd, (struct stat *)st);
+}
+
+/* glibc before 2.33 routes fstat() through here */
+int __fxstat(int ver, int fd, struct stat *st)
+{
+  if (!real_fxstat)
+    real_fxstat = next("__fxstat");
+  int rc = real_fxstat(ver, fd, st);
+  as_chrdev(fd, rc, st);
+  return rc;
+}
+
+int __fxstat64(int ver, int fd, struct stat64 *st)
+{
+  return __fxstat(ver, fd, (struct stat *)st);
+}
@@ -0,0 +1,138 @@
+// topology_discover() and the placement helpers against a fake sysfs/proc
+// tree: exits 0 if every check passed, else 1 after listing the failures
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "topology.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+      failures++;                                                    \
+    }                                                                \
+  } while (0)
+
+static void mkdirs(const std::string &path)
+{
+  for (size_t pos = 1; (pos = path.find('/', pos)) != std::string::npos; pos++)
+    mkdir(path.substr(0, pos).c_str(), 0755);
+  mkdir(path.c_str(), 0755);
+}
+
+static void put(const std::string &path, const char *text)
+{
+  mkdirs(path.substr(0, path.rfind('/')));
+  FILE *f = fopen(path.c_str(), "w");
+  if (!f) {
+    perror(path.c_str());
+    exit(1);
+  }
+  fputs(text, f);
+  fclose(f);
+}
+
+/* a c2h node on node 1 (cpus 4-7), msi vectors 40/41 mostly on cpu 5 */
+static void make_tree(const std::string &root)
+{
+  std::string pci = root + "/sys/devices/pci0000:00/0000:00:01.0/0000:03:00.0";
+
+  put(pci + "/numa_node", "1\n");
+  put(pci + "/local_cpulist", "4-7\n");
+  mkdirs(pci + "/msi_irqs/40");
+  mkdirs(pci + "/msi_irqs/41");
+  mkdirs(root + "/sys/class/xdma/xdma0_c2h_0");
+  if (symlink(pci.c_str(), (root + "/sys/class/xdma/xdma0_c2h_0/device").c_str()) < 0) {
+    perror("symlink");
+    exit(1);
+  }
+  put(root + "/proc/interrupts",
+      "            CPU0       CPU1       CPU4       CPU5       CPU6\n"
+      "  0:         10          0          0          0          0   IO-APIC    2-edge      timer\n"
+      " 40:          0          0          3        120          0   PCI-MSI 1572864-edge      xdma\n"
+      " 41:          0          0          0         80          9   PCI-MSI 1572865-edge      xdma\n"
+      " 42:          0          0          0          0        999   PCI-MSI 1572866-edge      nvme\n"
+      "NMI:          0          0          0          0          0   Non-maskable interrupts\n");
+
+  /* a second node whose vectors never fired: the affinity list decides */
+  std::string idle = root + "/sys/devices/pci0000:00/0000:00:02.0/0000:04:00.0";
+  put(idle + "/numa_node", "0\n");
+  put(idle + "/local_cpulist", "0-1\n");
+  put(idle + "/irq", "17\n");
+  put(root + "/proc/irq/17/smp_affinity_list", "1\n");
+  mkdirs(root + "/sys/class/xdma/xdma1_c2h_0");
+  if (symlink(idle.c_str(), (root + "/sys/class/xdma/xdma1_c2h_0/device").c_str()) < 0) {
+    perror("symlink");
+    exit(1);
+  }
+}
+
+int main()
+{
+  char tmpl[] = "/tmp/jw_topology_XXXXXX";
+  const char *root = mkdtemp(tmpl);
+  struct topology t;
+  int node, reader, writer;
+
+  if (!root) {
+    perror("mkdtemp");
+    return 1;
+  }
+  make_tree(root);
+
+  CHECK(topology_discover(&t, root, "/dev/xdma0_c2h_0") == 0);
+  CHECK(!strcmp(t.pci, "0000:03:00.0"));
+  CHECK(t.numa_node == 1);
+  CHECK(CPU_COUNT(&t.node_cpus) == 4 && CPU_ISSET(4, &t.node_cpus) &&
+        CPU_ISSET(7, &t.node_cpus));
+  CHECK(t.nirqs == 2);
+  CHECK(t.irq_cpu == 5 && t.irq_count == 200);
+  CHECK(t.reader_cpu == 5 && t.writer_cpu == 6);
+  CHECK(topology_cpu(&t, 2) == 7 && topology_cpu(&t, 3) == 4);
+
+  /* auto everything */
+  node = reader = writer = TOPO_AUTO;
+  topology_place(&t, &node, &reader, &writer);
+  CHECK(node == 1 && reader == 5 && writer == 6);
+
+  /* --pin 7: the writer goes next to the user's reader, wrapping */
+  CHECK(topology_parse_pin("7", &reader, &writer) == 0);
+  topology_place(&t, NULL, &reader, &writer);
+  CHECK(reader == 7 && writer == 4);
+
+  /* --pin 2,3 and --pin off are taken as they are */
+  CHECK(topology_parse_pin("2,3", &reader, &writer) == 0);
+  topology_place(&t, NULL, &reader, &writer);
+  CHECK(reader == 2 && writer == 3);
+  CHECK(topology_parse_pin("off", &reader, &writer) == 0);
+  topology_place(&t, NULL, &reader, &writer);
+  CHECK(reader == TOPO_OFF && writer == TOPO_OFF);
+
+  CHECK(topology_discover(&t, root, "/dev/xdma1_c2h_0") == 0);
+  CHECK(t.numa_node == 0 && t.nirqs == 1 && t.irqs[0] == 17);
+  CHECK(t.irq_cpu == 1 && t.irq_count == 0);
+  CHECK(t.reader_cpu == 1 && t.writer_cpu == 0);
+
+  /* no such node: unknown, nothing placed */
+  CHECK(topology_discover(&t, root, "/dev/xdma9_c2h_0") == -ENODEV);
+  node = reader = writer = TOPO_AUTO;
+  topology_place(&t, &node, &reader, &writer);
+  CHECK(node == TOPO_OFF && reader == TOPO_OFF && writer == TOPO_OFF);
+
+  std::string rm = std::string("rm -rf ") + root;
+  if (system(rm.c_str()) != 0)
+    fprintf(stderr, "left %s behind\n", root);
+  if (failures)
+    fprintf(stderr, "%d checks failed\n", failures);
+  else
+    printf("topology: all checks passed\n");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+// buffer handoff between threads: SpscQueue, MpmcQueue and a mutex queue,
+// throughput (ops/s) and one-way handoff latency per producer:consumer cpu pair
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "handoff_queue.h"
+#include "lat_hist.h"
+#include "topology.h"
+
+namespace po = boost::program_options;
+
+#define SPIN_BEFORE_YIELD 1024  // pause loops, then give the cpu away
+
+/* the baseline: what a buf_ring-style handoff costs, one lock per call */
+class MutexQueue {
+public:
+  int init(size_t capacity)
+  {
+    slots_.assign(capacity, 0);
+    return 0;
+  }
+  size_t push_n(const uint64_t *v, size_t n)
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    n = std::min(n, slots_.size() - (head_ - tail_));
+    for (size_t i = 0; i < n; i++)
+      slots_[(head_ + i) % slots_.size()] = v[i];
+    head_ += n;
+    return n;
+  }
+  size_t pop_n(uint64_t *v, size_t n)
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    n = std::min(n, head_ - tail_);
+    for (size_t i = 0; i < n; i++)
+      v[i] = slots_[(tail_ + i) % slots_.size()];
+    tail_ += n;
+    return n;
+  }
+
+private:
+  std::mutex lock_;
+  std::vector<uint64_t> slots_;
+  size_t head_ = 0;
+  size_t tail_ = 0;
+};
+
+/* spin a while, then yield: also fair with fewer cpus than threads */
+struct backoff {
+  unsigned spins = 0;
+  void wait()
+  {
+    if (++spins < SPIN_BEFORE_YIELD)
+      handoff_relax();
+    else
+      sched_yield();
+  }
+  void reset() { spins = 0; }
+};
+
+struct result {
+  uint64_t ops;
+  double secs;
+  bool ordered;
+  uint64_t sum;
+};
+
+static void pin(int cpu)
+{
+  int err = topology_pin(cpu);
+  if (err < 0)
+    fprintf(stderr, "pin to cpu %d: %s\n", cpu, strerror(-err));
+}
+
+/* producers push 0..count-1 between them in batches, consumers pop them */
+template <typename Q>
+static void throughput(Q &q, uint64_t count, size_t batch, unsigned producers,
+                       unsigned consumers, const std::vector<int> &cpus,
+                       struct result *r)
+{
+  std::atomic<unsigned> ready(0);
+  std::atomic<uint64_t> popped(0), sum(0);
+  std::atomic<bool> ordered(true);
+  unsigned threads = producers + consumers;
+  std::vector<std::thread> pool;
+  uint64_t t0 = 0;
+
+  for (unsigned p = 0; p < producers; p++) {
+    pool.emplace_back([&, p] {
+      pin(cpus[p % cpus.size()]);
+      std::vector<uint64_t> buf(batch);
+      uint64_t next = p, stride = producers;
+      backoff b;
+      ready++;
+      while (ready < threads)
+        sched_yield();
+      while (next < count) {
+        size_t n = 0;
+        for (uint64_t v = next; n < batch && v < count; v += stride)
+          buf[n++] = v;
+        size_t done = 0;
+        while (done < n) {
+          size_t k = q.push_n(buf.data() + done, n - done);
+          if (k) {
+            done += k;
+            b.reset();
+          } else {
+            b.wait();
+          }
+        }
+        next += n * stride;
+      }
+    });
+  }
+  for (unsigned c = 0; c < consumers; c++) {
+    pool.emplace_back([&, c] {
+      pin(cpus[(producers + c) % cpus.size()]);
+      std::vector<uint64_t> buf(batch);
+      uint64_t expect = 0, local = 0;
+      bool in_order = true;
+      backoff b;
+      ready++;
+      while (ready < threads)
+        sched_yield();
+      while (popped.load(std::memory_order_relaxed) < count) {
+        size_t k = q.pop_n(buf.data(), batch);
+        if (!k) {
+          b.wait();
+          continue;
+        }
+        b.reset();
+        for (size_t i = 0; i < k; i++) {
+          in_order &= buf[i] == expect++;
+          local += buf[i];
+        }
+        popped += k;
+      }
+      sum += local;
+      if (!in_order)
+        ordered = false;
+    });
+  }
+
+  while (ready < threads)
+    sched_yield();
+  t0 = lat_hist_now();
+  for (auto &t : pool)
+    t.join();
+  r->secs = (lat_hist_now() - t0) / 1e9;
+  r->ops = count;
+  r->ordered = ordered;
+  r->sum = sum;
+}
+
+/*
+ * one element in flight: a -> ping -> b -> pong -> a, half the round trip
+ * is the handoff latency (no clock shared between the two cpus needed)
+ */
+template <typename Q>
+static void latency(Q &ping, Q &pong, uint64_t pings, int cpu_a, int cpu_b,
+                    struct lat_hist *h)
+{
+  std::atomic<bool> ready(false);
+  cpu_set_t mask;
+  sched_getaffinity(0, sizeof(mask), &mask);
+  std::thread echo([&] {
+    pin(cpu_b);
+    backoff b;
+    uint64_t v;
+    ready = true;
+    for (uint64_t i = 0; i < pings; i++) {
+      while (!ping.pop_n(&v, 1))
+        b.wait();
+      b.reset();
+      while (!pong.push_n(&v, 1))
+        b.wait();
+    }
+  });
+
+  pin(cpu_a);
+  while (!ready)
+    sched_yield();
+  backoff b;
+  for (uint64_t i = 0; i < pings; i++) {
+    uint64_t t0 = lat_hist_now(), v = i;
+    while (!ping.push_n(&v, 1))
+      b.wait();
+    while (!pong.pop_n(&v, 1))
+      b.wait();
+    b.reset();
+    lat_hist_record(h, (lat_hist_now() - t0) / 2);
+  }
+  echo.join();
+  /* later threads inherit the mask: this one is free again */
+  sched_setaffinity(0, sizeof(mask), &mask);
+}
+
+static void print(const char *name, const std::string &where, const struct result *r,
+                  uint64_t expect_sum, bool fifo)
+{
+  bool ok = r->sum == expect_sum && (!fifo || r->ordered);
+  printf("%-6s %-10s %8.2f Mops/s %8.1f ns/op%s\n", name, where.c_str(),
+         r->ops / r->secs / 1e6, r->secs * 1e9 / r->ops,
+         ok ? "" : "  LOST OR REORDERED");
+}
+
+static void print_latency(const char *name, const std::string &where,
+                          const struct lat_hist *h)
+{
+  printf("%-6s %-10s handoff ns: p50 %lu, p99 %lu, p99.9 %lu, max %lu\n", name,
+         where.c_str(), lat_hist_percentile(h, 50), lat_hist_percentile(h, 99),
+         lat_hist_percentile(h, 99.9), h->max);
+}
+
+/* "0:1,0:2" -> {{0,1},{0,2}} */
+static int parse_pairs(const std::string &str, std::vector<std::pair<int, int>> *pairs)
+{
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    int a, b;
+    if (sscanf(item.c_str(), "%d:%d", &a, &b) != 2)
+      return -EINVAL;
+    pairs->push_back(std::make_pair(a, b));
+  }
+  return pairs->empty() ? -EINVAL : 0;
+}
+
+template <typename Q>
+static int run(const char *name, uint64_t count, size_t capacity, size_t batch,
+               uint64_t pings, const std::vector<std::pair<int, int>> &pairs)
+{
+  uint64_t expect_sum = count * (count - 1) / 2;
+
+  for (auto &pr : pairs) {
+    std::ostringstream where;
+    where << pr.first << "->" << pr.second;
+    std::vector<int> cpus = {pr.first, pr.second};
+    struct result r;
+    {
+      Q q;
+      if (q.init(capacity) < 0)
+        return -ENOMEM;
+      throughput(q, count, batch, 1, 1, cpus, &r);
+    }
+    print(name, where.str(), &r, expect_sum, true);
+
+    if (!pings)
+      continue;
+    Q ping, pong;
+    struct lat_hist h;
+    if (ping.init(capacity) < 0 || pong.init(capacity) < 0)
+      return -ENOMEM;
+    memset(&h, 0, sizeof(h));
+    h.min = UINT64_MAX;
+    latency(ping, pong, pings, pr.first, pr.second, &h);
+    print_latency(name, where.str(), &h);
+  }
+  return 0;
+}
+
+template <typename Q>
+static int run_many(const char *name, uint64_t count, size_t capacity,
+                    size_t batch, unsigned threads)
+{
+  Q q;
+  struct result r;
+  std::vector<int> any = {-1};
+  std::ostringstream where;
+
+  if (q.init(capacity) < 0)
+    return -ENOMEM;
+  where << threads << "x" << threads;
+  throughput(q, count, batch, threads, threads, any, &r);
+  print(name, where.str(), &r, count * (count - 1) / 2, false);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t count, pings;
+  size_t capacity, batch;
+  unsigned threads;
+  std::string pairs_str;
+
+  po::options_description desc("Command options");
+  desc.add_options()
+    ("help,h", "help messages")
+    ("count,c", po::value<uint64_t>(&count)->default_value(10000000), "elements per throughput run")
+    ("capacity,q", po::value<size_t>(&capacity)->default_value(1024), "queue capacity (rounded up to a power of two)")
+    ("batch,b", po::value<size_t>(&batch)->default_value(1), "elements per push_n()/pop_n()")
+    ("pairs,p", po::value<std::string>(&pairs_str)->default_value("0:1"), "producer:consumer cpus, e.g. 0:1,0:2 (-1: not pinned)")
+    ("pings", po::value<uint64_t>(&pings)->default_value(100000), "round trips for the handoff latency (0: skip)")
+    ("threads,t", po::value<unsigned>(&threads)->default_value(2), "mpmc/mutex: also N producers x N consumers, not pinned (0: skip)");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+
+  std::vector<std::pair<int, int>> pairs;
+  if (parse_pairs(pairs_str, &pairs) < 0 || !count || !capacity || !batch) {
+    std::cout << "bad --pairs, --count, --capacity or --batch\n";
+    return 1;
+  }
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+    std::cout << "one cpu online: both sides share it, expect yields, not handoffs\n";
+
+  run<SpscQueue<uint64_t>>("spsc", count, capacity, batch, pings, pairs);
+  run<MpmcQueue<uint64_t>>("mpmc", count, capacity, batch, pings, pairs);
+  run<MutexQueue>("mutex", count, capacity, batch, pings, pairs);
+  if (threads) {
+    run_many<MpmcQueue<uint64_t>>("mpmc", count, capacity, batch, threads);
+    run_many<MutexQueue>("mutex", count, capacity, batch, threads);
+  }
+  return 0;
+}